@@ -95,6 +95,14 @@ int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, con
 			joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, api_mem_json, req);
 			return 0;
 		}
+		if (!strcmp(uri, "/api/v1/recorder") && !strcmp(method, "GET")) {
+			joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, api_recorder_json, req);
+			return 0;
+		}
+		if (!strcmp(uri, "/api/v1/nearest") && !strcmp(method, "GET")) {
+			joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, api_nearest_json, req);
+			return 0;
+		}
 		if (!strcmp(uri, "/api/v1/livesources") && !strcmp(method, "GET")) {
 			joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, livesource_list_json, req);
 			return 0;
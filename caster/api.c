@@ -2,10 +2,13 @@
 #include <string.h>
 
 #include <json-c/json_object.h>
+#include <json-c/json_tokener.h>
 
 #include "conf.h"
 #include "livesource.h"
+#include "nearest.h"
 #include "ntrip_common.h"
+#include "packet.h"
 #include "rtcm.h"
 #include "sourcetable.h"
 
@@ -39,6 +42,8 @@ static json_object *api_ntrip_json(struct ntrip_state *st) {
 	json_object_object_add(new_obj, "id", jsonid);
 	json_object_object_add(new_obj, "received_bytes", received_bytes);
 	json_object_object_add(new_obj, "sent_bytes", sent_bytes);
+	if (st->dropped_bytes)
+		json_object_object_add(new_obj, "dropped_bytes", json_object_new_int64(st->dropped_bytes));
 	json_object_object_add(new_obj, "type", json_object_new_string(st->type));
 	json_object_object_add(new_obj, "wildcard", json_object_new_boolean(st->wildcard));
 	if (!strcmp(st->type, "source") || !strcmp(st->type, "source_fetcher"))
@@ -125,10 +130,45 @@ struct mime_content *api_rtcm_json(struct caster_state *caster, struct request *
 }
 
 /*
- * Return memory stats.
+ * Return memory stats: malloc stats if available, and packet pool counters.
  */
 struct mime_content *api_mem_json(struct caster_state *caster, struct request *req) {
 	struct mime_content *m = malloc_stats_dump(1);
+	if (m == NULL)
+		return NULL;
+
+	json_object *j = json_tokener_parse(m->s);
+	mime_free(m);
+	if (j == NULL || !json_object_is_type(j, json_type_object)) {
+		json_object_put(j);
+		j = json_object_new_object();
+	}
+	json_object_object_add(j, "packet_pool", packet_pool_json());
+
+	char *s = mystrdup(json_object_to_json_string(j));
+	json_object_put(j);
+	return mime_new(s, -1, "application/json", 1);
+}
+
+/*
+ * Return recorder counters, null if no recorder is configured.
+ */
+struct mime_content *api_recorder_json(struct caster_state *caster, struct request *req) {
+	json_object *j = caster->recorder ? recorder_json(caster->recorder) : json_object_new_null();
+	char *s = mystrdup(json_object_to_json_string(j));
+	struct mime_content *m = mime_new(s, -1, "application/json", 1);
+	json_object_put(j);
+	return m;
+}
+
+/*
+ * Return nearest base scheduler and cache counters.
+ */
+struct mime_content *api_nearest_json(struct caster_state *caster, struct request *req) {
+	json_object *j = nearest_sched_json(caster->nearest_sched);
+	char *s = mystrdup(json_object_to_json_string(j));
+	struct mime_content *m = mime_new(s, -1, "application/json", 1);
+	json_object_put(j);
 	return m;
 }
 
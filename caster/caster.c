@@ -36,6 +36,7 @@
 #include "jobs.h"
 #include "livesource.h"
 #include "log.h"
+#include "nearest.h"
 #include "ntrip_common.h"
 #include "ntrip_task.h"
 #include "ntripsrv.h"
@@ -244,6 +245,9 @@ caster_new(struct config *config, const char *config_file) {
 	P_RWLOCK_INIT(&this->configlock, NULL);
 
 	P_RWLOCK_INIT(&this->sourcetablestack.lock, NULL);
+	P_MUTEX_INIT(&this->sourcetablestack.flat_rebuild_lock, NULL);
+	atomic_init(&this->sourcetablestack.generation, 0);
+	refptr_init(&this->sourcetablestack.flat, NULL);
 
 	this->config = config;
 	this->endpoints_json = caster_endpoints_json(this);
@@ -275,8 +279,14 @@ caster_new(struct config *config, const char *config_file) {
 
 	this->graylog = NULL;
 	this->graylog_count = 0;
+	this->recorder = NULL;
+	this->replays = NULL;
+	this->replays_count = 0;
+	this->generators = NULL;
+	this->generators_count = 0;
 	this->syncers = NULL;
 	this->syncers_count = 0;
+	this->nearest_sched = nearest_sched_new(this);
 
 	fchdir(current_dir);
 	close(current_dir);
@@ -284,8 +294,10 @@ caster_new(struct config *config, const char *config_file) {
 	if (err || r1 < 0 || r2 < 0 || !this->config_dir
 	    || (threads && this->joblist == NULL)
 	    || this->ntrips.ipcount == NULL
-	    || this->livesources == NULL) {
+	    || this->livesources == NULL
+	    || this->nearest_sched == NULL) {
 		if (this->joblist) joblist_free(this->joblist);
+		if (this->nearest_sched) nearest_sched_free(this->nearest_sched);
 		if (r1 < 0) log_free(&this->flog);
 		if (r2 < 0) log_free(&this->alog);
 		if (this->ntrips.ipcount) hash_table_free(this->ntrips.ipcount);
@@ -402,6 +414,93 @@ static int caster_reload_graylog(struct caster_state *this) {
 	}
 }
 
+/*
+ * Start the livesource recorder, if configured.
+ *
+ * Not reloaded, as livesources keep a pointer to their recorded stream.
+ */
+static int caster_start_recorder(struct caster_state *this) {
+	if (this->config->recorder_count == 0)
+		return 0;
+	this->recorder = recorder_new(this, this->config->recorder, this->config->recorder_count, this->config->recorder_queue_size);
+	if (this->recorder == NULL) {
+		logfmt(&this->flog, LOG_ERR, "Can't allocate recorder");
+		return -1;
+	}
+	if (recorder_start(this->recorder) < 0) {
+		recorder_free(this->recorder);
+		this->recorder = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Start replaying the configured recordings.
+ *
+ * Not reloaded either, the livesources being unregistered asynchronously.
+ */
+static int caster_start_replays(struct caster_state *this) {
+	int r = 0;
+	if (this->config->replay_count == 0)
+		return 0;
+	this->replays = (struct replay **)malloc(sizeof(struct replay *)*this->config->replay_count);
+	if (this->replays == NULL)
+		return -1;
+	for (int i = 0; i < this->config->replay_count; i++) {
+		struct replay *replay = replay_new(this, &this->config->replay[i]);
+		if (replay == NULL) {
+			r = -1;
+			continue;
+		}
+		this->replays[this->replays_count++] = replay;
+		if (replay_start(replay) < 0)
+			r = -1;
+	}
+	return r;
+}
+
+static void caster_free_replays(struct caster_state *this) {
+	for (int i = 0; i < this->replays_count; i++)
+		replay_free(this->replays[i]);
+	free(this->replays);
+	this->replays = NULL;
+	this->replays_count = 0;
+}
+
+/*
+ * Start the configured synthetic sources.
+ *
+ * Not reloaded, like replays.
+ */
+static int caster_start_generators(struct caster_state *this) {
+	int r = 0;
+	if (this->config->generator_count == 0)
+		return 0;
+	this->generators = (struct generator **)malloc(sizeof(struct generator *)*this->config->generator_count);
+	if (this->generators == NULL)
+		return -1;
+	for (int i = 0; i < this->config->generator_count; i++) {
+		struct generator *generator = generator_new(this, &this->config->generator[i], i);
+		if (generator == NULL) {
+			r = -1;
+			continue;
+		}
+		this->generators[this->generators_count++] = generator;
+		if (generator_start(generator) < 0)
+			r = -1;
+	}
+	return r;
+}
+
+static void caster_free_generators(struct caster_state *this) {
+	for (int i = 0; i < this->generators_count; i++)
+		generator_free(this->generators[i]);
+	free(this->generators);
+	this->generators = NULL;
+	this->generators_count = 0;
+}
+
 void caster_free(struct caster_state *this) {
 	if (threads)
 		jobs_stop_threads(this->joblist);
@@ -418,6 +517,11 @@ void caster_free(struct caster_state *this) {
 	caster_free_fetchers(this);
 	caster_free_syncers(this);
 	caster_free_graylog(this);
+	caster_free_replays(this);
+	caster_free_generators(this);
+	if (this->recorder)
+		recorder_free(this->recorder);
+	nearest_sched_free(this->nearest_sched);
 
 	livesource_table_free(this->livesources);
 
@@ -440,9 +544,11 @@ void caster_free(struct caster_state *this) {
 		sourcetable_free(s);
 	}
 	P_RWLOCK_UNLOCK(&this->sourcetablestack.lock);
+	stack_flatten_clear(&this->sourcetablestack);
 
 	if (this->joblist) joblist_free(this->joblist);
 	P_RWLOCK_DESTROY(&this->sourcetablestack.lock);
+	P_MUTEX_DESTROY(&this->sourcetablestack.flat_rebuild_lock);
 	P_RWLOCK_DESTROY(&this->rtcm_lock);
 	P_RWLOCK_DESTROY(&this->ntrips.lock);
 	P_RWLOCK_DESTROY(&this->ntrips.free_lock);
@@ -680,6 +786,7 @@ caster_reload_sourcetables(struct caster_state *caster) {
 
 	logfmt(&caster->flog, LOG_INFO, "Reloading %s", caster->config->sourcetable_filename);
 	TAILQ_INSERT_TAIL(&caster->sourcetablestack.list, local_table, next);
+	stack_bump_generation(&caster->sourcetablestack);
 
 	P_RWLOCK_UNLOCK(&caster->sourcetablestack.lock);
 
@@ -1065,6 +1172,15 @@ int caster_main(char *config_file) {
 		return 1;
 	}
 
+	if (nearest_sched_start(caster->nearest_sched) < 0) {
+		logfmt(&caster->flog, LOG_CRIT, "Could not start the nearest base scheduler");
+		caster_free(caster);
+		return 1;
+	}
+
+	caster_start_recorder(caster);
+	caster_start_replays(caster);
+	caster_start_generators(caster);
 	caster_start_fetchers(caster);
 	caster_start_graylog(caster);
 	caster_start_syncers(caster);
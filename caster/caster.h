@@ -10,12 +10,15 @@
 
 #include "conf.h"
 #include "config.h"
+#include "generator.h"
 #include "hash.h"
 #include "ip.h"
 #include "jobs.h"
 #include "livesource.h"
 #include "log.h"
 #include "queue.h"
+#include "recorder.h"
+#include "replay.h"
 #include "rtcm.h"
 #include "sourcetable.h"
 #include "syncer.h"
@@ -83,12 +86,26 @@ struct caster_state {
 
 	sourcetable_stack_t sourcetablestack;
 
+	/* Nearest base recompute scheduler for virtual sources */
+	struct nearest_sched *nearest_sched;
+
 	/* Logs */
 	struct log flog, alog;
 	char hostname[128];
 	struct graylog_sender **graylog;
 	int graylog_count;	/* 0 or 1 */
 
+	/* Livesource recorder, NULL if none */
+	struct recorder *recorder;
+
+	/* Replayed recordings */
+	struct replay **replays;
+	int replays_count;
+
+	/* Synthetic sources */
+	struct generator **generators;
+	int generators_count;
+
 	/* Table synchronization */
 	struct syncer **syncers;
 	int syncers_count;
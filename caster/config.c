@@ -42,6 +42,13 @@ static struct config default_config = {
 	.sourcetable_priority = 90,
 	.backlog_socket = 112*1024,
 	.backlog_evbuffer = 16*1024,
+	.backlog_compaction = 0,
+	.decimation_interval = 0,
+	.rtcm_strict = 0,
+	.msm4_transcoding = 0,
+	.fanout_ring_size = 0,
+	.recorder_queue_size = 65536,
+	.fanout_partition_size = 0,
 	.sourcetable_fetch_timeout = 60,
 	.on_demand_source_timeout = 60,
 	.source_read_timeout = 60,
@@ -56,6 +63,7 @@ static struct config default_config = {
 	.log_level = LOG_INFO,
 	.admin_user = "admin",
 	.disable_zero_copy = 0,
+	.zero_copy_min_packet = 0,
 	.zero_copy = 1
 };
 
@@ -90,6 +98,24 @@ static struct config_graylog default_config_graylog = {
 	.port = 7777
 };
 
+static struct config_recorder default_config_recorder = {
+	.segment_max_size = 64*1024*1024,
+	.segment_max_duration = 3600,
+	.sync_interval = 10
+};
+
+static struct config_replay default_config_replay = {
+	.speed = 1
+};
+
+static struct config_generator default_config_generator = {
+	.count = 1,
+	.satellites = 10,
+	.signals = 2,
+	.epoch_interval = 1000,
+	.radius = 100
+};
+
 static struct config_threads default_config_threads = {
 	.stacksize = 500*1024
 };
@@ -214,6 +240,69 @@ static const cyaml_schema_value_t graylog_schema = {
 		struct config_graylog, graylog_fields_schema),
 };
 
+static const cyaml_schema_field_t recorder_fields_schema[] = {
+	CYAML_FIELD_STRING_PTR(
+		"mountpoint", CYAML_FLAG_POINTER, struct config_recorder, mountpoint, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_STRING_PTR(
+		"directory", CYAML_FLAG_POINTER, struct config_recorder, directory, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_INT(
+		"segment_max_size", CYAML_FLAG_OPTIONAL, struct config_recorder, segment_max_size),
+	CYAML_FIELD_INT(
+		"segment_max_duration", CYAML_FLAG_OPTIONAL, struct config_recorder, segment_max_duration),
+	CYAML_FIELD_INT(
+		"sync_interval", CYAML_FLAG_OPTIONAL, struct config_recorder, sync_interval),
+	CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t recorder_schema = {
+	CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT,
+		struct config_recorder, recorder_fields_schema),
+};
+
+static const cyaml_schema_field_t replay_fields_schema[] = {
+	CYAML_FIELD_STRING_PTR(
+		"mountpoint", CYAML_FLAG_POINTER, struct config_replay, mountpoint, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_STRING_PTR(
+		"file", CYAML_FLAG_POINTER, struct config_replay, file, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_FLOAT(
+		"speed", CYAML_FLAG_OPTIONAL, struct config_replay, speed),
+	CYAML_FIELD_BOOL(
+		"loop", CYAML_FLAG_OPTIONAL, struct config_replay, loop),
+	CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t replay_schema = {
+	CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT,
+		struct config_replay, replay_fields_schema),
+};
+
+static const cyaml_schema_field_t generator_fields_schema[] = {
+	CYAML_FIELD_STRING_PTR(
+		"prefix", CYAML_FLAG_POINTER, struct config_generator, prefix, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_INT(
+		"count", CYAML_FLAG_OPTIONAL, struct config_generator, count),
+	CYAML_FIELD_STRING_PTR(
+		"messages", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_generator, messages, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_INT(
+		"satellites", CYAML_FLAG_OPTIONAL, struct config_generator, satellites),
+	CYAML_FIELD_INT(
+		"signals", CYAML_FLAG_OPTIONAL, struct config_generator, signals),
+	CYAML_FIELD_INT(
+		"epoch_interval", CYAML_FLAG_OPTIONAL, struct config_generator, epoch_interval),
+	CYAML_FIELD_FLOAT(
+		"latitude", CYAML_FLAG_OPTIONAL, struct config_generator, latitude),
+	CYAML_FIELD_FLOAT(
+		"longitude", CYAML_FLAG_OPTIONAL, struct config_generator, longitude),
+	CYAML_FIELD_FLOAT(
+		"radius", CYAML_FLAG_OPTIONAL, struct config_generator, radius),
+	CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t generator_schema = {
+	CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT,
+		struct config_generator, generator_fields_schema),
+};
+
 static const cyaml_schema_field_t threads_fields_schema[] = {
 	CYAML_FIELD_INT(
 		"stacksize", CYAML_FLAG_OPTIONAL, struct config_threads, stacksize),
@@ -257,6 +346,17 @@ static const cyaml_schema_field_t top_mapping_schema[] = {
 	CYAML_FIELD_SEQUENCE(
 		"graylog", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
 		struct config, graylog, &graylog_schema, 0, 1),
+	CYAML_FIELD_SEQUENCE(
+		"recorder", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+		struct config, recorder, &recorder_schema, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_INT(
+		"recorder_queue_size", CYAML_FLAG_OPTIONAL, struct config, recorder_queue_size),
+	CYAML_FIELD_SEQUENCE(
+		"replay", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+		struct config, replay, &replay_schema, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_SEQUENCE(
+		"generator", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+		struct config, generator, &generator_schema, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_STRING_PTR(
 		"source_auth_file", CYAML_FLAG_POINTER, struct config, source_auth_filename, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_STRING_PTR(
@@ -271,6 +371,20 @@ static const cyaml_schema_field_t top_mapping_schema[] = {
 		"backlog_socket", CYAML_FLAG_OPTIONAL, struct config, backlog_socket),
 	CYAML_FIELD_INT(
 		"backlog_evbuffer", CYAML_FLAG_OPTIONAL, struct config, backlog_evbuffer),
+	CYAML_FIELD_INT(
+		"backlog_compaction", CYAML_FLAG_OPTIONAL, struct config, backlog_compaction),
+	CYAML_FIELD_INT(
+		"decimation_interval", CYAML_FLAG_OPTIONAL, struct config, decimation_interval),
+	CYAML_FIELD_INT(
+		"rtcm_strict", CYAML_FLAG_OPTIONAL, struct config, rtcm_strict),
+	CYAML_FIELD_INT(
+		"msm4_transcoding", CYAML_FLAG_OPTIONAL, struct config, msm4_transcoding),
+	CYAML_FIELD_INT(
+		"fanout_ring_size", CYAML_FLAG_OPTIONAL, struct config, fanout_ring_size),
+	CYAML_FIELD_INT(
+		"fanout_partition_size", CYAML_FLAG_OPTIONAL, struct config, fanout_partition_size),
+	CYAML_FIELD_INT(
+		"zero_copy_min_packet", CYAML_FLAG_OPTIONAL, struct config, zero_copy_min_packet),
 	CYAML_FIELD_INT(
 		"sourcetable_fetch_timeout", CYAML_FLAG_OPTIONAL, struct config, sourcetable_fetch_timeout),
 	CYAML_FIELD_INT(
@@ -349,6 +463,14 @@ struct config *config_parse(const char *filename) {
 	DEFAULT_ASSIGN(this, source_read_timeout);
 	DEFAULT_ASSIGN(this, backlog_socket);
 	DEFAULT_ASSIGN(this, backlog_evbuffer);
+	DEFAULT_ASSIGN(this, backlog_compaction);
+	DEFAULT_ASSIGN(this, decimation_interval);
+	DEFAULT_ASSIGN(this, rtcm_strict);
+	DEFAULT_ASSIGN(this, msm4_transcoding);
+	DEFAULT_ASSIGN(this, fanout_ring_size);
+	DEFAULT_ASSIGN(this, recorder_queue_size);
+	DEFAULT_ASSIGN(this, fanout_partition_size);
+	DEFAULT_ASSIGN(this, zero_copy_min_packet);
 	DEFAULT_ASSIGN(this, ntripcli_default_read_timeout);
 	DEFAULT_ASSIGN(this, ntripcli_default_write_timeout);
 	DEFAULT_ASSIGN(this, ntripsrv_default_read_timeout);
@@ -399,6 +521,33 @@ struct config *config_parse(const char *filename) {
 			this->graylog[i].queue_max_size = default_config_graylog.queue_max_size;
 	}
 
+	for (int i = 0; i < this->recorder_count; i++) {
+		if (this->recorder[i].segment_max_size == 0)
+			this->recorder[i].segment_max_size = default_config_recorder.segment_max_size;
+		if (this->recorder[i].segment_max_duration == 0)
+			this->recorder[i].segment_max_duration = default_config_recorder.segment_max_duration;
+		if (this->recorder[i].sync_interval == 0)
+			this->recorder[i].sync_interval = default_config_recorder.sync_interval;
+	}
+
+	for (int i = 0; i < this->replay_count; i++) {
+		if (this->replay[i].speed <= 0)
+			this->replay[i].speed = default_config_replay.speed;
+	}
+
+	for (int i = 0; i < this->generator_count; i++) {
+		if (this->generator[i].count <= 0)
+			this->generator[i].count = default_config_generator.count;
+		if (this->generator[i].satellites <= 0)
+			this->generator[i].satellites = default_config_generator.satellites;
+		if (this->generator[i].signals <= 0)
+			this->generator[i].signals = default_config_generator.signals;
+		if (this->generator[i].epoch_interval <= 0)
+			this->generator[i].epoch_interval = default_config_generator.epoch_interval;
+		if (this->generator[i].radius <= 0)
+			this->generator[i].radius = default_config_generator.radius;
+	}
+
 	for (int i = 0; i < this->bind_count; i++) {
 		if (this->bind[i].port == 0)
 			this->bind[i].port = default_config_bind.port;
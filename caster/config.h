@@ -93,6 +93,63 @@ struct config_graylog {
 	char *drainfilename;
 };
 
+struct config_recorder {
+	/* Mountpoint to record */
+	char *mountpoint;
+
+	/* Directory for segment and index files */
+	char *directory;
+
+	/* Maximum segment size in bytes and duration in seconds */
+	size_t segment_max_size;
+	int segment_max_duration;
+
+	/*
+	 * Delay in seconds between fdatasync() calls on the current segment,
+	 * -1 to only sync when closing a segment.
+	 */
+	int sync_interval;
+};
+
+struct config_replay {
+	/* Mountpoint of the replayed livesource */
+	char *mountpoint;
+
+	/* Segment file written by the recorder, with its .idx index alongside */
+	char *file;
+
+	/* Replay speed, 1 for the recorded pace */
+	float speed;
+
+	/* Restart at the end of the recording */
+	int loop;
+};
+
+struct config_generator {
+	/* Mountpoint prefix, followed by the source number from 1 */
+	char *prefix;
+
+	/* Number of sources */
+	int count;
+
+	/*
+	 * Message mix: types with their interval in epochs, like "1005(10),1077(1)".
+	 * Supported types are 1005, 1006 and MSM4 to MSM7.
+	 */
+	char *messages;
+
+	/* Satellites and signals per MSM message, at most 64 cells */
+	int satellites;
+	int signals;
+
+	/* Epoch interval in milliseconds */
+	int epoch_interval;
+
+	/* Center and radius in km of the area the sources are spread over */
+	float latitude, longitude;
+	float radius;
+};
+
 struct config_threads {
 	/* Thread stack size */
 	size_t	stacksize;
@@ -139,12 +196,86 @@ struct config {
 	struct config_graylog	*graylog;
 	int			graylog_count;
 
+	/*
+	 * Recorded livesources
+	 */
+	struct config_recorder	*recorder;
+	int			recorder_count;
+
+	/*
+	 * Number of frames queued for the recorder I/O thread,
+	 * frames are dropped when it is full.
+	 */
+	int			recorder_queue_size;
+
+	/*
+	 * Recordings replayed as livesources
+	 */
+	struct config_replay	*replay;
+	int			replay_count;
+
+	/*
+	 * Synthetic sources for load testing
+	 */
+	struct config_generator	*generator;
+	int			generator_count;
+
 	/*
 	 * Sizes of accepted backlogs before we drop a client.
 	 */
 	size_t			backlog_socket;		// used to set the socket buffer size
 	size_t			backlog_evbuffer;
 
+	/*
+	 * If set, when a RTCM client backlog exceeds backlog_evbuffer,
+	 * drop the queued frames older than the newest complete epoch
+	 * (except station messages) instead of dropping the client.
+	 */
+	int			backlog_compaction;
+
+	/*
+	 * Default minimum interval in seconds between RTCM observation epochs
+	 * sent to a client, 0 to send all of them.
+	 * Can be changed by the client with the decimate= query argument.
+	 */
+	int			decimation_interval;
+
+	/*
+	 * Strict RTCM mode: drop frames with a bad CRC and data outside
+	 * RTCM frames instead of forwarding them, and resynchronize on the
+	 * next valid frame.
+	 */
+	int			rtcm_strict;
+
+	/*
+	 * Transcode MSM7 messages from sources to MSM4, once per frame,
+	 * for clients asking for it with the msm=4 query argument.
+	 */
+	int			msm4_transcoding;
+
+	/*
+	 * Number of packets kept in the shared per-livesource ring.
+	 *
+	 * If not 0, subscribers don't get their own copy or reference
+	 * of each packet at reception time, but a read cursor in the ring,
+	 * drained when their output is empty.
+	 * A subscriber lagging more than this number of packets is dropped,
+	 * when it drains its output or, if its output does not drain at all,
+	 * on the next stalled subscriber check.
+	 *
+	 * Only used in zero-copy mode.
+	 */
+	int			fanout_ring_size;
+
+	/*
+	 * In threaded mode, number of subscribers over which a packet is sent
+	 * in parallel by several workers, by partitions of this size.
+	 * 0 to disable.
+	 *
+	 * Not used in packet ring mode.
+	 */
+	int			fanout_partition_size;
+
 	/*
 	 * Read timeout for sources
 	 */
@@ -241,6 +372,16 @@ struct config {
 	/* Used only for YAML config reading as the CYAML default is 0 */
 	int disable_zero_copy;
 
+	/*
+	 * In zero copy mode, packets smaller than this are still copied when
+	 * sent to several subscribers, as a shared reference then costs more
+	 * CPU than a copy, but they no longer save memory on backlogs.
+	 *
+	 * 0 (default) to share all packets. Most RTCM frames are under
+	 * 512 bytes, so a threshold around that size mostly disables zero copy.
+	 */
+	int zero_copy_min_packet;
+
 	/*
 	 * Web root file paths.
 	 */
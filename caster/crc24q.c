@@ -0,0 +1,386 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC24Q_CLMUL_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(__FreeBSD__)
+#include <sys/auxv.h>
+#include <machine/elf.h>
+#endif
+#if defined(HWCAP_PMULL)
+#define CRC24Q_CLMUL_ARM
+#endif
+#endif
+
+#include "crc24q.h"
+
+/*
+ * CRC24Q (RTCM 3) checksum.
+ *
+ * Internally, the CRC is handled as a 32-bit CRC on polynomial P32 = P24.x^8,
+ * the CRC24Q value being the upper 24 bits.
+ *
+ * Three implementations are available, the fastest one being selected
+ * by crc24q_init() from the CPU features:
+ *	- byte-at-a-time table lookup, usable before crc24q_init()
+ *	- slicing-by-8: 8 bytes at a time, with 8 tables
+ *	- carry-less multiplication (x86 PCLMULQDQ or ARMv8 PMULL): folding
+ *	  of 4x128-bit lanes, for messages of at least 64 bytes.
+ */
+
+#define	CRC24Q_P32	0x1864cfb00ULL
+
+static const uint32_t crc24q_table[256] = {
+    0x00000000, 0x01864CFB, 0x028AD50D, 0x030C99F6,
+    0x0493E6E1, 0x0515AA1A, 0x061933EC, 0x079F7F17,
+    0x08A18139, 0x0927CDC2, 0x0A2B5434, 0x0BAD18CF,
+    0x0C3267D8, 0x0DB42B23, 0x0EB8B2D5, 0x0F3EFE2E,
+    0x10C54E89, 0x11430272, 0x124F9B84, 0x13C9D77F,
+    0x1456A868, 0x15D0E493, 0x16DC7D65, 0x175A319E,
+    0x1864CFB0, 0x19E2834B, 0x1AEE1ABD, 0x1B685646,
+    0x1CF72951, 0x1D7165AA, 0x1E7DFC5C, 0x1FFBB0A7,
+    0x200CD1E9, 0x218A9D12, 0x228604E4, 0x2300481F,
+    0x249F3708, 0x25197BF3, 0x2615E205, 0x2793AEFE,
+    0x28AD50D0, 0x292B1C2B, 0x2A2785DD, 0x2BA1C926,
+    0x2C3EB631, 0x2DB8FACA, 0x2EB4633C, 0x2F322FC7,
+    0x30C99F60, 0x314FD39B, 0x32434A6D, 0x33C50696,
+    0x345A7981, 0x35DC357A, 0x36D0AC8C, 0x3756E077,
+    0x38681E59, 0x39EE52A2, 0x3AE2CB54, 0x3B6487AF,
+    0x3CFBF8B8, 0x3D7DB443, 0x3E712DB5, 0x3FF7614E,
+    0x4019A3D2, 0x419FEF29, 0x429376DF, 0x43153A24,
+    0x448A4533, 0x450C09C8, 0x4600903E, 0x4786DCC5,
+    0x48B822EB, 0x493E6E10, 0x4A32F7E6, 0x4BB4BB1D,
+    0x4C2BC40A, 0x4DAD88F1, 0x4EA11107, 0x4F275DFC,
+    0x50DCED5B, 0x515AA1A0, 0x52563856, 0x53D074AD,
+    0x544F0BBA, 0x55C94741, 0x56C5DEB7, 0x5743924C,
+    0x587D6C62, 0x59FB2099, 0x5AF7B96F, 0x5B71F594,
+    0x5CEE8A83, 0x5D68C678, 0x5E645F8E, 0x5FE21375,
+    0x6015723B, 0x61933EC0, 0x629FA736, 0x6319EBCD,
+    0x648694DA, 0x6500D821, 0x660C41D7, 0x678A0D2C,
+    0x68B4F302, 0x6932BFF9, 0x6A3E260F, 0x6BB86AF4,
+    0x6C2715E3, 0x6DA15918, 0x6EADC0EE, 0x6F2B8C15,
+    0x70D03CB2, 0x71567049, 0x725AE9BF, 0x73DCA544,
+    0x7443DA53, 0x75C596A8, 0x76C90F5E, 0x774F43A5,
+    0x7871BD8B, 0x79F7F170, 0x7AFB6886, 0x7B7D247D,
+    0x7CE25B6A, 0x7D641791, 0x7E688E67, 0x7FEEC29C,
+    0x803347A4, 0x81B50B5F, 0x82B992A9, 0x833FDE52,
+    0x84A0A145, 0x8526EDBE, 0x862A7448, 0x87AC38B3,
+    0x8892C69D, 0x89148A66, 0x8A181390, 0x8B9E5F6B,
+    0x8C01207C, 0x8D876C87, 0x8E8BF571, 0x8F0DB98A,
+    0x90F6092D, 0x917045D6, 0x927CDC20, 0x93FA90DB,
+    0x9465EFCC, 0x95E3A337, 0x96EF3AC1, 0x9769763A,
+    0x98578814, 0x99D1C4EF, 0x9ADD5D19, 0x9B5B11E2,
+    0x9CC46EF5, 0x9D42220E, 0x9E4EBBF8, 0x9FC8F703,
+    0xA03F964D, 0xA1B9DAB6, 0xA2B54340, 0xA3330FBB,
+    0xA4AC70AC, 0xA52A3C57, 0xA626A5A1, 0xA7A0E95A,
+    0xA89E1774, 0xA9185B8F, 0xAA14C279, 0xAB928E82,
+    0xAC0DF195, 0xAD8BBD6E, 0xAE872498, 0xAF016863,
+    0xB0FAD8C4, 0xB17C943F, 0xB2700DC9, 0xB3F64132,
+    0xB4693E25, 0xB5EF72DE, 0xB6E3EB28, 0xB765A7D3,
+    0xB85B59FD, 0xB9DD1506, 0xBAD18CF0, 0xBB57C00B,
+    0xBCC8BF1C, 0xBD4EF3E7, 0xBE426A11, 0xBFC426EA,
+    0xC02AE476, 0xC1ACA88D, 0xC2A0317B, 0xC3267D80,
+    0xC4B90297, 0xC53F4E6C, 0xC633D79A, 0xC7B59B61,
+    0xC88B654F, 0xC90D29B4, 0xCA01B042, 0xCB87FCB9,
+    0xCC1883AE, 0xCD9ECF55, 0xCE9256A3, 0xCF141A58,
+    0xD0EFAAFF, 0xD169E604, 0xD2657FF2, 0xD3E33309,
+    0xD47C4C1E, 0xD5FA00E5, 0xD6F69913, 0xD770D5E8,
+    0xD84E2BC6, 0xD9C8673D, 0xDAC4FECB, 0xDB42B230,
+    0xDCDDCD27, 0xDD5B81DC, 0xDE57182A, 0xDFD154D1,
+    0xE026359F, 0xE1A07964, 0xE2ACE092, 0xE32AAC69,
+    0xE4B5D37E, 0xE5339F85, 0xE63F0673, 0xE7B94A88,
+    0xE887B4A6, 0xE901F85D, 0xEA0D61AB, 0xEB8B2D50,
+    0xEC145247, 0xED921EBC, 0xEE9E874A, 0xEF18CBB1,
+    0xF0E37B16, 0xF16537ED, 0xF269AE1B, 0xF3EFE2E0,
+    0xF4709DF7, 0xF5F6D10C, 0xF6FA48FA, 0xF77C0401,
+    0xF842FA2F, 0xF9C4B6D4, 0xFAC82F22, 0xFB4E63D9,
+    0xFCD11CCE, 0xFD575035, 0xFE5BC9C3, 0xFFDD8538
+};
+
+static uint32_t crc24q_slice[8][256];
+
+static pthread_once_t crc24q_once = PTHREAD_ONCE_INIT;
+
+/* Fold constants: x^n mod P32 */
+static uint64_t crc24q_k512, crc24q_k576;	// 4x128-bit lanes
+static uint64_t crc24q_k128, crc24q_k192;	// 128 bits
+static uint64_t crc24q_k64, crc24q_k96;		// final reduction
+
+static uint32_t crc24q_update_bytewise(uint32_t c, const unsigned char *data, size_t len) {
+	for (size_t d = 0; d < len; d++)
+		c = (c << 8) ^ (crc24q_table[(data[d] ^ (c >> 24)) & 0xff] << 8);
+	return c;
+}
+
+static uint32_t crc24q_update_slicing8(uint32_t c, const unsigned char *d, size_t len) {
+	while (len >= 8) {
+		uint32_t one = c ^ ((uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | (uint32_t)d[2] << 8 | d[3]);
+		c = crc24q_slice[7][one >> 24] ^ crc24q_slice[6][(one >> 16) & 0xff]
+		  ^ crc24q_slice[5][(one >> 8) & 0xff] ^ crc24q_slice[4][one & 0xff]
+		  ^ crc24q_slice[3][d[4]] ^ crc24q_slice[2][d[5]]
+		  ^ crc24q_slice[1][d[6]] ^ crc24q_slice[0][d[7]];
+		d += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = (c << 8) ^ crc24q_slice[0][(c >> 24) ^ *d++];
+	return c;
+}
+
+/*
+ * Reduce a 64-bit value Z to Z mod P32, using the slicing tables:
+ * Z = Zh.x^32 + Zl, and Zh.x^32 mod P32 is the CRC of the 4 bytes of Zh.
+ */
+static inline uint32_t crc24q_reduce64(uint64_t z) {
+	return crc24q_slice[3][z >> 56] ^ crc24q_slice[2][(z >> 48) & 0xff]
+	     ^ crc24q_slice[1][(z >> 40) & 0xff] ^ crc24q_slice[0][(z >> 32) & 0xff]
+	     ^ (uint32_t)z;
+}
+
+#ifdef CRC24Q_CLMUL_X86
+
+/*
+ * Fold a 128-bit value x ahead by the distance of k, and add b.
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc24q_fold_x86(__m128i x, __m128i k, __m128i b) {
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)), b);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc24q_update_clmul(uint32_t c, const unsigned char *d, size_t len) {
+	if (len < 64)
+		return crc24q_update_slicing8(c, d, len);
+
+	/* Byte swap: the first byte of a block is the most significant */
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d), bswap);
+	__m128i x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d+16)), bswap);
+	__m128i x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d+32)), bswap);
+	__m128i x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d+48)), bswap);
+	x0 = _mm_xor_si128(x0, _mm_set_epi32((int)c, 0, 0, 0));
+	d += 64;
+	len -= 64;
+
+	__m128i k = _mm_set_epi64x(crc24q_k576, crc24q_k512);
+	while (len >= 64) {
+		x0 = crc24q_fold_x86(x0, k, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d), bswap));
+		x1 = crc24q_fold_x86(x1, k, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d+16)), bswap));
+		x2 = crc24q_fold_x86(x2, k, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d+32)), bswap));
+		x3 = crc24q_fold_x86(x3, k, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(d+48)), bswap));
+		d += 64;
+		len -= 64;
+	}
+
+	/* Merge the lanes, then fold the remaining 128-bit blocks */
+	k = _mm_set_epi64x(crc24q_k192, crc24q_k128);
+	__m128i x = crc24q_fold_x86(x0, k, x1);
+	x = crc24q_fold_x86(x, k, x2);
+	x = crc24q_fold_x86(x, k, x3);
+	while (len >= 16) {
+		x = crc24q_fold_x86(x, k, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d), bswap));
+		d += 16;
+		len -= 16;
+	}
+
+	/*
+	 * Reduce X.x^32 = H.x^96 + L.x^32 to 96 bits, then 64 bits.
+	 */
+	k = _mm_set_epi64x(crc24q_k64, crc24q_k96);
+	__m128i y = _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x01), _mm_slli_si128(_mm_move_epi64(x), 4));
+	__m128i z = _mm_xor_si128(_mm_clmulepi64_si128(y, k, 0x11), _mm_move_epi64(y));
+	uint64_t z64;
+	_mm_storel_epi64((__m128i *)&z64, z);
+
+	return crc24q_update_slicing8(crc24q_reduce64(z64), d, len);
+}
+
+static int crc24q_clmul_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+#elif defined(CRC24Q_CLMUL_ARM)
+
+#if defined(__clang__)
+#define CRC24Q_TARGET_PMULL	__attribute__((target("aes")))
+#else
+#define CRC24Q_TARGET_PMULL	__attribute__((target("+crypto")))
+#endif
+
+/*
+ * Load a 16-byte block as a 128-bit value, the first byte being the most significant.
+ */
+static inline uint64x2_t crc24q_load_arm(const unsigned char *d) {
+	uint8x16_t v = vrev64q_u8(vld1q_u8(d));
+	return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+CRC24Q_TARGET_PMULL
+static inline uint64x2_t crc24q_fold_arm(uint64x2_t x, uint64x2_t k, uint64x2_t b) {
+	poly128_t hi = vmull_high_p64(vreinterpretq_p64_u64(x), vreinterpretq_p64_u64(k));
+	poly128_t lo = vmull_p64((poly64_t)vgetq_lane_u64(x, 0), (poly64_t)vgetq_lane_u64(k, 0));
+	return veorq_u64(veorq_u64(vreinterpretq_u64_p128(hi), vreinterpretq_u64_p128(lo)), b);
+}
+
+CRC24Q_TARGET_PMULL
+static uint32_t crc24q_update_clmul(uint32_t c, const unsigned char *d, size_t len) {
+	if (len < 64)
+		return crc24q_update_slicing8(c, d, len);
+
+	uint64x2_t x0 = crc24q_load_arm(d);
+	uint64x2_t x1 = crc24q_load_arm(d+16);
+	uint64x2_t x2 = crc24q_load_arm(d+32);
+	uint64x2_t x3 = crc24q_load_arm(d+48);
+	x0 = veorq_u64(x0, vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t)c << 32)));
+	d += 64;
+	len -= 64;
+
+	uint64x2_t k = vcombine_u64(vcreate_u64(crc24q_k512), vcreate_u64(crc24q_k576));
+	while (len >= 64) {
+		x0 = crc24q_fold_arm(x0, k, crc24q_load_arm(d));
+		x1 = crc24q_fold_arm(x1, k, crc24q_load_arm(d+16));
+		x2 = crc24q_fold_arm(x2, k, crc24q_load_arm(d+32));
+		x3 = crc24q_fold_arm(x3, k, crc24q_load_arm(d+48));
+		d += 64;
+		len -= 64;
+	}
+
+	k = vcombine_u64(vcreate_u64(crc24q_k128), vcreate_u64(crc24q_k192));
+	uint64x2_t x = crc24q_fold_arm(x0, k, x1);
+	x = crc24q_fold_arm(x, k, x2);
+	x = crc24q_fold_arm(x, k, x3);
+	while (len >= 16) {
+		x = crc24q_fold_arm(x, k, crc24q_load_arm(d));
+		d += 16;
+		len -= 16;
+	}
+
+	/*
+	 * Reduce X.x^32 = H.x^96 + L.x^32 to 96 bits, then 64 bits.
+	 */
+	uint64_t h = vgetq_lane_u64(x, 1);
+	uint64_t l = vgetq_lane_u64(x, 0);
+	uint64x2_t y = vreinterpretq_u64_p128(vmull_p64((poly64_t)h, (poly64_t)crc24q_k96));
+	uint64_t yl = vgetq_lane_u64(y, 0) ^ (l << 32);
+	uint64_t yh = vgetq_lane_u64(y, 1) ^ (l >> 32);
+	uint64x2_t z = vreinterpretq_u64_p128(vmull_p64((poly64_t)yh, (poly64_t)crc24q_k64));
+	uint64_t z64 = vgetq_lane_u64(z, 0) ^ yl;
+
+	return crc24q_update_slicing8(crc24q_reduce64(z64), d, len);
+}
+
+static int crc24q_clmul_supported(void) {
+	unsigned long hwcap = 0;
+#if defined(__linux__)
+	hwcap = getauxval(AT_HWCAP);
+#else
+	elf_aux_info(AT_HWCAP, &hwcap, sizeof hwcap);
+#endif
+	return (hwcap & HWCAP_PMULL) != 0;
+}
+
+#else
+
+static uint32_t crc24q_update_clmul(uint32_t c, const unsigned char *d, size_t len) {
+	return crc24q_update_slicing8(c, d, len);
+}
+
+static int crc24q_clmul_supported(void) {
+	return 0;
+}
+
+#endif
+
+static uint32_t (*crc24q_update_best)(uint32_t c, const unsigned char *data, size_t len) = crc24q_update_bytewise;
+
+/*
+ * Return x^n mod P32.
+ */
+static uint64_t crc24q_xpow_mod(int n) {
+	uint64_t r = 1;
+	while (n--) {
+		r <<= 1;
+		if (r & (1ULL << 32))
+			r ^= CRC24Q_P32;
+	}
+	return r;
+}
+
+static void _crc24q_init(void) {
+	for (int i = 0; i < 256; i++)
+		crc24q_slice[0][i] = crc24q_table[i] << 8;
+	for (int k = 1; k < 8; k++)
+		for (int i = 0; i < 256; i++) {
+			uint32_t c = crc24q_slice[k-1][i];
+			crc24q_slice[k][i] = (c << 8) ^ crc24q_slice[0][c >> 24];
+		}
+
+	crc24q_k512 = crc24q_xpow_mod(512);
+	crc24q_k576 = crc24q_xpow_mod(576);
+	crc24q_k128 = crc24q_xpow_mod(128);
+	crc24q_k192 = crc24q_xpow_mod(192);
+	crc24q_k64 = crc24q_xpow_mod(64);
+	crc24q_k96 = crc24q_xpow_mod(96);
+
+	crc24q_update_best = crc24q_clmul_supported() ? crc24q_update_clmul : crc24q_update_slicing8;
+}
+
+/*
+ * Select the fastest implementation. To be called at startup.
+ */
+void crc24q_init(void) {
+	pthread_once(&crc24q_once, _crc24q_init);
+}
+
+/*
+ * Update a CRC24Q with more data.
+ */
+unsigned long crc24q_update(unsigned long crc, const unsigned char *data, size_t len) {
+	return crc24q_update_best((uint32_t)crc << 8, data, len) >> 8;
+}
+
+/* Compute and return CRC24Q (RTCM) checksum on a byte string. */
+unsigned long crc24q_hash(const unsigned char *data, size_t len) {
+	return crc24q_update(0, data, len);
+}
+
+int crc24q_impl_available(enum crc24q_impl impl) {
+	crc24q_init();
+	return impl == CRC24Q_BYTEWISE || impl == CRC24Q_SLICING8
+		|| (impl == CRC24Q_CLMUL && crc24q_clmul_supported());
+}
+
+/*
+ * Update a CRC24Q with a given implementation, which has to be available.
+ */
+unsigned long crc24q_update_impl(enum crc24q_impl impl, unsigned long crc, const unsigned char *data, size_t len) {
+	uint32_t c = (uint32_t)crc << 8;
+	crc24q_init();
+	switch(impl) {
+	case CRC24Q_BYTEWISE:
+		c = crc24q_update_bytewise(c, data, len);
+		break;
+	case CRC24Q_SLICING8:
+		c = crc24q_update_slicing8(c, data, len);
+		break;
+	case CRC24Q_CLMUL:
+		c = crc24q_update_clmul(c, data, len);
+		break;
+	default:
+		abort();
+	}
+	return c >> 8;
+}
+
+const char *crc24q_impl_name(enum crc24q_impl impl) {
+	static const char *names[] = {"bytewise", "slicing-by-8", "clmul"};
+	return impl < CRC24Q_NIMPL ? names[impl] : NULL;
+}
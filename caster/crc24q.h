@@ -0,0 +1,23 @@
+#ifndef __CRC24Q_H__
+#define __CRC24Q_H__
+
+#include <stddef.h>
+
+/*
+ * CRC24Q implementations, for tests and benchmarks.
+ */
+enum crc24q_impl {
+	CRC24Q_BYTEWISE,	// one table lookup per byte
+	CRC24Q_SLICING8,	// 8 bytes at a time, 8 tables
+	CRC24Q_CLMUL,		// carry-less multiply folding (x86 PCLMULQDQ or ARMv8 PMULL)
+	CRC24Q_NIMPL
+};
+
+void crc24q_init(void);
+unsigned long crc24q_update(unsigned long crc, const unsigned char *data, size_t len);
+unsigned long crc24q_hash(const unsigned char *data, size_t len);
+int crc24q_impl_available(enum crc24q_impl impl);
+unsigned long crc24q_update_impl(enum crc24q_impl impl, unsigned long crc, const unsigned char *data, size_t len);
+const char *crc24q_impl_name(enum crc24q_impl impl);
+
+#endif /* __CRC24Q_H__ */
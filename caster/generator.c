@@ -0,0 +1,511 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "conf.h"
+#include "caster.h"
+#include "config.h"
+#include "crc24q.h"
+#include "generator.h"
+#include "jobs.h"
+#include "ntrip_common.h"
+#include "rtcm.h"
+#include "rtcm_decode.h"
+#include "sourcetable.h"
+#include "util.h"
+
+/*
+ * Synthetic RTCM sources, for load testing.
+ *
+ * Each source has its own session without a connection, registered
+ * like a source connected to us. At every epoch, a job builds the
+ * configured message mix with valid CRCs and feeds it to the session
+ * input as received data, so that it goes through the whole RTCM
+ * pipeline: decoding, statistics, caches, fan-out to subscribers.
+ *
+ * Observations are random but well-formed MSM messages, the ARP (1005,
+ * 1006) is a random position in the configured area, also published
+ * in a sourcetable of its own for nearest base selection.
+ */
+
+/* WGS84 ellipsoid */
+#define	WGS84_A		6378137.0
+#define	WGS84_F		(1/298.257223563)
+
+/* MSM signal ids, in the order they are added */
+static const int generator_signals[] = {2, 16, 22, 9, 3, 15, 23, 30};
+#define	GENERATOR_MAX_SIGNALS	(sizeof generator_signals / sizeof generator_signals[0])
+
+/*
+ * MSM satellite and signal data fields, in the order of the message.
+ */
+enum generator_msm_kind {
+	GEN_ROUGH_MS,		// rough range, integer milliseconds
+	GEN_EXT_INFO,		// extended satellite information
+	GEN_ROUGH_MOD,		// rough range modulo 1 ms
+	GEN_ROUGH_RATE,		// rough phase range rate
+	GEN_FINE_PR,		// fine pseudorange
+	GEN_FINE_CP,		// fine phase range
+	GEN_LOCK,		// lock time indicator
+	GEN_HALF,		// half-cycle ambiguity indicator
+	GEN_CNR,		// carrier to noise ratio
+	GEN_FINE_RATE		// fine phase range rate
+};
+
+struct generator_msm_field {
+	int len;
+	enum generator_msm_kind kind;
+};
+
+static const struct generator_msm_field generator_sat_46[] = {
+	{8, GEN_ROUGH_MS}, {10, GEN_ROUGH_MOD}, {0}
+};
+static const struct generator_msm_field generator_sat_57[] = {
+	{8, GEN_ROUGH_MS}, {4, GEN_EXT_INFO}, {10, GEN_ROUGH_MOD}, {14, GEN_ROUGH_RATE}, {0}
+};
+static const struct generator_msm_field generator_sig_4[] = {
+	{15, GEN_FINE_PR}, {22, GEN_FINE_CP}, {4, GEN_LOCK}, {1, GEN_HALF}, {6, GEN_CNR}, {0}
+};
+static const struct generator_msm_field generator_sig_5[] = {
+	{15, GEN_FINE_PR}, {22, GEN_FINE_CP}, {4, GEN_LOCK}, {1, GEN_HALF}, {6, GEN_CNR}, {15, GEN_FINE_RATE}, {0}
+};
+static const struct generator_msm_field generator_sig_6[] = {
+	{20, GEN_FINE_PR}, {24, GEN_FINE_CP}, {10, GEN_LOCK}, {1, GEN_HALF}, {10, GEN_CNR}, {0}
+};
+static const struct generator_msm_field generator_sig_7[] = {
+	{20, GEN_FINE_PR}, {24, GEN_FINE_CP}, {10, GEN_LOCK}, {1, GEN_HALF}, {10, GEN_CNR}, {15, GEN_FINE_RATE}, {0}
+};
+
+/* Navigation systems by MSM type / 10 - 107, for the sourcetable */
+static const char *generator_gnss_names[RTCM_MSM_GNSS] = {"GPS", "GLO", "GAL", "SBAS", "QZS", "BDS", "IRN"};
+
+static int generator_is_msm(int type) {
+	return type >= 1074 && type <= 1137 && type % 10 >= 4 && type % 10 <= 7;
+}
+
+static int generator_type_supported(int type) {
+	return type == 1005 || type == 1006 || generator_is_msm(type);
+}
+
+/*
+ * xorshift64* pseudo-random generator.
+ */
+static uint64_t generator_random(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double generator_uniform(uint64_t *state) {
+	return (generator_random(state) >> 11) * (1.0/9007199254740992.0);
+}
+
+/* Signed value fitting in len bits, at most a quarter of the range */
+static int64_t generator_signed(uint64_t *state, int len) {
+	int64_t range = 1LL << (len-3);
+	return (int64_t)(generator_random(state) % (2*range+1)) - range;
+}
+
+/*
+ * Convert a position at height 0 to ECEF coordinates in 0.1 mm.
+ */
+static void generator_ecef(pos_t *pos, long long *ecef) {
+	double lat = pos->lat*(M_PI/180), lon = pos->lon*(M_PI/180);
+	double e2 = WGS84_F*(2-WGS84_F);
+	double n = WGS84_A / sqrt(1 - e2*sin(lat)*sin(lat));
+	ecef[0] = llround(n*cos(lat)*cos(lon)*1e4);
+	ecef[1] = llround(n*cos(lat)*sin(lon)*1e4);
+	ecef[2] = llround(n*(1-e2)*sin(lat)*1e4);
+}
+
+/*
+ * Parse a message mix like "1005(10),1077(1),1087": message types with
+ * their interval in epochs, 1 if not specified.
+ *
+ * Return 0, or -1 if invalid.
+ */
+int generator_parse_messages(struct generator *this, const char *messages) {
+	const char *p = messages;
+	this->nmessages = 0;
+	while (*p) {
+		char *end;
+		long type = strtol(p, &end, 10);
+		long interval = 1;
+		if (end == p || !generator_type_supported(type) || this->nmessages == GENERATOR_MAX_MESSAGES)
+			return -1;
+		p = end;
+		if (*p == '(') {
+			interval = strtol(p+1, &end, 10);
+			if (end == p+1 || *end != ')' || interval <= 0)
+				return -1;
+			p = end+1;
+		}
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+		this->messages[this->nmessages].type = type;
+		this->messages[this->nmessages].interval = interval;
+		this->nmessages++;
+	}
+	return this->nmessages ? 0 : -1;
+}
+
+/*
+ * Fill the satellite or signal data of a MSM message, return the new bit position.
+ */
+static int generator_msm_data(struct generator_source *src, unsigned char *d, int pos,
+	const struct generator_msm_field *fields, int n) {
+	for (const struct generator_msm_field *f = fields; f->len; f++) {
+		for (int i = 0; i < n; i++) {
+			int64_t value;
+			switch (f->kind) {
+			case GEN_ROUGH_MS:
+				value = 64 + generator_random(&src->prng) % 16;
+				break;
+			case GEN_ROUGH_MOD:
+				value = generator_random(&src->prng) & 1023;
+				break;
+			case GEN_ROUGH_RATE:
+				value = (int64_t)(generator_random(&src->prng) % 1601) - 800;
+				break;
+			case GEN_FINE_PR:
+			case GEN_FINE_CP:
+			case GEN_FINE_RATE:
+				value = generator_signed(&src->prng, f->len);
+				break;
+			case GEN_LOCK:
+				value = f->len == 4 ? 15 : 704;
+				break;
+			case GEN_CNR:
+				value = (40 + generator_random(&src->prng) % 10) << (f->len == 10 ? 4 : 0);
+				break;
+			default:
+				value = 0;
+			}
+			rtcm_setbits(d, pos, f->len, value);
+			pos += f->len;
+		}
+	}
+	return pos;
+}
+
+/*
+ * Build a frame of a supported type for an epoch, in milliseconds of the GPS week.
+ * mmb is the MSM multiple message bit.
+ *
+ * frame must be at least 1029 bytes long.
+ *
+ * Return the frame length, or -1 if the type is not supported.
+ */
+int generator_frame(struct generator_source *src, int type, long epoch_ms, int mmb, unsigned char *frame) {
+	struct generator *g = src->generator;
+	unsigned char *d = frame+3;
+	int pos;
+
+	memset(d, 0, 1023);
+	rtcm_setbits(d, 0, 12, type);
+	rtcm_setbits(d, 12, 12, src->station_id);
+
+	if (type == 1005 || type == 1006) {
+		rtcm_setbits(d, 30, 3, 7);			// GPS, GLONASS, Galileo
+		rtcm_setbits(d, 34, 38, src->ecef[0]);
+		rtcm_setbits(d, 72, 1, 1);			// single receiver oscillator
+		rtcm_setbits(d, 74, 38, src->ecef[1]);
+		rtcm_setbits(d, 114, 38, src->ecef[2]);
+		pos = 152;
+		if (type == 1006)
+			pos += 16;				// antenna height 0
+	} else if (generator_is_msm(type)) {
+		int gnss = type/10 - 107;
+		int msm = type % 10;
+		if (gnss == 1) {
+			/* GLONASS: day of week and time of day in Moscow time */
+			long t = (epoch_ms - RTCM_LEAP_MS + RTCM_GLONASS_OFFSET_MS + RTCM_WEEK_MS) % RTCM_WEEK_MS;
+			rtcm_setbits(d, 24, 3, t / RTCM_DAY_MS);
+			rtcm_setbits(d, 27, 27, t % RTCM_DAY_MS);
+		} else if (gnss == 5)
+			rtcm_setbits(d, 24, 30, (epoch_ms - RTCM_BDT_OFFSET_MS + RTCM_WEEK_MS) % RTCM_WEEK_MS);
+		else
+			rtcm_setbits(d, 24, 30, epoch_ms);
+		rtcm_setbits(d, 54, 1, mmb);
+		rtcm_setbits(d, 73, 64, src->sat_mask);
+		rtcm_setbits(d, 137, 32, g->sig_mask);
+		int ncell = g->nsat*g->nsig;
+		rtcm_setbits(d, 169, ncell, ncell == 64 ? ~0ULL : (1ULL << ncell) - 1);
+		pos = 169 + ncell;
+		pos = generator_msm_data(src, d, pos, (msm == 5 || msm == 7) ? generator_sat_57 : generator_sat_46, g->nsat);
+		pos = generator_msm_data(src, d, pos,
+			msm == 4 ? generator_sig_4 : msm == 5 ? generator_sig_5 : msm == 6 ? generator_sig_6 : generator_sig_7,
+			ncell);
+	} else
+		return -1;
+
+	int len = (pos+7) >> 3;
+	frame[0] = 0xd3;
+	frame[1] = len >> 8;
+	frame[2] = len & 0xff;
+	unsigned long crc = crc24q_hash(frame, len+3);
+	frame[len+3] = crc >> 16;
+	frame[len+4] = crc >> 8;
+	frame[len+5] = crc;
+	return len+6;
+}
+
+/*
+ * Build the frames of an epoch, numbered in epoch intervals since 1970.
+ *
+ * Return the total length, or -1 if buf is too small.
+ */
+int generator_epoch(struct generator_source *src, long long epoch, unsigned char *buf, size_t size) {
+	struct generator *g = src->generator;
+	long long unix_ms = epoch * g->epoch_interval;
+	long epoch_ms = ((unix_ms - RTCM_GPS_EPOCH_UNIX*1000LL + RTCM_LEAP_MS) % RTCM_WEEK_MS + RTCM_WEEK_MS) % RTCM_WEEK_MS;
+	unsigned char frame[1029];
+	size_t len = 0;
+
+	/* The last MSM message of the epoch has its multiple message bit cleared */
+	int last_msm = -1;
+	for (int i = 0; i < g->nmessages; i++)
+		if (epoch % g->messages[i].interval == 0 && generator_is_msm(g->messages[i].type))
+			last_msm = i;
+
+	for (int i = 0; i < g->nmessages; i++) {
+		if (epoch % g->messages[i].interval)
+			continue;
+		int flen = generator_frame(src, g->messages[i].type, epoch_ms, i != last_msm, frame);
+		if (flen < 0)
+			continue;
+		if (len + flen > size)
+			return -1;
+		memcpy(buf + len, frame, flen);
+		len += flen;
+	}
+	return len;
+}
+
+struct generator *generator_new(struct caster_state *caster, struct config_generator *config, int index) {
+	const char *messages = config->messages ? config->messages : GENERATOR_DEFAULT_MESSAGES;
+	struct generator *this = (struct generator *)malloc(sizeof(struct generator));
+	if (this == NULL)
+		return NULL;
+	this->caster = caster;
+	this->index = index;
+	this->epoch_interval = config->epoch_interval;
+	this->ev = NULL;
+	this->sourcetable_registered = 0;
+	this->nsources = 0;
+	this->sources = (struct generator_source *)calloc(config->count, sizeof(struct generator_source));
+	if (this->sources == NULL) {
+		generator_free(this);
+		return NULL;
+	}
+
+	if (generator_parse_messages(this, messages) < 0) {
+		logfmt(&caster->flog, LOG_ERR, "Generator %s: invalid message list %s", config->prefix, messages);
+		generator_free(this);
+		return NULL;
+	}
+
+	this->nsig = config->signals > GENERATOR_MAX_SIGNALS ? GENERATOR_MAX_SIGNALS : config->signals;
+	this->nsat = config->satellites;
+	if (this->nsat * this->nsig > GENERATOR_MAX_CELLS) {
+		this->nsat = GENERATOR_MAX_CELLS / this->nsig;
+		logfmt(&caster->flog, LOG_WARNING, "Generator %s: too many cells, using %d satellites", config->prefix, this->nsat);
+	}
+	this->sig_mask = 0;
+	for (int i = 0; i < this->nsig; i++)
+		this->sig_mask |= 1U << (32 - generator_signals[i]);
+
+	/* Uniform distribution over a disc */
+	double km_per_degree = 2*M_PI*WGS84_A/1000/360;
+	for (int i = 0; i < config->count; i++) {
+		struct generator_source *src = &this->sources[i];
+		char mountpoint[100];
+		snprintf(mountpoint, sizeof mountpoint, "%s%d", config->prefix, i+1);
+		src->generator = this;
+		src->mountpoint = mystrdup(mountpoint);
+		if (src->mountpoint == NULL) {
+			generator_free(this);
+			return NULL;
+		}
+		this->nsources++;
+		src->station_id = (i+1) % 4096;
+		src->prng = 0x9e3779b97f4a7c15ULL * ((uint64_t)index*1000003 + i + 1);
+		double r = config->radius * sqrt(generator_uniform(&src->prng));
+		double theta = 2*M_PI*generator_uniform(&src->prng);
+		src->pos.lat = config->latitude + r*cos(theta)/km_per_degree;
+		src->pos.lon = config->longitude + r*sin(theta)/(km_per_degree*cos(config->latitude*(M_PI/180)));
+		generator_ecef(&src->pos, src->ecef);
+		src->sat_mask = 0;
+		while (__builtin_popcountll(src->sat_mask) < this->nsat)
+			src->sat_mask |= 1ULL << (generator_random(&src->prng) & 63);
+		src->last_epoch = -1;
+		src->st = NULL;
+		src->bev = NULL;
+	}
+	return this;
+}
+
+/*
+ * Build the sourcetable of the generated mountpoints.
+ */
+static struct sourcetable *generator_sourcetable(struct generator *this) {
+	struct sourcetable *table = sourcetable_new(GENERATOR_SOURCETABLE_HOST, this->index, 0);
+	if (table == NULL)
+		return NULL;
+	table->priority = this->caster->config->sourcetable_priority;
+
+	char details[GENERATOR_MAX_MESSAGES*12+1] = "";
+	char nav[RTCM_MSM_GNSS*5+1] = "";
+	int gnss_seen = 0;
+	unsigned char frame[1029];
+	long bits = 0;
+	for (int i = 0; i < this->nmessages; i++) {
+		int type = this->messages[i].type;
+		size_t dlen = strlen(details);
+		snprintf(details + dlen, sizeof details - dlen, "%s%d(%d)", i ? "," : "", type, this->messages[i].interval);
+		if (generator_is_msm(type) && !(gnss_seen & (1 << (type/10 - 107)))) {
+			gnss_seen |= 1 << (type/10 - 107);
+			sprintf(nav + strlen(nav), "%s%s", *nav ? "+" : "", generator_gnss_names[type/10 - 107]);
+		}
+		bits += generator_frame(&this->sources[0], type, 0, 0, frame) * 8L / this->messages[i].interval;
+	}
+	int bps = bits * 1000 / this->epoch_interval;
+
+	for (int i = 0; i < this->nsources; i++) {
+		struct generator_source *src = &this->sources[i];
+		char line[400];
+		snprintf(line, sizeof line, "STR;%s;%s;RTCM 3.3;%s;2;%s;NONE;NONE;%.4f;%.4f;0;0;millipede-generator;none;N;N;%d;",
+			src->mountpoint, src->mountpoint, details, *nav ? nav : "NONE", src->pos.lat, src->pos.lon, bps);
+		if (sourcetable_add(table, line, 0) < 0) {
+			sourcetable_free(table);
+			return NULL;
+		}
+	}
+	return table;
+}
+
+/*
+ * Return the first epoch to send for a source up to the given one:
+ * the one after the last sent, so that none is skipped when a job runs
+ * late, or at most GENERATOR_MAX_CATCHUP epochs back.
+ *
+ * Return epoch+1 if it has already been sent.
+ */
+long long generator_first_epoch(struct generator_source *src, long long epoch) {
+	if (src->last_epoch < 0 || epoch - src->last_epoch > GENERATOR_MAX_CATCHUP)
+		return src->last_epoch < 0 ? epoch : epoch - GENERATOR_MAX_CATCHUP + 1;
+	return src->last_epoch + 1;
+}
+
+/*
+ * Send the epochs due since the last one sent.
+ *
+ * Required lock: ntrip_state
+ */
+static void generator_job(struct ntrip_state *st) {
+	struct generator_source *src = (struct generator_source *)st->feeder;
+	struct generator *g = src->generator;
+	unsigned char buf[GENERATOR_MAX_MESSAGES*1029];
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	long long epoch = (now.tv_sec*1000LL + now.tv_usec/1000) / g->epoch_interval;
+	for (long long e = generator_first_epoch(src, epoch); e <= epoch; e++) {
+		src->last_epoch = e;
+		int len = generator_epoch(src, e, buf, sizeof buf);
+		if (len > 0) {
+			evbuffer_add(st->input, buf, len);
+			rtcm_packet_handle(st);
+		}
+	}
+}
+
+/*
+ * Arm the timer for the start of the next epoch.
+ */
+static void generator_timer_add(struct generator *this) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long long ms = now.tv_sec*1000LL + now.tv_usec/1000;
+	long delay = this->epoch_interval - ms % this->epoch_interval;
+	struct timeval tv = {delay / 1000, (delay % 1000) * 1000};
+	event_add(this->ev, &tv);
+}
+
+static void generator_cb(evutil_socket_t fd, short what, void *arg) {
+	struct generator *this = (struct generator *)arg;
+	generator_timer_add(this);
+	for (int i = 0; i < this->nsources; i++) {
+		struct generator_source *src = &this->sources[i];
+		if (src->bev == NULL)
+			continue;
+		bufferevent_lock(src->bev);
+		if (src->st)
+			joblist_append_ntrip_locked(this->caster->joblist, src->st, generator_job);
+		bufferevent_unlock(src->bev);
+	}
+}
+
+/*
+ * Register the sourcetable and the source sessions, and start the epoch timer.
+ */
+int generator_start(struct generator *this) {
+	struct caster_state *caster = this->caster;
+	int r = 0;
+
+	struct sourcetable *table = generator_sourcetable(this);
+	if (table == NULL)
+		return -1;
+	stack_replace_host(caster, &caster->sourcetablestack, GENERATOR_SOURCETABLE_HOST, this->index, table);
+	this->sourcetable_registered = 1;
+
+	for (int i = 0; i < this->nsources; i++) {
+		struct generator_source *src = &this->sources[i];
+		struct ntrip_state *st = ntrip_new_feeder_source(caster, src->mountpoint, "generator", src, &src->st);
+		if (st == NULL) {
+			r = -1;
+			continue;
+		}
+		src->bev = st->bev;
+	}
+
+	/* One-shot timer, re-armed on each epoch boundary to avoid drifting */
+	this->ev = event_new(caster->base, -1, 0, generator_cb, this);
+	if (this->ev == NULL)
+		return -1;
+	generator_timer_add(this);
+	logfmt(&caster->flog, LOG_INFO, "Generator started: %d sources, %d messages every %d ms",
+		this->nsources, this->nmessages, this->epoch_interval);
+	return r;
+}
+
+void generator_free(struct generator *this) {
+	if (this->ev)
+		event_free(this->ev);
+	for (int i = 0; i < this->nsources; i++) {
+		struct generator_source *src = &this->sources[i];
+		if (src->bev) {
+			bufferevent_lock(src->bev);
+			if (src->st)
+				ntrip_deferred_free(src->st, "generator_free");
+			bufferevent_unlock(src->bev);
+			bufferevent_decref(src->bev);
+		}
+		strfree(src->mountpoint);
+	}
+	if (this->sourcetable_registered)
+		stack_replace_host(this->caster, &this->caster->sourcetablestack, GENERATOR_SOURCETABLE_HOST, this->index, NULL);
+	free(this->sources);
+	free(this);
+}
@@ -0,0 +1,79 @@
+#ifndef __GENERATOR_H__
+#define __GENERATOR_H__
+
+#include <stdint.h>
+
+#include "util.h"
+
+struct caster_state;
+struct config_generator;
+struct ntrip_state;
+
+/*
+ * Synthetic RTCM sources, for load testing.
+ */
+
+/* Message mix when none is configured */
+#define	GENERATOR_DEFAULT_MESSAGES	"1005(10),1077(1),1087(1),1097(1),1127(1)"
+
+/* Maximum number of messages in the mix */
+#define	GENERATOR_MAX_MESSAGES		16
+
+/* Maximum number of MSM cells (satellites * signals) */
+#define	GENERATOR_MAX_CELLS		64
+
+/* Maximum number of late epochs sent at once to catch up */
+#define	GENERATOR_MAX_CATCHUP		10
+
+/* Host name of the generator sourcetables in the stack */
+#define	GENERATOR_SOURCETABLE_HOST	"GENERATOR"
+
+struct generator_message {
+	int type;
+	int interval;			// in epochs
+};
+
+/*
+ * A synthetic base station.
+ */
+struct generator_source {
+	struct generator *generator;
+	char *mountpoint;
+	int station_id;
+	pos_t pos;
+	long long ecef[3];		// ARP in 0.1 mm
+	uint64_t sat_mask;
+	uint64_t prng;			// random state for the observations
+	long long last_epoch;		// last epoch sent, in epoch intervals since 1970
+
+	/*
+	 * Source session, NULL once closed.
+	 * Protected by the bufferevent lock, on which we keep a reference.
+	 */
+	struct ntrip_state *st;
+	struct bufferevent *bev;
+};
+
+struct generator {
+	struct caster_state *caster;
+	int index;			// position in the configuration
+	struct generator_message messages[GENERATOR_MAX_MESSAGES];
+	int nmessages;
+	int nsat, nsig;
+	uint32_t sig_mask;
+	int epoch_interval;		// in milliseconds
+	struct generator_source *sources;
+	int nsources;
+	struct event *ev;
+	int sourcetable_registered;
+};
+
+struct generator *generator_new(struct caster_state *caster, struct config_generator *config, int index);
+int generator_parse_messages(struct generator *this, const char *messages);
+int generator_frame(struct generator_source *src, int type, long epoch_ms, int mmb, unsigned char *frame);
+int generator_epoch(struct generator_source *src, long long epoch, unsigned char *buf, size_t size);
+long long generator_first_epoch(struct generator_source *src, long long epoch);
+int generator_start(struct generator *this);
+void generator_free(struct generator *this);
+
+#endif /* __GENERATOR_H__ */
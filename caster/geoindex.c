@@ -0,0 +1,403 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEOINDEX_KERNEL_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define GEOINDEX_KERNEL_NEON
+#endif
+
+#include "geoindex.h"
+
+/*
+ * Distance kernels.
+ *
+ * Compute the squared chord length from q to n bases given by their
+ * coordinate arrays. The vector kernels handle n rounded up to
+ * GEOINDEX_PAD, reading and writing past n.
+ */
+typedef void (*geoindex_kernel_t)(const float *x, const float *y, const float *z, int n, const float *q, float *out);
+
+static void geoindex_chord2_scalar(const float *x, const float *y, const float *z, int n, const float *q, float *out) {
+	for (int i = 0; i < n; i++) {
+		float dx = x[i] - q[0];
+		float dy = y[i] - q[1];
+		float dz = z[i] - q[2];
+		out[i] = dx*dx + dy*dy + dz*dz;
+	}
+}
+
+#ifdef GEOINDEX_KERNEL_AVX2
+
+__attribute__((target("avx2,fma")))
+static void geoindex_chord2_avx2(const float *x, const float *y, const float *z, int n, const float *q, float *out) {
+	__m256 qx = _mm256_set1_ps(q[0]);
+	__m256 qy = _mm256_set1_ps(q[1]);
+	__m256 qz = _mm256_set1_ps(q[2]);
+
+	for (int i = 0; i < n; i += 8) {
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x+i), qx);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y+i), qy);
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z+i), qz);
+		__m256 d = _mm256_mul_ps(dx, dx);
+		d = _mm256_fmadd_ps(dy, dy, d);
+		d = _mm256_fmadd_ps(dz, dz, d);
+		_mm256_storeu_ps(out+i, d);
+	}
+}
+
+static int geoindex_avx2_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+#else
+
+#define	geoindex_chord2_avx2	geoindex_chord2_scalar
+
+static int geoindex_avx2_supported(void) {
+	return 0;
+}
+
+#endif
+
+#ifdef GEOINDEX_KERNEL_NEON
+
+static void geoindex_chord2_neon(const float *x, const float *y, const float *z, int n, const float *q, float *out) {
+	float32x4_t qx = vdupq_n_f32(q[0]);
+	float32x4_t qy = vdupq_n_f32(q[1]);
+	float32x4_t qz = vdupq_n_f32(q[2]);
+
+	for (int i = 0; i < n; i += 8) {
+		float32x4_t dx0 = vsubq_f32(vld1q_f32(x+i), qx);
+		float32x4_t dx1 = vsubq_f32(vld1q_f32(x+i+4), qx);
+		float32x4_t dy0 = vsubq_f32(vld1q_f32(y+i), qy);
+		float32x4_t dy1 = vsubq_f32(vld1q_f32(y+i+4), qy);
+		float32x4_t dz0 = vsubq_f32(vld1q_f32(z+i), qz);
+		float32x4_t dz1 = vsubq_f32(vld1q_f32(z+i+4), qz);
+		float32x4_t d0 = vmulq_f32(dx0, dx0);
+		float32x4_t d1 = vmulq_f32(dx1, dx1);
+		d0 = vfmaq_f32(d0, dy0, dy0);
+		d1 = vfmaq_f32(d1, dy1, dy1);
+		d0 = vfmaq_f32(d0, dz0, dz0);
+		d1 = vfmaq_f32(d1, dz1, dz1);
+		vst1q_f32(out+i, d0);
+		vst1q_f32(out+i+4, d1);
+	}
+}
+
+#else
+
+#define	geoindex_chord2_neon	geoindex_chord2_scalar
+
+#endif
+
+static const geoindex_kernel_t geoindex_kernels[GEOINDEX_NIMPL] = {
+	geoindex_chord2_scalar,
+	geoindex_chord2_avx2,
+	geoindex_chord2_neon
+};
+
+static int geoindex_impl_supported(enum geoindex_impl impl) {
+	switch (impl) {
+	case GEOINDEX_SCALAR:
+		return 1;
+	case GEOINDEX_AVX2:
+		return geoindex_avx2_supported();
+	case GEOINDEX_NEON:
+#ifdef GEOINDEX_KERNEL_NEON
+		return 1;
+#else
+		return 0;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Kernels resolved once from the CPU features: the requested one if
+ * available, else the scalar one.
+ */
+static pthread_once_t geoindex_once = PTHREAD_ONCE_INIT;
+static int geoindex_available[GEOINDEX_NIMPL] = {1};
+static geoindex_kernel_t geoindex_kernels_resolved[GEOINDEX_NIMPL] = {
+	geoindex_chord2_scalar,
+	geoindex_chord2_scalar,
+	geoindex_chord2_scalar
+};
+static geoindex_kernel_t geoindex_kernel_best = geoindex_chord2_scalar;
+
+static void _geoindex_init(void) {
+	for (int i = 0; i < GEOINDEX_NIMPL; i++) {
+		geoindex_available[i] = geoindex_impl_supported(i);
+		if (geoindex_available[i])
+			geoindex_kernels_resolved[i] = geoindex_kernels[i];
+	}
+	if (geoindex_available[GEOINDEX_AVX2])
+		geoindex_kernel_best = geoindex_kernels[GEOINDEX_AVX2];
+	else if (geoindex_available[GEOINDEX_NEON])
+		geoindex_kernel_best = geoindex_kernels[GEOINDEX_NEON];
+}
+
+/*
+ * Select the fastest distance kernel. To be called at startup.
+ */
+void geoindex_init(void) {
+	pthread_once(&geoindex_once, _geoindex_init);
+}
+
+int geoindex_impl_available(enum geoindex_impl impl) {
+	geoindex_init();
+	return impl < GEOINDEX_NIMPL && geoindex_available[impl];
+}
+
+const char *geoindex_impl_name(enum geoindex_impl impl) {
+	static const char *names[GEOINDEX_NIMPL] = {"scalar", "avx2", "neon"};
+	return impl < GEOINDEX_NIMPL ? names[impl] : "unknown";
+}
+
+/*
+ * Unit vector in earth-centered coordinates for a latitude/longitude,
+ * on a spherical earth.
+ */
+void geoindex_unit_vector(pos_t *pos, double *v) {
+	double lat = pos->lat*(M_PI/180.);
+	double lon = pos->lon*(M_PI/180.);
+	double coslat = cos(lat);
+	v[0] = coslat*cos(lon);
+	v[1] = coslat*sin(lon);
+	v[2] = sin(lat);
+}
+
+/*
+ * A base while building the tree.
+ */
+struct geoindex_entry {
+	float v[3];
+	struct sourceline *sourceline;
+	unsigned char axis;
+};
+
+static inline void geoindex_swap(struct geoindex_entry *a, struct geoindex_entry *b) {
+	struct geoindex_entry tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/*
+ * Reorder entries[lo..hi[ so that entries[nth] is at its sorted position
+ * on the given axis, with smaller or equal values before it and larger
+ * or equal values after it.
+ *
+ * Three-way partition, to stay linear with many equal values: sourcelines
+ * without a position all sit at 0,0.
+ */
+static void geoindex_select(struct geoindex_entry *entries, int lo, int hi, int nth, int axis) {
+	hi--;
+	while (lo < hi) {
+		float pivot = entries[(lo+hi)/2].v[axis];
+		/* [lo, lt[ < pivot, [lt, i[ == pivot, ]gt, hi] > pivot */
+		int lt = lo, i = lo, gt = hi;
+		while (i <= gt) {
+			float x = entries[i].v[axis];
+			if (x < pivot)
+				geoindex_swap(&entries[i++], &entries[lt++]);
+			else if (x > pivot)
+				geoindex_swap(&entries[i], &entries[gt--]);
+			else
+				i++;
+		}
+		if (nth < lt)
+			hi = lt-1;
+		else if (nth > gt)
+			lo = gt+1;
+		else
+			return;
+	}
+}
+
+/*
+ * Build the node for entries[lo..hi[, split on the axis of largest spread.
+ */
+static void geoindex_build(struct geoindex_entry *entries, int lo, int hi) {
+	if (hi - lo <= GEOINDEX_LEAF_SIZE)
+		return;
+
+	float min[3], max[3];
+	for (int a = 0; a < 3; a++)
+		min[a] = max[a] = entries[lo].v[a];
+	for (int i = lo+1; i < hi; i++)
+		for (int a = 0; a < 3; a++) {
+			if (entries[i].v[a] < min[a]) min[a] = entries[i].v[a];
+			if (entries[i].v[a] > max[a]) max[a] = entries[i].v[a];
+		}
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+		if (max[a]-min[a] > max[axis]-min[axis])
+			axis = a;
+
+	int mid = (lo+hi)/2;
+	geoindex_select(entries, lo, hi, mid, axis);
+	entries[mid].axis = axis;
+	geoindex_build(entries, lo, mid);
+	geoindex_build(entries, mid+1, hi);
+}
+
+/*
+ * Build an index over the given sourcelines, which must outlive it.
+ */
+struct geoindex *geoindex_new(struct sourceline **sourcelines, int n) {
+	geoindex_init();
+
+	struct geoindex *this = (struct geoindex *)malloc(sizeof(struct geoindex));
+	struct geoindex_entry *entries = (struct geoindex_entry *)malloc(sizeof(struct geoindex_entry)*(n ? n : 1));
+	float *coords = (float *)calloc(3*(n + GEOINDEX_PAD), sizeof(float));
+	unsigned char *axis = (unsigned char *)malloc(n ? n : 1);
+	struct sourceline **lines = (struct sourceline **)malloc(sizeof(struct sourceline *)*(n ? n : 1));
+	if (this == NULL || entries == NULL || coords == NULL || axis == NULL || lines == NULL) {
+		free(this);
+		free(entries);
+		free(coords);
+		free(axis);
+		free(lines);
+		return NULL;
+	}
+	for (int i = 0; i < n; i++) {
+		double v[3];
+		geoindex_unit_vector(&sourcelines[i]->pos, v);
+		for (int a = 0; a < 3; a++)
+			entries[i].v[a] = v[a];
+		entries[i].sourceline = sourcelines[i];
+		entries[i].axis = 0;
+	}
+	geoindex_build(entries, 0, n);
+
+	this->n = n;
+	this->x = coords;
+	this->y = coords + n + GEOINDEX_PAD;
+	this->z = coords + 2*(n + GEOINDEX_PAD);
+	this->axis = axis;
+	this->sourcelines = lines;
+	for (int i = 0; i < n; i++) {
+		this->x[i] = entries[i].v[0];
+		this->y[i] = entries[i].v[1];
+		this->z[i] = entries[i].v[2];
+		this->axis[i] = entries[i].axis;
+		this->sourcelines[i] = entries[i].sourceline;
+	}
+	free(entries);
+	return this;
+}
+
+void geoindex_free(struct geoindex *this) {
+	free(this->x);
+	free(this->axis);
+	free(this->sourcelines);
+	free(this);
+}
+
+/*
+ * State of a k nearest query.
+ */
+struct geoindex_query {
+	float v[3];
+	int k;
+	int count;
+	struct geoindex_result *result;		// sorted by increasing distance
+	geoindex_kernel_t kernel;
+};
+
+static inline void geoindex_consider(struct geoindex_query *q, float d2, struct sourceline *sourceline) {
+	if (q->count == q->k && d2 >= q->result[q->count-1].chord2)
+		return;
+
+	int i = q->count < q->k ? q->count++ : q->count-1;
+	for (; i > 0 && q->result[i-1].chord2 > d2; i--)
+		q->result[i] = q->result[i-1];
+	q->result[i].chord2 = d2;
+	q->result[i].sourceline = sourceline;
+}
+
+/*
+ * Scan entries [lo..hi[ with the distance kernel.
+ */
+static void geoindex_scan(struct geoindex *this, struct geoindex_query *q, int lo, int hi) {
+	float d2[GEOINDEX_LEAF_SIZE];
+
+	for (int i = lo; i < hi; i += GEOINDEX_LEAF_SIZE) {
+		int n = hi - i < GEOINDEX_LEAF_SIZE ? hi - i : GEOINDEX_LEAF_SIZE;
+		q->kernel(this->x+i, this->y+i, this->z+i, n, q->v, d2);
+		for (int j = 0; j < n; j++)
+			geoindex_consider(q, d2[j], this->sourcelines[i+j]);
+	}
+}
+
+static void geoindex_search(struct geoindex *this, struct geoindex_query *q, int lo, int hi) {
+	if (hi - lo <= GEOINDEX_LEAF_SIZE) {
+		geoindex_scan(this, q, lo, hi);
+		return;
+	}
+
+	int mid = (lo+hi)/2;
+	int axis = this->axis[mid];
+	float split = axis == 0 ? this->x[mid] : axis == 1 ? this->y[mid] : this->z[mid];
+	float diff = q->v[axis] - split;
+	float d2;
+
+	geoindex_chord2_scalar(this->x+mid, this->y+mid, this->z+mid, 1, q->v, &d2);
+	geoindex_consider(q, d2, this->sourcelines[mid]);
+	if (diff < 0) {
+		geoindex_search(this, q, lo, mid);
+		if (q->count < q->k || diff*diff < q->result[q->count-1].chord2)
+			geoindex_search(this, q, mid+1, hi);
+	} else {
+		geoindex_search(this, q, mid+1, hi);
+		if (q->count < q->k || diff*diff < q->result[q->count-1].chord2)
+			geoindex_search(this, q, lo, mid);
+	}
+}
+
+static int geoindex_nearest_kernel(struct geoindex *this, geoindex_kernel_t kernel, int linear, pos_t *pos, int k, struct geoindex_result *result) {
+	struct geoindex_query q;
+	double v[3];
+
+	if (k <= 0)
+		return 0;
+	geoindex_unit_vector(pos, v);
+	for (int a = 0; a < 3; a++)
+		q.v[a] = v[a];
+	q.k = k;
+	q.count = 0;
+	q.result = result;
+	q.kernel = kernel;
+	if (linear)
+		geoindex_scan(this, &q, 0, this->n);
+	else
+		geoindex_search(this, &q, 0, this->n);
+	return q.count;
+}
+
+/*
+ * Find the k bases nearest to pos, with the given kernel, through the tree
+ * or with a linear scan of all bases.
+ *
+ * result is an array of k entries provided by the caller, filled by
+ * increasing distance.
+ * Return the number of entries filled, less than k if the index is smaller.
+ */
+int geoindex_nearest_impl(struct geoindex *this, enum geoindex_impl impl, int linear, pos_t *pos, int k, struct geoindex_result *result) {
+	geoindex_kernel_t kernel = impl < GEOINDEX_NIMPL ? geoindex_kernels_resolved[impl] : geoindex_chord2_scalar;
+	return geoindex_nearest_kernel(this, kernel, linear, pos, k, result);
+}
+
+/*
+ * Find the k bases nearest to pos, using the fastest kernel.
+ */
+int geoindex_nearest(struct geoindex *this, pos_t *pos, int k, struct geoindex_result *result) {
+	return geoindex_nearest_kernel(this, geoindex_kernel_best, 0, pos, k, result);
+}
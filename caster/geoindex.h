@@ -0,0 +1,66 @@
+#ifndef __GEOINDEX_H__
+#define __GEOINDEX_H__
+
+#include "sourceline.h"
+#include "util.h"
+
+/*
+ * Maximum number of bases in a leaf of the k-d tree, scanned with the
+ * distance kernel. Must be a multiple of GEOINDEX_PAD.
+ */
+#define	GEOINDEX_LEAF_SIZE	16
+
+/*
+ * Number of bases handled per iteration by the vector kernels: coordinate
+ * arrays are padded so that the kernels can read up to this many entries
+ * past the end.
+ */
+#define	GEOINDEX_PAD		8
+
+/*
+ * Distance kernel implementations, for tests and benchmarks.
+ */
+enum geoindex_impl {
+	GEOINDEX_SCALAR,	// one base at a time
+	GEOINDEX_AVX2,		// 8 bases per instruction, x86 AVX2 + FMA
+	GEOINDEX_NEON,		// 4 bases per instruction, 2 instructions per iteration, ARMv8
+	GEOINDEX_NIMPL
+};
+
+/*
+ * Static k-d tree over base positions.
+ *
+ * Positions are stored as unit vectors in earth-centered coordinates, so
+ * the chord length between two points orders them like the great-circle
+ * distance. Coordinates are in structure-of-arrays layout, in tree order,
+ * for the vector kernels.
+ *
+ * The tree is implicit: a node is a range of the arrays, split at its
+ * middle entry on the axis stored there. Ranges of at most
+ * GEOINDEX_LEAF_SIZE entries are leaves.
+ */
+struct geoindex {
+	int n;
+	float *x, *y, *z;			// n + GEOINDEX_PAD entries
+	unsigned char *axis;			// split axis, for node middle entries
+	struct sourceline **sourcelines;
+};
+
+/*
+ * Result of a nearest base query.
+ */
+struct geoindex_result {
+	float chord2;			// squared chord length on the unit sphere
+	struct sourceline *sourceline;
+};
+
+void geoindex_init(void);
+struct geoindex *geoindex_new(struct sourceline **sourcelines, int n);
+void geoindex_free(struct geoindex *this);
+int geoindex_nearest(struct geoindex *this, pos_t *pos, int k, struct geoindex_result *result);
+int geoindex_nearest_impl(struct geoindex *this, enum geoindex_impl impl, int linear, pos_t *pos, int k, struct geoindex_result *result);
+int geoindex_impl_available(enum geoindex_impl impl);
+const char *geoindex_impl_name(enum geoindex_impl impl);
+void geoindex_unit_vector(pos_t *pos, double *v);
+
+#endif
@@ -126,6 +126,10 @@ void joblist_run(struct joblist *this) {
 			P_MUTEX_UNLOCK(&this->mutex);
 			if (j->type == JOB_REDISTRIBUTE)
 				j->redistribute.cb(j->redistribute.arg);
+			else if (j->type == JOB_FANOUT)
+				j->fanout.cb(j->fanout.arg);
+			else if (j->type == JOB_NEAREST)
+				j->nearest.cb(j->nearest.arg);
 			else if (j->type == JOB_NTRIP_UNLOCKED)
 				j->ntrip_unlocked.cb(j->ntrip_unlocked.st);
 			else if (j->type == JOB_NTRIP_UNLOCKED_CONTENT)
@@ -409,6 +413,34 @@ void joblist_append_redistribute(struct joblist *this, void (*cb)(struct redistr
 		cb(redis_args);
 }
 
+/*
+ * Queue a new fan-out job, or directly execute in unthreaded mode.
+ */
+void joblist_append_fanout(struct joblist *this, void (*cb)(struct livesource_fanout *fanout), struct livesource_fanout *fanout) {
+	if (threads) {
+		struct job tmpj;
+		tmpj.type = JOB_FANOUT;
+		tmpj.fanout.cb = cb;
+		tmpj.fanout.arg = fanout;
+		_joblist_append_generic(this, NULL, &tmpj);
+	} else
+		cb(fanout);
+}
+
+/*
+ * Queue a new nearest base recompute job, or directly execute in unthreaded mode.
+ */
+void joblist_append_nearest(struct joblist *this, void (*cb)(struct nearest_batch *batch), struct nearest_batch *batch) {
+	if (threads) {
+		struct job tmpj;
+		tmpj.type = JOB_NEAREST;
+		tmpj.nearest.cb = cb;
+		tmpj.nearest.arg = batch;
+		_joblist_append_generic(this, NULL, &tmpj);
+	} else
+		cb(batch);
+}
+
 /*
  * Queue a new unlocked ntrip job, or directly execute in unthreaded mode.
  */
@@ -14,12 +14,16 @@ enum job_type {
 	JOB_NTRIP_UNLOCKED,
 	JOB_NTRIP_UNLOCKED_CONTENT,
 	JOB_REDISTRIBUTE,
+	JOB_FANOUT,
+	JOB_NEAREST,
 	JOB_STOP_THREAD
 };
 
 struct ntrip_state;
 struct caster_state;
 struct redistribute_cb_args;
+struct livesource_fanout;
+struct nearest_batch;
 struct mime_content;
 
 /*
@@ -61,6 +65,24 @@ struct job {
 			struct redistribute_cb_args *arg;
 		} redistribute;
 
+		/*
+		 * type == JOB_FANOUT:
+		 *	send a packet to a partition of livesource subscribers
+		 */
+		struct {
+			void (*cb)(struct livesource_fanout *arg);
+			struct livesource_fanout *arg;
+		} fanout;
+
+		/*
+		 * type == JOB_NEAREST:
+		 *	recompute the nearest base for a batch of sessions
+		 */
+		struct {
+			void (*cb)(struct nearest_batch *arg);
+			struct nearest_batch *arg;
+		} nearest;
+
 		/*
 		 * type == JOB_NTRIP_UNLOCKED: job associated with a ntrip_state,
 		 *	requires no lock on ntrip_state.
@@ -137,6 +159,8 @@ void joblist_run(struct joblist *this);
 void joblist_append(struct joblist *this, void (*cb)(struct bufferevent *bev, void *arg), void (*cbe)(struct bufferevent *bev, short events, void *arg), struct bufferevent *bev, void *arg, short events);
 void joblist_append_ntrip_locked(struct joblist *this, struct ntrip_state *st, void (*cb)(struct ntrip_state *arg));
 void joblist_append_redistribute(struct joblist *this, void (*cb)(struct redistribute_cb_args *redis_args), struct redistribute_cb_args *redis_args);
+void joblist_append_fanout(struct joblist *this, void (*cb)(struct livesource_fanout *fanout), struct livesource_fanout *fanout);
+void joblist_append_nearest(struct joblist *this, void (*cb)(struct nearest_batch *batch), struct nearest_batch *batch);
 void joblist_append_ntrip_unlocked(struct joblist *this, void (*cb)(struct ntrip_state *st), struct ntrip_state *st);
 void joblist_append_ntrip_unlocked_content(
 	struct joblist *this,
@@ -3,6 +3,7 @@
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/event.h>
 
 #include <json-c/json.h>
 #include <json-c/json_object_iterator.h>
@@ -12,20 +13,23 @@
 #include "endpoints.h"
 #include "jobs.h"
 #include "livesource.h"
+#include "nearest.h"
 #include "ntrip_common.h"
 #include "ntripsrv.h"
 #include "packet.h"
 #include "queue.h"
+#include "rtcm.h"
 #include "util.h"
 
 static const char *livesource_states[4] = {"INIT", "FETCH_PENDING", "RUNNING", NULL};
 static const char *livesource_types[3] = {"DIRECT", "FETCHED", NULL};
 static const char *livesource_update_types[4] = {"none", "add", "del", "update"};
 
-static void _livesource_del_subscriber_unlocked(struct ntrip_state *st);
+static struct subscriber *_livesource_del_subscriber_unlocked(struct ntrip_state *st);
 static json_object *livesource_update_json(struct livesource *this,
 	struct caster_state *caster, enum livesource_update_type utype);
 static struct livesource *livesource_find_unlocked(struct caster_state *this, struct ntrip_state *st, char *mountpoint, pos_t *mountpoint_pos, int on_demand, int sourceline_on_demand, enum livesource_state *new_state, json_object **jp);
+static void livesource_ring_cb(evutil_socket_t fd, short what, void *arg);
 
 /*
  * Create a remote livesource record
@@ -128,14 +132,124 @@ struct livesource *livesource_new(char *mountpoint, enum livesource_type type, e
 	}
 	TAILQ_INIT(&this->subscribers);
 	this->nsubs = 0;
-	this->npackets = 0;
+	refptr_init(&this->snapshot, NULL);
+	atomic_init(&this->npackets, 0);
+	atomic_init(&this->ncompactions, 0);
+	atomic_init(&this->compacted_frames, 0);
 	this->state = state;
 	this->type = type;
 
+	this->ring = NULL;
+	this->ring_size = 0;
+	this->ring_ev = NULL;
+	this->caster = NULL;
+	this->ring_head = 0;
+	TAILQ_INIT(&this->ring_waitq);
+
+	this->recorder_checked = 0;
+	this->recorder_stream = NULL;
+
 	P_RWLOCK_INIT(&this->lock, NULL);
+	P_MUTEX_INIT(&this->ring_lock, NULL);
 	return this;
 }
 
+/*
+ * Subscriber reference counting.
+ */
+static void subscriber_incref(struct subscriber *sub) {
+	atomic_fetch_add(&sub->refcnt, 1);
+}
+
+static void subscriber_free(struct subscriber *sub) {
+	bufferevent_decref(sub->bev);
+	free(sub);
+}
+
+static void subscriber_decref(struct subscriber *sub) {
+	if (atomic_fetch_sub(&sub->refcnt, 1) == 1)
+		subscriber_free(sub);
+}
+
+/*
+ * Get a reference on the current subscriber snapshot, without locking.
+ */
+static struct subscriber_snapshot *livesource_snapshot_get(struct livesource *this) {
+	unsigned phase;
+	struct subscriber_snapshot *snapshot = refptr_enter(&this->snapshot, &phase);
+	if (snapshot)
+		atomic_fetch_add(&snapshot->refcnt, 1);
+	refptr_leave(&this->snapshot, phase);
+	return snapshot;
+}
+
+/*
+ * Release a reference on a subscriber snapshot, freeing it if it was the last.
+ */
+static void livesource_snapshot_put(struct subscriber_snapshot *snapshot) {
+	if (snapshot == NULL || atomic_fetch_sub(&snapshot->refcnt, 1) != 1)
+		return;
+	for (int i = 0; i < snapshot->n; i++)
+		subscriber_decref(snapshot->subs[i]);
+	free(snapshot);
+}
+
+/*
+ * Replace the subscriber snapshot by a copy of the current list.
+ *
+ * On failure, the previous snapshot is kept, which is harmless for
+ * removed subscribers as they are skipped.
+ *
+ * Required lock (write): livesource
+ */
+static int _livesource_snapshot_update_unlocked(struct livesource *this) {
+	struct subscriber *np;
+	struct subscriber_snapshot *snapshot;
+
+	snapshot = (struct subscriber_snapshot *)malloc(sizeof(struct subscriber_snapshot) + this->nsubs*sizeof(struct subscriber *));
+	if (snapshot == NULL)
+		return -1;
+	atomic_init(&snapshot->refcnt, 1);
+	snapshot->n = 0;
+
+	TAILQ_FOREACH(np, &this->subscribers, next) {
+		subscriber_incref(np);
+		snapshot->subs[snapshot->n++] = np;
+	}
+	livesource_snapshot_put(refptr_publish(&this->snapshot, snapshot));
+	return 0;
+}
+
+/*
+ * Set up packet ring mode on a new livesource, if configured.
+ *
+ * Without an event loop (tests), waiting subscribers are woken up
+ * directly by the source, and stalled ones are not looked for.
+ *
+ * To be called before the livesource is published.
+ */
+static void livesource_ring_init(struct livesource *this, struct caster_state *caster) {
+	int ring_size = caster->config->fanout_ring_size;
+	if (ring_size <= 0 || !caster->config->zero_copy)
+		return;
+
+	struct packet **ring = (struct packet **)calloc(ring_size, sizeof(struct packet *));
+	if (ring == NULL)
+		return;
+	if (caster->base) {
+		this->ring_ev = event_new(caster->base, -1, EV_PERSIST, livesource_ring_cb, this);
+		if (this->ring_ev == NULL) {
+			free(ring);
+			return;
+		}
+		struct timeval interval = {LIVESOURCE_RING_CHECK_INTERVAL, 0};
+		event_add(this->ring_ev, &interval);
+	}
+	this->ring = ring;
+	this->ring_size = ring_size;
+	this->caster = caster;
+}
+
 /*
  * Kill some or all subscribers of a livesource.
  *
@@ -150,9 +264,11 @@ struct livesource *livesource_new(char *mountpoint, enum livesource_type type, e
 int livesource_kill_subscribers_unlocked(struct livesource *this, int kill_backlogged) {
 	struct subscriber *np, *tnp;
 	int killed = 0;
+	int removed = 0;
 	TAILQ_FOREACH_SAFE(np, &this->subscribers, next, tnp) {
 		/* Keep a pointer because it will be possibly destroyed by ntrip_deferred_free() */
-		struct bufferevent *bev = np->ntrip_state->bev;
+		struct bufferevent *bev = np->bev;
+		struct subscriber *sub = NULL;
 
 		bufferevent_lock(bev);
 
@@ -163,24 +279,40 @@ int livesource_kill_subscribers_unlocked(struct livesource *this, int kill_backl
 			/*
 			 * Try to resubscribe virtual sources to a new source
 			 */
-			joblist_append_ntrip_locked(np->ntrip_state->caster->joblist, np->ntrip_state, &ntripsrv_redo_virtual_pos);
+			nearest_sched_schedule(np->ntrip_state->caster->nearest_sched, np->ntrip_state);
 		}
 
 		if (kill_backlogged == 0 || np->backlogged) {
 			struct ntrip_state *st = np->ntrip_state;
-			_livesource_del_subscriber_unlocked(st);
+			sub = _livesource_del_subscriber_unlocked(st);
 			ntrip_deferred_free(st, "livesource_kill_subscribers_unlocked");
+			removed++;
 		}
 		bufferevent_unlock(bev);
+		if (sub)
+			subscriber_decref(sub);
 	}
+	if (removed)
+		_livesource_snapshot_update_unlocked(this);
 	return killed;
 }
 
 void livesource_free(struct livesource *this) {
+	/* Waits for a running callback */
+	if (this->ring_ev)
+		event_free(this->ring_ev);
 	P_RWLOCK_WRLOCK(&this->lock);
 	livesource_kill_subscribers_unlocked(this, 0);
 	P_RWLOCK_UNLOCK(&this->lock);
 	P_RWLOCK_DESTROY(&this->lock);
+	livesource_snapshot_put(refptr_publish(&this->snapshot, NULL));
+	if (this->ring) {
+		for (int i = 0; i < this->ring_size; i++)
+			if (this->ring[i])
+				packet_free(this->ring[i]);
+		free(this->ring);
+	}
+	P_MUTEX_DESTROY(&this->ring_lock);
 	strfree(this->mountpoint);
 	free(this);
 }
@@ -192,6 +324,7 @@ void livesource_set_state(struct livesource *this, struct caster_state *caster,
 		this->state = state;
 		j = livesource_update_json(this, caster, LIVESOURCE_UPDATE_STATUS);
 		caster->livesources->serial++;
+		stack_bump_generation(&caster->sourcetablestack);
 	}
 	P_RWLOCK_UNLOCK(&this->lock);
 	syncer_queue_json(caster, j);
@@ -207,13 +340,36 @@ struct subscriber *livesource_add_subscriber(struct livesource *this, struct ntr
 	if (sub != NULL) {
 		sub->livesource = this;
 		sub->ntrip_state = st;
+		sub->bev = st->bev;
+		bufferevent_incref(sub->bev);
+		/* Reference for the livesource list */
+		atomic_init(&sub->refcnt, 1);
 		sub->backlogged = 0;
 		sub->virtual = 0;
 
 		P_RWLOCK_WRLOCK(&this->lock);
 		TAILQ_INSERT_TAIL(&this->subscribers, sub, next);
 		this->nsubs++;
+		if (_livesource_snapshot_update_unlocked(this) < 0) {
+			TAILQ_REMOVE(&this->subscribers, sub, next);
+			this->nsubs--;
+			P_RWLOCK_UNLOCK(&this->lock);
+			ntrip_log(st, LOG_CRIT, "Not enough memory to subscribe to %s", this->mountpoint);
+			subscriber_free(sub);
+			return NULL;
+		}
 		st->subscription = sub;
+
+		if (this->ring) {
+			/* Start from the next packet, our output being empty */
+			P_MUTEX_LOCK(&this->ring_lock);
+			sub->ring_cursor = this->ring_head;
+			sub->ring_wait = SUBSCRIBER_WAIT_QUEUED;
+			sub->ring_drained = 0;
+			TAILQ_INSERT_TAIL(&this->ring_waitq, sub, next_wait);
+			P_MUTEX_UNLOCK(&this->ring_lock);
+		} else
+			sub->ring_wait = SUBSCRIBER_WAIT_NONE;
 		P_RWLOCK_UNLOCK(&this->lock);
 
 		ntrip_log(st, LOG_INFO, "subscription done to %s", this->mountpoint);
@@ -221,17 +377,68 @@ struct subscriber *livesource_add_subscriber(struct livesource *this, struct ntr
 	return sub;
 }
 
+/*
+ * Send a new subscriber the RTCM replay cache of the source, if any,
+ * for a faster first fix.
+ *
+ * To be called once the stream reply header has been sent.
+ *
+ * The replay is capped to half of backlog_evbuffer, including what is
+ * already queued, to leave room for live data before the subscriber
+ * is considered backlogged.
+ *
+ * Required lock: ntrip_state
+ */
+void livesource_replay_subscriber(struct livesource *this, struct ntrip_state *st) {
+	struct caster_state *caster = st->caster;
+
+	if (caster->rtcm_cache == NULL)
+		return;
+
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	size_t queued = evbuffer_get_length(output);
+	size_t max_len = caster->config->backlog_evbuffer / 2;
+	if (queued >= max_len)
+		return;
+
+	P_RWLOCK_RDLOCK(&caster->rtcm_lock);
+	struct rtcm_info *rp = hash_table_get(caster->rtcm_cache, this->mountpoint);
+	size_t len = rp ? rtcm_info_replay(rp, output, st->rtcm_filter, max_len - queued) : 0;
+	P_RWLOCK_UNLOCK(&caster->rtcm_lock);
+
+	if (len) {
+		st->sent_bytes += len;
+		ntrip_log(st, LOG_DEBUG, "replayed %zd bytes of cached RTCM from %s", len, this->mountpoint);
+	}
+}
+
 /*
  * Remove a subscriber from a live source.
+ *
+ * Return the subscriber, for the caller to update the snapshot and
+ * release the list reference with subscriber_decref() once
+ * the bufferevent is unlocked.
+ *
+ * Required locks: livesource (write), ntrip_state
  */
-static void _livesource_del_subscriber_unlocked(struct ntrip_state *st) {
-	if (st->subscription) {
-		struct subscriber *sub = st->subscription;
+static struct subscriber *_livesource_del_subscriber_unlocked(struct ntrip_state *st) {
+	struct subscriber *sub = st->subscription;
+	if (sub) {
 		TAILQ_REMOVE(&sub->livesource->subscribers, sub, next);
 		sub->livesource->nsubs--;
+		if (sub->livesource->ring) {
+			P_MUTEX_LOCK(&sub->livesource->ring_lock);
+			/* If being woken up, _livesource_ring_wake() will dequeue it */
+			if (sub->ring_wait == SUBSCRIBER_WAIT_QUEUED) {
+				TAILQ_REMOVE(&sub->livesource->ring_waitq, sub, next_wait);
+				sub->ring_wait = SUBSCRIBER_WAIT_NONE;
+			}
+			P_MUTEX_UNLOCK(&sub->livesource->ring_lock);
+		}
 		sub->ntrip_state->subscription = NULL;
-		free(sub);
+		sub->ntrip_state = NULL;
 	}
+	return sub;
 }
 
 void livesource_del_subscriber(struct ntrip_state *st) {
@@ -248,6 +455,8 @@ void livesource_del_subscriber(struct ntrip_state *st) {
 		_livesource_del_subscriber_unlocked(st);
 
 		bufferevent_unlock(st->bev);
+		_livesource_snapshot_update_unlocked(livesource);
+		subscriber_decref(sub);
 		P_RWLOCK_UNLOCK(&livesource->lock);
 	}
 	P_MUTEX_UNLOCK(&st->caster->livesources->delete_lock);
@@ -261,37 +470,323 @@ static void raw_free_callback(const void *data, size_t datalen, void *extra) {
 	packet_free(packet);
 }
 
+#define LIVESOURCE_DRAIN_BATCH	64
+
 /*
- * Send a packet to all source subscribers
+ * Backlog compaction for a subscriber lagging behind the ring:
+ * skip to the start of the newest complete epoch, after queuing the last
+ * station description messages found before it in batch, unless sent
+ * again after the epoch start.
  *
- * Required locks: ntrip_state, packet
+ * Return the number of packets skipped, or -1 if there is no complete
+ * RTCM epoch in the ring.
+ *
+ * Required lock: ring_lock
  */
-int livesource_send_subscribers(struct livesource *this, struct packet *packet, struct caster_state *caster) {
-	struct subscriber *np;
+static long _livesource_ring_compact_unlocked(struct livesource *this, struct subscriber *sub, struct packet **batch, int *n) {
+	static const int station_types[] = {1005, 1006, 1033};
+	unsigned long long oldest = this->ring_head > this->ring_size ? this->ring_head - this->ring_size : 0;
+	unsigned long long epoch_start = 0;
+	unsigned long long seq;
+	int nends = 0;
+
+	for (seq = this->ring_head; seq-- > oldest; ) {
+		struct packet *packet = this->ring[seq % this->ring_size];
+		if (rtcm_frame_epoch_end(packet->data, packet->datalen) == 1 && ++nends == 2) {
+			epoch_start = seq + 1;
+			break;
+		}
+	}
+	if (nends < 2)
+		return -1;
+
+	for (int i = 0; i < sizeof station_types / sizeof station_types[0]; i++) {
+		for (seq = epoch_start; seq < this->ring_head; seq++) {
+			struct packet *packet = this->ring[seq % this->ring_size];
+			if (rtcm_frame_type(packet->data, packet->datalen) == station_types[i])
+				break;
+		}
+		if (seq < this->ring_head)
+			/* Will be sent with the epoch */
+			continue;
+		for (seq = epoch_start; seq-- > oldest; ) {
+			struct packet *packet = this->ring[seq % this->ring_size];
+			if (rtcm_frame_type(packet->data, packet->datalen) == station_types[i]) {
+				if (rtcm_filter_check(sub->ntrip_state->rtcm_filter, station_types[i])) {
+					packet_incref(packet, 1);
+					batch[(*n)++] = packet;
+				}
+				break;
+			}
+		}
+	}
+
+	long skipped = epoch_start - sub->ring_cursor - *n;
+	sub->ring_cursor = epoch_start;
+	return skipped;
+}
+
+/*
+ * Send a subscriber the packets it has not seen yet in the livesource ring,
+ * or put it on the wait queue if it is up to date.
+ *
+ * At most LIVESOURCE_DRAIN_BATCH packets are queued at a time, the rest
+ * being sent on the next write callback, when the output is empty again.
+ *
+ * Return the number of packets queued, or -1 if the subscriber lags
+ * behind by more than the ring size.
+ *
+ * Required lock: ntrip_state
+ */
+int livesource_drain_subscriber(struct subscriber *sub) {
+	struct livesource *this = sub->livesource;
+	struct ntrip_state *st = sub->ntrip_state;
+	struct packet *batch[LIVESOURCE_DRAIN_BATCH];
 	int n = 0;
-	int ns = 0;
 
-	if (this == NULL)
-		/* Dead livesource */
+	if (this->ring == NULL)
 		return 0;
 
-	P_RWLOCK_WRLOCK(&this->lock);
+	P_MUTEX_LOCK(&this->ring_lock);
+	sub->ring_drained = 1;
+	unsigned long long lag = this->ring_head - sub->ring_cursor;
+	if (lag > (unsigned long long)this->ring_size) {
+		long skipped = -1;
+		if (st->caster->config->backlog_compaction)
+			skipped = _livesource_ring_compact_unlocked(this, sub, batch, &n);
+		if (skipped < 0) {
+			P_MUTEX_UNLOCK(&this->ring_lock);
+			ntrip_log(st, LOG_NOTICE, "RTCM: lagging %llu packets behind on %s", lag, this->mountpoint);
+			return -1;
+		}
+		atomic_fetch_add(&this->ncompactions, 1);
+		atomic_fetch_add(&this->compacted_frames, skipped);
+		ntrip_log(st, LOG_INFO, "RTCM: lagging %llu packets behind on %s, skipped %ld", lag, this->mountpoint, skipped);
+	}
+	while (sub->ring_cursor != this->ring_head && n < LIVESOURCE_DRAIN_BATCH) {
+		struct packet *packet = rtcm_filter_select(st->rtcm_filter, this->ring[sub->ring_cursor % this->ring_size]);
+		sub->ring_cursor++;
+		if (packet == NULL)
+			continue;
+		packet_incref(packet, 1);
+		batch[n++] = packet;
+	}
+	if (n == 0 && sub->ring_wait == SUBSCRIBER_WAIT_NONE) {
+		sub->ring_wait = SUBSCRIBER_WAIT_QUEUED;
+		TAILQ_INSERT_TAIL(&this->ring_waitq, sub, next_wait);
+	}
+	P_MUTEX_UNLOCK(&this->ring_lock);
+
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	for (int i = 0; i < n; i++) {
+		if (evbuffer_add_reference(output, batch[i]->data, batch[i]->datalen, raw_free_callback, batch[i]) < 0) {
+			ntrip_log(st, LOG_CRIT, "RTCM: evbuffer_add_reference failed");
+			packet_free(batch[i]);
+		} else
+			st->sent_bytes += batch[i]->datalen;
+	}
+	return n;
+}
+
+/*
+ * Wake up the subscribers waiting for packets, sending them what they missed.
+ */
+static void _livesource_ring_wake(struct livesource *this, int *nbacklogged) {
+	struct subscribersq wakeq;
+	struct subscriber *np, *tnp;
 
-	this->npackets++;
+	TAILQ_INIT(&wakeq);
 
-	/* Increase reference count in one go to reduce overhead */
-	if (packet->caster->config->zero_copy) {
-		P_MUTEX_LOCK(&packet->mutex);
-		packet->refcnt += this->nsubs;
-		P_MUTEX_UNLOCK(&packet->mutex);
+	P_MUTEX_LOCK(&this->ring_lock);
+	TAILQ_CONCAT(&wakeq, &this->ring_waitq, next_wait);
+	TAILQ_FOREACH(np, &wakeq, next_wait) {
+		/* Keep the subscriber around in case it is removed meanwhile */
+		subscriber_incref(np);
+		np->ring_wait = SUBSCRIBER_WAIT_WAKING;
 	}
+	P_MUTEX_UNLOCK(&this->ring_lock);
 
-	int nbacklogged = 0;
+	TAILQ_FOREACH_SAFE(np, &wakeq, next_wait, tnp) {
+		struct bufferevent *bev = np->bev;
+		bufferevent_lock(bev);
+		P_MUTEX_LOCK(&this->ring_lock);
+		TAILQ_REMOVE(&wakeq, np, next_wait);
+		np->ring_wait = SUBSCRIBER_WAIT_NONE;
+		P_MUTEX_UNLOCK(&this->ring_lock);
+		struct ntrip_state *st = np->ntrip_state;
+		if (st == NULL) {
+			/* Unsubscribed meanwhile */
+		} else if (st->state == NTRIP_END) {
+			/* Subscriber currently closing, skip */
+			ntrip_log(st, LOG_DEBUG, "livesource_send_subscribers: dropping, state=%d", st->state);
+		} else if (livesource_drain_subscriber(np) < 0) {
+			np->backlogged = 1;
+			(*nbacklogged)++;
+		}
+		bufferevent_unlock(bev);
+		subscriber_decref(np);
+	}
+}
 
-	TAILQ_FOREACH(np, &this->subscribers, next) {
+/*
+ * Insert a batch of packets in the livesource ring, and have the
+ * subscribers waiting for them woken up.
+ *
+ * The cost for the source does not depend on the number of subscribers
+ * only because it is moved elsewhere: waiting ones are woken up by the ring
+ * event, once for all the packets received meanwhile, _livesource_ring_wake()
+ * locking and draining each of them in turn on the single caster->base
+ * thread, and the others fetch the packets from the ring on their next
+ * write callback.
+ *
+ * Required locks: ntrip_state of the source, packets
+ */
+static void _livesource_send_ring(struct livesource *this, struct packet **packets, int npackets, int *nbacklogged) {
+	struct packet *old[LIVESOURCE_SEND_BATCH];
+	int nold = 0;
+
+	/* Reference kept by the ring */
+	for (int i = 0; i < npackets; i++)
+		packet_incref(packets[i], 1);
+
+	P_MUTEX_LOCK(&this->ring_lock);
+	for (int i = 0; i < npackets; i++) {
+		struct packet **slot = &this->ring[this->ring_head % this->ring_size];
+		if (*slot)
+			old[nold++] = *slot;
+		*slot = packets[i];
+		this->ring_head++;
+	}
+	int wake = !TAILQ_EMPTY(&this->ring_waitq);
+	P_MUTEX_UNLOCK(&this->ring_lock);
+
+	for (int i = 0; i < nold; i++)
+		packet_free(old[i]);
+
+	if (!wake)
+		return;
+	if (this->ring_ev)
+		event_active(this->ring_ev, EV_WRITE, 0);
+	else
+		_livesource_ring_wake(this, nbacklogged);
+}
+
+/*
+ * Flag stalled subscribers in packet ring mode: those lagging behind by
+ * more than the ring size, and not drained since the previous check.
+ *
+ * A stalled socket never gets a write callback, hence never notices
+ * its own lag in livesource_drain_subscriber().
+ */
+static void _livesource_ring_check(struct livesource *this, int *nbacklogged) {
+	struct subscriber_snapshot *snapshot = livesource_snapshot_get(this);
+	if (snapshot == NULL)
+		return;
+
+	for (int i = 0; i < snapshot->n; i++) {
+		struct subscriber *np = snapshot->subs[i];
+		struct bufferevent *bev = np->bev;
+		bufferevent_lock(bev);
 		struct ntrip_state *st = np->ntrip_state;
-		struct bufferevent *bev = st->bev;
+		if (st != NULL && st->state != NTRIP_END && !np->backlogged) {
+			P_MUTEX_LOCK(&this->ring_lock);
+			unsigned long long lag = this->ring_head - np->ring_cursor;
+			int stalled = lag > (unsigned long long)this->ring_size && !np->ring_drained;
+			np->ring_drained = 0;
+			P_MUTEX_UNLOCK(&this->ring_lock);
+			if (stalled) {
+				ntrip_log(st, LOG_NOTICE, "RTCM: stalled %llu packets behind on %s", lag, this->mountpoint);
+				np->backlogged = 1;
+				(*nbacklogged)++;
+			}
+		}
+		bufferevent_unlock(bev);
+	}
+	livesource_snapshot_put(snapshot);
+}
+
+/*
+ * Get rid of backlogged subscribers.
+ */
+static void livesource_drop_backlogged(struct livesource *this, struct caster_state *caster, int nbacklogged) {
+	P_RWLOCK_WRLOCK(&this->lock);
+	int found_backlogs = livesource_kill_subscribers_unlocked(this, 1);
+	P_RWLOCK_UNLOCK(&this->lock);
+	if (found_backlogs == nbacklogged)
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d backlogged clients dropped from %s", nbacklogged, this->mountpoint);
+	else
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d (expected %d) backlogged clients dropped from %s", found_backlogs, nbacklogged, this->mountpoint);
+}
+
+/*
+ * Ring event callback: activated by _livesource_send_ring() to wake up
+ * waiting subscribers, and periodically to look for stalled ones.
+ */
+static void livesource_ring_cb(evutil_socket_t fd, short what, void *arg) {
+	struct livesource *this = (struct livesource *)arg;
+	int nbacklogged = 0;
+
+	if (what & EV_WRITE)
+		_livesource_ring_wake(this, &nbacklogged);
+	if (what & EV_TIMEOUT)
+		_livesource_ring_check(this, &nbacklogged);
+	if (nbacklogged)
+		livesource_drop_backlogged(this, this->caster, nbacklogged);
+}
+
+/*
+ * Try to bring a subscriber backlog back under backlog_evbuffer
+ * by dropping stale RTCM epochs.
+ *
+ * Return 1 if successful.
+ *
+ * Required lock: ntrip_state
+ */
+static int livesource_compact_backlog(struct livesource *this, struct ntrip_state *st, struct evbuffer *output, struct caster_state *caster) {
+	long dropped = rtcm_backlog_compact(output);
+	if (dropped <= 0)
+		return 0;
+	atomic_fetch_add(&this->ncompactions, 1);
+	atomic_fetch_add(&this->compacted_frames, dropped);
+	size_t backlog_len = evbuffer_get_length(output);
+	ntrip_log(st, LOG_INFO, "RTCM: backlog compacted to %zd bytes on output for %s, %ld frames dropped", backlog_len, this->mountpoint, dropped);
+	return backlog_len <= caster->config->backlog_evbuffer;
+}
+
+/*
+ * Send a batch of packets to each subscriber output, for subscribers
+ * start to end-1 in a snapshot.
+ *
+ * Each subscriber is locked only once for the whole batch.
+ *
+ * Return the number of subscribers.
+ *
+ * Required locks: packets
+ */
+static int _livesource_send_direct(struct livesource *this, struct subscriber_snapshot *snapshot, int start, int end,
+	struct packet **packets, int npackets, struct caster_state *caster, int *nbacklogged) {
+	int n = 0;
+	int ns = 0;
+	int by_reference[LIVESOURCE_SEND_BATCH];
+
+	/* Increase reference counts in one go to reduce overhead */
+	for (int j = 0; j < npackets; j++) {
+		by_reference[j] = packet_by_reference(packets[j], snapshot->n);
+		if (by_reference[j])
+			packet_incref(packets[j], end - start);
+	}
+
+	for (int i = start; i < end; i++) {
+		struct subscriber *np = snapshot->subs[i];
+		struct bufferevent *bev = np->bev;
 		bufferevent_lock(bev);
+		struct ntrip_state *st = np->ntrip_state;
+		if (st == NULL) {
+			/* Unsubscribed since the snapshot was taken, skip */
+			bufferevent_unlock(bev);
+			ns++;
+			continue;
+		}
 		if (st->state == NTRIP_END) {
 			/* Subscriber currently closing, skip */
 			ntrip_log(st, LOG_DEBUG, "livesource_send_subscribers: dropping, state=%d", st->state);
@@ -300,58 +795,272 @@ int livesource_send_subscribers(struct livesource *this, struct packet *packet,
 			n++;
 			continue;
 		}
-		size_t backlog_len = evbuffer_get_length(bufferevent_get_output(st->bev));
-		if (backlog_len > caster->config->backlog_evbuffer) {
+		struct evbuffer *output = bufferevent_get_output(st->bev);
+		size_t backlog_len = evbuffer_get_length(output);
+		if (backlog_len > caster->config->backlog_evbuffer
+		    && !(caster->config->backlog_compaction && livesource_compact_backlog(this, st, output, caster))) {
 			ntrip_log(st, LOG_NOTICE, "RTCM: backlog len %ld on output for %s", backlog_len, this->mountpoint);
 			np->backlogged = 1;
-			nbacklogged++;
+			(*nbacklogged)++;
 			ns++;
-		} else if (packet->caster->config->zero_copy) {
-			if (evbuffer_add_reference(bufferevent_get_output(st->bev), packet->data, packet->datalen, raw_free_callback, packet) < 0) {
-				ntrip_log(st, LOG_CRIT, "RTCM: evbuffer_add_reference failed");
-				ns++;
-			} else
-				st->sent_bytes += packet->datalen;
-		} else {
-			if (evbuffer_add(bufferevent_get_output(st->bev), packet->data, packet->datalen) < 0) {
-				ns++;
-			} else
+			bufferevent_unlock(bev);
+			n++;
+			continue;
+		}
+		for (int j = 0; j < npackets; j++) {
+			struct packet *packet = rtcm_filter_select(st->rtcm_filter, packets[j]);
+			if (packet == NULL) {
+				if (by_reference[j])
+					packet_incref(packets[j], -1);
+				continue;
+			}
+			if (packet != packets[j] && by_reference[j]) {
+				/* Derived packet, kept alive by the original one */
+				packet_incref(packet, 1);
+				packet_incref(packets[j], -1);
+			}
+			if (by_reference[j]) {
+				if (evbuffer_add_reference(output, packet->data, packet->datalen, raw_free_callback, packet) < 0) {
+					ntrip_log(st, LOG_CRIT, "RTCM: evbuffer_add_reference failed");
+					/* The caller still holds a reference */
+					packet_incref(packet, -1);
+				} else
+					st->sent_bytes += packet->datalen;
+			} else if (evbuffer_add(output, packet->data, packet->datalen) == 0)
 				st->sent_bytes += packet->datalen;
 		}
 		bufferevent_unlock(bev);
 		n++;
 	}
 
-	assert(n == this->nsubs);
-
 	/*
-	 * Adjust reference count to account for failed calls
+	 * Adjust reference counts to account for skipped subscribers
 	 */
-	if (packet->caster->config->zero_copy && ns) {
-		/* Don't need to free the packet as it will be done by the caller, the refcnt should never be 0 here */
-		P_MUTEX_LOCK(&packet->mutex);
-		packet->refcnt -= ns;
-		P_MUTEX_UNLOCK(&packet->mutex);
+	for (int j = 0; j < npackets; j++) {
+		if (by_reference[j] && ns)
+			/* Don't need to free the packet as it will be done by the caller, the refcnt should never be 0 here */
+			packet_incref(packets[j], -ns);
+		assert(atomic_load(&packets[j]->refcnt) > 0);
 	}
-	assert(packet->refcnt > 0);
+	return n;
+}
+
+/*
+ * Parallel fan-out of a packet batch to a subscriber snapshot, by partitions.
+ *
+ * Partitions are claimed in turn by the caller of livesource_send_subscribers()
+ * and the workers running a JOB_FANOUT job, until none is left.
+ * The caller then waits for claimed partitions to be done, and releases
+ * the snapshot and packets.
+ *
+ * Jobs starting late find no partition left: they only access the fields
+ * before livesource, and this structure is reference counted.
+ */
+struct livesource_fanout {
+	P_MUTEX_T mutex;
+	pthread_cond_t cond;
+	int refcnt;
+
+	int nsubs;		// size of the snapshot
+	int partition_size;
+	int next;		// start of the next partition to claim
+	int running;		// number of partitions being sent
+
+	/* Only valid while partitions are left */
+	struct livesource *livesource;
+	struct subscriber_snapshot *snapshot;
+	struct packet **packets;
+	int npackets;
+	struct caster_state *caster;
+
+	/* Results */
+	int n;
+	int nbacklogged;
+};
+
+static void livesource_fanout_decref(struct livesource_fanout *this) {
+	P_MUTEX_LOCK(&this->mutex);
+	int refcnt = --this->refcnt;
+	P_MUTEX_UNLOCK(&this->mutex);
+	if (refcnt == 0) {
+		P_MUTEX_DESTROY(&this->mutex);
+		pthread_cond_destroy(&this->cond);
+		free(this);
+	}
+}
+
+/*
+ * Claim and send partitions until none is left.
+ */
+static void livesource_fanout_run(struct livesource_fanout *this) {
+	while (1) {
+		P_MUTEX_LOCK(&this->mutex);
+		int start = this->next;
+		if (start >= this->nsubs) {
+			P_MUTEX_UNLOCK(&this->mutex);
+			return;
+		}
+		int end = start + this->partition_size;
+		if (end > this->nsubs)
+			end = this->nsubs;
+		this->next = end;
+		this->running++;
+		P_MUTEX_UNLOCK(&this->mutex);
+
+		int nbacklogged = 0;
+		int n = _livesource_send_direct(this->livesource, this->snapshot, start, end, this->packets, this->npackets, this->caster, &nbacklogged);
+
+		P_MUTEX_LOCK(&this->mutex);
+		this->n += n;
+		this->nbacklogged += nbacklogged;
+		if (--this->running == 0 && this->next >= this->nsubs)
+			pthread_cond_signal(&this->cond);
+		P_MUTEX_UNLOCK(&this->mutex);
+	}
+}
+
+/*
+ * JOB_FANOUT callback
+ */
+static void livesource_fanout_job(struct livesource_fanout *this) {
+	livesource_fanout_run(this);
+	livesource_fanout_decref(this);
+}
+
+/*
+ * Send a packet batch to a snapshot of subscribers, in parallel if configured
+ * and worth it.
+ *
+ * Return the number of subscribers.
+ *
+ * Required locks: packets
+ */
+static int _livesource_send_snapshot(struct livesource *this, struct subscriber_snapshot *snapshot,
+	struct packet **packets, int npackets, struct caster_state *caster, int *nbacklogged) {
+	int partition_size = caster->config->fanout_partition_size;
+
+	if (!threads || nthreads < 2 || partition_size <= 0 || snapshot->n <= partition_size)
+		return _livesource_send_direct(this, snapshot, 0, snapshot->n, packets, npackets, caster, nbacklogged);
+
+	struct livesource_fanout *fanout = (struct livesource_fanout *)malloc(sizeof(struct livesource_fanout));
+	if (fanout == NULL)
+		return _livesource_send_direct(this, snapshot, 0, snapshot->n, packets, npackets, caster, nbacklogged);
+
+	int npartitions = (snapshot->n + partition_size - 1) / partition_size;
+	int njobs = (npartitions < nthreads ? npartitions : nthreads) - 1;
+
+	P_MUTEX_INIT(&fanout->mutex, NULL);
+	pthread_cond_init(&fanout->cond, NULL);
+	fanout->refcnt = njobs + 1;
+	fanout->nsubs = snapshot->n;
+	fanout->livesource = this;
+	fanout->snapshot = snapshot;
+	fanout->packets = packets;
+	fanout->npackets = npackets;
+	fanout->caster = caster;
+	fanout->partition_size = partition_size;
+	fanout->next = 0;
+	fanout->running = 0;
+	fanout->n = 0;
+	fanout->nbacklogged = 0;
+
+	for (int i = 0; i < njobs; i++)
+		joblist_append_fanout(caster->joblist, livesource_fanout_job, fanout);
 
 	/*
-	 * Get rid of backlogged connections
+	 * Do our share, then wait for the partitions claimed by other workers.
+	 *
+	 * We wait with the source ntrip_state locked, which is safe as
+	 * a claimed partition only locks subscribers, and nothing locks
+	 * a source while holding a subscriber lock. Fan-out jobs run without
+	 * any lock, and partitions not claimed yet are sent by us, so
+	 * we never wait for a busy worker to pick up a job.
 	 */
-	if (nbacklogged) {
-		int found_backlogs = livesource_kill_subscribers_unlocked(this, 1);
-		if (found_backlogs == nbacklogged)
-			logfmt(&caster->flog, LOG_INFO, "RTCM: %d backlogged clients dropped from %s", nbacklogged, this->mountpoint);
-		else
-			logfmt(&caster->flog, LOG_INFO, "RTCM: %d (expected %d) backlogged clients dropped from %s", found_backlogs, nbacklogged, this->mountpoint);
+	livesource_fanout_run(fanout);
+
+	P_MUTEX_LOCK(&fanout->mutex);
+	while (fanout->running)
+		pthread_cond_wait(&fanout->cond, &fanout->mutex);
+	int n = fanout->n;
+	*nbacklogged += fanout->nbacklogged;
+	P_MUTEX_UNLOCK(&fanout->mutex);
+
+	livesource_fanout_decref(fanout);
+	return n;
+}
+
+/*
+ * Send a batch of at most LIVESOURCE_SEND_BATCH packets to all source subscribers.
+ *
+ * The subscriber list is not locked, we only use a reference
+ * on its current snapshot. The livesource is only locked to drop
+ * backlogged subscribers.
+ *
+ * Required locks: ntrip_state, packets
+ */
+static int _livesource_send_batch(struct livesource *this, struct packet **packets, int npackets, struct caster_state *caster) {
+	int n;
+
+	int npackets_before = atomic_fetch_add(&this->npackets, npackets);
+	int npackets_after = npackets_before + npackets;
+
+	if (caster->recorder)
+		recorder_livesource_queue(caster->recorder, this, packets, npackets);
+
+	int nbacklogged = 0;
+
+	if (this->ring != NULL) {
+		_livesource_send_ring(this, packets, npackets, &nbacklogged);
+		n = this->nsubs;
+	} else {
+		struct subscriber_snapshot *snapshot = livesource_snapshot_get(this);
+		n = snapshot ? _livesource_send_snapshot(this, snapshot, packets, npackets, caster, &nbacklogged) : 0;
+		livesource_snapshot_put(snapshot);
 	}
-	P_RWLOCK_UNLOCK(&this->lock);
 
-	if (n && (this->npackets == 1 || (this->npackets % 100 == 0)))
-		logfmt(&caster->flog, LOG_INFO, "RTCM: %d packets sent, current one to %d subscribers for %s", this->npackets, n, this->mountpoint);
+	if (nbacklogged)
+		livesource_drop_backlogged(this, caster, nbacklogged);
+
+	if (n && (npackets_before == 0 || npackets_before / 100 != npackets_after / 100))
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d packets sent, current ones to %d subscribers for %s", npackets_after, n, this->mountpoint);
+	return n;
+}
+
+/*
+ * Send a batch of packets to all source subscribers, in order.
+ *
+ * Used to deliver all the packets received in one read callback
+ * with a single lock of each subscriber.
+ *
+ * Return the number of subscribers.
+ *
+ * Required locks: ntrip_state, packets
+ */
+int livesource_send_subscribers_batch(struct livesource *this, struct packet **packets, int npackets, struct caster_state *caster) {
+	int n = 0;
+
+	if (this == NULL)
+		/* Dead livesource */
+		return 0;
+
+	for (int i = 0; i < npackets; i += LIVESOURCE_SEND_BATCH) {
+		int len = npackets - i;
+		if (len > LIVESOURCE_SEND_BATCH)
+			len = LIVESOURCE_SEND_BATCH;
+		n = _livesource_send_batch(this, packets + i, len, caster);
+	}
 	return n;
 }
 
+/*
+ * Send a packet to all source subscribers
+ *
+ * Required locks: ntrip_state, packet
+ */
+int livesource_send_subscribers(struct livesource *this, struct packet *packet, struct caster_state *caster) {
+	return livesource_send_subscribers_batch(this, &packet, 1, caster);
+}
+
 int livesource_del(struct livesource *this, struct ntrip_state *st, struct caster_state *caster) {
 	json_object *j;
 	int r = 0;
@@ -363,6 +1072,7 @@ int livesource_del(struct livesource *this, struct ntrip_state *st, struct caste
 	hash_table_del(caster->livesources->hash, this->mountpoint);
 	r = 1;
 	caster->livesources->serial++;
+	stack_bump_generation(&caster->sourcetablestack);
 	P_RWLOCK_UNLOCK(&caster->livesources->lock);
 	P_MUTEX_UNLOCK(&caster->livesources->delete_lock);
 	syncer_queue_json(caster, j);
@@ -402,6 +1112,7 @@ struct livesource *livesource_connected(struct ntrip_state *st, char *mountpoint
 		P_RWLOCK_UNLOCK(&st->caster->livesources->lock);
 		return NULL;
 	}
+	livesource_ring_init(np, st->caster);
 	int e = hash_table_add(st->caster->livesources->hash, mountpoint, np);
 	if (e != 0) {
 		livesource_free(np);
@@ -411,6 +1122,7 @@ struct livesource *livesource_connected(struct ntrip_state *st, char *mountpoint
 	}
 	j = livesource_update_json(np, st->caster, LIVESOURCE_UPDATE_ADD);
 	st->caster->livesources->serial++;
+	stack_bump_generation(&st->caster->sourcetablestack);
 	st->own_livesource = np;
 	P_RWLOCK_UNLOCK(&st->caster->livesources->lock);
 	ntrip_log(st, LOG_INFO, "livesource %s created RUNNING", mountpoint);
@@ -468,9 +1180,11 @@ static struct livesource *livesource_find_unlocked(struct caster_state *this, st
 		if (np == NULL) {
 			return NULL;
 		}
+		livesource_ring_init(np, this);
 		hash_table_add(this->livesources->hash, mountpoint, np);
 		*jp = livesource_update_json(np, this, LIVESOURCE_UPDATE_ADD);
 		this->livesources->serial++;
+		stack_bump_generation(&this->sourcetablestack);
 		ntrip_log(st, LOG_INFO, "Trying to subscribe to on-demand source %s", mountpoint);
 		struct redistribute_cb_args *redis_args = redistribute_args_new(this, np,
 			&e, mountpoint, mountpoint_pos, this->config->reconnect_delay, 0);
@@ -530,7 +1244,9 @@ static json_object *livesource_json(struct livesource *this, enum livesource_upd
 	json_object *j = _livesource_common_json(this->mountpoint, this->state, this->type, utype != LIVESOURCE_UPDATE_DEL);
 	if (utype == LIVESOURCE_UPDATE_NONE) {
 		json_object_object_add(j, "nsubscribers", json_object_new_int(this->nsubs));
-		json_object_object_add(j, "npackets", json_object_new_int(this->npackets));
+		json_object_object_add(j, "npackets", json_object_new_int(atomic_load(&this->npackets)));
+		json_object_object_add(j, "ncompactions", json_object_new_int64(atomic_load(&this->ncompactions)));
+		json_object_object_add(j, "compacted_frames", json_object_new_int64(atomic_load(&this->compacted_frames)));
 	}
 	return j;
 }
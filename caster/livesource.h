@@ -5,6 +5,7 @@
 #include <sys/queue.h>
 
 #include "packet.h"
+#include "refptr.h"
 #include "sourceline.h"
 
 enum livesource_state {
@@ -25,21 +26,57 @@ enum livesource_update_type {
 	LIVESOURCE_UPDATE_STATUS
 };
 
+/*
+ * Wait state of a subscriber in packet ring mode.
+ */
+enum subscriber_wait {
+	SUBSCRIBER_WAIT_NONE,		// output not empty, will be drained by the write callback
+	SUBSCRIBER_WAIT_QUEUED,		// up to date, on the livesource ring wait queue
+	SUBSCRIBER_WAIT_WAKING		// being woken up by livesource_send_subscribers()
+};
+
 /*
  * A source subscription for a client.
+ *
+ * Reference counted, as it can be kept in a subscriber snapshot after
+ * its removal from the livesource list.
+ * ntrip_state is set to NULL on removal, under the bufferevent lock;
+ * we keep a reference on the bufferevent to be able to check it.
  */
 struct subscriber {
 	TAILQ_ENTRY(subscriber) next;
 	struct livesource *livesource;
 	struct ntrip_state *ntrip_state;
+	struct bufferevent *bev;
+	atomic_int refcnt;
 
 	// backlog overflow flag.
 	// if set, this subscriber structure is already off the livesource list
 	int backlogged;
 	int virtual;
+
+	/*
+	 * Packet ring mode: sequence number of the next packet to send,
+	 * wait state and wait queue entry, and whether the subscriber was
+	 * drained since the last lag check, protected by the livesource ring_lock.
+	 */
+	unsigned long long ring_cursor;
+	enum subscriber_wait ring_wait;
+	TAILQ_ENTRY(subscriber) next_wait;
+	int ring_drained;
 };
 TAILQ_HEAD (subscribersq, subscriber);
 
+/*
+ * Immutable snapshot of the subscriber list of a livesource,
+ * replaced on each change, to send packets without locking the list.
+ */
+struct subscriber_snapshot {
+	atomic_int refcnt;
+	int n;
+	struct subscriber *subs[];
+};
+
 /*
  * A live source: either one that sends us its stream directly,
  * or one we pull from a caster.
@@ -49,9 +86,42 @@ struct livesource {
 	char *mountpoint;
 	struct subscribersq subscribers;
 	int nsubs;
-	int npackets;
+
+	/*
+	 * Current snapshot of subscribers, for livesource_send_subscribers(),
+	 * read without locking. Replaced under the livesource write lock.
+	 */
+	struct refptr snapshot;
+
+	atomic_int npackets;
+
+	/* Backlog compactions done on subscribers, and packets dropped by them */
+	atomic_ulong ncompactions;
+	atomic_ulong compacted_frames;
+
 	enum livesource_state state;
 	enum livesource_type type;
+
+	/*
+	 * Shared ring of the last packets received, if fanout_ring_size is set.
+	 * ring and ring_size are set at creation and never change.
+	 *
+	 * Waiting subscribers are woken up by activating ring_ev, and
+	 * stalled ones are looked for on its timeout.
+	 *
+	 * No other lock is acquired while holding ring_lock.
+	 */
+	P_MUTEX_T ring_lock;
+	struct packet **ring;
+	int ring_size;
+	struct event *ring_ev;
+	struct caster_state *caster;		// for the ring_ev callback
+	unsigned long long ring_head;		// sequence number of the next packet
+	struct subscribersq ring_waitq;		// up to date subscribers
+
+	/* Recorded stream, looked up on the first packet sent */
+	int recorder_checked;
+	struct recorder_stream *recorder_stream;
 };
 
 /*
@@ -95,8 +165,21 @@ struct livesources {
 	char *hostname;			// our hostname
 };
 
+/*
+ * Maximum number of packets sent in one pass by livesource_send_subscribers_batch(),
+ * larger batches are split.
+ */
+#define LIVESOURCE_SEND_BATCH	64
+
+/*
+ * Interval in seconds between checks for stalled subscribers in packet ring mode.
+ */
+#define LIVESOURCE_RING_CHECK_INTERVAL	1
+
 struct caster_state;
+struct event;
 struct request;
+struct recorder_stream;
 
 struct livesources *livesource_table_new(const char *hostname, struct timeval *start_date);
 void livesource_table_free(struct livesources *this);
@@ -111,7 +194,10 @@ void livesource_free(struct livesource *this);
 void livesource_set_state(struct livesource *this, struct caster_state *caster, enum livesource_state state);
 struct subscriber *livesource_add_subscriber(struct livesource *this, struct ntrip_state *st);
 void livesource_del_subscriber(struct ntrip_state *st);
+void livesource_replay_subscriber(struct livesource *this, struct ntrip_state *st);
 int livesource_send_subscribers(struct livesource *this, struct packet *packet, struct caster_state *caster);
+int livesource_send_subscribers_batch(struct livesource *this, struct packet **packets, int npackets, struct caster_state *caster);
+int livesource_drain_subscriber(struct subscriber *sub);
 struct livesource *livesource_find(struct caster_state *this, struct ntrip_state *st, char *mountpoint, pos_t *mountpoint_pos);
 
 struct mime_content *livesource_list_json(struct caster_state *caster, struct request *req);
@@ -7,6 +7,9 @@
 #include "conf.h"
 #include "caster.h"
 #include "config.h"
+#include "crc24q.h"
+#include "geoindex.h"
+#include "rtcm.h"
 
 
 /*
@@ -65,6 +68,9 @@ main(int argc, char **argv) {
 
 	SSL_library_init();
 	OpenSSL_add_all_algorithms();
+	crc24q_init();
+	geoindex_init();
+	rtcm_init();
 
 	if (start_daemon) {
 		int pid = fork();
@@ -0,0 +1,438 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "conf.h"
+#include "caster.h"
+#include "hash.h"
+#include "jobs.h"
+#include "nearest.h"
+#include "ntrip_common.h"
+#include "ntripsrv.h"
+#include "sourcetable.h"
+
+static void nearest_sched_cb(evutil_socket_t fd, short what, void *arg);
+
+struct nearest_sched *nearest_sched_new(struct caster_state *caster) {
+	struct nearest_sched *this = (struct nearest_sched *)malloc(sizeof(struct nearest_sched));
+	if (this == NULL)
+		return NULL;
+	this->caster = caster;
+	P_MUTEX_INIT(&this->lock, NULL);
+	TAILQ_INIT(&this->pending);
+	this->npending = 0;
+	this->ev = NULL;
+	atomic_init(&this->cache_hits, 0);
+	atomic_init(&this->cache_misses, 0);
+	atomic_init(&this->cache_evictions, 0);
+	return this;
+}
+
+/*
+ * Start the tick timer.
+ */
+int nearest_sched_start(struct nearest_sched *this) {
+	this->ev = event_new(this->caster->base, -1, EV_PERSIST, nearest_sched_cb, this);
+	if (this->ev == NULL)
+		return -1;
+	struct timeval interval = {0, NEAREST_SCHED_TICK_MS * 1000};
+	event_add(this->ev, &interval);
+	return 0;
+}
+
+/*
+ * Release a request, once run or cancelled.
+ */
+static void nearest_request_free(struct nearest_request *req) {
+	bufferevent_decref(req->bev);
+	free(req);
+}
+
+void nearest_sched_free(struct nearest_sched *this) {
+	struct nearest_request *req;
+
+	if (this->ev)
+		event_free(this->ev);
+	while ((req = TAILQ_FIRST(&this->pending))) {
+		TAILQ_REMOVE_HEAD(&this->pending, next);
+		bufferevent_lock(req->bev);
+		if (req->st)
+			req->st->nearest_request = NULL;
+		bufferevent_unlock(req->bev);
+		nearest_request_free(req);
+	}
+	P_MUTEX_DESTROY(&this->lock);
+	free(this);
+}
+
+/*
+ * Job callback: recompute the nearest base for a batch of sessions.
+ */
+static void nearest_batch_run(struct nearest_batch *batch) {
+	struct caster_state *caster = batch->sched->caster;
+
+	/* Immediate requests take their table reference here, out of the session lock */
+	if (batch->sourcetable == NULL)
+		batch->sourcetable = stack_flatten_get(caster, &caster->sourcetablestack);
+
+	for (int i = 0; i < batch->n; i++) {
+		struct nearest_request *req = batch->requests[i];
+		bufferevent_lock(req->bev);
+		struct ntrip_state *st = req->st;
+		if (st) {
+			st->nearest_request = NULL;
+			if (batch->sourcetable && st->state != NTRIP_END)
+				ntripsrv_redo_virtual_pos(st, batch->sourcetable);
+		}
+		bufferevent_unlock(req->bev);
+		nearest_request_free(req);
+	}
+	if (batch->sourcetable)
+		stack_flatten_put(&caster->sourcetablestack, batch->sourcetable);
+	free(batch);
+}
+
+/*
+ * Queue requests[0..n[ as batches.
+ * sourcetable is a reference on the flattened table, used by all batches,
+ * or NULL to have each batch get its own.
+ */
+static void nearest_sched_dispatch(struct nearest_sched *this, struct nearest_request **requests, int n, struct sourcetable *sourcetable) {
+	struct caster_state *caster = this->caster;
+	int nworkers = threads && caster->joblist->nthreads ? caster->joblist->nthreads : 1;
+	int batch_size = (n + nworkers - 1) / nworkers;
+	if (batch_size > NEAREST_SCHED_BATCH_MAX)
+		batch_size = NEAREST_SCHED_BATCH_MAX;
+	int nbatches = (n + batch_size - 1) / batch_size;
+
+	if (sourcetable && nbatches > 1)
+		stack_flatten_incref(&caster->sourcetablestack, sourcetable, nbatches - 1);
+
+	for (int i = 0; i < n; i += batch_size) {
+		int len = n - i < batch_size ? n - i : batch_size;
+		struct nearest_batch *batch = (struct nearest_batch *)malloc(sizeof(struct nearest_batch) + len*sizeof(struct nearest_request *));
+		if (batch == NULL) {
+			/* Drop the requests, a later GGA will reschedule them */
+			for (int j = i; j < i + len; j++) {
+				bufferevent_lock(requests[j]->bev);
+				if (requests[j]->st)
+					requests[j]->st->nearest_request = NULL;
+				bufferevent_unlock(requests[j]->bev);
+				nearest_request_free(requests[j]);
+			}
+			if (sourcetable)
+				stack_flatten_put(&caster->sourcetablestack, sourcetable);
+			continue;
+		}
+		batch->sched = this;
+		batch->sourcetable = sourcetable;
+		batch->n = len;
+		for (int j = 0; j < len; j++)
+			batch->requests[j] = requests[i+j];
+		joblist_append_nearest(caster->joblist, nearest_batch_run, batch);
+	}
+}
+
+/*
+ * Dispatch all requests due at the given date.
+ *
+ * The pending list is sorted by due date: stop at the first request
+ * not due yet.
+ *
+ * Return the number of requests dispatched.
+ */
+int nearest_sched_run(struct nearest_sched *this, struct timeval *now) {
+	struct nearest_request *req;
+	struct nearest_request **requests;
+	int n = 0;
+
+	P_MUTEX_LOCK(&this->lock);
+	TAILQ_FOREACH(req, &this->pending, next) {
+		if (timercmp(&req->due, now, >))
+			break;
+		n++;
+	}
+	if (n == 0) {
+		P_MUTEX_UNLOCK(&this->lock);
+		return 0;
+	}
+	requests = (struct nearest_request **)malloc(n*sizeof(struct nearest_request *));
+	if (requests == NULL) {
+		P_MUTEX_UNLOCK(&this->lock);
+		return 0;
+	}
+	for (int i = 0; i < n; i++) {
+		requests[i] = TAILQ_FIRST(&this->pending);
+		TAILQ_REMOVE_HEAD(&this->pending, next);
+	}
+	this->npending -= n;
+	P_MUTEX_UNLOCK(&this->lock);
+
+	struct sourcetable *sourcetable = stack_flatten_get(this->caster, &this->caster->sourcetablestack);
+	nearest_sched_dispatch(this, requests, n, sourcetable);
+	free(requests);
+	return n;
+}
+
+static void nearest_sched_cb(evutil_socket_t fd, short what, void *arg) {
+	struct nearest_sched *this = (struct nearest_sched *)arg;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	nearest_sched_run(this, &now);
+}
+
+/*
+ * Schedule a nearest base recompute for a virtual source client,
+ * unless one is already pending.
+ *
+ * A client without a base yet is handled at once, others wait for
+ * the minimum recompute interval.
+ *
+ * Required lock: ntrip_state
+ */
+void nearest_sched_schedule(struct nearest_sched *this, struct ntrip_state *st) {
+	if (!st->last_pos_valid || !st->source_virtual || st->nearest_request || st->state == NTRIP_END)
+		return;
+
+	struct nearest_request *req = (struct nearest_request *)malloc(sizeof(struct nearest_request));
+	if (req == NULL)
+		return;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	req->due = now;
+	if (st->last_recompute_date.tv_sec) {
+		struct timeval interval = {st->caster->config->min_nearest_recompute_interval, 0};
+		timeradd(&st->last_recompute_date, &interval, &req->due);
+	}
+	req->st = st;
+	req->bev = st->bev;
+	bufferevent_incref(req->bev);
+	st->nearest_request = req;
+
+	if (st->virtual_mountpoint == NULL && !timercmp(&req->due, &now, >)) {
+		nearest_sched_dispatch(this, &req, 1, NULL);
+		return;
+	}
+
+	/*
+	 * Keep the list sorted by due date. Requests mostly come in due
+	 * order, so look for the insertion point from the tail.
+	 */
+	P_MUTEX_LOCK(&this->lock);
+	struct nearest_request *prev;
+	TAILQ_FOREACH_REVERSE(prev, &this->pending, nearest_requestq, next)
+		if (!timercmp(&prev->due, &req->due, >))
+			break;
+	if (prev)
+		TAILQ_INSERT_AFTER(&this->pending, prev, req, next);
+	else
+		TAILQ_INSERT_HEAD(&this->pending, req, next);
+	this->npending++;
+	P_MUTEX_UNLOCK(&this->lock);
+}
+
+/*
+ * Cancel any pending recompute for a session being closed.
+ *
+ * Required lock: ntrip_state
+ */
+void nearest_sched_cancel(struct ntrip_state *st) {
+	if (st->nearest_request) {
+		st->nearest_request->st = NULL;
+		st->nearest_request = NULL;
+	}
+}
+
+/*
+ * Return scheduler and nearest base cache counters.
+ */
+json_object *nearest_sched_json(struct nearest_sched *this) {
+	json_object *j = json_object_new_object();
+	unsigned long hits = atomic_load(&this->cache_hits);
+	unsigned long misses = atomic_load(&this->cache_misses);
+	unsigned long evictions = atomic_load(&this->cache_evictions);
+	P_MUTEX_LOCK(&this->lock);
+	int npending = this->npending;
+	P_MUTEX_UNLOCK(&this->lock);
+	json_object_object_add(j, "pending", json_object_new_int(npending));
+	json_object_object_add(j, "cache_hits", json_object_new_int64(hits));
+	json_object_object_add(j, "cache_misses", json_object_new_int64(misses));
+	json_object_object_add(j, "cache_evictions", json_object_new_int64(evictions));
+	json_object_object_add(j, "cache_hit_ratio", json_object_new_double(hits + misses ? (double)hits / (hits + misses) : 0));
+	return j;
+}
+
+/*
+ * A cache entry: the nearest bases from the cell center.
+ */
+struct nearest_cache_entry {
+	int n;
+	struct spos bases[DIST_TABLE_SIZE];
+};
+
+static struct nearest_cache *nearest_cache_new(float cell_m) {
+	struct nearest_cache *this = (struct nearest_cache *)malloc(sizeof(struct nearest_cache));
+	if (this == NULL)
+		return NULL;
+	this->cells = hash_table_new(NEAREST_CACHE_BUCKETS, free);
+	if (this->cells == NULL) {
+		free(this);
+		return NULL;
+	}
+	P_RWLOCK_INIT(&this->lock, NULL);
+	this->cell_m = cell_m;
+	this->evict_bucket = 0;
+	return this;
+}
+
+void nearest_cache_free(struct nearest_cache *this) {
+	hash_table_free(this->cells);
+	P_RWLOCK_DESTROY(&this->lock);
+	free(this);
+}
+
+/*
+ * Return the cache of a flattened sourcetable, creating it on first use.
+ *
+ * Cells are half the switching hysteresis on a side: the base picked
+ * from the cell center is then less than one hysteresis further than the
+ * nearest base from anywhere in the cell.
+ *
+ * Return NULL if caching is disabled (no hysteresis).
+ */
+static struct nearest_cache *nearest_cache_get(struct nearest_sched *sched, struct sourcetable *sourcetable) {
+	float cell_m = sched->caster->config->hysteresis_m / 2;
+	if (cell_m <= 0)
+		return NULL;
+
+	P_MUTEX_LOCK(&sourcetable->index_lock);
+	if (sourcetable->nearest_cache == NULL)
+		sourcetable->nearest_cache = nearest_cache_new(cell_m);
+	struct nearest_cache *r = sourcetable->nearest_cache;
+	P_MUTEX_UNLOCK(&sourcetable->index_lock);
+	return r;
+}
+
+/*
+ * Compute the cell key and center for a position.
+ *
+ * Rows are cell_m high, and split in columns of about cell_m at the row
+ * center latitude. Columns are at most 100 times as wide in degrees as
+ * rows, to stay finite at the poles.
+ *
+ * The polar rows and the last column, at the antimeridian, are cut short:
+ * the center is that of the actual cell.
+ */
+void nearest_cache_cell(struct nearest_cache *this, pos_t *pos, char *key, size_t keylen, pos_t *center) {
+	double dlat = this->cell_m / 111320.;
+	long ilat = (long)floor(pos->lat / dlat);
+	double lat0 = ilat * dlat, lat1 = lat0 + dlat;
+	if (lat0 < -90)
+		lat0 = -90;
+	if (lat1 > 90)
+		lat1 = 90;
+	double clat = (lat0 + lat1) / 2;
+	double c = cos(clat * M_PI / 180);
+	double dlon = c > 0.01 ? dlat / c : dlat / 0.01;
+	double lon = pos->lon >= 180 ? pos->lon - 360 : pos->lon;
+	long ilon = (long)floor((lon + 180) / dlon);
+	double lon0 = ilon * dlon, lon1 = lon0 + dlon;
+	if (lon1 > 360)
+		lon1 = 360;
+	snprintf(key, keylen, "%ld,%ld", ilat, ilon);
+	center->lat = clat;
+	center->lon = (lon0 + lon1) / 2 - 180;
+}
+
+/*
+ * Evict a cell to make room for a new one.
+ *
+ * Buckets are swept in turn, and the last cell of a bucket, its oldest,
+ * is removed.
+ *
+ * Required lock: cache (write)
+ */
+static void nearest_cache_evict(struct nearest_sched *sched, struct nearest_cache *this) {
+	struct hash_table *cells = this->cells;
+	for (int i = 0; i < cells->n_buckets; i++) {
+		struct elementlisthead *head = &cells->element_lists[this->evict_bucket];
+		this->evict_bucket = (this->evict_bucket + 1) % cells->n_buckets;
+		struct element *e, *last = NULL;
+		SLIST_FOREACH(e, head, next)
+			last = e;
+		if (last) {
+			hash_table_del(cells, last->key);
+			atomic_fetch_add(&sched->cache_evictions, 1);
+			return;
+		}
+	}
+}
+
+/*
+ * Find the nearest bases from a position, like sourcetable_find_pos(),
+ * through the cache of the flattened sourcetable.
+ *
+ * The cached bases are those of the cell center, reordered by their
+ * distance to the actual position.
+ *
+ * The sourcetable must not be modified, like the shared flattened table.
+ */
+int nearest_cache_find_pos(struct nearest_sched *sched, struct sourcetable *sourcetable, pos_t *pos, struct dist_table *d) {
+	struct nearest_cache *this = nearest_cache_get(sched, sourcetable);
+	if (this == NULL)
+		return sourcetable_find_pos(sourcetable, pos, d);
+
+	char key[48];
+	pos_t center;
+	int n = -1;
+	nearest_cache_cell(this, pos, key, sizeof key, &center);
+
+	P_RWLOCK_RDLOCK(&this->lock);
+	struct nearest_cache_entry *e = (struct nearest_cache_entry *)hash_table_get(this->cells, key);
+	if (e) {
+		n = e->n;
+		memcpy(d->dist_array, e->bases, n*sizeof(struct spos));
+	}
+	P_RWLOCK_UNLOCK(&this->lock);
+
+	if (e)
+		atomic_fetch_add(&sched->cache_hits, 1);
+	else {
+		atomic_fetch_add(&sched->cache_misses, 1);
+		n = sourcetable_find_pos(sourcetable, &center, d);
+		if (n < 0)
+			return n;
+		e = (struct nearest_cache_entry *)malloc(sizeof(struct nearest_cache_entry));
+		if (e != NULL) {
+			e->n = n;
+			memcpy(e->bases, d->dist_array, n*sizeof(struct spos));
+			P_RWLOCK_WRLOCK(&this->lock);
+			if (this->cells->nentries >= NEAREST_CACHE_MAX && hash_table_get(this->cells, key) == NULL)
+				nearest_cache_evict(sched, this);
+			if (hash_table_add(this->cells, key, e) < 0)
+				free(e);
+			P_RWLOCK_UNLOCK(&this->lock);
+		}
+	}
+
+	/*
+	 * Sort by distance to the actual position.
+	 */
+	for (int i = 0; i < n; i++) {
+		struct spos s = d->dist_array[i];
+		s.dist = distance(&s.pos, pos);
+		int j;
+		for (j = i; j > 0 && d->dist_array[j-1].dist > s.dist; j--)
+			d->dist_array[j] = d->dist_array[j-1];
+		d->dist_array[j] = s;
+	}
+	d->size_dist_array = n;
+	d->pos = *pos;
+	d->sourcetable = sourcetable;
+	return n;
+}
@@ -0,0 +1,105 @@
+#ifndef __NEAREST_H__
+#define __NEAREST_H__
+
+#include <stdatomic.h>
+#include <sys/time.h>
+
+#include <json-c/json.h>
+
+#include "conf.h"
+#include "queue.h"
+#include "util.h"
+
+struct bufferevent;
+struct caster_state;
+struct dist_table;
+struct event;
+struct hash_table;
+struct ntrip_state;
+struct sourcetable;
+
+/*
+ * Scheduler for nearest base recomputes of virtual source clients.
+ *
+ * A session has at most one pending recompute, due when the minimum
+ * recompute interval has elapsed. Further GGA updates only change its
+ * position. Due sessions are processed on each tick, in batches sized to
+ * spread them evenly on the workers, against one flattened sourcetable.
+ */
+
+/* Tick interval */
+#define	NEAREST_SCHED_TICK_MS	100
+
+/* Maximum number of sessions in a batch */
+#define	NEAREST_SCHED_BATCH_MAX	64
+
+/*
+ * A pending recompute.
+ */
+struct nearest_request {
+	TAILQ_ENTRY(nearest_request) next;
+	struct timeval due;
+
+	/*
+	 * Session, set to NULL if it is closed before the recompute.
+	 * Protected by the bufferevent lock, on which we keep a reference.
+	 */
+	struct ntrip_state *st;
+	struct bufferevent *bev;
+};
+TAILQ_HEAD (nearest_requestq, nearest_request);
+
+/*
+ * A batch of recomputes, run as a single job.
+ */
+struct nearest_batch {
+	struct nearest_sched *sched;
+	struct sourcetable *sourcetable;	// flattened table reference, or NULL
+	int n;
+	struct nearest_request *requests[];
+};
+
+/* Maximum number of cells in a nearest base cache */
+#define	NEAREST_CACHE_MAX	65536
+#define	NEAREST_CACHE_BUCKETS	8191
+
+/*
+ * Cache of nearest bases by geographic cell, for a flattened sourcetable.
+ *
+ * Positions are quantized to cells of about cell_m meters on each side,
+ * and the nearest bases are looked up once per cell, from its center.
+ * The cache belongs to the sourcetable, and is dropped with it on the
+ * next generation change.
+ */
+struct nearest_cache {
+	P_RWLOCK_T lock;			// protects cells
+	float cell_m;
+	struct hash_table *cells;		// "lat_index,lon_index" -> struct nearest_cache_entry
+	int evict_bucket;			// next bucket to evict from when full
+};
+
+struct nearest_sched {
+	struct caster_state *caster;
+	P_MUTEX_T lock;				// protects the pending list
+	struct nearest_requestq pending;	// sorted by due date
+	int npending;
+	struct event *ev;
+
+	/* Nearest base cache counters, across sourcetable generations */
+	atomic_ulong cache_hits;
+	atomic_ulong cache_misses;
+	atomic_ulong cache_evictions;
+};
+
+struct nearest_sched *nearest_sched_new(struct caster_state *caster);
+int nearest_sched_start(struct nearest_sched *this);
+void nearest_sched_free(struct nearest_sched *this);
+void nearest_sched_schedule(struct nearest_sched *this, struct ntrip_state *st);
+void nearest_sched_cancel(struct ntrip_state *st);
+int nearest_sched_run(struct nearest_sched *this, struct timeval *now);
+json_object *nearest_sched_json(struct nearest_sched *this);
+void nearest_cache_free(struct nearest_cache *this);
+void nearest_cache_cell(struct nearest_cache *this, pos_t *pos, char *key, size_t keylen, pos_t *center);
+int nearest_cache_find_pos(struct nearest_sched *sched, struct sourcetable *sourcetable, pos_t *pos, struct dist_table *d);
+
+#endif
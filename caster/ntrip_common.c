@@ -14,6 +14,7 @@
 #include "caster.h"
 #include "log.h"
 #include "livesource.h"
+#include "nearest.h"
 #include "ntrip_common.h"
 #include "rtcm.h"
 
@@ -41,6 +42,7 @@ struct ntrip_state *ntrip_new(struct caster_state *caster, struct bufferevent *b
 	gettimeofday(&this->start, NULL);
 	this->received_bytes = 0;
 	this->sent_bytes = 0;
+	this->dropped_bytes = 0;
 
 	this->caster = caster;
 	this->state = NTRIP_INIT;
@@ -57,6 +59,8 @@ struct ntrip_state *ntrip_new(struct caster_state *caster, struct bufferevent *b
 	this->source_on_demand = 0;
 	this->last_pos_valid = 0;
 	this->max_min_dist = 0;
+	timerclear(&this->last_recompute_date);
+	this->nearest_request = NULL;
 	this->user = NULL;
 	this->password = NULL;
 	this->scheme_basic = 0;
@@ -65,7 +69,10 @@ struct ntrip_state *ntrip_new(struct caster_state *caster, struct bufferevent *b
 	this->user_agent_ntrip = 0;
 	this->wildcard = 0;
 	this->rtcm_info = NULL;
+	this->rtcm_filter = NULL;
 	this->own_livesource = NULL;
+	this->feeder = NULL;
+	this->feeder_ref = NULL;
 	if (threads)
 		STAILQ_INIT(&this->jobq);
 	this->njobs = 0;
@@ -313,6 +320,8 @@ static void _ntrip_free(struct ntrip_state *this, char *orig, int unlink) {
 
 	if (this->subscription)
 		livesource_del_subscriber(this);
+	nearest_sched_cancel(this);
+	rtcm_filter_free(this->rtcm_filter);
 
 	if (unlink) {
 		P_RWLOCK_WRLOCK(&this->caster->ntrips.lock);
@@ -372,8 +381,13 @@ void ntrip_deferred_free(struct ntrip_state *this, char *orig) {
 	 * TBD: might move some relevant things from _ntrip_free() down here.
 	 */
 
+	if (this->feeder_ref) {
+		*this->feeder_ref = NULL;
+		this->feeder_ref = NULL;
+	}
 	if (this->own_livesource)
 		ntrip_unregister_livesource(this);
+	nearest_sched_cancel(this);
 	if (this->chunk_buf) {
 		evbuffer_free(this->chunk_buf);
 		this->chunk_buf = NULL;
@@ -405,6 +419,44 @@ void ntrip_deferred_free(struct ntrip_state *this, char *orig) {
 	joblist_append_ntrip_unlocked(this->caster->joblist, &ntrip_deferred_free2, this);
 }
 
+/*
+ * Create a source session without a connection, fed from inside the caster,
+ * and register its livesource.
+ *
+ * *ref is set to the session, and cleared when it is closed. The caller
+ * gets a reference on the bufferevent, to be able to check it under its lock.
+ */
+struct ntrip_state *ntrip_new_feeder_source(struct caster_state *caster, char *mountpoint, const char *type, void *feeder, struct ntrip_state **ref) {
+	struct bufferevent *bev = bufferevent_socket_new(caster->base, -1, threads ? BEV_OPT_THREADSAFE : 0);
+	if (bev == NULL)
+		return NULL;
+	struct ntrip_state *st = ntrip_new(caster, bev, NULL, 0, NULL, mountpoint);
+	if (st == NULL) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+	bufferevent_incref(bev);
+	st->type = type;
+	st->persistent = 1;
+	st->feeder = feeder;
+	st->feeder_ref = ref;
+	*ref = st;
+	ntrip_register(st);
+
+	bufferevent_lock(bev);
+	if (livesource_connected(st, st->mountpoint, NULL) == NULL) {
+		ntrip_log(st, LOG_ERR, "Can't register livesource %s", st->mountpoint);
+		ntrip_deferred_free(st, "ntrip_new_feeder_source");
+		bufferevent_unlock(bev);
+		bufferevent_decref(bev);
+		return NULL;
+	}
+	st->state = NTRIP_WAIT_STREAM_SOURCE;
+	ntrip_set_rtcm_cache(st);
+	bufferevent_unlock(bev);
+	return st;
+}
+
 /*
  * Run deferred frees
  *
@@ -63,7 +63,9 @@ enum ntrip_chunk_state {
  * State for a connection (client or server)
  */
 
+struct nearest_request;
 struct rtcm_info;
+struct rtcm_filter;
 
 struct ntrip_state {
 	/*
@@ -78,6 +80,7 @@ struct ntrip_state {
 	const char *type;
 	struct timeval start;	// time the connection was established
 	unsigned long long received_bytes, sent_bytes;
+	unsigned long long dropped_bytes;	// invalid RTCM data from a source
 
 	/* linked-list pointers for main job queue */
 	STAILQ_ENTRY(ntrip_state) next;
@@ -134,6 +137,12 @@ struct ntrip_state {
 
 	struct rtcm_info *rtcm_info;
 
+	/*
+	 * RTCM message types wanted by a client (types= query argument),
+	 * NULL for all.
+	 */
+	struct rtcm_filter *rtcm_filter;
+
 	struct {
 		struct evbuffer *raw_input;
 		bufferevent_filter_cb in_filter;
@@ -171,6 +180,13 @@ struct ntrip_state {
 	char *host;				// host to connect to
 	unsigned short port;			// port to connect to
 	struct ntrip_task *task;		// descriptor and callbacks for the current task
+
+	/*
+	 * Internal source (replay, generator) feeding this session without
+	 * a connection: its state, and its pointer to us, cleared on close.
+	 */
+	void *feeder;
+	struct ntrip_state **feeder_ref;
 	struct subscriber *subscription;	// current source subscription
 	char *uri;				// URI for requests
 
@@ -212,6 +228,8 @@ struct ntrip_state {
 	// date and position last used for recomputing the nearest base
 	struct timeval last_recompute_date;
 	pos_t last_recompute_pos;
+	// pending nearest base recompute, if any
+	struct nearest_request *nearest_request;
 
 	/*
 	 * Virtual mountpoint handling
@@ -229,6 +247,7 @@ void ntrip_set_localaddr(struct ntrip_state *this);
 void ntrip_clear_request(struct ntrip_state *this);
 void ntrip_free(struct ntrip_state *this, char *orig);
 void ntrip_deferred_free(struct ntrip_state *this, char *orig);
+struct ntrip_state *ntrip_new_feeder_source(struct caster_state *caster, char *mountpoint, const char *type, void *feeder, struct ntrip_state **ref);
 void ntrip_deferred_run(struct caster_state *this);
 int ntrip_drop_by_id(struct caster_state *caster, long long id);
 void ntrip_unregister_livesource(struct ntrip_state *this);
@@ -12,6 +12,7 @@
 #include "file.h"
 #include "http.h"
 #include "jobs.h"
+#include "nearest.h"
 #include "ntrip_common.h"
 #include "packet.h"
 #include "redistribute.h"
@@ -96,12 +97,12 @@ send_server_reply(struct ntrip_state *this, struct evbuffer *ev,
 }
 
 static int ntripsrv_send_sourcetable(struct ntrip_state *this, struct evbuffer *output) {
-	struct sourcetable *sourcetable = stack_flatten(this->caster, &this->caster->sourcetablestack);
+	struct sourcetable *sourcetable = stack_flatten_get(this->caster, &this->caster->sourcetablestack);
 	if (sourcetable == NULL)
 		return 503;
 
 	struct mime_content *m = sourcetable_get(sourcetable);
-	sourcetable_free(sourcetable);
+	stack_flatten_put(&this->caster->sourcetablestack, sourcetable);
 	if (m == NULL)
 		return 503;
 
@@ -227,9 +228,12 @@ int check_password(struct ntrip_state *this, const char *mountpoint, const char
 }
 
 /*
+ * Recompute the nearest base for a virtual source client, and switch to it
+ * if needed. Called by the nearest base scheduler.
+ *
  * Required lock: ntrip_state
  */
-void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
+void ntripsrv_redo_virtual_pos(struct ntrip_state *st, struct sourcetable *pos_sourcetable) {
 	if (!st->last_pos_valid || !st->source_virtual)
 		return;
 
@@ -247,16 +251,10 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 		&& distance(&st->last_pos, &st->last_recompute_pos) < st->caster->config->min_nearest_recompute_pos_delta)
 		return;
 
-	struct sourcetable *pos_sourcetable = stack_flatten(st->caster, &st->caster->sourcetablestack);
-	if (pos_sourcetable == NULL)
-		return;
-
-
-	struct dist_table *s = sourcetable_find_pos(pos_sourcetable, &st->last_pos);
-	if (s == NULL) {
-		sourcetable_free(pos_sourcetable);
+	struct dist_table dist_table;
+	struct dist_table *s = &dist_table;
+	if (nearest_cache_find_pos(st->caster->nearest_sched, pos_sourcetable, &st->last_pos, s) <= 0)
 		return;
-	}
 	st->last_recompute_pos = st->last_pos;
 	st->last_recompute_date = t0;
 
@@ -294,9 +292,74 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 			}
 		}
 	}
+}
+
+/*
+ * Set up the RTCM filter of a stream request, from the configuration
+ * and the query string arguments:
+ *	types=<type>,<type>...		only send these RTCM message types
+ *	decimate=<seconds>		only send one observation epoch per interval,
+ *					0 to disable the configured default
+ *	msm=4				send MSM7 messages transcoded to MSM4,
+ *					if msm4_transcoding is enabled
+ *
+ * Return -1 if an argument is invalid.
+ */
+static int ntripsrv_stream_args(struct ntrip_state *st) {
+	struct hash_table *h = NULL;
+	char *types = NULL;
+	char *decimate = NULL;
+	char *msm = NULL;
+
+	if (st->query_string) {
+		char *qs = mystrdup(st->query_string);
+		if (qs == NULL)
+			return -1;
+		h = hash_from_urlencoding(qs);
+		strfree(qs);
+		if (h == NULL)
+			return -1;
+		types = (char *)hash_table_get(h, "types");
+		decimate = (char *)hash_table_get(h, "decimate");
+		msm = (char *)hash_table_get(h, "msm");
+	}
+
+	int r = 0;
+	long decimation = st->caster->config->decimation_interval;
+	if (decimate) {
+		char *end;
+		decimation = strtol(decimate, &end, 10);
+		if (*decimate == '\0' || *end != '\0' || decimation < 0 || decimation > 3600) {
+			ntrip_log(st, LOG_NOTICE, "Invalid decimate argument: %s", decimate);
+			r = -1;
+		}
+	}
+	int msm4 = 0;
+	if (msm) {
+		if (!strcmp(msm, "4"))
+			msm4 = 1;
+		else if (strcmp(msm, "7")) {
+			ntrip_log(st, LOG_NOTICE, "Invalid msm argument: %s", msm);
+			r = -1;
+		}
+	}
 
-	sourcetable_free(pos_sourcetable);
-	dist_table_free(s);
+	if (r == 0 && (types || decimation || msm4)) {
+		st->rtcm_filter = rtcm_filter_new();
+		if (st->rtcm_filter == NULL)
+			r = -1;
+		else {
+			st->rtcm_filter->decimation_ms = decimation * 1000;
+			st->rtcm_filter->msm4 = msm4;
+			if (types && rtcm_filter_set_types(st->rtcm_filter, types) < 0) {
+				ntrip_log(st, LOG_NOTICE, "Invalid types argument: %s", types);
+				r = -1;
+			}
+		}
+	}
+	if (h)
+		hash_table_free(h);
+	return r;
 }
 
 /*
@@ -464,6 +527,11 @@ void ntripsrv_readcb(struct bufferevent *bev, void *arg) {
 					struct sourceline *sourceline = NULL;
 					struct livesource *l = NULL;
 
+					if (*mountpoint && ntripsrv_stream_args(st) < 0) {
+						err = 400;
+						break;
+					}
+
 					if (*mountpoint) {
 						/*
 						 * Find both a relevant source line and a live source (actually live or on-demand).
@@ -516,6 +584,7 @@ void ntripsrv_readcb(struct bufferevent *bev, void *arg) {
 						if (l) {
 							ntrip_log(st, LOG_DEBUG, "Found requested source %s, on_demand=%d", mountpoint, st->source_on_demand);
 							ntripsrv_send_stream_result_ok(st, output, "gnss/data", NULL);
+							livesource_replay_subscriber(l, st);
 							st->state = NTRIP_WAIT_CLIENT_INPUT;
 
 							/* Regular NTRIP stream client: disable read and write timeouts */
@@ -539,7 +608,7 @@ void ntripsrv_readcb(struct bufferevent *bev, void *arg) {
 					/* If we have a position (Ntrip-gga header), use it */
 
 					if (st->last_pos_valid)
-						joblist_append_ntrip_locked(st->caster->joblist, st, &ntripsrv_redo_virtual_pos);
+						nearest_sched_schedule(st->caster->nearest_sched, st);
 
 					/*
 					 * We only limit the send buffer on NTRIP clients, except for the sourcetable.
@@ -640,7 +709,7 @@ void ntripsrv_readcb(struct bufferevent *bev, void *arg) {
 			if (parse_gga(line, &pos) >= 0) {
 				st->last_pos = pos;
 				st->last_pos_valid = 1;
-				joblist_append_ntrip_locked(st->caster->joblist, st, &ntripsrv_redo_virtual_pos);
+				nearest_sched_schedule(st->caster->nearest_sched, st);
 			}
 		} else if (st->state == NTRIP_WAIT_CLIENT_CONTENT) {
 			int len;
@@ -721,6 +790,12 @@ void ntripsrv_writecb(struct bufferevent *bev, void *arg)
 			ntrip_deferred_free(st, "ntripsrv_writecb");
 		else
 			ntrip_log(st, LOG_EDEBUG, "ntripsrv_writecb remaining len %d", len);
+	} else if (st->subscription && st->state != NTRIP_END) {
+		/*
+		 * Packet ring mode: fetch what we missed while our output was busy.
+		 */
+		if (livesource_drain_subscriber(st->subscription) < 0)
+			ntrip_deferred_free(st, "ntripsrv_writecb");
 	}
 }
 
@@ -11,7 +11,7 @@ enum check_password_result {
 	CHECKPW_MOUNTPOINT_WILDCARD
 };
 
-void ntripsrv_redo_virtual_pos(struct ntrip_state *st);
+void ntripsrv_redo_virtual_pos(struct ntrip_state *st, struct sourcetable *pos_sourcetable);
 int ntripsrv_send_result_ok(struct ntrip_state *this, struct evbuffer *output, struct mime_content *m, struct evkeyvalq *opt_headers);
 int ntripsrv_send_stream_result_ok(struct ntrip_state *this, struct evbuffer *output, const char *mime_type, struct evkeyvalq *opt_headers);
 void ntripsrv_deferred_output(
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include <event2/buffer.h>
 
 #include "conf.h"
@@ -5,40 +7,292 @@
 #include "packet.h"
 #include "ntrip_common.h"
 
+/*
+ * Packet pool.
+ *
+ * Packets are allocated by size class from a per-thread cache, refilled from
+ * and flushed to a shared depot, as the last reference to a packet is often
+ * dropped by another thread than the one which allocated it (evbuffer cleanup
+ * in zero-copy mode).
+ *
+ * Size classes fit small RTCM messages, the maximum RTCM frame (1029 bytes)
+ * and the default max_raw_packet. Bigger packets use malloc() directly.
+ *
+ * A thread cache is flushed to the depot when its thread exits.
+ */
+static const size_t packet_size_classes[] = {64, 256, 1029, 1536};
+#define PACKET_NCLASSES		(sizeof packet_size_classes / sizeof packet_size_classes[0])
+
+#define PACKET_CACHE_MAX	64	// packets per class in a thread cache
+#define PACKET_DEPOT_MAX	4096	// packets per class in the depot
+
+/*
+ * Free list of packets, linked through the packet memory.
+ */
+struct packet_freelist {
+	struct packet_freelist *next;
+};
+
+struct packet_cache {
+	struct packet_freelist *head;
+	int n;
+};
+
+static _Thread_local struct packet_cache packet_cache[PACKET_NCLASSES];
+static _Thread_local int packet_cache_registered;
+static pthread_key_t packet_cache_key;
+static pthread_once_t packet_cache_key_once = PTHREAD_ONCE_INIT;
+
+static struct packet_depot {
+	P_MUTEX_T lock;
+	struct packet_freelist *head;
+	int n;
+} packet_depot[PACKET_NCLASSES] = {
+	/* One per size class */
+	{PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+	{PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+	{PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+	{PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+};
+
+static atomic_ulong packet_pool_hits;
+static atomic_ulong packet_pool_misses;
+static atomic_ulong packet_pool_oversize;
+static atomic_ulong packet_pool_released;
+
+static int packet_size_class(size_t len) {
+	for (int c = 0; c < PACKET_NCLASSES; c++)
+		if (len <= packet_size_classes[c])
+			return c;
+	return -1;
+}
+
+/*
+ * Move a thread cache to the depot, or to the system if full.
+ *
+ * Called by the packet_cache_key destructor on thread exit.
+ */
+static void packet_cache_flush(void *arg) {
+	struct packet_cache *caches = (struct packet_cache *)arg;
+
+	for (int c = 0; c < PACKET_NCLASSES; c++) {
+		struct packet_cache *cache = &caches[c];
+		struct packet_depot *depot = &packet_depot[c];
+		struct packet_freelist *p, *release = NULL;
+
+		P_MUTEX_LOCK(&depot->lock);
+		while ((p = cache->head)) {
+			cache->head = p->next;
+			if (depot->n < PACKET_DEPOT_MAX) {
+				p->next = depot->head;
+				depot->head = p;
+				depot->n++;
+			} else {
+				p->next = release;
+				release = p;
+			}
+		}
+		cache->n = 0;
+		P_MUTEX_UNLOCK(&depot->lock);
+		while ((p = release)) {
+			release = p->next;
+			free(p);
+			atomic_fetch_add_explicit(&packet_pool_released, 1, memory_order_relaxed);
+		}
+	}
+}
+
+static void packet_cache_key_init(void) {
+	pthread_key_create(&packet_cache_key, packet_cache_flush);
+}
+
+/*
+ * Have the thread cache flushed on thread exit, before its first use.
+ */
+static void packet_cache_register(void) {
+	if (packet_cache_registered)
+		return;
+	pthread_once(&packet_cache_key_once, packet_cache_key_init);
+	pthread_setspecific(packet_cache_key, packet_cache);
+	packet_cache_registered = 1;
+}
+
+/*
+ * Get a packet from the pool, or allocate a new one.
+ */
+static struct packet *packet_pool_get(int c) {
+	struct packet_cache *cache = &packet_cache[c];
+	struct packet_freelist *p;
+
+	if (cache->head == NULL) {
+		packet_cache_register();
+		/* Refill half the cache from the depot */
+		struct packet_depot *depot = &packet_depot[c];
+		P_MUTEX_LOCK(&depot->lock);
+		while (cache->n < PACKET_CACHE_MAX/2 && (p = depot->head)) {
+			depot->head = p->next;
+			depot->n--;
+			p->next = cache->head;
+			cache->head = p;
+			cache->n++;
+		}
+		P_MUTEX_UNLOCK(&depot->lock);
+	}
+
+	p = cache->head;
+	if (p != NULL) {
+		cache->head = p->next;
+		cache->n--;
+		atomic_fetch_add_explicit(&packet_pool_hits, 1, memory_order_relaxed);
+		return (struct packet *)p;
+	}
+	atomic_fetch_add_explicit(&packet_pool_misses, 1, memory_order_relaxed);
+	return (struct packet *)malloc(sizeof(struct packet) + packet_size_classes[c]);
+}
+
+/*
+ * Return a packet to the pool.
+ */
+static void packet_pool_put(struct packet *packet) {
+	int c = packet->pool_class;
+	struct packet_cache *cache = &packet_cache[c];
+	struct packet_freelist *p;
+
+	packet_cache_register();
+	if (cache->n >= PACKET_CACHE_MAX) {
+		/* Flush half the cache to the depot, or to the system if full */
+		struct packet_freelist *release = NULL;
+		struct packet_depot *depot = &packet_depot[c];
+		P_MUTEX_LOCK(&depot->lock);
+		while (cache->n > PACKET_CACHE_MAX/2) {
+			p = cache->head;
+			cache->head = p->next;
+			cache->n--;
+			if (depot->n < PACKET_DEPOT_MAX) {
+				p->next = depot->head;
+				depot->head = p;
+				depot->n++;
+			} else {
+				p->next = release;
+				release = p;
+			}
+		}
+		P_MUTEX_UNLOCK(&depot->lock);
+		while ((p = release)) {
+			release = p->next;
+			free(p);
+			atomic_fetch_add_explicit(&packet_pool_released, 1, memory_order_relaxed);
+		}
+	}
+
+	p = (struct packet_freelist *)packet;
+	p->next = cache->head;
+	cache->head = p;
+	cache->n++;
+}
+
 struct packet *packet_new(size_t len_raw, struct caster_state *caster) {
-	struct packet *this = (struct packet *)malloc(sizeof(struct packet) + len_raw);
-	P_MUTEX_INIT(&this->mutex, NULL);
+	struct packet *this;
+	int c = packet_size_class(len_raw);
+	if (c < 0) {
+		atomic_fetch_add_explicit(&packet_pool_oversize, 1, memory_order_relaxed);
+		this = (struct packet *)malloc(sizeof(struct packet) + len_raw);
+	} else
+		this = packet_pool_get(c);
+	if (this == NULL)
+		return NULL;
+	atomic_init(&this->refcnt, 1);
+	this->pool_class = c;
+	this->rtcm_type = -1;
+	this->rtcm_epoch_end = -1;
+	this->rtcm_epoch_ms = -1;
+	this->msm4 = NULL;
 	this->datalen = len_raw;
-	this->refcnt = 1;
 	this->caster = caster;
 	return this;
 }
 
+/*
+ * Add n references to a packet, in zero copy mode.
+ *
+ * The caller already holds a reference, so no ordering is needed.
+ */
+void packet_incref(struct packet *packet, int n) {
+	atomic_fetch_add_explicit(&packet->refcnt, n, memory_order_relaxed);
+}
+
+/*
+ * Check whether a packet sent to nsubs subscribers should be shared
+ * by reference instead of copied.
+ *
+ * A reference costs an evbuffer chain allocation per subscriber, more
+ * than a copy of a small packet in an existing chain.
+ */
+int packet_by_reference(struct packet *packet, int nsubs) {
+	struct config *config = packet->caster->config;
+	return config->zero_copy && nsubs > 1 && packet->datalen >= config->zero_copy_min_packet;
+}
+
 /*
  * Packet freeing function with a reference count
  * for zero copy mode.
  */
 void packet_free(struct packet *packet) {
 	/*
-	 * When not in zero-copy mode, don't lock the packet as
-	 * we are the only thread handling it.
+	 * When not in zero-copy mode, we are the only thread handling the packet.
+	 *
+	 * Otherwise, release semantics so that our accesses happen before the free,
+	 * acquire for the thread doing the free.
 	 */
-	if (!packet->caster->config->zero_copy) {
-		P_MUTEX_UNLOCK(&packet->mutex);
-		P_MUTEX_DESTROY(&packet->mutex);
-		free((void *)packet);
+	if (packet->caster->config->zero_copy
+	    && atomic_fetch_sub_explicit(&packet->refcnt, 1, memory_order_acq_rel) != 1)
 		return;
-	}
 
-	P_MUTEX_LOCK(&packet->mutex);
-	packet->refcnt--;
-	if (packet->refcnt == 0) {
-		P_MUTEX_UNLOCK(&packet->mutex);
-		P_MUTEX_DESTROY(&packet->mutex);
+	if (packet->msm4)
+		packet_free(packet->msm4);
+	if (packet->pool_class < 0)
 		free((void *)packet);
-	} else {
-		P_MUTEX_UNLOCK(&packet->mutex);
+	else
+		packet_pool_put(packet);
+}
+
+void packet_pool_get_stats(struct packet_pool_stats *stats) {
+	stats->hits = atomic_load_explicit(&packet_pool_hits, memory_order_relaxed);
+	stats->misses = atomic_load_explicit(&packet_pool_misses, memory_order_relaxed);
+	stats->oversize = atomic_load_explicit(&packet_pool_oversize, memory_order_relaxed);
+	stats->released = atomic_load_explicit(&packet_pool_released, memory_order_relaxed);
+	stats->depot = 0;
+	for (int c = 0; c < PACKET_NCLASSES; c++) {
+		P_MUTEX_LOCK(&packet_depot[c].lock);
+		stats->depot += packet_depot[c].n;
+		P_MUTEX_UNLOCK(&packet_depot[c].lock);
+	}
+}
+
+/*
+ * Return packet pool statistics as JSON.
+ */
+json_object *packet_pool_json(void) {
+	struct packet_pool_stats stats;
+	packet_pool_get_stats(&stats);
+
+	json_object *j = json_object_new_object();
+	json_object_object_add(j, "hits", json_object_new_int64(stats.hits));
+	json_object_object_add(j, "misses", json_object_new_int64(stats.misses));
+	json_object_object_add(j, "oversize", json_object_new_int64(stats.oversize));
+	json_object_object_add(j, "released", json_object_new_int64(stats.released));
+
+	json_object *jdepot = json_object_new_object();
+	for (int c = 0; c < PACKET_NCLASSES; c++) {
+		char size[20];
+		snprintf(size, sizeof size, "%zd", packet_size_classes[c]);
+		P_MUTEX_LOCK(&packet_depot[c].lock);
+		int n = packet_depot[c].n;
+		P_MUTEX_UNLOCK(&packet_depot[c].lock);
+		json_object_object_add(jdepot, size, json_object_new_int(n));
 	}
+	json_object_object_add(j, "depot", jdepot);
+	return j;
 }
 
 int packet_handle_raw(struct ntrip_state *st) {
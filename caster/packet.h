@@ -1,6 +1,10 @@
 #ifndef __PACKET_H__
 #define __PACKET_H__
 
+#include <stdatomic.h>
+
+#include <json-c/json.h>
+
 #include "conf.h"
 
 struct ntrip_state;
@@ -10,15 +14,34 @@ struct ntrip_state;
  * Variable-length structure, varies according to packet size.
  */
 struct packet {
-	P_MUTEX_T mutex;
-	int refcnt;		// mostly for zero-copy mode
+	atomic_int refcnt;	// only used in zero-copy mode
+	int pool_class;		// size class in the packet pool, -1 if not pooled
+	int rtcm_type;		// RTCM message type, -1 if unknown
+	int rtcm_epoch_end;	// observation message: 1 if last of its epoch, else 0; -1 for others
+	long rtcm_epoch_ms;	// observation epoch in ms of the GPS week, -1 if unknown
+	struct packet *msm4;	// MSM4 version of a MSM7 frame, freed along with the packet, or NULL
 	struct caster_state *caster;
 	size_t datalen;
 	unsigned char data[];
 };
 
+/*
+ * Packet pool statistics.
+ */
+struct packet_pool_stats {
+	unsigned long hits;		// allocations from a thread cache or the depot
+	unsigned long misses;		// allocations from malloc()
+	unsigned long oversize;		// packets too big for any size class
+	unsigned long released;		// packets returned to the system, depot full
+	unsigned long depot;		// packets currently in the depot
+};
+
 struct packet *packet_new(size_t len_raw, struct caster_state *caster);
+void packet_incref(struct packet *packet, int n);
+int packet_by_reference(struct packet *packet, int nsubs);
 void packet_free(struct packet *packet);
+void packet_pool_get_stats(struct packet_pool_stats *stats);
+json_object *packet_pool_json(void);
 int packet_handle_raw(struct ntrip_state *st);
 int packet_handle_rtcm(struct ntrip_state *st);
 
@@ -0,0 +1,499 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "caster.h"
+#include "config.h"
+#include "livesource.h"
+#include "packet.h"
+#include "recorder.h"
+#include "util.h"
+
+/*
+ * Recorder of livesource streams to rotating segment files.
+ *
+ * Frames are queued by livesource_send_subscribers() in a lock-free
+ * queue, never blocking: when the queue is full, they are dropped and
+ * counted. A dedicated I/O thread drains the queue, buffers writes per
+ * stream, rotates segments and calls fdatasync() according to the
+ * configured policy.
+ *
+ * Frames are copied to malloc()-ed records rather than referenced,
+ * as packets are only reference-counted in zero-copy mode, and the
+ * packet pool depot is only locked in threaded mode.
+ */
+
+static int recorder_queue_init(struct recorder_queue *this, int size) {
+	unsigned long n = 1;
+	while (n < size)
+		n <<= 1;
+	this->slots = (struct recorder_slot *)malloc(n * sizeof(struct recorder_slot));
+	if (this->slots == NULL)
+		return -1;
+	for (unsigned long i = 0; i < n; i++) {
+		atomic_init(&this->slots[i].seq, i);
+		this->slots[i].record = NULL;
+	}
+	this->mask = n - 1;
+	atomic_init(&this->head, 0);
+	this->tail = 0;
+	return 0;
+}
+
+/*
+ * Enqueue a record, return -1 if the queue is full.
+ *
+ * Thread-safe for any number of producers.
+ */
+static int recorder_queue_push(struct recorder_queue *this, struct recorder_record *record) {
+	unsigned long pos = atomic_load_explicit(&this->head, memory_order_relaxed);
+	struct recorder_slot *slot;
+
+	while (1) {
+		slot = &this->slots[pos & this->mask];
+		unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		long diff = (long)(seq - pos);
+		if (diff == 0) {
+			/* Free slot, try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&this->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			/* Full: the consumer has not freed this slot yet */
+			return -1;
+		else
+			pos = atomic_load_explicit(&this->head, memory_order_relaxed);
+	}
+	slot->record = record;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+/*
+ * Dequeue a record, NULL if the queue is empty.
+ *
+ * Only called from the consumer thread.
+ */
+static struct recorder_record *recorder_queue_pop(struct recorder_queue *this) {
+	struct recorder_slot *slot = &this->slots[this->tail & this->mask];
+	unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+	if (seq != this->tail + 1)
+		return NULL;
+	struct recorder_record *record = slot->record;
+	atomic_store_explicit(&slot->seq, this->tail + this->mask + 1, memory_order_release);
+	this->tail++;
+	return record;
+}
+
+static void recorder_stream_init(struct recorder_stream *this) {
+	this->fd = -1;
+	this->index_fd = -1;
+	this->offset = 0;
+	this->index_last_ms = 0;
+	this->dirty = 0;
+	this->buffer_len = 0;
+	this->index_len = 0;
+	this->buffer = NULL;
+	this->index_buffer = NULL;
+	atomic_init(&this->frames, 0);
+	atomic_init(&this->bytes, 0);
+	atomic_init(&this->segments, 0);
+	atomic_init(&this->write_errors, 0);
+}
+
+struct recorder *recorder_new(struct caster_state *caster, struct config_recorder *config, int count, int queue_size) {
+	struct recorder *this = (struct recorder *)malloc(sizeof(struct recorder));
+	if (this == NULL)
+		return NULL;
+	this->caster = caster;
+	this->thread_started = 0;
+	this->nstreams = 0;
+	atomic_init(&this->stop, 0);
+	atomic_init(&this->dropped, 0);
+	this->streams = (struct recorder_stream *)malloc(count * sizeof(struct recorder_stream));
+	if (this->streams == NULL || recorder_queue_init(&this->queue, queue_size) < 0) {
+		free(this->streams);
+		free(this);
+		return NULL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct recorder_stream *s = &this->streams[i];
+		recorder_stream_init(s);
+		s->mountpoint = mystrdup(config[i].mountpoint);
+		s->directory = mystrdup(config[i].directory);
+		s->segment_max_size = config[i].segment_max_size;
+		s->segment_max_duration = config[i].segment_max_duration;
+		s->sync_interval = config[i].sync_interval;
+		s->buffer = (unsigned char *)malloc(RECORDER_WRITE_BUFFER);
+		s->index_buffer = (struct recorder_index *)malloc(RECORDER_WRITE_BUFFER);
+		this->nstreams++;
+		if (s->mountpoint == NULL || s->directory == NULL || s->buffer == NULL || s->index_buffer == NULL) {
+			recorder_free(this);
+			return NULL;
+		}
+	}
+	return this;
+}
+
+/*
+ * Return the stream for a mountpoint, NULL if not recorded.
+ */
+struct recorder_stream *recorder_find(struct recorder *this, const char *mountpoint) {
+	for (int i = 0; i < this->nstreams; i++)
+		if (!strcmp(this->streams[i].mountpoint, mountpoint))
+			return &this->streams[i];
+	return NULL;
+}
+
+/*
+ * Queue packets for recording.
+ * Never blocks, return the number of packets dropped on a full queue.
+ */
+int recorder_queue(struct recorder *this, struct recorder_stream *stream, struct packet **packets, int npackets) {
+	struct timeval now;
+	int ndropped = 0;
+
+	gettimeofday(&now, NULL);
+	for (int i = 0; i < npackets; i++) {
+		struct recorder_record *r = (struct recorder_record *)malloc(sizeof(struct recorder_record) + packets[i]->datalen);
+		if (r == NULL) {
+			ndropped++;
+			continue;
+		}
+		r->stream = stream;
+		r->date = now;
+		r->len = packets[i]->datalen;
+		memcpy(r->data, packets[i]->data, r->len);
+		if (recorder_queue_push(&this->queue, r) < 0) {
+			free(r);
+			ndropped++;
+		}
+	}
+	if (ndropped)
+		atomic_fetch_add_explicit(&this->dropped, ndropped, memory_order_relaxed);
+	return ndropped;
+}
+
+/*
+ * Queue packets sent to a livesource, if it is recorded.
+ *
+ * The stream is looked up once per livesource.
+ *
+ * Required lock: ntrip_state of the source
+ */
+void recorder_livesource_queue(struct recorder *this, struct livesource *livesource, struct packet **packets, int npackets) {
+	if (!livesource->recorder_checked) {
+		livesource->recorder_stream = recorder_find(this, livesource->mountpoint);
+		livesource->recorder_checked = 1;
+	}
+	if (livesource->recorder_stream)
+		recorder_queue(this, livesource->recorder_stream, packets, npackets);
+}
+
+/*
+ * Write all of a buffer, return -1 on error.
+ */
+static int recorder_write(int fd, const void *data, size_t len) {
+	while (len) {
+		ssize_t r = write(fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data = (const char *)data + r;
+		len -= r;
+	}
+	return 0;
+}
+
+static void recorder_stream_sync(struct recorder_stream *s, struct timeval *now) {
+	if (s->dirty) {
+		if (s->fd >= 0)
+			fdatasync(s->fd);
+		if (s->index_fd >= 0)
+			fdatasync(s->index_fd);
+	}
+	s->dirty = 0;
+	s->sync_date = *now;
+}
+
+static void recorder_stream_close_files(struct recorder_stream *s, struct timeval *now) {
+	recorder_stream_sync(s, now);
+	if (s->fd >= 0)
+		close(s->fd);
+	if (s->index_fd >= 0)
+		close(s->index_fd);
+	s->fd = -1;
+	s->index_fd = -1;
+}
+
+/*
+ * Handle a write error: the segment size and index no longer match
+ * what is on disk, so drop the buffered data and close the segment.
+ * The next frame starts a new one.
+ */
+static void recorder_stream_error(struct recorder *this, struct recorder_stream *s, struct timeval *now) {
+	logfmt(&this->caster->flog, LOG_ERR, "Recorder: write error on %s: %s, closing segment", s->mountpoint, strerror(errno));
+	atomic_fetch_add_explicit(&s->write_errors, 1, memory_order_relaxed);
+	s->buffer_len = 0;
+	s->index_len = 0;
+	recorder_stream_close_files(s, now);
+}
+
+/*
+ * Write the buffered data and index entries of a stream,
+ * and sync it if due according to its policy.
+ *
+ * Return -1 on a write error, the segment being closed.
+ */
+static int recorder_stream_flush(struct recorder *this, struct recorder_stream *s, struct timeval *now) {
+	if (s->fd >= 0 && s->buffer_len) {
+		s->dirty = 1;
+		if (recorder_write(s->fd, s->buffer, s->buffer_len) < 0) {
+			recorder_stream_error(this, s, now);
+			return -1;
+		}
+	}
+	if (s->index_fd >= 0 && s->index_len) {
+		s->dirty = 1;
+		if (recorder_write(s->index_fd, s->index_buffer, s->index_len * sizeof(struct recorder_index)) < 0) {
+			recorder_stream_error(this, s, now);
+			return -1;
+		}
+	}
+	s->buffer_len = 0;
+	s->index_len = 0;
+	if (s->fd >= 0 && s->sync_interval > 0 && now->tv_sec - s->sync_date.tv_sec >= s->sync_interval)
+		recorder_stream_sync(s, now);
+	return 0;
+}
+
+static void recorder_stream_close(struct recorder *this, struct recorder_stream *s, struct timeval *now) {
+	recorder_stream_flush(this, s, now);
+	recorder_stream_close_files(s, now);
+}
+
+/*
+ * Open a new segment starting at the given date.
+ *
+ * Segment files are created exclusively: if the name is already taken,
+ * for instance by a size rotation within the same millisecond,
+ * a sequence number is appended.
+ */
+static int recorder_stream_open(struct recorder *this, struct recorder_stream *s, struct timeval *date) {
+	char path[PATH_MAX], index_path[PATH_MAX], stamp[40];
+	struct tm t;
+	int len;
+
+	gmtime_r(&date->tv_sec, &t);
+	len = strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", &t);
+	len += snprintf(stamp + len, sizeof stamp - len, "-%03ld", (long)date->tv_usec / 1000);
+
+	for (int seq = 0; ; seq++) {
+		if (seq)
+			snprintf(stamp + len, sizeof stamp - len, "-%d", seq);
+		snprintf(path, sizeof path, "%s/%s-%s.rtcm", s->directory, s->mountpoint, stamp);
+		s->fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+		if (s->fd < 0) {
+			if (errno == EEXIST && seq < RECORDER_OPEN_RETRIES)
+				continue;
+			logfmt(&this->caster->flog, LOG_ERR, "Recorder: can't open %s: %s", path, strerror(errno));
+			return -1;
+		}
+		snprintf(index_path, sizeof index_path, "%s/%s-%s.idx", s->directory, s->mountpoint, stamp);
+		s->index_fd = open(index_path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+		if (s->index_fd >= 0)
+			break;
+		int err = errno;
+		close(s->fd);
+		s->fd = -1;
+		unlink(path);
+		if (err != EEXIST || seq >= RECORDER_OPEN_RETRIES) {
+			logfmt(&this->caster->flog, LOG_ERR, "Recorder: can't open %s: %s", index_path, strerror(err));
+			return -1;
+		}
+	}
+
+	s->offset = 0;
+	s->segment_date = *date;
+	s->sync_date = *date;
+	s->index_last_ms = 0;
+	atomic_fetch_add_explicit(&s->segments, 1, memory_order_relaxed);
+	logfmt(&this->caster->flog, LOG_INFO, "Recorder: new segment %s-%s", s->mountpoint, stamp);
+	return 0;
+}
+
+/*
+ * Append a record to its stream, rotating segments as needed.
+ */
+static void recorder_stream_append(struct recorder *this, struct recorder_record *r) {
+	struct recorder_stream *s = r->stream;
+
+	if (s->fd >= 0
+	    && ((s->segment_max_size && s->offset + r->len > s->segment_max_size && s->offset)
+		|| (s->segment_max_duration && r->date.tv_sec - s->segment_date.tv_sec >= s->segment_max_duration)))
+		recorder_stream_close(this, s, &r->date);
+
+	/* Make room in the buffers first, a write error closes the segment */
+	if (s->fd >= 0
+	    && ((s->index_len + 1) * sizeof(struct recorder_index) > RECORDER_WRITE_BUFFER
+		|| s->buffer_len + r->len > RECORDER_WRITE_BUFFER))
+		recorder_stream_flush(this, s, &r->date);
+
+	if (s->fd < 0 && recorder_stream_open(this, s, &r->date) < 0) {
+		atomic_fetch_add_explicit(&s->write_errors, 1, memory_order_relaxed);
+		return;
+	}
+
+	int64_t ms = (int64_t)r->date.tv_sec * 1000 + r->date.tv_usec / 1000;
+	if (s->index_last_ms == 0 || ms - s->index_last_ms >= RECORDER_INDEX_INTERVAL_MS) {
+		s->index_buffer[s->index_len].time_ms = ms;
+		s->index_buffer[s->index_len].offset = s->offset;
+		s->index_len++;
+		s->index_last_ms = ms;
+	}
+
+	if (r->len > RECORDER_WRITE_BUFFER) {
+		s->dirty = 1;
+		if (recorder_write(s->fd, r->data, r->len) < 0) {
+			recorder_stream_error(this, s, &r->date);
+			return;
+		}
+	} else {
+		memcpy(s->buffer + s->buffer_len, r->data, r->len);
+		s->buffer_len += r->len;
+	}
+	s->offset += r->len;
+	atomic_fetch_add_explicit(&s->frames, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->bytes, r->len, memory_order_relaxed);
+}
+
+/*
+ * Write at most max queued records, return their number.
+ */
+static int recorder_drain_max(struct recorder *this, int max) {
+	struct recorder_record *r;
+	int n = 0;
+	while (n < max && (r = recorder_queue_pop(&this->queue))) {
+		recorder_stream_append(this, r);
+		free(r);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Write all queued records, return their number.
+ *
+ * Only called from the I/O thread, or when it is not running.
+ */
+int recorder_drain(struct recorder *this) {
+	return recorder_drain_max(this, INT_MAX);
+}
+
+/*
+ * Write buffered data, and sync streams according to their policy.
+ */
+void recorder_flush(struct recorder *this) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	for (int i = 0; i < this->nstreams; i++) {
+		struct recorder_stream *s = &this->streams[i];
+		recorder_stream_flush(this, s, &now);
+		/* Close idle segments past their duration */
+		if (s->fd >= 0 && s->segment_max_duration
+		    && now.tv_sec - s->segment_date.tv_sec >= s->segment_max_duration)
+			recorder_stream_close(this, s, &now);
+	}
+}
+
+static void *recorder_thread(void *arg) {
+	struct recorder *this = (struct recorder *)arg;
+	struct timespec poll = {0, RECORDER_POLL_MS*1000000L};
+
+	struct timeval last_flush, now, dt;
+
+	gettimeofday(&last_flush, NULL);
+	while (!atomic_load(&this->stop)) {
+		int n = recorder_drain_max(this, RECORDER_DRAIN_BATCH);
+		gettimeofday(&now, NULL);
+		timersub(&now, &last_flush, &dt);
+		/*
+		 * Write what we have and sync as due when the queue is empty,
+		 * and at least every poll interval under sustained load.
+		 */
+		if (n < RECORDER_DRAIN_BATCH || dt.tv_sec || dt.tv_usec >= RECORDER_POLL_MS*1000) {
+			recorder_flush(this);
+			last_flush = now;
+		}
+		if (n == 0)
+			nanosleep(&poll, NULL);
+	}
+	recorder_drain(this);
+	return NULL;
+}
+
+int recorder_start(struct recorder *this) {
+	size_t stacksize = this->caster->config->threads[0].stacksize;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stacksize);
+	int r = pthread_create(&this->thread, &attr, recorder_thread, this);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		logfmt(&this->caster->flog, LOG_ERR, "Recorder: can't create thread");
+		return -1;
+	}
+	this->thread_started = 1;
+	return 0;
+}
+
+/*
+ * Stop the I/O thread, write pending frames and close all segments.
+ */
+void recorder_free(struct recorder *this) {
+	struct timeval now;
+
+	if (this->thread_started) {
+		atomic_store(&this->stop, 1);
+		pthread_join(this->thread, NULL);
+	}
+	recorder_drain(this);
+
+	gettimeofday(&now, NULL);
+	for (int i = 0; i < this->nstreams; i++) {
+		struct recorder_stream *s = &this->streams[i];
+		recorder_stream_close(this, s, &now);
+		strfree(s->mountpoint);
+		strfree(s->directory);
+		free(s->buffer);
+		free(s->index_buffer);
+	}
+	free(this->streams);
+	free(this->queue.slots);
+	free(this);
+}
+
+json_object *recorder_json(struct recorder *this) {
+	json_object *j = json_object_new_object();
+	json_object *js = json_object_new_object();
+	for (int i = 0; i < this->nstreams; i++) {
+		struct recorder_stream *s = &this->streams[i];
+		json_object *jm = json_object_new_object();
+		json_object_object_add(jm, "frames", json_object_new_int64(atomic_load(&s->frames)));
+		json_object_object_add(jm, "bytes", json_object_new_int64(atomic_load(&s->bytes)));
+		json_object_object_add(jm, "segments", json_object_new_int64(atomic_load(&s->segments)));
+		json_object_object_add(jm, "write_errors", json_object_new_int64(atomic_load(&s->write_errors)));
+		json_object_object_add(js, s->mountpoint, jm);
+	}
+	json_object_object_add(j, "streams", js);
+	json_object_object_add(j, "dropped", json_object_new_int64(atomic_load(&this->dropped)));
+	return j;
+}
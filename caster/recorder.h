@@ -0,0 +1,133 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <json-c/json.h>
+
+#include "conf.h"
+
+struct caster_state;
+struct config_recorder;
+struct livesource;
+struct packet;
+
+/*
+ * On-disk recording of livesource streams.
+ *
+ * Frames are appended to segment files named
+ *	<directory>/<mountpoint>-YYYYMMDD-HHMMSS-mmm.rtcm	(UTC start date)
+ * with a -<n> suffix added if the name is already taken, along with
+ * an index file (same name, .idx) of struct recorder_index entries
+ * in host byte order, one per RECORDER_INDEX_INTERVAL_MS of stream time
+ * at most.
+ *
+ * After a write error, the segment is closed and the next frame starts
+ * a new one, so that index entries always point at written data.
+ */
+
+/* Minimum interval between index entries */
+#define	RECORDER_INDEX_INTERVAL_MS	100
+
+/* Delay between queue polls when idle, in milliseconds */
+#define	RECORDER_POLL_MS		20
+
+/* Maximum number of records written between two flush checks */
+#define	RECORDER_DRAIN_BATCH		1024
+
+/* Maximum sequence number tried for a segment name already taken */
+#define	RECORDER_OPEN_RETRIES		100
+
+/* Size of the per-stream write buffer */
+#define	RECORDER_WRITE_BUFFER		65536
+
+/*
+ * Index entry: segment offset of the first frame received at or after time_ms.
+ */
+struct recorder_index {
+	int64_t time_ms;		// UNIX time in milliseconds
+	uint64_t offset;
+};
+
+/*
+ * A frame queued for writing.
+ */
+struct recorder_record {
+	struct recorder_stream *stream;
+	struct timeval date;
+	size_t len;
+	unsigned char data[];
+};
+
+/*
+ * Bounded multi-producer, single consumer lock-free queue.
+ *
+ * Each slot has a sequence number telling whether it is free for
+ * the producer at the same position, or full for the consumer.
+ */
+struct recorder_slot {
+	atomic_ulong seq;
+	struct recorder_record *record;
+};
+
+struct recorder_queue {
+	struct recorder_slot *slots;
+	unsigned long mask;		// queue size - 1, size is a power of 2
+	atomic_ulong head;		// next position for producers
+	unsigned long tail;		// next position for the consumer
+};
+
+/*
+ * A recorded mountpoint.
+ *
+ * All fields except the counters are only accessed by the I/O thread.
+ */
+struct recorder_stream {
+	char *mountpoint;
+	char *directory;
+	size_t segment_max_size;
+	int segment_max_duration;
+	int sync_interval;
+
+	int fd, index_fd;		// current segment, -1 if none
+	struct timeval segment_date;	// start of the current segment
+	uint64_t offset;		// current segment size, including buffered data
+	int64_t index_last_ms;		// time of the last index entry
+	struct timeval sync_date;	// last fdatasync()
+	int dirty;			// data written since the last fdatasync()
+
+	unsigned char *buffer;
+	size_t buffer_len;
+	struct recorder_index *index_buffer;
+	int index_len;
+
+	atomic_ulong frames;
+	atomic_ulong bytes;
+	atomic_ulong segments;
+	atomic_ulong write_errors;
+};
+
+struct recorder {
+	struct caster_state *caster;
+	struct recorder_queue queue;
+	struct recorder_stream *streams;
+	int nstreams;
+	pthread_t thread;
+	int thread_started;
+	atomic_int stop;
+	atomic_ulong dropped;		// frames dropped on a full queue
+};
+
+struct recorder *recorder_new(struct caster_state *caster, struct config_recorder *config, int count, int queue_size);
+int recorder_start(struct recorder *this);
+void recorder_free(struct recorder *this);
+struct recorder_stream *recorder_find(struct recorder *this, const char *mountpoint);
+int recorder_queue(struct recorder *this, struct recorder_stream *stream, struct packet **packets, int npackets);
+void recorder_livesource_queue(struct recorder *this, struct livesource *livesource, struct packet **packets, int npackets);
+int recorder_drain(struct recorder *this);
+void recorder_flush(struct recorder *this);
+json_object *recorder_json(struct recorder *this);
+
+#endif /* __RECORDER_H__ */
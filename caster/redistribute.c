@@ -29,6 +29,8 @@ int redistribute_switch_source(struct ntrip_state *this, char *new_mountpoint, p
 	}
 	this->subscription = livesource_add_subscriber(livesource, this);
 	this->subscription->virtual = 1;
+	/* Send the station description and ephemeris of the new base right away */
+	livesource_replay_subscriber(livesource, this);
 	if (this->virtual_mountpoint)
 		strfree(this->virtual_mountpoint);
 	this->virtual_mountpoint = new_mountpoint;
@@ -0,0 +1,47 @@
+#include <sched.h>
+
+#include "refptr.h"
+
+void refptr_init(struct refptr *this, void *ptr) {
+	atomic_init(&this->ptr, ptr);
+	atomic_init(&this->phase, 0);
+	atomic_init(&this->readers[0], 0);
+	atomic_init(&this->readers[1], 0);
+}
+
+/*
+ * Start a read, returning the current object.
+ *
+ * phase is to be passed to refptr_leave().
+ */
+void *refptr_enter(struct refptr *this, unsigned *phase) {
+	unsigned p;
+	while (1) {
+		p = atomic_load(&this->phase) & 1;
+		atomic_fetch_add(&this->readers[p], 1);
+		/* Check we are not counted in a phase already waited for */
+		if ((atomic_load(&this->phase) & 1) == p)
+			break;
+		atomic_fetch_sub(&this->readers[p], 1);
+	}
+	*phase = p;
+	return atomic_load(&this->ptr);
+}
+
+void refptr_leave(struct refptr *this, unsigned phase) {
+	atomic_fetch_sub(&this->readers[phase], 1);
+}
+
+/*
+ * Replace the object, and return the previous one, with the reference
+ * held by the pointer.
+ *
+ * Required lock: whatever serializes writers
+ */
+void *refptr_publish(struct refptr *this, void *ptr) {
+	void *old = atomic_exchange(&this->ptr, ptr);
+	unsigned p = atomic_fetch_add(&this->phase, 1) & 1;
+	while (atomic_load(&this->readers[p]))
+		sched_yield();
+	return old;
+}
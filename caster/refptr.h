@@ -0,0 +1,35 @@
+#ifndef __REFPTR_H__
+#define __REFPTR_H__
+
+#include <stdatomic.h>
+
+/*
+ * Atomic pointer to a reference counted object, read without locking.
+ *
+ * Readers call refptr_enter(), which returns the current object and
+ * guarantees it is not freed until refptr_leave(). They take their own
+ * reference in between, with an atomic increment.
+ *
+ * Writers, serialized by the caller, replace the object with
+ * refptr_publish(). It returns the old object with the reference held
+ * by the pointer, once the readers that may have loaded it have left.
+ * Readers only stay a few instructions between enter and leave, so the
+ * wait is short.
+ *
+ * Readers are counted in two phases, flipped on each publication:
+ * a reader entering after the flip can only load the new object.
+ *
+ * A zeroed structure is a valid NULL pointer.
+ */
+struct refptr {
+	void *_Atomic ptr;
+	atomic_uint phase;
+	atomic_int readers[2];
+};
+
+void refptr_init(struct refptr *this, void *ptr);
+void *refptr_enter(struct refptr *this, unsigned *phase);
+void refptr_leave(struct refptr *this, unsigned phase);
+void *refptr_publish(struct refptr *this, void *ptr);
+
+#endif
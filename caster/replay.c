@@ -0,0 +1,227 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "conf.h"
+#include "caster.h"
+#include "config.h"
+#include "livesource.h"
+#include "ntrip_common.h"
+#include "replay.h"
+#include "rtcm.h"
+#include "util.h"
+
+/*
+ * Replay of recorder segments as direct livesources.
+ *
+ * The replay has its own source session without a connection,
+ * registered like a source connected to us, and fed from a timer:
+ * the frames between two index entries are added to its input buffer
+ * and handled as received data, at the recorded pace divided by the
+ * replay speed.
+ */
+
+struct replay *replay_new(struct caster_state *caster, struct config_replay *config) {
+	struct replay *this = (struct replay *)malloc(sizeof(struct replay));
+	if (this == NULL)
+		return NULL;
+	this->caster = caster;
+	this->mountpoint = mystrdup(config->mountpoint);
+	this->filename = mystrdup(config->file);
+	this->speed = config->speed;
+	this->loop = config->loop;
+	this->st = NULL;
+	this->bev = NULL;
+	this->ev = NULL;
+	this->data = NULL;
+	this->len = 0;
+	this->index = NULL;
+	this->nindex = 0;
+	this->next = 0;
+	this->loops = 0;
+	if (this->mountpoint == NULL || this->filename == NULL) {
+		replay_free(this);
+		return NULL;
+	}
+	return this;
+}
+
+/*
+ * Read a full file in memory, return its size or -1.
+ */
+static ssize_t replay_read_file(const char *filename, unsigned char **data) {
+	struct stat sb;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0 || (sb.st_mode & S_IFMT) != S_IFREG
+	    || (*data = (unsigned char *)malloc(sb.st_size ? sb.st_size : 1)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	ssize_t r = read(fd, *data, sb.st_size);
+	close(fd);
+	if (r != sb.st_size) {
+		free(*data);
+		*data = NULL;
+		return -1;
+	}
+	return r;
+}
+
+/*
+ * Load a segment and its index, checking the index is consistent.
+ */
+int replay_load(struct replay *this) {
+	size_t flen = strlen(this->filename);
+	if (flen < 5 || strcmp(this->filename + flen - 5, ".rtcm")) {
+		logfmt(&this->caster->flog, LOG_ERR, "Replay %s: %s is not a .rtcm segment", this->mountpoint, this->filename);
+		return -1;
+	}
+	char *index_filename = (char *)strmalloc(flen);
+	if (index_filename == NULL)
+		return -1;
+	memcpy(index_filename, this->filename, flen - 5);
+	strcpy(index_filename + flen - 5, ".idx");
+
+	ssize_t len = replay_read_file(this->filename, &this->data);
+	ssize_t index_len = replay_read_file(index_filename, (unsigned char **)&this->index);
+	if (len < 0 || index_len < 0) {
+		logfmt(&this->caster->flog, LOG_ERR, "Replay %s: can't read %s", this->mountpoint, len < 0 ? this->filename : index_filename);
+		strfree(index_filename);
+		return -1;
+	}
+	strfree(index_filename);
+	this->len = len;
+	this->nindex = index_len / sizeof(struct recorder_index);
+
+	int i;
+	for (i = 0; i < this->nindex; i++) {
+		if (this->index[i].offset > this->len
+		    || (i && (this->index[i].offset < this->index[i-1].offset
+			|| this->index[i].time_ms < this->index[i-1].time_ms)))
+			break;
+	}
+	if (this->nindex == 0 || i < this->nindex || this->index[0].offset != 0) {
+		logfmt(&this->caster->flog, LOG_ERR, "Replay %s: invalid index for %s", this->mountpoint, this->filename);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send the frames of the next index entry to the livesource,
+ * and return in delay the time to wait for the next one.
+ *
+ * Return 0, or -1 at the end of the recording.
+ *
+ * Required lock: ntrip_state
+ */
+int replay_send(struct replay *this, struct timeval *delay) {
+	struct ntrip_state *st = this->st;
+	struct timeval now, target;
+
+	gettimeofday(&now, NULL);
+	if (this->next == 0)
+		this->start = now;
+
+	size_t end = this->next + 1 < this->nindex ? this->index[this->next+1].offset : this->len;
+	size_t offset = this->index[this->next].offset;
+	if (end > offset) {
+		evbuffer_add(st->input, this->data + offset, end - offset);
+		rtcm_packet_handle(st);
+	}
+
+	if (++this->next == this->nindex) {
+		if (!this->loop)
+			return -1;
+		this->next = 0;
+		this->loops++;
+		timerclear(delay);
+		return 0;
+	}
+
+	/* Absolute target date, to avoid drifting */
+	long long ms = (this->index[this->next].time_ms - this->index[0].time_ms) / this->speed;
+	target.tv_sec = this->start.tv_sec + ms / 1000;
+	target.tv_usec = this->start.tv_usec + (ms % 1000) * 1000;
+	if (target.tv_usec >= 1000000) {
+		target.tv_sec++;
+		target.tv_usec -= 1000000;
+	}
+	if (timercmp(&target, &now, >))
+		timersub(&target, &now, delay);
+	else
+		timerclear(delay);
+	return 0;
+}
+
+static void replay_cb(evutil_socket_t fd, short what, void *arg) {
+	struct replay *this = (struct replay *)arg;
+	struct timeval delay;
+
+	bufferevent_lock(this->bev);
+	if (this->st == NULL) {
+		/* Session closed, e.g. dropped through the API */
+		bufferevent_unlock(this->bev);
+		return;
+	}
+	if (replay_send(this, &delay) < 0) {
+		ntrip_log(this->st, LOG_INFO, "Replay of %s done", this->filename);
+		ntrip_deferred_free(this->st, "replay_cb");
+		bufferevent_unlock(this->bev);
+		return;
+	}
+	bufferevent_unlock(this->bev);
+	evtimer_add(this->ev, &delay);
+}
+
+/*
+ * Create the source session, register the livesource and start sending.
+ */
+int replay_start(struct replay *this) {
+	struct caster_state *caster = this->caster;
+
+	if (replay_load(this) < 0)
+		return -1;
+
+	this->ev = evtimer_new(caster->base, replay_cb, this);
+	if (this->ev == NULL)
+		return -1;
+	struct ntrip_state *st = ntrip_new_feeder_source(caster, this->mountpoint, "replay", this, &this->st);
+	if (st == NULL)
+		return -1;
+	this->bev = st->bev;
+
+	bufferevent_lock(this->bev);
+	ntrip_log(st, LOG_INFO, "Replaying %s, %d index entries, speed %.1f%s",
+		this->filename, this->nindex, this->speed, this->loop ? ", loop" : "");
+	bufferevent_unlock(this->bev);
+
+	struct timeval now = {0, 0};
+	evtimer_add(this->ev, &now);
+	return 0;
+}
+
+void replay_free(struct replay *this) {
+	if (this->ev)
+		event_free(this->ev);
+	if (this->bev) {
+		bufferevent_lock(this->bev);
+		if (this->st)
+			ntrip_deferred_free(this->st, "replay_free");
+		bufferevent_unlock(this->bev);
+		bufferevent_decref(this->bev);
+	}
+	strfree(this->mountpoint);
+	strfree(this->filename);
+	free(this->data);
+	free(this->index);
+	free(this);
+}
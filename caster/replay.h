@@ -0,0 +1,48 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "recorder.h"
+
+struct caster_state;
+struct config_replay;
+struct ntrip_state;
+
+/*
+ * Replay of a recorder segment as a direct livesource.
+ */
+struct replay {
+	struct caster_state *caster;
+	char *mountpoint;
+	char *filename;
+	float speed;			// replay speed, 1 for real-time
+	int loop;			// restart at the end of the recording
+
+	/*
+	 * Source session, NULL once closed.
+	 * Protected by the bufferevent lock, on which we keep a reference.
+	 */
+	struct ntrip_state *st;
+	struct bufferevent *bev;
+	struct event *ev;
+
+	/* Recording, fully loaded in memory */
+	unsigned char *data;
+	size_t len;
+	struct recorder_index *index;
+	int nindex;
+
+	int next;			// next index entry to send
+	struct timeval start;		// replay date of index entry 0 in the current loop
+	unsigned long loops;		// number of completed loops
+};
+
+struct replay *replay_new(struct caster_state *caster, struct config_replay *config);
+int replay_load(struct replay *this);
+int replay_start(struct replay *this);
+int replay_send(struct replay *this, struct timeval *delay);
+void replay_free(struct replay *this);
+
+#endif /* __REPLAY_H__ */
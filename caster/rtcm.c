@@ -1,95 +1,30 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
 
 #include <event2/buffer.h>
 //#include <json-c/json.h>
 
+#include "crc24q.h"
 #include "ntrip_common.h"
+#include "packet.h"
 #include "rtcm.h"
 
 /*
  * RTCM handling module.
  */
 
-static unsigned long crc24q[] = {
-    0x00000000, 0x01864CFB, 0x028AD50D, 0x030C99F6,
-    0x0493E6E1, 0x0515AA1A, 0x061933EC, 0x079F7F17,
-    0x08A18139, 0x0927CDC2, 0x0A2B5434, 0x0BAD18CF,
-    0x0C3267D8, 0x0DB42B23, 0x0EB8B2D5, 0x0F3EFE2E,
-    0x10C54E89, 0x11430272, 0x124F9B84, 0x13C9D77F,
-    0x1456A868, 0x15D0E493, 0x16DC7D65, 0x175A319E,
-    0x1864CFB0, 0x19E2834B, 0x1AEE1ABD, 0x1B685646,
-    0x1CF72951, 0x1D7165AA, 0x1E7DFC5C, 0x1FFBB0A7,
-    0x200CD1E9, 0x218A9D12, 0x228604E4, 0x2300481F,
-    0x249F3708, 0x25197BF3, 0x2615E205, 0x2793AEFE,
-    0x28AD50D0, 0x292B1C2B, 0x2A2785DD, 0x2BA1C926,
-    0x2C3EB631, 0x2DB8FACA, 0x2EB4633C, 0x2F322FC7,
-    0x30C99F60, 0x314FD39B, 0x32434A6D, 0x33C50696,
-    0x345A7981, 0x35DC357A, 0x36D0AC8C, 0x3756E077,
-    0x38681E59, 0x39EE52A2, 0x3AE2CB54, 0x3B6487AF,
-    0x3CFBF8B8, 0x3D7DB443, 0x3E712DB5, 0x3FF7614E,
-    0x4019A3D2, 0x419FEF29, 0x429376DF, 0x43153A24,
-    0x448A4533, 0x450C09C8, 0x4600903E, 0x4786DCC5,
-    0x48B822EB, 0x493E6E10, 0x4A32F7E6, 0x4BB4BB1D,
-    0x4C2BC40A, 0x4DAD88F1, 0x4EA11107, 0x4F275DFC,
-    0x50DCED5B, 0x515AA1A0, 0x52563856, 0x53D074AD,
-    0x544F0BBA, 0x55C94741, 0x56C5DEB7, 0x5743924C,
-    0x587D6C62, 0x59FB2099, 0x5AF7B96F, 0x5B71F594,
-    0x5CEE8A83, 0x5D68C678, 0x5E645F8E, 0x5FE21375,
-    0x6015723B, 0x61933EC0, 0x629FA736, 0x6319EBCD,
-    0x648694DA, 0x6500D821, 0x660C41D7, 0x678A0D2C,
-    0x68B4F302, 0x6932BFF9, 0x6A3E260F, 0x6BB86AF4,
-    0x6C2715E3, 0x6DA15918, 0x6EADC0EE, 0x6F2B8C15,
-    0x70D03CB2, 0x71567049, 0x725AE9BF, 0x73DCA544,
-    0x7443DA53, 0x75C596A8, 0x76C90F5E, 0x774F43A5,
-    0x7871BD8B, 0x79F7F170, 0x7AFB6886, 0x7B7D247D,
-    0x7CE25B6A, 0x7D641791, 0x7E688E67, 0x7FEEC29C,
-    0x803347A4, 0x81B50B5F, 0x82B992A9, 0x833FDE52,
-    0x84A0A145, 0x8526EDBE, 0x862A7448, 0x87AC38B3,
-    0x8892C69D, 0x89148A66, 0x8A181390, 0x8B9E5F6B,
-    0x8C01207C, 0x8D876C87, 0x8E8BF571, 0x8F0DB98A,
-    0x90F6092D, 0x917045D6, 0x927CDC20, 0x93FA90DB,
-    0x9465EFCC, 0x95E3A337, 0x96EF3AC1, 0x9769763A,
-    0x98578814, 0x99D1C4EF, 0x9ADD5D19, 0x9B5B11E2,
-    0x9CC46EF5, 0x9D42220E, 0x9E4EBBF8, 0x9FC8F703,
-    0xA03F964D, 0xA1B9DAB6, 0xA2B54340, 0xA3330FBB,
-    0xA4AC70AC, 0xA52A3C57, 0xA626A5A1, 0xA7A0E95A,
-    0xA89E1774, 0xA9185B8F, 0xAA14C279, 0xAB928E82,
-    0xAC0DF195, 0xAD8BBD6E, 0xAE872498, 0xAF016863,
-    0xB0FAD8C4, 0xB17C943F, 0xB2700DC9, 0xB3F64132,
-    0xB4693E25, 0xB5EF72DE, 0xB6E3EB28, 0xB765A7D3,
-    0xB85B59FD, 0xB9DD1506, 0xBAD18CF0, 0xBB57C00B,
-    0xBCC8BF1C, 0xBD4EF3E7, 0xBE426A11, 0xBFC426EA,
-    0xC02AE476, 0xC1ACA88D, 0xC2A0317B, 0xC3267D80,
-    0xC4B90297, 0xC53F4E6C, 0xC633D79A, 0xC7B59B61,
-    0xC88B654F, 0xC90D29B4, 0xCA01B042, 0xCB87FCB9,
-    0xCC1883AE, 0xCD9ECF55, 0xCE9256A3, 0xCF141A58,
-    0xD0EFAAFF, 0xD169E604, 0xD2657FF2, 0xD3E33309,
-    0xD47C4C1E, 0xD5FA00E5, 0xD6F69913, 0xD770D5E8,
-    0xD84E2BC6, 0xD9C8673D, 0xDAC4FECB, 0xDB42B230,
-    0xDCDDCD27, 0xDD5B81DC, 0xDE57182A, 0xDFD154D1,
-    0xE026359F, 0xE1A07964, 0xE2ACE092, 0xE32AAC69,
-    0xE4B5D37E, 0xE5339F85, 0xE63F0673, 0xE7B94A88,
-    0xE887B4A6, 0xE901F85D, 0xEA0D61AB, 0xEB8B2D50,
-    0xEC145247, 0xED921EBC, 0xEE9E874A, 0xEF18CBB1,
-    0xF0E37B16, 0xF16537ED, 0xF269AE1B, 0xF3EFE2E0,
-    0xF4709DF7, 0xF5F6D10C, 0xF6FA48FA, 0xF77C0401,
-    0xF842FA2F, 0xF9C4B6D4, 0xFAC82F22, 0xFB4E63D9,
-    0xFCD11CCE, 0xFD575035, 0xFE5BC9C3, 0xFFDD8538
+/*
+ * Context of the decoded frame handlers.
+ */
+struct rtcm_handler_arg {
+	struct ntrip_state *st;
+	struct rtcm_info *rp;
+	struct packet *packet;
+	struct timeval now;
 };
 
-/* Compute and return CRC24Q (RTCM) checksum on a byte string. */
-static unsigned long rtcm_crc24q_hash(unsigned char *data, size_t len) {
-	unsigned long crc = 0;
-	for (int d = 0; d < len; d++) {
-		crc = (crc << 8) ^ crc24q[(data[d] ^ (crc>>16)) & 0xff];
-	}
-
-	crc = crc & 0x00ffffff;
-	return crc;
-}
-
 // WGS84 constants
 static double a = 6378137.0;
 static double e = 8.1819190842622e-2;
@@ -132,114 +67,465 @@ static void ecef_to_lat_lon(pos_t *pos, double *palt, long ecef_x, long ecef_y,
 }
 
 /*
- * Extract a bit field in a RTCM packet.
- * beg and len are counted in bits.
+ * Return the type of a complete RTCM frame, or -1 if it is not one.
+ * The CRC is not checked.
  */
-static inline long getbits(unsigned char *d, int beg, int len) {
-	long r;
-	unsigned char mask;
+int rtcm_frame_type(const unsigned char *d, size_t len) {
+	if (len < 8 || d[0] != 0xd3 || (d[1] & 3)*256 + d[2] + 6 != len)
+		return -1;
+	return rtcm_bits(d+3, len-3, 0, 12);
+}
 
-	// Compute all constants that depend on function arguments
-	// to make the task easier for the inline optimizer.
-	int offset_first = beg >> 3;
-	int offset_last = (beg+len-1) >> 3;
-	int bits_first = beg & 7;
-	int full_bytes = (len - (8 - bits_first)) >> 3;
-	int bits_last = (len - (8 - bits_first)) & 7;
+/*
+ * Check whether a RTCM frame carries observations (legacy or MSM).
+ *
+ * Return 1 if it is the last observation message of an epoch
+ *	(synchronous GNSS / multiple message flag not set),
+ *	0 if it is an observation message followed by others for the same epoch,
+ *	-1 if it is not an observation message.
+ */
+int rtcm_frame_epoch_end(const unsigned char *d, size_t len) {
+	struct rtcm_frame frame;
+	rtcm_decode(d, len, &frame);
+	return frame.epoch_end;
+}
 
-	/* First, possibly incomplete, byte */
-	mask = 0xff>>bits_first;
-	r = d[offset_first] & mask;
+static void rtcm_msm_epoch_reset(struct rtcm_msm_epoch *this) {
+	memset(this, 0, sizeof *this);
+	this->epoch_ms = -1;
+}
 
-	if (offset_first == offset_last)
-		return r >> (8-beg-len);
+struct rtcm_info *rtcm_info_new() {
+	struct rtcm_info *this = (struct rtcm_info *)malloc(sizeof(struct rtcm_info));
+	if (this == NULL)
+		return NULL;
+	memset(this->types1k, 0, sizeof this->types1k);
+	memset(this->types4k, 0, sizeof this->types4k);
+	P_MUTEX_INIT(&this->replay_lock, NULL);
+	memset(this->replay_station, 0, sizeof this->replay_station);
+	memset(this->replay_ephemeris, 0, sizeof this->replay_ephemeris);
+	memset(this->replay_ephemeris_time, 0, sizeof this->replay_ephemeris_time);
+	this->replay_epoch_n = 0;
+	this->epoch_n = 0;
+	P_MUTEX_INIT(&this->stats_lock, NULL);
+	rtcm_msm_epoch_reset(&this->msm_epoch);
+	rtcm_msm_epoch_reset(&this->msm_last);
+	timerclear(&this->msm_last_date);
+	memset(this->type_stats, 0, sizeof this->type_stats);
+	gettimeofday(&this->rate_date, NULL);
+	this->msm_nepochs = 0;
+	this->msm_nepochs_incomplete = 0;
+	this->latency_ms = 0;
+	this->latency_avg_ms = 0;
+	this->dropped_bytes = 0;
+	return this;
+}
 
-	int offset = offset_first+1;
+static void rtcm_info_free_packets(struct packet **packets, int n) {
+	for (int i = 0; i < n; i++)
+		if (packets[i]) {
+			packet_free(packets[i]);
+			packets[i] = NULL;
+		}
+}
 
-	/* Process full bytes */
-	while (full_bytes--)
-		r = (r<<8) + d[offset++];
+void rtcm_info_free(struct rtcm_info *this) {
+	rtcm_info_free_packets(this->replay_station, RTCM_REPLAY_STATION);
+	for (int i = 0; i < RTCM_REPLAY_EPHEMERIS; i++)
+		rtcm_info_free_packets(this->replay_ephemeris[i], RTCM_REPLAY_SATELLITES);
+	rtcm_info_free_packets(this->replay_epoch, this->replay_epoch_n);
+	if (this->epoch_n > 0)
+		rtcm_info_free_packets(this->epoch, this->epoch_n);
+	P_MUTEX_DESTROY(&this->replay_lock);
+	P_MUTEX_DESTROY(&this->stats_lock);
+	free(this);
+}
 
-	/* Last, possibly incomplete, byte */
-	if (bits_last)
-		r = (r << bits_last) + (d[offset] >> (8-bits_last));
-	return r;
+/*
+ * Return the replay cache slot index for station and ephemeris messages,
+ * -1 for other types.
+ */
+static int rtcm_station_index(int type) {
+	switch(type) {
+	case 1005: return 0;
+	case 1006: return 1;
+	case 1033: return 2;
+	}
+	return -1;
+}
+static int rtcm_ephemeris_index(int type) {
+	switch(type) {
+	case 1019: return 0;	// GPS
+	case 1020: return 1;	// GLONASS
+	case 1042: return 2;	// BeiDou
+	case 1044: return 3;	// QZSS
+	case 1045: return 4;	// Galileo F/NAV
+	case 1046: return 5;	// Galileo I/NAV
+	}
+	return -1;
 }
 
 /*
- * Get and return a int38 as a long
+ * Maximum age in seconds of a cached ephemeris to be replayed, by
+ * rtcm_ephemeris_index(): about the update interval of the broadcast
+ * ephemeris, well within their validity period.
  */
-static inline long get_int38(unsigned char *d, int beg, int len) {
-	long r = getbits(d, beg, len);
-	if (r & (1L<<37)) r |= 0xffffffc000000000;
-	return r;
+static const int rtcm_ephemeris_max_age[RTCM_REPLAY_EPHEMERIS] = {
+	7200,	// GPS
+	1800,	// GLONASS
+	3600,	// BeiDou
+	3600,	// QZSS
+	3600,	// Galileo F/NAV
+	3600	// Galileo I/NAV
+};
+
+/*
+ * Replace a packet slot in the replay cache by a copy of a message,
+ * along with its MSM4 version if any.
+ */
+static int rtcm_info_cache_set(struct packet **slot, struct packet *packet) {
+	struct packet *p = packet_new(packet->datalen, packet->caster);
+	if (p == NULL)
+		return -1;
+	memcpy(p->data, packet->data, packet->datalen);
+	p->rtcm_type = packet->rtcm_type;
+	p->rtcm_epoch_end = packet->rtcm_epoch_end;
+	p->rtcm_epoch_ms = packet->rtcm_epoch_ms;
+	if (packet->msm4)
+		rtcm_info_cache_set(&p->msm4, packet->msm4);
+	if (*slot)
+		packet_free(*slot);
+	*slot = p;
+	return 0;
 }
 
 /*
- * Handle packet types 1005 and 1006.
+ * Update the replay cache with a received station, ephemeris
+ * or observation message.
+ *
+ * Required lock: stats_lock, replay_lock is taken after it
  */
-static void handle_1005_1006(struct ntrip_state *st, struct rtcm_info *rp, int type, unsigned char *d, int len) {
-	unsigned char *data = d+3;
-	long ecef_x, ecef_y, ecef_z;
+static void rtcm_frame_cache(struct rtcm_frame *frame, void *arg) {
+	struct rtcm_handler_arg *a = (struct rtcm_handler_arg *)arg;
+	struct rtcm_info *this = a->rp;
+	int i;
+
+	if (frame->desc == NULL)
+		return;
 
-	ecef_x = get_int38(data, 34, 38);
-	ecef_y = get_int38(data, 74, 38);
-	ecef_z = get_int38(data, 114, 38);
+	P_MUTEX_LOCK(&this->replay_lock);
+	if ((i = rtcm_station_index(frame->type)) >= 0)
+		rtcm_info_cache_set(&this->replay_station[i], a->packet);
+	else if ((i = rtcm_ephemeris_index(frame->type)) >= 0) {
+		int sat = frame->field[RTCM_F_SATELLITE];
+		if (rtcm_info_cache_set(&this->replay_ephemeris[i][sat], a->packet) == 0)
+			this->replay_ephemeris_time[i][sat] = a->now.tv_sec;
+	}
+	else if (frame->epoch_end >= 0) {
+		/*
+		 * Observation message: accumulate the current epoch,
+		 * and make it the cached one on its last message.
+		 */
+		if (this->epoch_n >= 0) {
+			if (this->epoch_n == RTCM_REPLAY_EPOCH_MAX) {
+				rtcm_info_free_packets(this->epoch, this->epoch_n);
+				this->epoch_n = -1;
+			} else {
+				this->epoch[this->epoch_n] = NULL;
+				if (rtcm_info_cache_set(&this->epoch[this->epoch_n], a->packet) == 0)
+					this->epoch_n++;
+			}
+		}
+		if (frame->epoch_end) {
+			if (this->epoch_n > 0) {
+				rtcm_info_free_packets(this->replay_epoch, this->replay_epoch_n);
+				memcpy(this->replay_epoch, this->epoch, this->epoch_n * sizeof(struct packet *));
+				this->replay_epoch_n = this->epoch_n;
+				this->replay_epoch_date = a->now;
+			}
+			this->epoch_n = 0;
+		}
+	}
+	P_MUTEX_UNLOCK(&this->replay_lock);
+}
 
-	if (type == 1005) {
-		gettimeofday(&rp->posdate, NULL);
-		rp->date1005 = rp->posdate;
-		memcpy(&rp->copy1005, d, sizeof(rp->copy1005));
-	} else if (type == 1006) {
-		gettimeofday(&rp->posdate, NULL);
-		rp->date1006 = rp->posdate;
-		memcpy(&rp->copy1006, d, sizeof(rp->copy1006));
+/*
+ * Return the size of cached packets once filtered.
+ *
+ * The packets are filtered through a copy of the filter, to leave its
+ * decimation state for the actual replay.
+ */
+static size_t rtcm_info_replay_size(struct packet **packets, int n, struct rtcm_filter *filter) {
+	struct rtcm_filter copy;
+	size_t len = 0;
+	if (filter) {
+		copy = *filter;
+		filter = &copy;
+	}
+	for (int i = 0; i < n; i++) {
+		struct packet *p = packets[i] ? rtcm_filter_select(filter, packets[i]) : NULL;
+		if (p)
+			len += p->datalen;
 	}
-	rp->x = ecef_x;
-	rp->y = ecef_y;
-	rp->z = ecef_z;
+	return len;
 }
 
-struct rtcm_info *rtcm_info_new() {
-	struct rtcm_info *this = (struct rtcm_info *)malloc(sizeof(struct rtcm_info));
-	if (this == NULL)
-		return NULL;
-	memset(this->types1k, 0, sizeof this->types1k);
-	memset(this->types4k, 0, sizeof this->types4k);
-	return this;
+/*
+ * Add cached packets to an output, skipping those which don't fit in
+ * max_len bytes, and ephemeris older than max_age seconds if times is
+ * not NULL.
+ */
+static size_t rtcm_info_replay_packets(struct packet **packets, int n, struct evbuffer *output, struct rtcm_filter *filter,
+	size_t max_len, time_t *times, time_t max_age, time_t now) {
+	size_t len = 0;
+	for (int i = 0; i < n; i++) {
+		if (packets[i] == NULL || (times && now - times[i] > max_age))
+			continue;
+		struct packet *p = rtcm_filter_select(filter, packets[i]);
+		if (p && len + p->datalen <= max_len && evbuffer_add(output, p->data, p->datalen) == 0)
+			len += p->datalen;
+	}
+	return len;
 }
 
-void rtcm_info_free(struct rtcm_info *this) {
-	free(this);
+/*
+ * Send the replay cache to a new subscriber, to speed up its first fix.
+ * The cached epoch and ephemeris are skipped if too old.
+ *
+ * At most max_len bytes are sent: station messages first, then as many
+ * ephemeris as possible while leaving room for the whole cached epoch,
+ * then the epoch if it fits.
+ *
+ * Return the number of bytes sent.
+ *
+ * Required lock: ntrip_state of the subscriber
+ */
+size_t rtcm_info_replay(struct rtcm_info *this, struct evbuffer *output, struct rtcm_filter *filter, size_t max_len) {
+	struct timeval now;
+	size_t len = 0;
+
+	gettimeofday(&now, NULL);
+
+	P_MUTEX_LOCK(&this->replay_lock);
+	len += rtcm_info_replay_packets(this->replay_station, RTCM_REPLAY_STATION, output, filter, max_len, NULL, 0, 0);
+	int send_epoch = now.tv_sec - this->replay_epoch_date.tv_sec <= RTCM_REPLAY_EPOCH_MAX_AGE;
+	size_t epoch_len = send_epoch ? rtcm_info_replay_size(this->replay_epoch, this->replay_epoch_n, filter) : 0;
+	if (len + epoch_len > max_len) {
+		send_epoch = 0;
+		epoch_len = 0;
+	}
+	for (int i = 0; i < RTCM_REPLAY_EPHEMERIS; i++)
+		len += rtcm_info_replay_packets(this->replay_ephemeris[i], RTCM_REPLAY_SATELLITES, output, filter,
+			max_len - epoch_len - len, this->replay_ephemeris_time[i], rtcm_ephemeris_max_age[i], now.tv_sec);
+	if (send_epoch)
+		len += rtcm_info_replay_packets(this->replay_epoch, this->replay_epoch_n, output, filter, epoch_len, NULL, 0, 0);
+	P_MUTEX_UNLOCK(&this->replay_lock);
+	return len;
 }
 
-static void handle_1006(struct ntrip_state *st, struct rtcm_info *rp, unsigned char *d, int len) {
-	handle_1005_1006(st, rp, 1006, d, len);
-	// d += 3;
-	// unsigned short antenna_height = getbits(d, 152, 16);
+/*
+ * Antenna reference point messages 1005 and 1006.
+ */
+static void rtcm_frame_position(struct rtcm_frame *frame, void *arg) {
+	struct rtcm_handler_arg *a = (struct rtcm_handler_arg *)arg;
+	struct rtcm_info *rp = a->rp;
+	struct packet *packet = a->packet;
+
+	if (frame->desc == NULL)
+		return;
+
+	if (frame->type == 1005 && packet->datalen == sizeof rp->copy1005) {
+		rp->date1005 = a->now;
+		memcpy(&rp->copy1005, packet->data, sizeof(rp->copy1005));
+	} else if (frame->type == 1006 && packet->datalen == sizeof rp->copy1006) {
+		rp->date1006 = a->now;
+		memcpy(&rp->copy1006, packet->data, sizeof(rp->copy1006));
+	} else
+		return;
+	rp->posdate = a->now;
+	rp->x = frame->field[RTCM_F_ECEF_X];
+	rp->y = frame->field[RTCM_F_ECEF_Y];
+	rp->z = frame->field[RTCM_F_ECEF_Z];
 }
 
 /*
- * Return a type bit in the type bitfields.
+ * Return a type bit in type bitfields.
  */
-static inline int rtcm_info_check_type(struct rtcm_info *this, int type) {
+static inline int rtcm_check_type(const char *types1k, const char *types4k, int type) {
 	if (type >= RTCM_1K_MIN && type <= RTCM_1K_MAX)
-		return this->types1k[(type-RTCM_1K_MIN)>>3] & (1<<((type-RTCM_1K_MIN)&7));
+		return types1k[(type-RTCM_1K_MIN)>>3] & (1<<((type-RTCM_1K_MIN)&7));
 	if (type >= RTCM_4K_MIN && type <= RTCM_4K_MAX)
-		return this->types4k[(type-RTCM_4K_MIN)>>3] & (1<<((type-RTCM_4K_MIN)&7));
+		return types4k[(type-RTCM_4K_MIN)>>3] & (1<<((type-RTCM_4K_MIN)&7));
 	return 0;
 }
 
 /*
- * Set a type bit in the type bitfields.
+ * Set a type bit in type bitfields.
  */
-static inline void rtcm_info_set_type(struct rtcm_info *this, int type) {
+static inline void rtcm_set_type(char *types1k, char *types4k, int type) {
 	if (type >= RTCM_1K_MIN && type <= RTCM_1K_MAX)
-		this->types1k[(type-RTCM_1K_MIN)>>3] |= (1<<(type&7));
+		types1k[(type-RTCM_1K_MIN)>>3] |= (1<<((type-RTCM_1K_MIN)&7));
 	else if (type >= RTCM_4K_MIN && type <= RTCM_4K_MAX)
-		this->types4k[(type-RTCM_4K_MIN)>>3] |= (1<<(type&7));
+		types4k[(type-RTCM_4K_MIN)>>3] |= (1<<((type-RTCM_4K_MIN)&7));
+}
+
+static inline int rtcm_info_check_type(struct rtcm_info *this, int type) {
+	return rtcm_check_type(this->types1k, this->types4k, type);
+}
+
+static inline void rtcm_info_set_type(struct rtcm_info *this, int type) {
+	rtcm_set_type(this->types1k, this->types4k, type);
+}
+
+/*
+ * Reverse of rtcm_type_index().
+ */
+static inline int rtcm_type_from_index(int i) {
+	if (i <= RTCM_1K_MAX-RTCM_1K_MIN)
+		return i + RTCM_1K_MIN;
+	return i - (RTCM_1K_MAX-RTCM_1K_MIN+1) + RTCM_4K_MIN;
+}
+
+/*
+ * Fold the counters received since the last update into the rate averages.
+ *
+ * Required lock: stats_lock
+ */
+static void rtcm_info_rate_update(struct rtcm_info *this, struct timeval *now) {
+	struct timeval dt;
+	timersub(now, &this->rate_date, &dt);
+	double elapsed = dt.tv_sec + dt.tv_usec / 1e6;
+	double alpha = 1 - exp(-elapsed / RTCM_RATE_TAU);
+
+	for (int i = 0; i < RTCM_NTYPES; i++) {
+		struct rtcm_type_stats *ts = &this->type_stats[i];
+		if (ts->count == 0)
+			continue;
+		ts->rate += alpha * (ts->tick_count / elapsed - ts->rate);
+		ts->byte_rate += alpha * (ts->tick_bytes / elapsed - ts->byte_rate);
+		ts->tick_count = 0;
+		ts->tick_bytes = 0;
+	}
+	this->rate_date = *now;
+}
+
+/*
+ * Account for a received message in the type statistics.
+ *
+ * Required lock: stats_lock
+ */
+static inline void rtcm_info_count_type(struct rtcm_info *this, int type, int len, struct timeval *now) {
+	int i = rtcm_type_index(type);
+	if (i >= 0) {
+		struct rtcm_type_stats *ts = &this->type_stats[i];
+		ts->count++;
+		ts->bytes += len;
+		ts->tick_count++;
+		ts->tick_bytes += len;
+	}
+	if (now->tv_sec - this->rate_date.tv_sec >= RTCM_RATE_INTERVAL)
+		rtcm_info_rate_update(this, now);
 }
 
+/*
+ * Create a filter passing everything.
+ */
+struct rtcm_filter *rtcm_filter_new() {
+	struct rtcm_filter *this = (struct rtcm_filter *)malloc(sizeof(struct rtcm_filter));
+	if (this == NULL)
+		return NULL;
+	memset(this, 0, sizeof(*this));
+	this->all_types = 1;
+	this->last_epoch_ms = -1;
+	return this;
+}
+
+/*
+ * Restrict a filter to a list of message types separated by ','.
+ * Return -1 if the list is invalid, or empty as it would filter out
+ * all RTCM messages.
+ */
+int rtcm_filter_set_types(struct rtcm_filter *this, const char *types) {
+	char types1k[sizeof this->types1k];
+	char types4k[sizeof this->types4k];
+	memset(types1k, 0, sizeof types1k);
+	memset(types4k, 0, sizeof types4k);
+
+	if (*types == '\0')
+		return -1;
+
+	const char *p = types;
+	while (*p) {
+		char *end;
+		long type = strtol(p, &end, 10);
+		if (end == p || (*end != ',' && *end != '\0')
+		    || !((type >= RTCM_1K_MIN && type <= RTCM_1K_MAX) || (type >= RTCM_4K_MIN && type <= RTCM_4K_MAX)))
+			return -1;
+		rtcm_set_type(types1k, types4k, type);
+		p = *end ? end+1 : end;
+	}
+	memcpy(this->types1k, types1k, sizeof types1k);
+	memcpy(this->types4k, types4k, sizeof types4k);
+	this->all_types = 0;
+	return 0;
+}
+
+void rtcm_filter_free(struct rtcm_filter *this) {
+	free(this);
+}
+
+/*
+ * Check whether a message type passes a filter.
+ * Data of unknown type (not RTCM, or bad checksum) always passes.
+ */
+int rtcm_filter_check(struct rtcm_filter *this, int type) {
+	return this == NULL || this->all_types || type < 0 || rtcm_check_type(this->types1k, this->types4k, type);
+}
+
+/*
+ * Check whether a packet is to be sent to a subscriber.
+ *
+ * On decimation, the decision is taken on the first observation message
+ * of each epoch from its epoch time, and applies to all the messages
+ * of the epoch. Other messages are not decimated.
+ *
+ * Required lock: ntrip_state of the subscriber
+ */
+int rtcm_filter_packet(struct rtcm_filter *this, struct packet *packet) {
+	if (this == NULL)
+		return 1;
+
+	int forward = 1;
+	if (this->decimation_ms && packet->rtcm_epoch_end >= 0) {
+		if (!this->in_epoch) {
+			long t = packet->rtcm_epoch_ms;
+			this->in_epoch = 1;
+			this->forward_epoch = t < 0 || this->last_epoch_ms < 0
+				|| (t - this->last_epoch_ms + RTCM_WEEK_MS) % RTCM_WEEK_MS >= this->decimation_ms;
+			if (this->forward_epoch && t >= 0)
+				this->last_epoch_ms = t;
+		}
+		forward = this->forward_epoch;
+		if (packet->rtcm_epoch_end)
+			this->in_epoch = 0;
+	}
+	return forward && rtcm_filter_check(this, packet->rtcm_type);
+}
+
+/*
+ * Return the packet to send to a subscriber for a received packet:
+ * the packet itself or its MSM4 version, or NULL if filtered out.
+ */
+struct packet *rtcm_filter_select(struct rtcm_filter *this, struct packet *packet) {
+	if (this && this->msm4 && packet->msm4)
+		packet = packet->msm4;
+	return rtcm_filter_packet(this, packet) ? packet : NULL;
+}
+
+static const char *rtcm_msm_gnss_names[RTCM_MSM_GNSS] = {
+	"GPS", "GLONASS", "Galileo", "SBAS", "QZSS", "BeiDou", "NavIC"
+};
+
 /*
  * Return a string list of marked RTCM types, separated by ',',
  * ended by '\0'
@@ -282,7 +568,9 @@ static char *rtcm_info_types(struct rtcm_info *this) {
  */
 json_object *rtcm_info_json(struct rtcm_info *this) {
 	json_object *j = json_object_new_object();
+	P_MUTEX_LOCK(&this->stats_lock);
 	char *types = rtcm_info_types(this);
+	P_MUTEX_UNLOCK(&this->stats_lock);
 	if (types) {
 		json_object_object_add(j, "types", json_object_new_string(types));
 	} else {
@@ -306,94 +594,776 @@ json_object *rtcm_info_json(struct rtcm_info *this) {
 		iso_date_from_timeval(iso_date, sizeof iso_date, &this->posdate);
 		json_object_object_add(jpos, "date", json_object_new_string(iso_date));
 	}
+
+	int nstation = 0, nephemeris = 0;
+	json_object *jreplay = json_object_new_object();
+	P_MUTEX_LOCK(&this->replay_lock);
+	for (int i = 0; i < RTCM_REPLAY_STATION; i++)
+		if (this->replay_station[i])
+			nstation++;
+	for (int i = 0; i < RTCM_REPLAY_EPHEMERIS; i++)
+		for (int sat = 0; sat < RTCM_REPLAY_SATELLITES; sat++)
+			if (this->replay_ephemeris[i][sat])
+				nephemeris++;
+	json_object_object_add(jreplay, "epoch", json_object_new_int(this->replay_epoch_n));
+	P_MUTEX_UNLOCK(&this->replay_lock);
+	json_object_object_add(jreplay, "station", json_object_new_int(nstation));
+	json_object_object_add(jreplay, "ephemeris", json_object_new_int(nephemeris));
+	json_object_object_add(j, "replay", jreplay);
+
+	struct timeval now, dt;
+	gettimeofday(&now, NULL);
+
+	P_MUTEX_LOCK(&this->stats_lock);
+
+	/*
+	 * Per type statistics. Rates are decayed for the time elapsed since
+	 * their last update, in case the source went quiet.
+	 */
+	timersub(&now, &this->rate_date, &dt);
+	double decay = exp(-(dt.tv_sec + dt.tv_usec / 1e6) / RTCM_RATE_TAU);
+	json_object *jstats = json_object_new_object();
+	for (int i = 0; i < RTCM_NTYPES; i++) {
+		struct rtcm_type_stats *ts = &this->type_stats[i];
+		if (ts->count == 0)
+			continue;
+		char type[8];
+		snprintf(type, sizeof type, "%d", rtcm_type_from_index(i));
+		json_object *jt = json_object_new_object();
+		json_object_object_add(jt, "count", json_object_new_int64(ts->count));
+		json_object_object_add(jt, "bytes", json_object_new_int64(ts->bytes));
+		json_object_object_add(jt, "rate", json_object_new_double(ts->rate * decay));
+		json_object_object_add(jt, "bitrate", json_object_new_double(ts->byte_rate * decay * 8));
+		json_object_object_add(jstats, type, jt);
+	}
+	json_object_object_add(j, "stats", jstats);
+
+	if (this->msm_nepochs) {
+		struct rtcm_msm_epoch *e = &this->msm_last;
+		json_object *jmsm = json_object_new_object();
+		json_object *jgnss = json_object_new_object();
+		int nsat = 0;
+		for (int i = 0; i < RTCM_MSM_GNSS; i++) {
+			if (!(e->gnss & (1 << i)))
+				continue;
+			json_object *jg = json_object_new_object();
+			json_object_object_add(jg, "satellites", json_object_new_int(e->nsat[i]));
+			json_object_object_add(jg, "signals", json_object_new_int(e->nsig[i]));
+			json_object_object_add(jg, "cells", json_object_new_int(e->ncell[i]));
+			json_object_object_add(jgnss, rtcm_msm_gnss_names[i], jg);
+			nsat += e->nsat[i];
+		}
+		char iso_date[30];
+		iso_date_from_timeval(iso_date, sizeof iso_date, &this->msm_last_date);
+		json_object_object_add(jmsm, "date", json_object_new_string(iso_date));
+		json_object_object_add(jmsm, "epoch_ms", json_object_new_int64(e->epoch_ms));
+		json_object_object_add(jmsm, "complete", json_object_new_boolean(e->complete));
+		json_object_object_add(jmsm, "messages", json_object_new_int(e->nmsg));
+		json_object_object_add(jmsm, "satellites", json_object_new_int(nsat));
+		json_object_object_add(jmsm, "gnss", jgnss);
+		json_object_object_add(jmsm, "epochs", json_object_new_int64(this->msm_nepochs));
+		json_object_object_add(jmsm, "incomplete_epochs", json_object_new_int64(this->msm_nepochs_incomplete));
+		if (e->epoch_ms >= 0) {
+			json_object_object_add(jmsm, "latency_ms", json_object_new_int64(this->latency_ms));
+			json_object_object_add(jmsm, "latency_avg_ms", json_object_new_int64(this->latency_avg_ms));
+		}
+		json_object_object_add(j, "msm", jmsm);
+	}
+	json_object_object_add(j, "dropped_bytes", json_object_new_int64(this->dropped_bytes));
+	P_MUTEX_UNLOCK(&this->stats_lock);
 	return j;
 }
 
-static void rtcm_handler(struct ntrip_state *st, unsigned char *d, int len, struct rtcm_info *rp) {
-	unsigned short type = getbits(d+3, 0, 12);
-	ntrip_log(st, LOG_DEBUG, "RTCM source %s size %d type %d", st->mountpoint, len, type);
+/*
+ * Set the RTCM fields of a packet from its decoded frame.
+ */
+static void rtcm_packet_set_frame(struct packet *packet, struct rtcm_frame *frame) {
+	packet->rtcm_type = frame->type;
+	packet->rtcm_epoch_end = frame->epoch_end;
+	packet->rtcm_epoch_ms = frame->epoch_ms;
+}
+
+/*
+ * Set the RTCM fields of a packet holding a RTCM frame.
+ */
+void rtcm_packet_set_info(struct packet *packet) {
+	struct rtcm_frame frame;
+	rtcm_decode(packet->data, packet->datalen, &frame);
+	rtcm_packet_set_frame(packet, &frame);
+}
+
+/*
+ * Decode the header of a MSM message.
+ *
+ * Return 0 on success, -1 if the frame is not a valid MSM message.
+ */
+int rtcm_msm_header_decode(const unsigned char *d, size_t len, struct rtcm_msm_header *h) {
+	struct rtcm_frame frame;
+	if (rtcm_decode(d, len, &frame) < 0 || !frame.is_msm)
+		return -1;
+	*h = frame.msm;
+	return 0;
+}
+
+/*
+ * Convert a MSM7 extended lock time indicator (DF407) to a MSM4
+ * lock time indicator (DF402), through the minimum lock time in ms.
+ */
+static int rtcm_msm_lock_time(int lti) {
+	long ms;
+	if (lti < 64)
+		ms = lti;
+	else if (lti <= 704) {
+		int n = (lti >> 5) - 1;
+		ms = (long)(lti - 32*n) << n;
+	} else
+		ms = 67108864;
+	if (ms < 32)
+		return 0;
+	int indicator = 63 - __builtin_clzl(ms) - 4;
+	return indicator > 15 ? 15 : indicator;
+}
+
+/*
+ * Transcode a MSM7 frame to MSM4: lower resolution pseudoranges,
+ * phase ranges, lock times and CNR, without the extended satellite
+ * information and the phase range rates.
+ *
+ * out must be at least len bytes long, the MSM4 frame being shorter.
+ *
+ * Return the length of the MSM4 frame, or -1 if d is not a valid MSM7 frame.
+ */
+static int _rtcm_msm7_to_msm4(struct rtcm_frame *frame, unsigned char *out) {
+	const unsigned char *data = frame->payload;
+	size_t dlen = frame->len+3;
+	unsigned char *odata = out+3;
+
+	if (!frame->is_msm || frame->msm.msm != 7)
+		return -1;
+
+	int ns = frame->msm.nsat, nc = frame->msm.ncell;
+	int hlen = frame->msm.hlen;
+	int sat = hlen, sig = hlen + 36*ns;
+	if (frame->len*8 < sig + 80*nc)
+		return -1;
+	int osig = hlen + 18*ns;
+	int olen = (osig + 48*nc + 7) >> 3;
+
+	memset(odata, 0, olen);
+
+	/* Header with the new message type */
+	for (int i = 12; i < hlen; i += 32)
+		rtcm_setbits(odata, i, hlen-i > 32 ? 32 : hlen-i, rtcm_bits(data, dlen, i, hlen-i > 32 ? 32 : hlen-i));
+	rtcm_setbits(odata, 0, 12, frame->type - 3);
+
+	/* Satellite data: rough ranges, integer and modulo 1 ms */
+	for (int i = 0; i < ns; i++) {
+		rtcm_setbits(odata, hlen + 8*i, 8, rtcm_bits(data, dlen, sat + 8*i, 8));
+		rtcm_setbits(odata, hlen + 8*ns + 10*i, 10, rtcm_bits(data, dlen, sat + 12*ns + 10*i, 10));
+	}
+
+	/* Signal data */
+	for (int i = 0; i < nc; i++) {
+		long pr = rtcm_sbits(data, dlen, sig + 20*i, 20);
+		long cp = rtcm_sbits(data, dlen, sig + 20*nc + 24*i, 24);
+		int lti = rtcm_bits(data, dlen, sig + 44*nc + 10*i, 10);
+		int half = rtcm_bits(data, dlen, sig + 54*nc + i, 1);
+		int cnr = rtcm_bits(data, dlen, sig + 55*nc + 10*i, 10);
+
+		/* Fine pseudorange, 2^-29 to 2^-24 ms, keeping the invalid value */
+		if (pr == -(1L<<19))
+			pr = -(1L<<14);
+		else {
+			pr = (pr + 16) >> 5;
+			if (pr > (1L<<14)-1)
+				pr = (1L<<14)-1;
+		}
+		/* Fine phase range, 2^-31 to 2^-29 ms */
+		if (cp == -(1L<<23))
+			cp = -(1L<<21);
+		else {
+			cp = (cp + 2) >> 2;
+			if (cp > (1L<<21)-1)
+				cp = (1L<<21)-1;
+		}
+		/* CNR, 2^-4 to 1 dB-Hz */
+		cnr = (cnr + 8) >> 4;
+		if (cnr > 63)
+			cnr = 63;
+
+		rtcm_setbits(odata, osig + 15*i, 15, pr);
+		rtcm_setbits(odata, osig + 15*nc + 22*i, 22, cp);
+		rtcm_setbits(odata, osig + 37*nc + 4*i, 4, rtcm_msm_lock_time(lti));
+		rtcm_setbits(odata, osig + 41*nc + i, 1, half);
+		rtcm_setbits(odata, osig + 42*nc + 6*i, 6, cnr);
+	}
+
+	out[0] = 0xd3;
+	out[1] = olen >> 8;
+	out[2] = olen & 0xff;
+	unsigned long crc = crc24q_hash(out, olen+3);
+	out[olen+3] = crc >> 16;
+	out[olen+4] = crc >> 8;
+	out[olen+5] = crc;
+	return olen+6;
+}
+
+int rtcm_msm7_to_msm4(const unsigned char *d, size_t len, unsigned char *out) {
+	struct rtcm_frame frame;
+	if (rtcm_decode(d, len, &frame) < 0)
+		return -1;
+	return _rtcm_msm7_to_msm4(&frame, out);
+}
+
+/*
+ * Attach its MSM4 version to a packet holding a MSM7 frame.
+ */
+static void rtcm_packet_transcode(struct packet *packet, struct rtcm_frame *frame) {
+	if (!frame->is_msm || frame->msm.msm != 7)
+		return;
+	struct packet *msm4 = packet_new(packet->datalen, packet->caster);
+	if (msm4 == NULL)
+		return;
+	int len = _rtcm_msm7_to_msm4(frame, msm4->data);
+	if (len < 0) {
+		packet_free(msm4);
+		return;
+	}
+	msm4->datalen = len;
+	rtcm_packet_set_info(msm4);
+	packet->msm4 = msm4;
+}
+
+/*
+ * Return the current time in milliseconds of the GPS week.
+ */
+static long rtcm_gps_week_ms(struct timeval *t) {
+	long ms = (t->tv_sec - RTCM_GPS_EPOCH_UNIX) % (RTCM_WEEK_MS/1000) * 1000 + t->tv_usec / 1000 + RTCM_LEAP_MS;
+	return ms % RTCM_WEEK_MS;
+}
+
+/*
+ * End the MSM epoch being received, and compute its metrics.
+ *
+ * Required lock: stats_lock
+ */
+static void rtcm_info_msm_epoch_end(struct rtcm_info *this, struct timeval *now, int complete) {
+	struct rtcm_msm_epoch *e = &this->msm_epoch;
+
+	/* A GNSS missing compared to the previous epoch makes it incomplete */
+	if (this->msm_nepochs && (this->msm_last.gnss & ~e->gnss))
+		complete = 0;
+	e->complete = complete;
+
+	this->msm_nepochs++;
+	if (!complete)
+		this->msm_nepochs_incomplete++;
+
+	if (e->epoch_ms >= 0) {
+		/* Wall clock minus epoch time, modulo a week */
+		long latency = rtcm_gps_week_ms(now) - e->epoch_ms;
+		if (latency > RTCM_WEEK_MS/2)
+			latency -= RTCM_WEEK_MS;
+		else if (latency < -RTCM_WEEK_MS/2)
+			latency += RTCM_WEEK_MS;
+		this->latency_avg_ms = this->msm_last.epoch_ms < 0 ? latency : (this->latency_avg_ms*7 + latency)/8;
+		this->latency_ms = latency;
+	}
+
+	this->msm_last = *e;
+	this->msm_last_date = *now;
+	rtcm_msm_epoch_reset(e);
+}
+
+/*
+ * Update MSM epoch metrics with a received MSM message.
+ *
+ * Required lock: stats_lock
+ */
+static void rtcm_frame_msm(struct rtcm_frame *frame, void *arg) {
+	struct rtcm_handler_arg *a = (struct rtcm_handler_arg *)arg;
+	struct rtcm_info *this = a->rp;
+	struct rtcm_msm_epoch *e = &this->msm_epoch;
+	struct rtcm_msm_header *h = &frame->msm;
+
+	if (!frame->is_msm)
+		return;
+
+	/* New epoch before the end of the current one */
+	if (e->nmsg && e->epoch_ms != h->epoch_ms)
+		rtcm_info_msm_epoch_end(this, &a->now, 0);
+
+	e->epoch_ms = h->epoch_ms;
+	e->gnss |= 1 << h->gnss;
+	e->nmsg++;
+	e->nsat[h->gnss] = h->nsat;
+	e->nsig[h->gnss] = h->nsig;
+	e->ncell[h->gnss] = h->ncell;
+
+	if (!h->mmb)
+		rtcm_info_msm_epoch_end(this, &a->now, 1);
+}
+
+/*
+ * Update type bit fields and statistics, for all messages.
+ *
+ * Required lock: stats_lock
+ */
+static void rtcm_frame_stats(struct rtcm_frame *frame, void *arg) {
+	struct rtcm_handler_arg *a = (struct rtcm_handler_arg *)arg;
+	rtcm_info_set_type(a->rp, frame->type);
+	rtcm_info_count_type(a->rp, frame->type, a->packet->datalen, &a->now);
+}
+
+static void rtcm_register_handlers() {
+	static const int station_types[] = {1005, 1006, 1033};
+	static const int ephemeris_types[] = {1019, 1020, 1042, 1044, 1045, 1046};
+
+	rtcm_decode_register(-1, rtcm_frame_stats);
+	for (int i = 0; i < sizeof station_types / sizeof station_types[0]; i++)
+		rtcm_decode_register(station_types[i], rtcm_frame_cache);
+	for (int i = 0; i < sizeof ephemeris_types / sizeof ephemeris_types[0]; i++)
+		rtcm_decode_register(ephemeris_types[i], rtcm_frame_cache);
+	rtcm_decode_register(1005, rtcm_frame_position);
+	rtcm_decode_register(1006, rtcm_frame_position);
+	for (int type = 1001; type <= 1012; type++)
+		if (type <= 1004 || type >= 1009)
+			rtcm_decode_register(type, rtcm_frame_cache);
+	for (int type = 1071; type <= 1137; type++)
+		if (type % 10 >= 1 && type % 10 <= 7) {
+			rtcm_decode_register(type, rtcm_frame_msm);
+			rtcm_decode_register(type, rtcm_frame_cache);
+		}
+}
+
+/*
+ * Register the RTCM cache handlers in the decoder.
+ */
+void rtcm_init() {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, rtcm_register_handlers);
+}
+
+/*
+ * Run the handlers of a received frame, decoded once.
+ */
+static void rtcm_handler(struct ntrip_state *st, struct packet *packet, struct rtcm_frame *frame, struct rtcm_info *rp) {
+	ntrip_log(st, LOG_DEBUG, "RTCM source %s size %zd type %d", st->mountpoint, packet->datalen, frame->type);
 
 	if (!rp)
 		return;
 
-	rtcm_info_set_type(rp, type);
+	struct rtcm_handler_arg arg;
+	arg.st = st;
+	arg.rp = rp;
+	arg.packet = packet;
+	gettimeofday(&arg.now, NULL);
+
+	/* Handlers run under stats_lock, see the lock order in struct rtcm_info */
+	P_MUTEX_LOCK(&rp->stats_lock);
+	rtcm_decode_dispatch(frame, &arg);
+	P_MUTEX_UNLOCK(&rp->stats_lock);
+}
+
+/*
+ * Return a pointer to len bytes at pos in an evbuffer, without
+ * flattening it: in place if they are contiguous, else copied to tmp.
+ * Return NULL if the buffer is too short.
+ */
+static const unsigned char *rtcm_evbuffer_get(struct evbuffer *buf, struct evbuffer_ptr *pos, size_t len, unsigned char *tmp) {
+	struct evbuffer_iovec v;
+	if (evbuffer_peek(buf, len, pos, &v, 1) < 1)
+		return NULL;
+	if (v.iov_len >= len)
+		return (const unsigned char *)v.iov_base;
+	if (evbuffer_copyout_from(buf, pos, tmp, len) != len)
+		return NULL;
+	return tmp;
+}
+
+/*
+ * Read the frame at pos in an evbuffer.
+ * Return it, and its length in *flen, or NULL if there is no complete
+ * frame there.
+ */
+static const unsigned char *rtcm_evbuffer_frame(struct evbuffer *buf, struct evbuffer_ptr *pos, size_t *flen, unsigned char *tmp) {
+	const unsigned char *d = rtcm_evbuffer_get(buf, pos, 3, tmp);
+	if (d == NULL || d[0] != 0xd3)
+		return NULL;
+	*flen = (d[1] & 3)*256 + d[2] + 6;
+	return rtcm_evbuffer_get(buf, pos, *flen, tmp);
+}
+
+/*
+ * Find the next valid RTCM frame (correct length and CRC) in an evbuffer.
+ * Return its offset, or -1 if none.
+ */
+static long rtcm_frame_find(struct evbuffer *buf) {
+	unsigned char tmp[1029];
+	struct evbuffer_ptr pos = evbuffer_search(buf, "\xd3", 1, NULL);
+	while (pos.pos >= 0) {
+		size_t flen;
+		const unsigned char *d = rtcm_evbuffer_frame(buf, &pos, &flen, tmp);
+		if (d) {
+			unsigned long crc = crc24q_hash((unsigned char *)d, flen-3);
+			if (crc == (d[flen-3]<<16)+(d[flen-2]<<8)+d[flen-1])
+				return pos.pos;
+		}
+		if (evbuffer_ptr_set(buf, &pos, 1, EVBUFFER_PTR_ADD) < 0)
+			break;
+		pos = evbuffer_search(buf, "\xd3", 1, &pos);
+	}
+	return -1;
+}
+
+/*
+ * Compact a subscriber backlog: drop the queued frames older than the
+ * newest complete epoch, except the last station description messages
+ * (1005, 1006, 1033).
+ *
+ * A partially sent frame at the start of the buffer, and trailing data
+ * that can't be parsed, are kept as they are.
+ *
+ * The buffer is walked in place, frames are only copied when they span
+ * several chains.
+ *
+ * Return the number of frames dropped, or -1 if the backlog does not
+ * contain a complete RTCM epoch.
+ */
+long rtcm_backlog_compact(struct evbuffer *output) {
+	unsigned char tmp[1029];
+	size_t len = evbuffer_get_length(output);
+
+	long start = rtcm_frame_find(output);
+	if (start < 0)
+		return -1;
+
+	/*
+	 * List consecutive frames with their length, type and epoch end flag
+	 */
+	int nframes = 0;
+	int maxframes = (len - start) / 6;
+	struct {
+		size_t len;
+		int type;
+		char epoch_end, keep;
+	} *frames = malloc(sizeof(*frames) * maxframes);
+	if (frames == NULL)
+		return -1;
+
+	struct evbuffer_ptr pos;
+	evbuffer_ptr_set(output, &pos, start, EVBUFFER_PTR_SET);
+	while (nframes < maxframes) {
+		size_t flen;
+		const unsigned char *d = rtcm_evbuffer_frame(output, &pos, &flen, tmp);
+		if (d == NULL)
+			break;
+		frames[nframes].len = flen;
+		frames[nframes].type = rtcm_frame_type(d, flen);
+		frames[nframes].epoch_end = rtcm_frame_epoch_end(d, flen) == 1;
+		nframes++;
+		if (evbuffer_ptr_set(output, &pos, flen, EVBUFFER_PTR_ADD) < 0)
+			break;
+	}
+
+	/*
+	 * Find the end of the epoch before the newest complete one:
+	 * frames up to this one are stale.
+	 */
+	int last_stale = -1;
+	int nends = 0;
+	for (int i = nframes - 1; i >= 0; i--)
+		if (frames[i].epoch_end && ++nends == 2) {
+			last_stale = i;
+			break;
+		}
+	if (last_stale < 0) {
+		free(frames);
+		return -1;
+	}
+
+	/*
+	 * Keep only the last station message of each type.
+	 */
+	int station_seen[RTCM_REPLAY_STATION] = {0};
+	for (int i = nframes - 1; i >= 0; i--) {
+		int j = rtcm_station_index(frames[i].type);
+		frames[i].keep = j >= 0 && !station_seen[j];
+		if (j >= 0)
+			station_seen[j] = 1;
+	}
+
+	struct evbuffer *kept = evbuffer_new();
+	if (kept == NULL) {
+		free(frames);
+		return -1;
+	}
+
+	/*
+	 * Move the kept head of the buffer aside, drain the stale frames,
+	 * then put the head back in front.
+	 */
+	long dropped = 0;
+	evbuffer_remove_buffer(output, kept, start);
+	for (int i = 0; i <= last_stale; i++) {
+		if (frames[i].keep)
+			evbuffer_remove_buffer(output, kept, frames[i].len);
+		else {
+			evbuffer_drain(output, frames[i].len);
+			dropped++;
+		}
+	}
+	free(frames);
+	evbuffer_prepend_buffer(output, kept);
+	evbuffer_free(kept);
+	return dropped;
+}
+
+/*
+ * Send the packets collected by rtcm_packet_handle() and release them.
+ */
+static void rtcm_send_batch(struct ntrip_state *st, struct packet **batch, int *nbatch) {
+	if (*nbatch == 0)
+		return;
+	if (livesource_send_subscribers_batch(st->own_livesource, batch, *nbatch, st->caster))
+		st->last_send = time(NULL);
+	for (int i = 0; i < *nbatch; i++)
+		packet_free(batch[i]);
+	*nbatch = 0;
+}
+
+/*
+ * Read cursor over the iovecs of an evbuffer, to parse frames without
+ * linearizing the buffer.
+ */
+struct rtcm_cursor {
+	struct evbuffer_iovec *v;
+	int n;
+	int i;			// current iovec
+	size_t off;		// offset in the current iovec
+	size_t pos;		// position from the start of the buffer
+	size_t len;		// total length
+};
 
-	if (type == 1005 && len == 25)
-		handle_1005_1006(st, rp, 1005, d, len);
-	else if (type == 1006 && len == 27)
-		handle_1006(st, rp, d, len);
+/*
+ * Return the byte at a given distance ahead of the cursor, or -1 if beyond the end.
+ */
+static int rtcm_cursor_peek(struct rtcm_cursor *this, size_t ahead) {
+	if (this->pos + ahead >= this->len)
+		return -1;
+	int i = this->i;
+	size_t off = this->off + ahead;
+	while (off >= this->v[i].iov_len) {
+		off -= this->v[i].iov_len;
+		i++;
+	}
+	return ((unsigned char *)this->v[i].iov_base)[off];
+}
+
+static void rtcm_cursor_advance(struct rtcm_cursor *this, size_t n) {
+	this->pos += n;
+	n += this->off;
+	while (this->i < this->n && n >= this->v[this->i].iov_len) {
+		n -= this->v[this->i].iov_len;
+		this->i++;
+	}
+	this->off = n;
+}
+
+/*
+ * Return the position of the next byte c from the cursor, -1 if none.
+ */
+static long rtcm_cursor_find(struct rtcm_cursor *this, unsigned char c) {
+	size_t pos = this->pos - this->off;
+	size_t off = this->off;
+	for (int i = this->i; i < this->n; i++) {
+		unsigned char *base = (unsigned char *)this->v[i].iov_base;
+		unsigned char *found = memchr(base + off, c, this->v[i].iov_len - off);
+		if (found)
+			return pos + (found - base);
+		pos += this->v[i].iov_len;
+		off = 0;
+	}
+	return -1;
+}
+
+/*
+ * Copy n bytes from the cursor and move past them.
+ * Return the CRC24Q of the first crclen bytes.
+ */
+static unsigned long rtcm_cursor_copy(struct rtcm_cursor *this, unsigned char *dst, size_t n, size_t crclen) {
+	unsigned long crc = 0;
+	while (n) {
+		unsigned char *src = (unsigned char *)this->v[this->i].iov_base + this->off;
+		size_t len = this->v[this->i].iov_len - this->off;
+		if (len > n)
+			len = n;
+		memcpy(dst, src, len);
+		if (crclen) {
+			size_t l = len < crclen ? len : crclen;
+			crc = crc24q_update(crc, src, l);
+			crclen -= l;
+		}
+		dst += len;
+		n -= len;
+		rtcm_cursor_advance(this, len);
+	}
+	return crc;
+}
+
+#define	RTCM_PEEK_IOVECS	32
+
+/*
+ * Account for data dropped outside valid RTCM frames.
+ *
+ * Dropped data is received data too: received minus dropped bytes
+ * is what was forwarded.
+ */
+static void rtcm_dropped(struct ntrip_state *st, size_t len) {
+	struct rtcm_info *rp = st->rtcm_info;
+	st->received_bytes += len;
+	st->dropped_bytes += len;
+	if (rp) {
+		P_MUTEX_LOCK(&rp->stats_lock);
+		rp->dropped_bytes += len;
+		P_MUTEX_UNLOCK(&rp->stats_lock);
+	}
 }
 
 /*
  * Handle receipt and retransmission of all complete RTCM packets.
+ *
+ * Frames are parsed and copied to packets straight from the input buffer
+ * chains, which is then drained once.
+ *
+ * Packets are retransmitted in batches, to lock each subscriber only once
+ * for all the packets received in a read callback.
+ *
+ * In strict mode, frames with a bad CRC and data outside frames are
+ * dropped. After a bad frame, the search for the next header restarts
+ * right after the false 0xd3 match.
+ *
  * Return 0 if more data is needed,
  *	1 if at least one packet has been processed.
  */
 int rtcm_packet_handle(struct ntrip_state *st) {
-	unsigned short len_rtcm;
-	struct evbuffer_ptr p;
 	struct evbuffer *input = st->input;
+	struct packet *batch[LIVESOURCE_SEND_BATCH];
+	struct evbuffer_iovec iov_local[RTCM_PEEK_IOVECS];
+	struct rtcm_cursor c;
+	int strict = st->caster->config->rtcm_strict;
+	size_t dropped = 0;
+	int nbatch = 0;
 	int r = 0;
 
-	while (1) {
+	c.n = evbuffer_peek(input, -1, NULL, NULL, 0);
+	c.v = iov_local;
+	if (c.n > RTCM_PEEK_IOVECS) {
+		c.v = (struct evbuffer_iovec *)malloc(c.n * sizeof(struct evbuffer_iovec));
+		if (c.v == NULL) {
+			ntrip_log(st, LOG_CRIT, "RTCM: Not enough memory, waiting");
+			return 0;
+		}
+	}
+	c.n = evbuffer_peek(input, -1, NULL, c.v, c.n);
+	c.i = 0;
+	c.off = 0;
+	c.pos = 0;
+	c.len = evbuffer_get_length(input);
+
+	while (c.pos < c.len) {
+		if (nbatch == LIVESOURCE_SEND_BATCH)
+			rtcm_send_batch(st, batch, &nbatch);
+
 		/*
 		 * Look for 0xd3 header byte
 		 */
-		evbuffer_ptr_set(input, &p, 0, EVBUFFER_PTR_SET);
-		p = evbuffer_search(input, "\xd3", 1, &p);
-		if (p.pos < 0) {
-			unsigned long len = evbuffer_get_length(input);
-			if (len) {
-				struct packet *not_rtcmp = packet_new(len, st->caster);
-				evbuffer_remove(input, not_rtcmp->data, len);
-				st->received_bytes += len;
-				ntrip_log(st, LOG_INFO, "resending %zd bytes", len);
-				if (livesource_send_subscribers(st->own_livesource, not_rtcmp, st->caster))
-					st->last_send = time(NULL);
-				r = 1;
-				packet_free(not_rtcmp);
+		long start = rtcm_cursor_find(&c, 0xd3);
+		if (start < 0 && strict) {
+			ntrip_log(st, LOG_DEBUG, "RTCM: no packet start, dropping %zd bytes", c.len - c.pos);
+			dropped += c.len - c.pos;
+			rtcm_cursor_advance(&c, c.len - c.pos);
+			continue;
+		}
+		if (start < 0) {
+			size_t len = c.len - c.pos;
+			struct packet *not_rtcmp = packet_new(len, st->caster);
+			st->received_bytes += len;
+			if (not_rtcmp == NULL) {
+				rtcm_cursor_advance(&c, len);
+				ntrip_log(st, LOG_CRIT, "RTCM: Not enough memory, dropping %zd bytes", len);
 				continue;
 			}
-			return r;
+			rtcm_cursor_copy(&c, not_rtcmp->data, len, 0);
+			ntrip_log(st, LOG_INFO, "resending %zd bytes", len);
+			batch[nbatch++] = not_rtcmp;
+			r = 1;
+			continue;
 		}
-		if (p.pos > 0) {
-			ntrip_log(st, LOG_DEBUG, "RTCM: found packet start, draining %zd bytes", p.pos);
-			evbuffer_drain(input, p.pos);
-		}
-
-		unsigned char *mem = evbuffer_pullup(input, 3);
-		if (mem == NULL) {
-			ntrip_log(st, LOG_DEBUG, "RTCM: not enough data, waiting");
-			return r;
+		if (start > c.pos) {
+			ntrip_log(st, LOG_DEBUG, "RTCM: found packet start, draining %zd bytes", start - c.pos);
+			dropped += start - c.pos;
+			rtcm_cursor_advance(&c, start - c.pos);
 		}
 
 		/*
 		 * Compute RTCM length from packet header
 		 */
-		len_rtcm = (mem[1] & 3)*256 + mem[2] + 6;
-		if (len_rtcm > evbuffer_get_length(input)) {
-			return r;
+		int len_hi = rtcm_cursor_peek(&c, 1);
+		int len_lo = rtcm_cursor_peek(&c, 2);
+		if (len_lo < 0) {
+			ntrip_log(st, LOG_DEBUG, "RTCM: not enough data, waiting");
+			break;
 		}
+		if (strict && (len_hi & 0xfc)) {
+			/* Reserved bits set: not a frame header */
+			dropped++;
+			rtcm_cursor_advance(&c, 1);
+			continue;
+		}
+		unsigned short len_rtcm = (len_hi & 3)*256 + len_lo + 6;
+		if (len_rtcm > c.len - c.pos)
+			break;
 
+		struct rtcm_cursor frame_start = c;
 		struct packet *rtcmp = packet_new(len_rtcm, st->caster);
-		st->received_bytes += len_rtcm;
 		if (rtcmp == NULL) {
-			evbuffer_drain(input, len_rtcm);
+			st->received_bytes += len_rtcm;
+			rtcm_cursor_advance(&c, len_rtcm);
 			ntrip_log(st, LOG_CRIT, "RTCM: Not enough memory, dropping packet");
 			continue;
 		}
 
-		evbuffer_remove(input, &rtcmp->data[0], len_rtcm);
-		unsigned long crc = rtcm_crc24q_hash(&rtcmp->data[0], len_rtcm-3);
+		unsigned long crc = rtcm_cursor_copy(&c, &rtcmp->data[0], len_rtcm, len_rtcm-3);
 		if (crc == (rtcmp->data[len_rtcm-3]<<16)+(rtcmp->data[len_rtcm-2]<<8)+rtcmp->data[len_rtcm-1]) {
-			rtcm_handler(st, rtcmp->data, len_rtcm, st->rtcm_info);
+			struct rtcm_frame frame;
+			rtcm_decode(rtcmp->data, len_rtcm, &frame);
+			rtcm_packet_set_frame(rtcmp, &frame);
+			if (st->caster->config->msm4_transcoding)
+				rtcm_packet_transcode(rtcmp, &frame);
+			rtcm_handler(st, rtcmp, &frame, st->rtcm_info);
+		} else if (strict) {
+			/* Maybe a false header match: resynchronize just after it */
+			ntrip_log(st, LOG_INFO, "RTCM: bad checksum, resynchronizing");
+			packet_free(rtcmp);
+			c = frame_start;
+			rtcm_cursor_advance(&c, 1);
+			dropped++;
+			continue;
 		} else {
 			ntrip_log(st, LOG_INFO, "RTCM: bad checksum! %08lx %08x", crc, (rtcmp->data[len_rtcm-3]<<16)+(rtcmp->data[len_rtcm-2]<<8)+rtcmp->data[len_rtcm-1]);
 		}
 
-		if (livesource_send_subscribers(st->own_livesource, rtcmp, st->caster))
-			st->last_send = time(NULL);
-		packet_free(rtcmp);
+		st->received_bytes += len_rtcm;
+		batch[nbatch++] = rtcmp;
 		r = 1;
 	}
+
+	if (c.v != iov_local)
+		free(c.v);
+	if (dropped)
+		rtcm_dropped(st, dropped);
+	evbuffer_drain(input, c.pos);
+	rtcm_send_batch(st, batch, &nbatch);
+	return r;
 }
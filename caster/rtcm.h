@@ -3,14 +3,58 @@
 
 #include <sys/time.h>
 
+#include <event2/buffer.h>
 #include <json-c/json.h>
 
+#include "conf.h"
+#include "rtcm_decode.h"
+
 struct ntrip_state;
+struct packet;
+
+/* Number of station message types kept in the replay cache */
+#define	RTCM_REPLAY_STATION	3
+/* Number of ephemeris message types kept in the replay cache, and satellites per type */
+#define	RTCM_REPLAY_EPHEMERIS	6
+#define	RTCM_REPLAY_SATELLITES	64
+/* Maximum number of messages in a cached observation epoch */
+#define	RTCM_REPLAY_EPOCH_MAX	32
+/* Maximum age in seconds of a cached observation epoch to be replayed */
+#define	RTCM_REPLAY_EPOCH_MAX_AGE	5
+
+/* Time constant in seconds of the message rate averages, and update interval */
+#define	RTCM_RATE_TAU		10
+#define	RTCM_RATE_INTERVAL	1
+
+/* Unix time of the GPS time origin, 1980-01-06 */
+#define	RTCM_GPS_EPOCH_UNIX	315964800L
 
-#define	RTCM_1K_MIN	1000
-#define	RTCM_1K_MAX	1230
-#define	RTCM_4K_MIN	4000
-#define	RTCM_4K_MAX	4095
+/*
+ * Per message type statistics.
+ */
+struct rtcm_type_stats {
+	unsigned long count;
+	unsigned long bytes;
+	/* Counters since the last rate update */
+	unsigned int tick_count;
+	unsigned int tick_bytes;
+	/* Exponentially weighted moving averages, per second */
+	float rate;
+	float byte_rate;
+};
+
+/*
+ * Statistics on an observation epoch made of MSM messages.
+ */
+struct rtcm_msm_epoch {
+	long epoch_ms;		// -1 if none
+	int gnss;		// bit field of received GNSS
+	int nmsg;
+	int complete;		// ended by a message without the multiple message bit
+	int nsat[RTCM_MSM_GNSS];
+	int nsig[RTCM_MSM_GNSS];
+	int ncell[RTCM_MSM_GNSS];
+};
 
 struct rtcm_info {
 	// ECEF coordinates for a base, in tenths of millimeters
@@ -22,11 +66,94 @@ struct rtcm_info {
 	char copy1005[25];
 	char copy1006[27];
 	struct timeval date1005, date1006, posdate;
+
+	/*
+	 * First-fix replay cache, sent to new subscribers: last station
+	 * messages, last ephemeris for each satellite, and last complete
+	 * observation epoch.
+	 *
+	 * replay_lock is a leaf lock protecting the cache.
+	 */
+	P_MUTEX_T replay_lock;
+	struct packet *replay_station[RTCM_REPLAY_STATION];
+	struct packet *replay_ephemeris[RTCM_REPLAY_EPHEMERIS][RTCM_REPLAY_SATELLITES];
+	time_t replay_ephemeris_time[RTCM_REPLAY_EPHEMERIS][RTCM_REPLAY_SATELLITES];
+	struct packet *replay_epoch[RTCM_REPLAY_EPOCH_MAX];
+	int replay_epoch_n;
+	struct timeval replay_epoch_date;
+	/* Epoch being received, -1 if too large to be cached */
+	struct packet *epoch[RTCM_REPLAY_EPOCH_MAX];
+	int epoch_n;
+
+	/*
+	 * Per type statistics, and MSM epoch metrics to spot slow upstream
+	 * links and overloaded bases.
+	 *
+	 * stats_lock protects them. The decoder handlers all run under it,
+	 * including the replay cache update: lock order is stats_lock,
+	 * then replay_lock.
+	 */
+	P_MUTEX_T stats_lock;
+	struct rtcm_type_stats type_stats[RTCM_NTYPES];
+	struct timeval rate_date;		// last rate update
+	struct rtcm_msm_epoch msm_epoch;	// epoch being received
+	struct rtcm_msm_epoch msm_last;		// last finished epoch
+	struct timeval msm_last_date;		// reception date of msm_last
+	unsigned long msm_nepochs;
+	unsigned long msm_nepochs_incomplete;
+	long latency_ms;			// ingest latency of the last epoch
+	long latency_avg_ms;			// exponentially weighted average
+	unsigned long long dropped_bytes;	// data dropped outside valid frames
+};
+
+/*
+ * Station description messages: antenna reference point and descriptors.
+ */
+static inline int rtcm_type_is_station(int type) {
+	return type == 1005 || type == 1006 || type == 1033;
+}
+
+/*
+ * Per-subscriber filter on RTCM message types and observation rate.
+ *
+ * Protected by the subscriber ntrip_state lock.
+ */
+struct rtcm_filter {
+	/* bit fields of accepted types, same layout as in struct rtcm_info */
+	int all_types;
+	char types1k[(RTCM_1K_MAX-RTCM_1K_MIN+8)>>3];
+	char types4k[(RTCM_4K_MAX-RTCM_4K_MIN+8)>>3];
+
+	/*
+	 * Decimation: minimum interval between forwarded observation epochs,
+	 * 0 to forward all of them.
+	 */
+	long decimation_ms;
+	int in_epoch;			// in an epoch, forwarded or not
+	int forward_epoch;		// forward the current epoch
+	long last_epoch_ms;		// epoch time of the last forwarded epoch, -1 if none
+
+	/* Send MSM7 messages transcoded to MSM4, when available */
+	int msm4;
 };
 
+void rtcm_init();
 struct rtcm_info *rtcm_info_new();
 void rtcm_info_free(struct rtcm_info *this);
+size_t rtcm_info_replay(struct rtcm_info *this, struct evbuffer *output, struct rtcm_filter *filter, size_t max_len);
+void rtcm_packet_set_info(struct packet *packet);
+struct rtcm_filter *rtcm_filter_new();
+int rtcm_filter_set_types(struct rtcm_filter *this, const char *types);
+void rtcm_filter_free(struct rtcm_filter *this);
+int rtcm_filter_check(struct rtcm_filter *this, int type);
+int rtcm_filter_packet(struct rtcm_filter *this, struct packet *packet);
+struct packet *rtcm_filter_select(struct rtcm_filter *this, struct packet *packet);
 json_object *rtcm_info_json(struct rtcm_info *this);
 int rtcm_packet_handle(struct ntrip_state *st);
+int rtcm_frame_type(const unsigned char *d, size_t len);
+int rtcm_frame_epoch_end(const unsigned char *d, size_t len);
+int rtcm_msm_header_decode(const unsigned char *d, size_t len, struct rtcm_msm_header *h);
+int rtcm_msm7_to_msm4(const unsigned char *d, size_t len, unsigned char *out);
+long rtcm_backlog_compact(struct evbuffer *output);
 
 #endif
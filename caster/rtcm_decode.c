@@ -0,0 +1,323 @@
+#include "rtcm_decode.h"
+
+/*
+ * Table-driven RTCM 3 message decoder.
+ *
+ * Message headers are described by compile-time tables of bit fields,
+ * decoded once per frame with a 64-bit bit reader. The decoded frame is
+ * then passed to the handlers registered for its type, so that every
+ * analysis (statistics, epoch detection, caches...) shares one decode pass.
+ */
+
+#define	F(id, len)	{RTCM_F_##id, len, 0}
+#define	S(id, len)	{RTCM_F_##id, len, 1}
+#define	R(len)		{RTCM_F_RESERVED, len, 0}
+
+/* 1001-1004: GPS RTK observations */
+static const struct rtcm_field_desc rtcm_fields_gps_obs[] = {
+	F(TYPE, 12), F(STATION_ID, 12), F(TOW, 30), F(SYNC, 1), F(NSAT, 5),
+	F(SMOOTHING, 1), F(SMOOTHING_INTERVAL, 3)
+};
+
+/* 1009-1012: GLONASS RTK observations */
+static const struct rtcm_field_desc rtcm_fields_glonass_obs[] = {
+	F(TYPE, 12), F(STATION_ID, 12), F(GLONASS_TOD, 27), F(SYNC, 1), F(NSAT, 5),
+	F(SMOOTHING, 1), F(SMOOTHING_INTERVAL, 3)
+};
+
+/* 1005: stationary antenna reference point */
+#define	RTCM_FIELDS_ARP \
+	F(TYPE, 12), F(STATION_ID, 12), F(ITRF_YEAR, 6), \
+	F(GPS_IND, 1), F(GLONASS_IND, 1), F(GALILEO_IND, 1), F(REF_STATION_IND, 1), \
+	S(ECEF_X, 38), F(OSCILLATOR_IND, 1), R(1), \
+	S(ECEF_Y, 38), F(QUARTER_CYCLE_IND, 2), \
+	S(ECEF_Z, 38)
+static const struct rtcm_field_desc rtcm_fields_1005[] = {
+	RTCM_FIELDS_ARP
+};
+
+/* 1006: same with antenna height */
+static const struct rtcm_field_desc rtcm_fields_1006[] = {
+	RTCM_FIELDS_ARP, F(ANTENNA_HEIGHT, 16)
+};
+
+/* 1007, 1008, 1033: antenna and receiver descriptors */
+static const struct rtcm_field_desc rtcm_fields_station_id[] = {
+	F(TYPE, 12), F(STATION_ID, 12)
+};
+
+/* 1019, 1020, 1042, 1045, 1046: ephemeris */
+static const struct rtcm_field_desc rtcm_fields_ephemeris[] = {
+	F(TYPE, 12), F(SATELLITE, 6)
+};
+
+/* 1044: QZSS ephemeris */
+static const struct rtcm_field_desc rtcm_fields_ephemeris_qzss[] = {
+	F(TYPE, 12), F(SATELLITE, 4)
+};
+
+/* MSM header, before the cell mask */
+#define	RTCM_FIELDS_MSM_END \
+	F(SYNC, 1), F(IODS, 3), R(7), F(CLOCK_STEERING, 2), F(EXT_CLOCK, 2), \
+	F(SMOOTHING, 1), F(SMOOTHING_INTERVAL, 3), F(SAT_MASK, 64), F(SIG_MASK, 32)
+static const struct rtcm_field_desc rtcm_fields_msm[] = {
+	F(TYPE, 12), F(STATION_ID, 12), F(TOW, 30), RTCM_FIELDS_MSM_END
+};
+static const struct rtcm_field_desc rtcm_fields_msm_glonass[] = {
+	F(TYPE, 12), F(STATION_ID, 12), F(GLONASS_DOW, 3), F(GLONASS_TOD, 27), RTCM_FIELDS_MSM_END
+};
+
+#define	DESC(kind, fields)	{kind, sizeof fields / sizeof fields[0], fields}
+
+static const struct rtcm_msg_desc rtcm_desc_gps_obs = DESC(RTCM_KIND_OBS, rtcm_fields_gps_obs);
+static const struct rtcm_msg_desc rtcm_desc_glonass_obs = DESC(RTCM_KIND_OBS, rtcm_fields_glonass_obs);
+static const struct rtcm_msg_desc rtcm_desc_1005 = DESC(RTCM_KIND_OTHER, rtcm_fields_1005);
+static const struct rtcm_msg_desc rtcm_desc_1006 = DESC(RTCM_KIND_OTHER, rtcm_fields_1006);
+static const struct rtcm_msg_desc rtcm_desc_station_id = DESC(RTCM_KIND_OTHER, rtcm_fields_station_id);
+static const struct rtcm_msg_desc rtcm_desc_ephemeris = DESC(RTCM_KIND_OTHER, rtcm_fields_ephemeris);
+static const struct rtcm_msg_desc rtcm_desc_ephemeris_qzss = DESC(RTCM_KIND_OTHER, rtcm_fields_ephemeris_qzss);
+static const struct rtcm_msg_desc rtcm_desc_msm = DESC(RTCM_KIND_MSM, rtcm_fields_msm);
+static const struct rtcm_msg_desc rtcm_desc_msm_glonass = DESC(RTCM_KIND_MSM, rtcm_fields_msm_glonass);
+
+/*
+ * Message descriptions by type range.
+ */
+static const struct {
+	int first, last;
+	const struct rtcm_msg_desc *desc;
+} rtcm_descs[] = {
+	{1001, 1004, &rtcm_desc_gps_obs},
+	{1005, 1005, &rtcm_desc_1005},
+	{1006, 1006, &rtcm_desc_1006},
+	{1007, 1008, &rtcm_desc_station_id},
+	{1009, 1012, &rtcm_desc_glonass_obs},
+	{1019, 1020, &rtcm_desc_ephemeris},
+	{1033, 1033, &rtcm_desc_station_id},
+	{1042, 1042, &rtcm_desc_ephemeris},
+	{1044, 1044, &rtcm_desc_ephemeris_qzss},
+	{1045, 1046, &rtcm_desc_ephemeris},
+	{1071, 1077, &rtcm_desc_msm},		// GPS
+	{1081, 1087, &rtcm_desc_msm_glonass},	// GLONASS
+	{1091, 1097, &rtcm_desc_msm},		// Galileo
+	{1101, 1107, &rtcm_desc_msm},		// SBAS
+	{1111, 1117, &rtcm_desc_msm},		// QZSS
+	{1121, 1127, &rtcm_desc_msm},		// BeiDou
+	{1131, 1137, &rtcm_desc_msm}		// NavIC
+};
+
+static const struct rtcm_msg_desc *rtcm_desc_find(int type) {
+	for (int i = 0; i < sizeof rtcm_descs / sizeof rtcm_descs[0]; i++)
+		if (type >= rtcm_descs[i].first && type <= rtcm_descs[i].last)
+			return rtcm_descs[i].desc;
+	return NULL;
+}
+
+/*
+ * Handlers for all types, and by type index.
+ */
+static rtcm_decode_handler rtcm_handlers_all[RTCM_DECODE_HANDLERS];
+static rtcm_decode_handler rtcm_handlers[RTCM_NTYPES][RTCM_DECODE_HANDLERS];
+
+/*
+ * Check the framing of a RTCM frame and return its type, -1 if invalid.
+ */
+static int rtcm_decode_type(const unsigned char *d, size_t len) {
+	if (len < 8 || d[0] != 0xd3 || (d[1] & 3)*256 + d[2] + 6 != len)
+		return -1;
+	return rtcm_bits(d+3, len-3, 0, 12);
+}
+
+/*
+ * Compute the epoch time of an observation message, in milliseconds
+ * of the GPS week, or -1 if unknown.
+ *
+ * GLONASS and BeiDou times are converted using the current leap seconds,
+ * which is good enough to compare epochs.
+ */
+static long rtcm_decode_epoch_ms(struct rtcm_frame *this) {
+	if (rtcm_frame_has(this, RTCM_F_GLONASS_DOW)) {
+		/* GLONASS: day of week and time of day in Moscow time */
+		long dow = this->field[RTCM_F_GLONASS_DOW];
+		long tod = this->field[RTCM_F_GLONASS_TOD];
+		if (dow == 7)
+			return -1;
+		return (dow*RTCM_DAY_MS + tod - RTCM_GLONASS_OFFSET_MS + RTCM_LEAP_MS + RTCM_WEEK_MS) % RTCM_WEEK_MS;
+	}
+	if (!rtcm_frame_has(this, RTCM_F_TOW))
+		/* Legacy GLONASS messages: no day of week */
+		return -1;
+	if (this->type/10 == 112)
+		/* BeiDou: time of week in BDT */
+		return (this->field[RTCM_F_TOW] + RTCM_BDT_OFFSET_MS) % RTCM_WEEK_MS;
+	/* GPS, Galileo, SBAS, QZSS, NavIC: time of week */
+	return this->field[RTCM_F_TOW];
+}
+
+/*
+ * Fill the MSM header from the decoded fields, and check the cell mask.
+ */
+static void rtcm_decode_msm(struct rtcm_frame *this) {
+	struct rtcm_msm_header *h = &this->msm;
+	h->gnss = this->type/10 - 107;
+	h->msm = this->type % 10;
+	h->station_id = this->field[RTCM_F_STATION_ID];
+	h->epoch_ms = this->epoch_ms;
+	h->mmb = this->field[RTCM_F_SYNC];
+	h->iods = this->field[RTCM_F_IODS];
+	h->sat_mask = this->field[RTCM_F_SAT_MASK];
+	h->sig_mask = this->field[RTCM_F_SIG_MASK];
+	h->nsat = __builtin_popcountl(h->sat_mask);
+	h->nsig = __builtin_popcountl(h->sig_mask);
+
+	/* Cell mask, at most 64 bits */
+	int ncellbits = h->nsat * h->nsig;
+	h->hlen = 169 + ncellbits;
+	if (ncellbits > 64 || this->len*8 < h->hlen)
+		return;
+	h->ncell = __builtin_popcountl(rtcm_bits(this->payload, this->len+3, 169, ncellbits));
+	this->is_msm = 1;
+}
+
+/*
+ * Decode a complete RTCM frame.
+ *
+ * Return -1 if d is not a RTCM frame, 0 otherwise. frame->desc is
+ * NULL if the type is not described or the frame is too short for its
+ * header.
+ * The CRC is not checked.
+ */
+int rtcm_decode(const unsigned char *d, size_t len, struct rtcm_frame *frame) {
+	frame->type = rtcm_decode_type(d, len);
+	frame->desc = NULL;
+	frame->present = 0;
+	frame->epoch_end = -1;
+	frame->epoch_ms = -1;
+	frame->is_msm = 0;
+	if (frame->type < 0)
+		return -1;
+	frame->payload = d+3;
+	frame->len = len-6;
+
+	const struct rtcm_msg_desc *desc = rtcm_desc_find(frame->type);
+	if (desc == NULL)
+		return 0;
+
+	/* Bit reads may go up to the end of the CRC */
+	size_t buflen = len-3;
+	int pos = 0;
+	for (int i = 0; i < desc->nfields; i++) {
+		const struct rtcm_field_desc *f = &desc->fields[i];
+		if (pos + f->len > frame->len*8) {
+			frame->present = 0;
+			return 0;
+		}
+		if (f->id != RTCM_F_RESERVED) {
+			frame->field[f->id] = f->is_signed ? rtcm_sbits(frame->payload, buflen, pos, f->len)
+				: (int64_t)rtcm_bits(frame->payload, buflen, pos, f->len);
+			frame->present |= 1ULL << f->id;
+		}
+		pos += f->len;
+	}
+	frame->desc = desc;
+
+	if (desc->kind != RTCM_KIND_OTHER) {
+		frame->epoch_end = !frame->field[RTCM_F_SYNC];
+		frame->epoch_ms = rtcm_decode_epoch_ms(frame);
+	}
+	if (desc->kind == RTCM_KIND_MSM)
+		rtcm_decode_msm(frame);
+	return 0;
+}
+
+/*
+ * Decode a single header field of a RTCM frame, without decoding the others.
+ *
+ * Return 0 and set *value if found, -1 otherwise.
+ */
+int rtcm_decode_field(const unsigned char *d, size_t len, enum rtcm_field_id id, int64_t *value) {
+	int type = rtcm_decode_type(d, len);
+	if (type < 0)
+		return -1;
+	const struct rtcm_msg_desc *desc = rtcm_desc_find(type);
+	if (desc == NULL)
+		return -1;
+
+	int pos = 0;
+	for (int i = 0; i < desc->nfields; i++) {
+		const struct rtcm_field_desc *f = &desc->fields[i];
+		if (f->id == id) {
+			if (pos + f->len > (len-6)*8)
+				return -1;
+			*value = f->is_signed ? rtcm_sbits(d+3, len-3, pos, f->len) : (int64_t)rtcm_bits(d+3, len-3, pos, f->len);
+			return 0;
+		}
+		pos += f->len;
+	}
+	return -1;
+}
+
+/*
+ * Register a handler for a message type, or for all types if type is -1.
+ * Handlers are called in registration order, those for all types first.
+ *
+ * Not thread-safe: to be called at initialization.
+ *
+ * Return -1 if the type is invalid or has too many handlers.
+ */
+int rtcm_decode_register(int type, rtcm_decode_handler handler) {
+	rtcm_decode_handler *list;
+	if (type == -1)
+		list = rtcm_handlers_all;
+	else {
+		int i = rtcm_type_index(type);
+		if (i < 0)
+			return -1;
+		list = rtcm_handlers[i];
+	}
+	for (int n = 0; n < RTCM_DECODE_HANDLERS; n++)
+		if (list[n] == NULL) {
+			list[n] = handler;
+			return 0;
+		}
+	return -1;
+}
+
+/*
+ * Remove a handler registered by rtcm_decode_register(), keeping
+ * the others in order.
+ *
+ * Not thread-safe: no frame must be dispatched meanwhile.
+ *
+ * Return -1 if the handler is not registered for this type.
+ */
+int rtcm_decode_unregister(int type, rtcm_decode_handler handler) {
+	rtcm_decode_handler *list;
+	if (type == -1)
+		list = rtcm_handlers_all;
+	else {
+		int i = rtcm_type_index(type);
+		if (i < 0)
+			return -1;
+		list = rtcm_handlers[i];
+	}
+	for (int n = 0; n < RTCM_DECODE_HANDLERS && list[n]; n++)
+		if (list[n] == handler) {
+			memmove(list+n, list+n+1, (RTCM_DECODE_HANDLERS-n-1) * sizeof list[0]);
+			list[RTCM_DECODE_HANDLERS-1] = NULL;
+			return 0;
+		}
+	return -1;
+}
+
+/*
+ * Run the handlers registered for a decoded frame.
+ */
+void rtcm_decode_dispatch(struct rtcm_frame *frame, void *arg) {
+	for (int n = 0; n < RTCM_DECODE_HANDLERS && rtcm_handlers_all[n]; n++)
+		rtcm_handlers_all[n](frame, arg);
+	int i = rtcm_type_index(frame->type);
+	if (i < 0)
+		return;
+	for (int n = 0; n < RTCM_DECODE_HANDLERS && rtcm_handlers[i][n]; n++)
+		rtcm_handlers[i][n](frame, arg);
+}
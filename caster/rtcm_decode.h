@@ -0,0 +1,200 @@
+#ifndef __RTCM_DECODE_H__
+#define __RTCM_DECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Table-driven RTCM 3 message decoder.
+ */
+
+#define	RTCM_1K_MIN	1000
+#define	RTCM_1K_MAX	1230
+#define	RTCM_4K_MIN	4000
+#define	RTCM_4K_MAX	4095
+
+/* Number of message types with a type index: 1000-1230 and 4000-4095 */
+#define	RTCM_NTYPES	(RTCM_1K_MAX-RTCM_1K_MIN+1 + RTCM_4K_MAX-RTCM_4K_MIN+1)
+
+/* Time constants for epoch comparisons */
+#define	RTCM_DAY_MS		(86400L*1000)
+#define	RTCM_WEEK_MS		(7*RTCM_DAY_MS)
+#define	RTCM_GLONASS_OFFSET_MS	(3*3600L*1000)		// Moscow time - UTC
+#define	RTCM_LEAP_MS		(18L*1000)		// GPS time - UTC
+#define	RTCM_BDT_OFFSET_MS	(14L*1000)		// GPS time - BeiDou time
+
+/* GNSS with MSM messages: GPS, GLONASS, Galileo, SBAS, QZSS, BeiDou, NavIC */
+#define	RTCM_MSM_GNSS		7
+
+/* Maximum number of handlers for a message type */
+#define	RTCM_DECODE_HANDLERS	4
+
+/*
+ * Extract a bit field of at most 64 bits from a buffer of len bytes,
+ * bits past the end reading as 0.
+ *
+ * Loads a 64-bit big-endian word at once when the buffer is long enough.
+ */
+static inline uint64_t rtcm_bits(const unsigned char *d, size_t len, int beg, int nbits) {
+	size_t off = beg >> 3;
+	int shift = beg & 7;
+	uint64_t w;
+
+	if (nbits == 0)
+		return 0;
+	if (off + 8 <= len) {
+		memcpy(&w, d+off, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		w = __builtin_bswap64(w);
+#endif
+	} else {
+		w = 0;
+		for (int i = 0; i < 8; i++)
+			w = (w << 8) | (off+i < len ? d[off+i] : 0);
+	}
+	w <<= shift;
+	if (shift + nbits > 64)
+		/* Field spread over 9 bytes */
+		w |= (off+8 < len ? d[off+8] : 0) >> (8-shift);
+	return w >> (64-nbits);
+}
+
+/*
+ * Extract a two's complement signed bit field.
+ */
+static inline int64_t rtcm_sbits(const unsigned char *d, size_t len, int beg, int nbits) {
+	return (int64_t)(rtcm_bits(d, len, beg, nbits) << (64-nbits)) >> (64-nbits);
+}
+
+/*
+ * Set a bit field in a RTCM packet, at most 64 bits.
+ */
+static inline void rtcm_setbits(unsigned char *d, int beg, int nbits, uint64_t value) {
+	for (int i = 0; i < nbits; i++) {
+		int bit = beg + i;
+		if (value & (1ULL << (nbits-1-i)))
+			d[bit>>3] |= 0x80 >> (bit & 7);
+		else
+			d[bit>>3] &= ~(0x80 >> (bit & 7));
+	}
+}
+
+/*
+ * Return the index of a message type in per-type tables, -1 if none.
+ */
+static inline int rtcm_type_index(int type) {
+	if (type >= RTCM_1K_MIN && type <= RTCM_1K_MAX)
+		return type - RTCM_1K_MIN;
+	if (type >= RTCM_4K_MIN && type <= RTCM_4K_MAX)
+		return type - RTCM_4K_MIN + RTCM_1K_MAX-RTCM_1K_MIN+1;
+	return -1;
+}
+
+/*
+ * Message header fields known to the decoder.
+ */
+enum rtcm_field_id {
+	RTCM_F_TYPE,
+	RTCM_F_STATION_ID,
+	RTCM_F_ITRF_YEAR,
+	RTCM_F_GPS_IND,
+	RTCM_F_GLONASS_IND,
+	RTCM_F_GALILEO_IND,
+	RTCM_F_REF_STATION_IND,
+	RTCM_F_ECEF_X,
+	RTCM_F_OSCILLATOR_IND,
+	RTCM_F_ECEF_Y,
+	RTCM_F_QUARTER_CYCLE_IND,
+	RTCM_F_ECEF_Z,
+	RTCM_F_ANTENNA_HEIGHT,
+	RTCM_F_TOW,			// GNSS time of week, ms
+	RTCM_F_GLONASS_DOW,		// GLONASS day of week
+	RTCM_F_GLONASS_TOD,		// GLONASS time of day, ms
+	RTCM_F_SYNC,			// synchronous GNSS / multiple message bit
+	RTCM_F_NSAT,
+	RTCM_F_SMOOTHING,
+	RTCM_F_SMOOTHING_INTERVAL,
+	RTCM_F_IODS,
+	RTCM_F_CLOCK_STEERING,
+	RTCM_F_EXT_CLOCK,
+	RTCM_F_SAT_MASK,
+	RTCM_F_SIG_MASK,
+	RTCM_F_SATELLITE,		// ephemeris satellite id
+	RTCM_F_NFIELDS,
+	RTCM_F_RESERVED = RTCM_F_NFIELDS	// skipped
+};
+
+/*
+ * Bit field in a message, in order.
+ */
+struct rtcm_field_desc {
+	unsigned char id;
+	unsigned char len;
+	unsigned char is_signed;
+};
+
+enum rtcm_msg_kind {
+	RTCM_KIND_OTHER,
+	RTCM_KIND_OBS,			// legacy observations
+	RTCM_KIND_MSM			// multiple signal messages
+};
+
+/*
+ * Message description: header fields, variable parts being ignored.
+ */
+struct rtcm_msg_desc {
+	enum rtcm_msg_kind kind;
+	int nfields;
+	const struct rtcm_field_desc *fields;
+};
+
+/*
+ * Decoded MSM (Multiple Signal Messages, types 1071-1137) header.
+ */
+struct rtcm_msm_header {
+	int gnss;		// 0 to RTCM_MSM_GNSS-1
+	int msm;		// MSM1 to MSM7
+	int station_id;
+	long epoch_ms;		// epoch time in milliseconds of the GPS week
+	int mmb;		// multiple message bit: more messages follow for the epoch
+	int iods;
+	unsigned long sat_mask;
+	unsigned long sig_mask;
+	int nsat, nsig, ncell;
+	int hlen;		// header length in bits, including the cell mask
+};
+
+/*
+ * A decoded frame, shared by all analysis handlers.
+ */
+struct rtcm_frame {
+	const unsigned char *payload;
+	size_t len;			// payload length, without the header and CRC
+	int type;
+	const struct rtcm_msg_desc *desc;	// NULL if the type is unknown or the frame too short
+	uint64_t present;		// bit field of decoded fields
+	int64_t field[RTCM_F_NFIELDS];
+
+	/* Observation messages */
+	int epoch_end;			// 1 if last of its epoch, 0 if not, -1 for other messages
+	long epoch_ms;			// epoch in ms of the GPS week, -1 if unknown
+
+	/* MSM messages */
+	int is_msm;			// set if the header and cell mask are valid
+	struct rtcm_msm_header msm;
+};
+
+typedef void (*rtcm_decode_handler)(struct rtcm_frame *frame, void *arg);
+
+static inline int rtcm_frame_has(struct rtcm_frame *this, enum rtcm_field_id id) {
+	return (this->present >> id) & 1;
+}
+
+int rtcm_decode(const unsigned char *d, size_t len, struct rtcm_frame *frame);
+int rtcm_decode_field(const unsigned char *d, size_t len, enum rtcm_field_id id, int64_t *value);
+int rtcm_decode_register(int type, rtcm_decode_handler handler);
+int rtcm_decode_unregister(int type, rtcm_decode_handler handler);
+void rtcm_decode_dispatch(struct rtcm_frame *frame, void *arg);
+
+#endif /* __RTCM_DECODE_H__ */
@@ -9,6 +9,7 @@
 #include <json-c/json_object_iterator.h>
 
 #include "livesource.h"
+#include "nearest.h"
 #include "ntrip_common.h"
 #include "sourcetable.h"
 
@@ -131,6 +132,11 @@ struct sourcetable *sourcetable_new(const char *host, unsigned short port, int t
 	this->fetch_time = t;
 	this->nvirtual = 0;
 	this->tls = tls;
+	P_MUTEX_INIT(&this->index_lock, NULL);
+	this->index = NULL;
+	this->nearest_cache = NULL;
+	atomic_init(&this->refcnt, 1);
+	this->generation = 0;
 	return this;
 }
 
@@ -140,6 +146,11 @@ void sourcetable_free_unlocked(struct sourcetable *this) {
 	strfree((char *)this->filename);
 
 	hash_table_free(this->key_val);
+	if (this->index)
+		geoindex_free(this->index);
+	if (this->nearest_cache)
+		nearest_cache_free(this->nearest_cache);
+	P_MUTEX_DESTROY(&this->index_lock);
 
 	P_RWLOCK_UNLOCK(&this->lock);
 	P_RWLOCK_DESTROY(&this->lock);
@@ -247,6 +258,10 @@ static int _sourcetable_add_direct(struct sourcetable *this, struct sourceline *
 	r = hash_table_add(this->key_val, s->key, s);
 	if (s->virtual)
 		this->nvirtual++;
+	if (this->index) {
+		geoindex_free(this->index);
+		this->index = NULL;
+	}
 	P_RWLOCK_UNLOCK(&this->lock);
 	return r;
 }
@@ -343,90 +358,70 @@ void sourcetable_diff(struct caster_state *caster, struct sourcetable *t1, struc
 	hash_array_free(keys2);
 }
 
-static int _cmp_dist(const void *pos1, const void *pos2) {
-	struct spos *p1 = (struct spos *)pos1;
-	struct spos *p2 = (struct spos *)pos2;
-	if (p1->dist > p2->dist) {
-		return 1;
-	}
-	if (p1->dist < p2->dist) {
-		return -1;
+/*
+ * Build the spatial index of non-virtual entries.
+ *
+ * Required lock: sourcetable read lock.
+ */
+static struct geoindex *_sourcetable_index(struct sourcetable *this) {
+	int n = _sourcetable_nentries_unlocked(this, 1);
+	struct sourceline **lines = (struct sourceline **)malloc(sizeof(struct sourceline *)*(n ? n : 1));
+	if (lines == NULL)
+		return NULL;
+
+	int i = 0;
+	struct hash_iterator hi;
+	struct element *e;
+	HASH_FOREACH(e, this->key_val, hi) {
+		struct sourceline *np = (struct sourceline *)e->value;
+		if (!np->virtual && i < n)
+			lines[i++] = np;
 	}
-	return 0;
+
+	struct geoindex *index = geoindex_new(lines, i);
+	free(lines);
+	return index;
 }
 
 /*
- * Return a distance table for all mountpoints in sourcetable relative to the given position.
+ * Fill a distance table with the nearest non-virtual mountpoints in sourcetable,
+ * relative to the given position.
+ *
+ * Return the number of entries, 0 if none, -1 on error.
  */
-struct dist_table *sourcetable_find_pos(struct sourcetable *this, pos_t *pos) {
-	int n = 0;
-	struct sourceline *np;
+int sourcetable_find_pos(struct sourcetable *this, pos_t *pos, struct dist_table *d) {
+	struct geoindex_result nearest[DIST_TABLE_SIZE];
+
 	if (this == NULL)
-		return NULL;
+		return -1;
 
 	P_RWLOCK_RDLOCK(&this->lock);
 
-	/*
-	 * Count how many entries we need to reserve.
-	 */
-	n = _sourcetable_nentries_unlocked(this, 1);
-
-	if (n == 0) {
-		P_RWLOCK_UNLOCK(&this->lock);
-		return NULL;
-	}
+	P_MUTEX_LOCK(&this->index_lock);
+	if (this->index == NULL)
+		this->index = _sourcetable_index(this);
+	P_MUTEX_UNLOCK(&this->index_lock);
 
-	/*
-	 * Allocate the table structures.
-	 */
-	struct dist_table *d = (struct dist_table *)malloc(sizeof(struct dist_table));
-	if (d == NULL) {
-		P_RWLOCK_UNLOCK(&this->lock);
-		return NULL;
-	}
-	struct spos *dist_array = (struct spos *)malloc(sizeof(struct spos)*n);
-	if (dist_array == NULL) {
+	if (this->index == NULL) {
 		P_RWLOCK_UNLOCK(&this->lock);
-		free(d);
-		return NULL;
+		return -1;
 	}
 
-	/*
-	 * Prepare the table to be sorted.
-	 */
-	int i = 0;
-
-	struct hash_iterator hi;
-	struct element *e;
-	HASH_FOREACH(e, this->key_val, hi) {
-		np = (struct sourceline *)e->value;
-		// printf("%d: %s pos (%f, %f)\n", i, np->key, np->pos.lat, np->pos.lon);
-		if (!np->virtual) {
-			dist_array[i].dist = distance(&np->pos, pos);
-			dist_array[i].pos = np->pos;
-			dist_array[i].mountpoint = np->key;
-			dist_array[i].on_demand = np->on_demand;
-			i++;
-		}
+	int n = geoindex_nearest(this->index, pos, DIST_TABLE_SIZE, nearest);
+	for (int i = 0; i < n; i++) {
+		struct sourceline *np = nearest[i].sourceline;
+		d->dist_array[i].dist = distance(&np->pos, pos);
+		d->dist_array[i].pos = np->pos;
+		d->dist_array[i].mountpoint = np->key;
+		d->dist_array[i].on_demand = np->on_demand;
 	}
 
 	P_RWLOCK_UNLOCK(&this->lock);
 
-	/*
-	 * Keep some useful additional info
-	 *
-	 * Use i instead of n as the table size, in case they differ.
-	 */
-	d->dist_array = dist_array;
-	d->size_dist_array = i;
+	d->size_dist_array = n;
 	d->pos = *pos;
 	d->sourcetable = this;
-
-	/*
-	 * Sort the distance array
-	 */
-	qsort(dist_array, i, sizeof(struct spos), _cmp_dist);
-	return d;
+	return n;
 }
 
 /*
@@ -442,15 +437,10 @@ struct sourceline *sourcetable_find_mountpoint(struct sourcetable *this, char *m
 	return result;
 }
 
-void dist_table_free(struct dist_table *this) {
-	free(this->dist_array);
-	free(this);
-}
-
 void dist_table_display(struct ntrip_state *st, struct dist_table *this, int max) {
 	float max_dist = this->size_dist_array ? this->dist_array[this->size_dist_array-1].dist : 40000;
 
-	ntrip_log(st, LOG_INFO, "dist_table from (%f, %f) %s:%d, furthest base dist %.2f:", this->pos.lat, this->pos.lon, this->sourcetable->caster, this->sourcetable->port, max_dist);
+	ntrip_log(st, LOG_INFO, "dist_table from (%f, %f) %s:%d, furthest listed base dist %.2f:", this->pos.lat, this->pos.lon, this->sourcetable->caster, this->sourcetable->port, max_dist);
 	for (int i = 0; i < max && i < this->size_dist_array; i++) {
 		ntrip_log(st, LOG_INFO, "%.2f: %s", this->dist_array[i].dist, this->dist_array[i].mountpoint);
 	}
@@ -569,6 +559,7 @@ static void _stack_replace_host(struct caster_state *caster, sourcetable_stack_t
 	}
 	if (new_sourcetable != NULL)
 		TAILQ_INSERT_TAIL(&stack->list, new_sourcetable, next);
+	stack_bump_generation(stack);
 
 	P_RWLOCK_UNLOCK(&stack->lock);
 }
@@ -669,6 +660,96 @@ cancel:
 	return NULL;
 }
 
+/*
+ * Invalidate the shared flattened table.
+ */
+void stack_bump_generation(sourcetable_stack_t *this) {
+	atomic_fetch_add_explicit(&this->generation, 1, memory_order_release);
+}
+
+/*
+ * Return a reference on the shared flattened table if it is for
+ * the given generation, NULL otherwise.
+ *
+ * Lock-free: a single atomic load of the table, then an atomic increment
+ * of its reference count.
+ */
+static struct sourcetable *stack_flatten_lookup(sourcetable_stack_t *this, unsigned long generation) {
+	unsigned phase;
+	struct sourcetable *r = (struct sourcetable *)refptr_enter(&this->flat, &phase);
+	if (r && r->generation == generation)
+		atomic_fetch_add_explicit(&r->refcnt, 1, memory_order_relaxed);
+	else
+		r = NULL;
+	refptr_leave(&this->flat, phase);
+	return r;
+}
+
+/*
+ * Return a reference on the flattened table for the current stack generation,
+ * to be released with stack_flatten_put().
+ *
+ * The table is shared and must not be modified. It is only rebuilt
+ * after a generation change.
+ */
+struct sourcetable *stack_flatten_get(struct caster_state *caster, sourcetable_stack_t *this) {
+	unsigned long generation = atomic_load_explicit(&this->generation, memory_order_acquire);
+	struct sourcetable *r = stack_flatten_lookup(this, generation);
+	if (r)
+		return r;
+
+	P_MUTEX_LOCK(&this->flat_rebuild_lock);
+
+	/*
+	 * Check again, another thread may have rebuilt the table while we waited.
+	 */
+	generation = atomic_load_explicit(&this->generation, memory_order_acquire);
+	r = stack_flatten_lookup(this, generation);
+
+	struct sourcetable *old = NULL;
+	if (r == NULL) {
+		r = stack_flatten(caster, this);
+		if (r != NULL) {
+			r->generation = generation;
+			/* One reference for the stack, one for the caller */
+			atomic_store(&r->refcnt, 2);
+			old = (struct sourcetable *)refptr_publish(&this->flat, r);
+		}
+	}
+
+	P_MUTEX_UNLOCK(&this->flat_rebuild_lock);
+
+	if (old)
+		stack_flatten_put(this, old);
+	return r;
+}
+
+/*
+ * Add n references on a table obtained from stack_flatten_get().
+ */
+void stack_flatten_incref(sourcetable_stack_t *this, struct sourcetable *flat, int n) {
+	atomic_fetch_add_explicit(&flat->refcnt, n, memory_order_relaxed);
+}
+
+/*
+ * Release a reference obtained from stack_flatten_get().
+ */
+void stack_flatten_put(sourcetable_stack_t *this, struct sourcetable *flat) {
+	if (atomic_fetch_sub_explicit(&flat->refcnt, 1, memory_order_acq_rel) == 1)
+		sourcetable_free(flat);
+}
+
+/*
+ * Drop the shared flattened table, at exit.
+ */
+void stack_flatten_clear(sourcetable_stack_t *this) {
+	P_MUTEX_LOCK(&this->flat_rebuild_lock);
+	struct sourcetable *old = (struct sourcetable *)refptr_publish(&this->flat, NULL);
+	P_MUTEX_UNLOCK(&this->flat_rebuild_lock);
+	if (old)
+		stack_flatten_put(this, old);
+}
+
 /*
  * Return all the sourcetables as a JSON array
  */
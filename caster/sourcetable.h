@@ -3,9 +3,13 @@
 
 #include "conf.h"
 
+#include <stdatomic.h>
+
 #include "caster.h"
+#include "geoindex.h"
 #include "hash.h"
 #include "queue.h"
+#include "refptr.h"
 #include "sourceline.h"
 #include "util.h"
 
@@ -29,6 +33,25 @@ struct sourcetable {
 	int priority;
 	int nvirtual;			// number of "virtual" entries
 	struct timeval fetch_time;              // time of fetch, if remote table
+
+	/*
+	 * Spatial index of the non-virtual entries, built on the first
+	 * position lookup and dropped on any change to key_val.
+	 *
+	 * index_lock only serializes the build, under the read lock.
+	 */
+	P_MUTEX_T index_lock;
+	struct geoindex *index;
+
+	/*
+	 * Nearest base cache, for a shared flattened table.
+	 * Created on first use, under index_lock.
+	 */
+	struct nearest_cache *nearest_cache;
+
+	/* For a shared flattened table */
+	atomic_int refcnt;
+	unsigned long generation;	// stack generation it was built for
 };
 TAILQ_HEAD (sourcetableq, sourcetable);
 
@@ -38,6 +61,23 @@ TAILQ_HEAD (sourcetableq, sourcetable);
 typedef struct sourcetable_stack {
 	struct sourcetableq list;
 	P_RWLOCK_T lock;
+
+	/*
+	 * Generation number, bumped whenever the result of stack_flatten()
+	 * may change: sourcetable replacement or reload, livesource
+	 * addition, removal or state change.
+	 */
+	atomic_ulong generation;
+
+	/*
+	 * Shared flattened table, see stack_flatten_get(), published
+	 * for lock-free readers.
+	 *
+	 * flat_rebuild_lock serializes rebuilds, so that only one thread
+	 * flattens the stack after a generation change, and publications.
+	 */
+	P_MUTEX_T flat_rebuild_lock;
+	struct refptr flat;
 } sourcetable_stack_t;
 
 /*
@@ -51,12 +91,17 @@ struct spos {
 };
 
 /*
- * Table to determine the closest base from a rover
+ * Maximum number of nearest bases returned by sourcetable_find_pos()
+ */
+#define	DIST_TABLE_SIZE	10
+
+/*
+ * Table of the closest bases from a rover, by increasing distance
  */
 struct dist_table {
 	struct sourcetable *sourcetable;	// original sourcetable
 	pos_t pos;				// known rover position
-	struct spos *dist_array;		// array of distances
+	struct spos dist_array[DIST_TABLE_SIZE];	// array of distances
 	int size_dist_array;
 };
 
@@ -79,14 +124,18 @@ int sourcetable_add(struct sourcetable *this, const char *sourcetable_entry, int
 int sourcetable_nentries(struct sourcetable *this, int omit_virtual);
 void sourcetable_diff(struct caster_state *caster, struct sourcetable *t1, struct sourcetable *t2);
 struct sourceline *sourcetable_find_mountpoint(struct sourcetable *this, char *mountpoint);
-struct dist_table *sourcetable_find_pos(struct sourcetable *this, pos_t *pos);
-void dist_table_free(struct dist_table *this);
+int sourcetable_find_pos(struct sourcetable *this, pos_t *pos, struct dist_table *d);
 void dist_table_display(struct ntrip_state *st, struct dist_table *this, int max);
 struct sourceline *stack_find_mountpoint(struct caster_state *caster, sourcetable_stack_t *stack, char *mountpoint);
 struct sourceline *stack_find_local_mountpoint(struct caster_state *caster, sourcetable_stack_t *stack, char *mountpoint);
 struct sourceline *stack_find_pullable(sourcetable_stack_t *stack, char *mountpoint, struct sourcetable **sourcetable);
 void stack_replace_host(struct caster_state *caster, sourcetable_stack_t *stack, const char *host, unsigned port, struct sourcetable *new_sourcetable);
 struct sourcetable *stack_flatten(struct caster_state *caster, sourcetable_stack_t *this);
+void stack_bump_generation(sourcetable_stack_t *this);
+struct sourcetable *stack_flatten_get(struct caster_state *caster, sourcetable_stack_t *this);
+void stack_flatten_incref(sourcetable_stack_t *this, struct sourcetable *flat, int n);
+void stack_flatten_put(sourcetable_stack_t *this, struct sourcetable *flat);
+void stack_flatten_clear(sourcetable_stack_t *this);
 struct mime_content *sourcetable_list_json(struct caster_state *caster, struct request *req);
 int sourcetable_update_execute(struct caster_state *caster, json_object *j);
 
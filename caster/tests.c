@@ -1,10 +1,37 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/thread.h>
 
 #include "conf.h"
+#include "caster.h"
+#include "config.h"
+#include "crc24q.h"
+#include "generator.h"
+#include "geoindex.h"
 #include "ip.h"
+#include "jobs.h"
+#include "livesource.h"
+#include "nearest.h"
+#include "ntrip_common.h"
+#include "packet.h"
+#include "refptr.h"
+#include "rtcm.h"
+#include "sourcetable.h"
 #include "util.h"
 
 static int urldecode_test() {
@@ -204,37 +231,2744 @@ static int test_ip_analyze_prefixquota() {
 	return fail;
 }
 
-#if 0
-static void sourcetable_test(struct sourcetable *sourcetable) {
-	char *ggalist[] = {
-	    "$GPGGA,014822.78,0000.0000000,N,00000.0000000,E,1,00,1.0,-17.162,M,17.162,M,0.0,*5C\r\n",
-	    "$GNGGA,205655.60,4849.4770477,N,00220.6693234,E,4,12,0.63,60.806,M,46.188,M,14.6,0000*6E\r\n",
-	    "$GNGGA,104710.00,4832.5844943,N,00229.8320136,E,5,12,0.84,80.418,M,46.332,M,1.0,0000*5A\r\n",
-	    "$GPGGA,182700,4609.8802,N,00056.9231,W,4,10,1,11.8,M,1,M,3,0*50\r\n",
-	    NULL
+/*
+ * Object published through a refptr, checked by readers.
+ */
+struct refptr_test_obj {
+	atomic_int refcnt;
+	int value;
+};
+
+struct refptr_test_args {
+	struct refptr *ptr;
+	atomic_int *stop;
+	int errors;
+};
+
+static void refptr_test_put(struct refptr_test_obj *obj) {
+	if (obj && atomic_fetch_sub(&obj->refcnt, 1) == 1) {
+		obj->value = -1;
+		free(obj);
+	}
+}
+
+static void *refptr_test_reader(void *arg) {
+	struct refptr_test_args *args = (struct refptr_test_args *)arg;
+	while (!atomic_load(args->stop)) {
+		unsigned phase;
+		struct refptr_test_obj *obj = refptr_enter(args->ptr, &phase);
+		atomic_fetch_add(&obj->refcnt, 1);
+		refptr_leave(args->ptr, phase);
+		if (obj->value < 0)
+			args->errors++;
+		refptr_test_put(obj);
+	}
+	return NULL;
+}
+
+static int refptr_test() {
+	int fail = 0;
+	struct refptr ptr;
+	atomic_int stop;
+	pthread_t threads[4];
+	struct refptr_test_args args[4];
+
+	puts("refptr");
+
+	struct refptr_test_obj *obj = (struct refptr_test_obj *)malloc(sizeof(struct refptr_test_obj));
+	atomic_init(&obj->refcnt, 1);
+	obj->value = 0;
+	refptr_init(&ptr, obj);
+	atomic_init(&stop, 0);
+
+	for (int i = 0; i < 4; i++) {
+		args[i].ptr = &ptr;
+		args[i].stop = &stop;
+		args[i].errors = 0;
+		pthread_create(&threads[i], NULL, refptr_test_reader, &args[i]);
+	}
+	for (int i = 1; i <= 20000; i++) {
+		obj = (struct refptr_test_obj *)malloc(sizeof(struct refptr_test_obj));
+		atomic_init(&obj->refcnt, 1);
+		obj->value = i;
+		refptr_test_put(refptr_publish(&ptr, obj));
+	}
+	atomic_store(&stop, 1);
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		if (args[i].errors) {
+			printf("FAIL refptr: %d freed objects read\n", args[i].errors);
+			fail++;
+		}
+	}
+	putchar('.');
+
+	refptr_test_put(refptr_publish(&ptr, NULL));
+	putchar('\n');
+	return fail;
+}
+
+static void *packet_pool_free_thread(void *arg) {
+	struct packet **packets = (struct packet **)arg;
+	for (int i = 0; packets[i]; i++)
+		packet_free(packets[i]);
+	return NULL;
+}
+
+static int packet_pool_test() {
+	int fail = 0;
+	struct config config;
+	struct caster_state caster;
+	struct packet_pool_stats before, after;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	caster.config = &config;
+	config.zero_copy = 1;
+
+	puts("packet_pool");
+
+	/* Recycling in the same thread and size class */
+	struct packet *p1 = packet_new(100, &caster);
+	packet_free(p1);
+	packet_pool_get_stats(&before);
+	struct packet *p2 = packet_new(200, &caster);
+	packet_pool_get_stats(&after);
+	if (p2 == p1 && after.hits == before.hits + 1)
+		putchar('.');
+	else {
+		printf("\nFAIL: packet not recycled\n");
+		fail++;
+	}
+	packet_free(p2);
+
+	/* Size class boundaries */
+	size_t sizes[] = {1, 64, 65, 1029, 1536};
+	for (int i = 0; i < sizeof sizes/sizeof sizes[0]; i++) {
+		struct packet *p = packet_new(sizes[i], &caster);
+		memset(p->data, 0xd3, sizes[i]);
+		if (p->pool_class >= 0 && p->datalen == sizes[i])
+			putchar('.');
+		else {
+			printf("\nFAIL: packet size %zd not pooled\n", sizes[i]);
+			fail++;
+		}
+		packet_free(p);
+	}
+	packet_pool_get_stats(&before);
+	struct packet *p3 = packet_new(1537, &caster);
+	packet_pool_get_stats(&after);
+	if (p3->pool_class < 0 && after.oversize == before.oversize + 1)
+		putchar('.');
+	else {
+		printf("\nFAIL: oversize packet\n");
+		fail++;
+	}
+	packet_free(p3);
+
+	/* Packets freed by another thread are recycled through the depot */
+	int n = 200;
+	struct packet **packets = (struct packet **)malloc((n+1)*sizeof(struct packet *));
+	for (int i = 0; i < n; i++)
+		packets[i] = packet_new(1000, &caster);
+	packets[n] = NULL;
+	packet_pool_get_stats(&before);
+	pthread_t thread;
+	pthread_create(&thread, NULL, packet_pool_free_thread, packets);
+	pthread_join(thread, NULL);
+	packet_pool_get_stats(&after);
+	if (after.depot == before.depot + n)
+		putchar('.');
+	else {
+		printf("\nFAIL: %ld packets left in an exited thread cache\n", before.depot + n - after.depot);
+		fail++;
+	}
+	packet_pool_get_stats(&before);
+	for (int i = 0; i < n/2; i++)
+		packets[i] = packet_new(1000, &caster);
+	packet_pool_get_stats(&after);
+	if (after.misses == before.misses && after.hits == before.hits + n/2)
+		putchar('.');
+	else {
+		printf("\nFAIL: %ld misses on packets freed by another thread\n", after.misses - before.misses);
+		fail++;
+	}
+	for (int i = 0; i < n/2; i++)
+		packet_free(packets[i]);
+	free(packets);
+
+	putchar('\n');
+	return fail;
+}
+
+/*
+ * Set a bit field in a RTCM frame payload.
+ */
+static void test_rtcm_setbits(unsigned char *d, int beg, int len, unsigned long value) {
+	for (int i = 0; i < len; i++) {
+		int bit = beg + i;
+		if (value & (1UL << (len-1-i)))
+			d[3 + (bit>>3)] |= 0x80 >> (bit & 7);
+		else
+			d[3 + (bit>>3)] &= ~(0x80 >> (bit & 7));
+	}
+}
+
+/*
+ * Set the CRC of a RTCM frame.
+ */
+static void test_rtcm_frame_crc(unsigned char *d, int len) {
+	unsigned long crc = 0;
+	for (int i = 0; i < len-3; i++) {
+		crc ^= (unsigned long)d[i] << 16;
+		for (int b = 0; b < 8; b++) {
+			crc <<= 1;
+			if (crc & 0x1000000)
+				crc ^= 0x1864cfb;
+		}
+	}
+	d[len-3] = crc >> 16;
+	d[len-2] = crc >> 8;
+	d[len-1] = crc;
+}
+
+/*
+ * Build a RTCM frame with a given type, payload length and
+ * multiple message / synchronous GNSS flag (bit 54), with a valid CRC.
+ * Return the frame length.
+ */
+static int test_rtcm_frame(unsigned char *d, int type, int payload_len, int mmb) {
+	memset(d, 0, payload_len+6);
+	d[0] = 0xd3;
+	d[1] = payload_len >> 8;
+	d[2] = payload_len & 0xff;
+	d[3] = type >> 4;
+	d[4] = (type & 15) << 4;
+	if (mmb)
+		test_rtcm_setbits(d, 54, 1, 1);
+	test_rtcm_frame_crc(d, payload_len+6);
+	return payload_len+6;
+}
+
+/*
+ * Log callback counting the subscribers dropped as backlogged by a livesource,
+ * and the drops reported with a count differing from the expected one.
+ *
+ * Also keeps the first packet counts logged by the source, which is done
+ * after each batch crossing a multiple of 100.
+ */
+struct test_fanout_log {
+	atomic_int dropped;
+	atomic_int mismatches;
+	int sent[8];
+	int nsent;
+};
+
+static void test_fanout_log_cb(void *arg, struct gelf_entry *g, int level, const char *fmt, va_list ap) {
+	struct test_fanout_log *this = (struct test_fanout_log *)arg;
+	char msg[256];
+	int n, end = 0;
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	if (sscanf(msg, "RTCM: %d backlogged clients dropped%n", &n, &end) == 1 && end)
+		atomic_fetch_add(&this->dropped, n);
+	else if (strstr(msg, "backlogged clients dropped"))
+		atomic_fetch_add(&this->mismatches, 1);
+	else if (sscanf(msg, "RTCM: %d packets sent%n", &n, &end) == 1 && end && this->nsent < 8)
+		this->sent[this->nsent++] = n;
+}
+
+/*
+ * A livesource fed by a source session, with subscriber sessions
+ * on unconnected bufferevents, whose output is never sent.
+ */
+struct test_fanout {
+	struct config config;
+	struct caster_state caster;
+	struct test_fanout_log log;
+	struct event_base *base;
+	struct ntrip_state *source;
+	struct livesource *livesource;
+	int nsubs;
+	struct ntrip_state **subs;
+};
+
+/*
+ * Initialize the caster state, the configuration being set by the caller
+ * before test_fanout_start().
+ */
+static void test_fanout_init(struct test_fanout *this) {
+	memset(this, 0, sizeof *this);
+	this->caster.config = &this->config;
+	this->caster.flog.log_cb = test_fanout_log_cb;
+	this->caster.flog.state = &this->log;
+	atomic_init(&this->log.dropped, 0);
+	atomic_init(&this->log.mismatches, 0);
+	this->config.backlog_evbuffer = 1000000;
+}
+
+static struct ntrip_state *test_fanout_session(struct test_fanout *this, enum ntrip_session_state state) {
+	struct bufferevent *bev = bufferevent_socket_new(this->base, -1, threads ? BEV_OPT_THREADSAFE : 0);
+	struct ntrip_state *st = ntrip_new(&this->caster, bev, NULL, 0, NULL, "TEST");
+	st->state = state;
+	ntrip_register(st);
+	return st;
+}
+
+/*
+ * Create the livesource and its subscribers.
+ * If ring_ev is set, waiting subscribers are woken up by the ring event,
+ * from the event loop.
+ */
+static int test_fanout_start(struct test_fanout *this, int nsubs, int ring_ev) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	TAILQ_INIT(&this->caster.ntrips.queue);
+	TAILQ_INIT(&this->caster.ntrips.free_queue);
+	P_RWLOCK_INIT(&this->caster.ntrips.lock, NULL);
+	P_RWLOCK_INIT(&this->caster.ntrips.free_lock, NULL);
+	TAILQ_INIT(&this->caster.sourcetablestack.list);
+	atomic_init(&this->caster.sourcetablestack.generation, 0);
+	this->caster.livesources = livesource_table_new("test", &now);
+	this->base = event_base_new();
+	if (ring_ev)
+		this->caster.base = this->base;
+
+	this->source = test_fanout_session(this, NTRIP_WAIT_STREAM_SOURCE);
+	this->livesource = livesource_connected(this->source, "TEST", NULL);
+	if (this->livesource == NULL)
+		return -1;
+
+	this->nsubs = nsubs;
+	this->subs = (struct ntrip_state **)malloc(nsubs*sizeof(struct ntrip_state *));
+	for (int i = 0; i < nsubs; i++) {
+		struct ntrip_state *st = test_fanout_session(this, NTRIP_WAIT_CLIENT_INPUT);
+		bufferevent_lock(st->bev);
+		livesource_add_subscriber(this->livesource, st);
+		bufferevent_unlock(st->bev);
+		this->subs[i] = st;
+	}
+	return 0;
+}
+
+/*
+ * Close the source, which frees the livesource and its remaining subscribers.
+ */
+static void test_fanout_stop(struct test_fanout *this) {
+	/* Keep the bufferevent until unlocked */
+	struct bufferevent *bev = this->source->bev;
+	bufferevent_incref(bev);
+	bufferevent_lock(bev);
+	ntrip_deferred_free(this->source, "test_fanout_stop");
+	bufferevent_unlock(bev);
+	bufferevent_decref(bev);
+	this->source = NULL;
+	this->livesource = NULL;
+}
+
+static void test_fanout_free(struct test_fanout *this) {
+	livesource_table_free(this->caster.livesources);
+	event_base_free(this->base);
+	P_RWLOCK_DESTROY(&this->caster.ntrips.lock);
+	P_RWLOCK_DESTROY(&this->caster.ntrips.free_lock);
+	free(this->subs);
+}
+
+/*
+ * Build a packet holding a RTCM frame, with a sequence number
+ * in the payload.
+ */
+static struct packet *test_fanout_packet(struct test_fanout *this, int type, int seq, int mmb) {
+	unsigned char frame[38];
+	int len = test_rtcm_frame(frame, type, 32, mmb);
+	frame[6] = seq >> 8;
+	frame[7] = seq;
+	test_rtcm_frame_crc(frame, len);
+	struct packet *packet = packet_new(len, &this->caster);
+	memcpy(packet->data, frame, len);
+	return packet;
+}
+
+/*
+ * Send a packet with a sequence number to the livesource.
+ */
+static void test_fanout_send(struct test_fanout *this, int type, int seq, int mmb) {
+	struct packet *packet = test_fanout_packet(this, type, seq, mmb);
+	bufferevent_lock(this->source->bev);
+	livesource_send_subscribers(this->livesource, packet, &this->caster);
+	bufferevent_unlock(this->source->bev);
+	packet_free(packet);
+}
+
+/*
+ * Read and drain the RTCM frames queued on a subscriber output,
+ * as if sent to the socket.
+ * Return the number of frames, up to max, their types and sequence numbers.
+ */
+static int test_fanout_read(struct ntrip_state *st, int *types, int *seqs, int max) {
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	unsigned char head[8];
+	int n = 0;
+	/* The start of the output is only drained by the bufferevent */
+	evbuffer_unfreeze(output, 1);
+	while (n < max && evbuffer_copyout(output, head, sizeof head) == sizeof head) {
+		int len = ((head[1] << 8) | head[2]) + 6;
+		if (types)
+			types[n] = (head[3] << 4) | (head[4] >> 4);
+		if (seqs)
+			seqs[n] = (head[6] << 8) | head[7];
+		n++;
+		evbuffer_drain(output, len);
+	}
+	evbuffer_freeze(output, 1);
+	return n;
+}
+
+/*
+ * Drain a subscriber output, as if sent to the socket.
+ */
+static void test_fanout_flush(struct ntrip_state *st) {
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	evbuffer_unfreeze(output, 1);
+	evbuffer_drain(output, evbuffer_get_length(output));
+	evbuffer_freeze(output, 1);
+}
+
+static int rtcm_compact_test() {
+	int fail = 0;
+	unsigned char frame[1030];
+	struct evbuffer *output = evbuffer_new();
+
+	puts("rtcm_backlog_compact");
+
+	/* Not RTCM */
+	evbuffer_add(output, "$GPGGA,hello", 12);
+	if (rtcm_backlog_compact(output) == -1 && evbuffer_get_length(output) == 12)
+		putchar('.');
+	else {
+		printf("\nFAIL: compaction of non-RTCM data\n");
+		fail++;
+	}
+	evbuffer_drain(output, 12);
+
+	/* Tail of a partially sent frame */
+	evbuffer_add(output, "\x12\x34\x56", 3);
+
+	struct {
+		int type, len, mmb, kept;
+	} frames[] = {
+		{1005, 19, 0, 1},		// last station message
+		{1006, 21, 0, 0},		// superseded
+		{1077, 300, 1, 0},		// stale epoch
+		{1087, 200, 0, 0},
+		{1006, 21, 0, 1},
+		{1019, 61, 0, 1},		// ephemeris, after the stale epoch
+		{1077, 300, 1, 1},		// newest complete epoch
+		{1087, 200, 0, 1},
+		{1077, 300, 1, 1}		// incomplete epoch
 	};
+	int nframes = sizeof frames / sizeof frames[0];
+	size_t kept_len = 3;
+	int dropped = 0;
+	for (int i = 0; i < nframes; i++) {
+		int len = test_rtcm_frame(frame, frames[i].type, frames[i].len, frames[i].mmb);
+		if (rtcm_frame_type(frame, len) != frames[i].type) {
+			printf("\nFAIL: frame type %d\n", frames[i].type);
+			fail++;
+		}
+		evbuffer_add(output, frame, len);
+		if (frames[i].kept)
+			kept_len += len;
+		else
+			dropped++;
+	}
+	/* Trailing partial frame */
+	evbuffer_add(output, frame, 10);
+	kept_len += 10;
 
-	for (char **gga = ggalist; *gga; gga++) {
-		pos_t pos;
-		if (parse_gga(*gga, &pos) < 0) {
-			continue;
+	/* Same backlog split in small chains, frames spanning several of them */
+	size_t backlog_len = evbuffer_get_length(output);
+	unsigned char *backlog = (unsigned char *)malloc(backlog_len);
+	evbuffer_copyout(output, backlog, backlog_len);
+	struct evbuffer *chained = evbuffer_new();
+	for (size_t off = 0; off < backlog_len; off += 7)
+		evbuffer_add_reference(chained, backlog+off, backlog_len-off < 7 ? backlog_len-off : 7, NULL, NULL);
+
+	long r = rtcm_backlog_compact(output);
+	if (r == dropped && evbuffer_get_length(output) == kept_len)
+		putchar('.');
+	else {
+		printf("\nFAIL: compaction dropped %ld frames (expected %d), length %zd (expected %zd)\n",
+			r, dropped, evbuffer_get_length(output), kept_len);
+		fail++;
+	}
+
+	r = rtcm_backlog_compact(chained);
+	if (r == dropped && evbuffer_get_length(chained) == kept_len
+	    && !memcmp(evbuffer_pullup(chained, -1), evbuffer_pullup(output, -1), kept_len))
+		putchar('.');
+	else {
+		printf("\nFAIL: compaction of a chained backlog dropped %ld frames (expected %d)\n", r, dropped);
+		fail++;
+	}
+	evbuffer_free(chained);
+	free(backlog);
+
+	/* Only one complete epoch left: nothing to compact */
+	if (rtcm_backlog_compact(output) == -1 && evbuffer_get_length(output) == kept_len)
+		putchar('.');
+	else {
+		printf("\nFAIL: compaction without a stale epoch\n");
+		fail++;
+	}
+	evbuffer_free(output);
+
+	/*
+	 * Packet ring mode: a subscriber lagging behind by more than the ring
+	 * size skips to the newest complete epoch.
+	 */
+	struct test_fanout fx;
+	test_fanout_init(&fx);
+	fx.config.zero_copy = 1;
+	fx.config.fanout_ring_size = 16;
+	fx.config.backlog_compaction = 1;
+	if (test_fanout_start(&fx, 1, 0) < 0) {
+		printf("\nFAIL: livesource creation\n");
+		return fail+1;
+	}
+	struct ntrip_state *sub = fx.subs[0];
+
+	/* Woken up for the first packet, then left out of the wait queue */
+	test_fanout_send(&fx, 1019, 0, 0);
+	test_fanout_read(sub, NULL, NULL, 1);
+
+	struct {
+		int type, mmb;
+	} ring_frames[] = {
+		{1006, 0},			// last 1006 before the newest epoch
+		{1005, 0},			// sent again after
+		{1077, 1},			// stale epoch
+		{1087, 0},
+		{1005, 0},			// newest complete epoch
+		{1077, 1},
+		{1087, 0}
+	};
+	int nring_frames = sizeof ring_frames / sizeof ring_frames[0];
+	int seq = 1;
+	for (int i = 0; i < 20; i++)
+		test_fanout_send(&fx, 1019, seq++, 0);
+	for (int i = 0; i < nring_frames; i++)
+		test_fanout_send(&fx, ring_frames[i].type, seq++, ring_frames[i].mmb);
+
+	int types[8];
+	int expected_types[] = {1006, 1005, 1077, 1087};
+	bufferevent_lock(sub->bev);
+	int nqueued = livesource_drain_subscriber(sub->subscription);
+	bufferevent_unlock(sub->bev);
+	int ntypes = test_fanout_read(sub, types, NULL, 8);
+	if (nqueued == 4 && ntypes == 4 && !memcmp(types, expected_types, sizeof expected_types)
+	    && atomic_load(&fx.livesource->ncompactions) == 1
+	    && atomic_load(&fx.livesource->compacted_frames) == 23)
+		putchar('.');
+	else {
+		printf("\nFAIL: ring compaction queued %d frames:", ntypes);
+		for (int i = 0; i < ntypes; i++)
+			printf(" %d", types[i]);
+		putchar('\n');
+		fail++;
+	}
+	test_fanout_stop(&fx);
+	test_fanout_free(&fx);
+
+	putchar('\n');
+	return fail;
+}
+
+/*
+ * Lock a subscriber and drain the livesource ring to its output.
+ */
+static int test_fanout_drain(struct ntrip_state *st) {
+	bufferevent_lock(st->bev);
+	int n = livesource_drain_subscriber(st->subscription);
+	bufferevent_unlock(st->bev);
+	return n;
+}
+
+/*
+ * Check the sequence numbers first to first+n-1 are in seqs, in order.
+ */
+static int test_fanout_check_seqs(int *seqs, int nseqs, int first, int n) {
+	if (nseqs != n)
+		return 0;
+	for (int i = 0; i < n; i++)
+		if (seqs[i] != first + i)
+			return 0;
+	return 1;
+}
+
+static int livesource_ring_test() {
+	int fail = 0;
+	int seqs[400];
+	int n;
+
+	puts("livesource_ring");
+
+	struct test_fanout fx;
+	test_fanout_init(&fx);
+	fx.config.zero_copy = 1;
+	fx.config.fanout_ring_size = 256;
+	if (test_fanout_start(&fx, 2, 0) < 0) {
+		printf("\nFAIL: livesource creation\n");
+		return 1;
+	}
+	struct ntrip_state *a = fx.subs[0], *b = fx.subs[1];
+
+	/* New subscribers wait for the next packet, and are woken up by the source */
+	test_fanout_send(&fx, 1019, 0, 0);
+	int na = test_fanout_read(a, NULL, seqs, 400);
+	int nb = test_fanout_read(b, NULL, seqs+1, 400);
+	if (na == 1 && nb == 1 && seqs[0] == 0 && seqs[1] == 0
+	    && a->subscription->ring_wait == SUBSCRIBER_WAIT_NONE)
+		putchar('.');
+	else {
+		printf("\nFAIL: wake up of waiting subscribers, got %d and %d packets\n", na, nb);
+		fail++;
+	}
+
+	/* Subscribers not waiting fetch the packets themselves, by batches */
+	for (int seq = 1; seq <= 100; seq++)
+		test_fanout_send(&fx, 1019, seq, 0);
+	na = test_fanout_read(a, NULL, seqs, 400);
+	int drained[3];
+	for (int i = 0; i < 3; i++) {
+		drained[i] = test_fanout_drain(a);
+		na += test_fanout_read(a, NULL, seqs+na, 400-na);
+	}
+	if (drained[0] == 64 && drained[1] == 36 && drained[2] == 0
+	    && test_fanout_check_seqs(seqs, na, 1, 100)
+	    && a->subscription->ring_wait == SUBSCRIBER_WAIT_QUEUED)
+		putchar('.');
+	else {
+		printf("\nFAIL: drain by batches, %d %d %d\n", drained[0], drained[1], drained[2]);
+		fail++;
+	}
+
+	/*
+	 * Wrap around the ring: packets are freed once overwritten and sent.
+	 * a keeps up, b lags behind by more than the ring size.
+	 */
+	struct packet *held = test_fanout_packet(&fx, 1019, 101, 0);
+	bufferevent_lock(fx.source->bev);
+	livesource_send_subscribers(fx.livesource, held, &fx.caster);
+	bufferevent_unlock(fx.source->bev);
+	na = test_fanout_read(a, NULL, seqs, 400);
+	for (int seq = 102; seq <= 400; seq++) {
+		test_fanout_send(&fx, 1019, seq, 0);
+		if (seq % 50 == 0) {
+			test_fanout_drain(a);
+			na += test_fanout_read(a, NULL, seqs+na, 400-na);
 		}
-		printf("sourcetable test from %s -> %.3f %.3f\n", *gga, pos.lat, pos.lon);
-		struct dist_table *s = sourcetable_find_pos(sourcetable, &pos);
-		if (s == NULL) {
+	}
+	while (test_fanout_drain(a) > 0)
+		na += test_fanout_read(a, NULL, seqs+na, 400-na);
+	if (fx.livesource->ring_head == 401 && atomic_load(&held->refcnt) == 1
+	    && test_fanout_check_seqs(seqs, na, 101, 300))
+		putchar('.');
+	else {
+		printf("\nFAIL: ring wrap around, %d packets, refcnt %d\n", na, atomic_load(&held->refcnt));
+		fail++;
+	}
+	packet_free(held);
+
+	n = test_fanout_drain(b);
+	nb = test_fanout_read(b, NULL, seqs, 400);
+	if (n == -1 && nb == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: lagging subscriber drain returned %d\n", n);
+		fail++;
+	}
+	test_fanout_stop(&fx);
+	test_fanout_free(&fx);
+
+	/*
+	 * With an event loop: waiting subscribers are woken up by the ring event,
+	 * stalled ones are dropped on its timeout.
+	 */
+	test_fanout_init(&fx);
+	fx.config.zero_copy = 1;
+	fx.config.fanout_ring_size = 16;
+	if (test_fanout_start(&fx, 2, 1) < 0) {
+		printf("\nFAIL: livesource creation\n");
+		return fail+1;
+	}
+	a = fx.subs[0];
+	b = fx.subs[1];
+
+	test_fanout_send(&fx, 1019, 0, 0);
+	int early = test_fanout_read(a, NULL, NULL, 400);
+	event_base_loop(fx.base, EVLOOP_NONBLOCK);
+	na = test_fanout_read(a, NULL, seqs, 400);
+	nb = test_fanout_read(b, NULL, seqs+1, 400);
+	if (early == 0 && na == 1 && nb == 1 && seqs[0] == 0 && seqs[1] == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: wake up from the event loop, got %d and %d packets\n", na, nb);
+		fail++;
+	}
+
+	/* b doesn't drain anymore, as on a stalled socket */
+	for (int seq = 1; seq <= 40; seq++) {
+		test_fanout_send(&fx, 1019, seq, 0);
+		if (seq % 10 == 0)
+			test_fanout_drain(a);
+	}
+	test_fanout_read(a, NULL, NULL, 400);
+
+	/* Drained since the previous check, hence not stalled yet */
+	event_active(fx.livesource->ring_ev, EV_TIMEOUT, 0);
+	event_base_loop(fx.base, EVLOOP_NONBLOCK);
+	int nsubs_before = fx.livesource->nsubs;
+	event_active(fx.livesource->ring_ev, EV_TIMEOUT, 0);
+	event_base_loop(fx.base, EVLOOP_NONBLOCK);
+	if (nsubs_before == 2 && fx.livesource->nsubs == 1
+	    && TAILQ_FIRST(&fx.livesource->subscribers)->ntrip_state == a
+	    && atomic_load(&fx.log.dropped) == 1 && atomic_load(&fx.log.mismatches) == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: stalled subscriber check, %d then %d subscribers, %d dropped\n",
+			nsubs_before, fx.livesource->nsubs, atomic_load(&fx.log.dropped));
+		fail++;
+	}
+	test_fanout_stop(&fx);
+	test_fanout_free(&fx);
+
+	putchar('\n');
+	return fail;
+}
+
+/*
+ * Check a subscriber output holds the given packets, in order,
+ * and drain it.
+ */
+static int test_fanout_check_output(struct ntrip_state *st, struct packet **packets, int npackets) {
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	unsigned char frame[64];
+	int r = 1;
+	evbuffer_unfreeze(output, 1);
+	for (int i = 0; i < npackets; i++) {
+		size_t len = packets[i]->datalen;
+		if (evbuffer_remove(output, frame, len) != len || memcmp(frame, packets[i]->data, len)) {
+			r = 0;
+			break;
+		}
+	}
+	r = r && evbuffer_get_length(output) == 0;
+	evbuffer_freeze(output, 1);
+	return r;
+}
+
+/*
+ * Packet batches larger than LIVESOURCE_SEND_BATCH, in copy and zero-copy modes.
+ */
+static int livesource_batch_test() {
+	int fail = 0;
+	struct packet *packets[150];
+	int npackets = sizeof packets / sizeof packets[0];
+	static const int types[] = {1005, 1019, 1077};
+
+	puts("livesource_send_subscribers_batch");
+
+	for (int zero_copy = 0; zero_copy <= 1; zero_copy++) {
+		struct test_fanout fx;
+		test_fanout_init(&fx);
+		fx.config.zero_copy = zero_copy;
+		if (test_fanout_start(&fx, 3, 0) < 0) {
+			printf("\nFAIL: livesource creation\n");
+			return fail+1;
+		}
+		for (int i = 0; i < npackets; i++)
+			packets[i] = test_fanout_packet(&fx, types[i % 3], i, 0);
+
+		bufferevent_lock(fx.source->bev);
+		int n = livesource_send_subscribers_batch(fx.livesource, packets, npackets, &fx.caster);
+		bufferevent_unlock(fx.source->bev);
+
+		/* Sent by batches of 64, each logged when crossing a multiple of 100 */
+		if (n == 3 && atomic_load(&fx.livesource->npackets) == npackets
+		    && fx.log.nsent == 2 && fx.log.sent[0] == LIVESOURCE_SEND_BATCH && fx.log.sent[1] == 2*LIVESOURCE_SEND_BATCH)
+			putchar('.');
+		else {
+			printf("\nFAIL: batch sent to %d subscribers, %d packet counts logged\n", n, fx.log.nsent);
+			fail++;
+		}
+
+		int complete = 1;
+		for (int i = 0; i < fx.nsubs; i++)
+			if (!test_fanout_check_output(fx.subs[i], packets, npackets))
+				complete = 0;
+		if (complete)
+			putchar('.');
+		else {
+			printf("\nFAIL: batch output%s\n", zero_copy ? " in zero-copy mode" : "");
+			fail++;
+		}
+
+		/* Only our references are left once the outputs are drained */
+		int refs = 1;
+		for (int i = 0; i < npackets; i++) {
+			if (zero_copy && atomic_load(&packets[i]->refcnt) != 1)
+				refs = 0;
+			packet_free(packets[i]);
+		}
+		if (refs)
+			putchar('.');
+		else {
+			printf("\nFAIL: packet references left after a batch\n");
+			fail++;
+		}
+		test_fanout_stop(&fx);
+		test_fanout_free(&fx);
+	}
+
+	putchar('\n');
+	return fail;
+}
+
+static void *test_fanout_worker(void *arg) {
+	struct caster_state *caster = (struct caster_state *)arg;
+	joblist_run(caster->joblist);
+	return NULL;
+}
+
+/*
+ * Parallel fan-out by partitions, with worker threads.
+ */
+static int livesource_fanout_test() {
+	int fail = 0;
+	int nsubs = 20;
+	int seqs[20][256];
+	int nseqs[20];
+	pthread_t workers[2];
+	int nworkers = sizeof workers / sizeof workers[0];
+
+	puts("livesource_fanout");
+
+	int threads_saved = threads, nthreads_saved = nthreads;
+	threads = 1;
+	nthreads = nworkers + 1;
+	evthread_use_pthreads();
+
+	struct test_fanout fx;
+	test_fanout_init(&fx);
+	fx.config.zero_copy = 1;
+	fx.config.fanout_partition_size = 4;
+	fx.config.backlog_evbuffer = 100000;
+	pthread_key_create(&fx.caster.thread_id, NULL);
+	fx.caster.joblist = joblist_new(&fx.caster);
+	if (test_fanout_start(&fx, nsubs, 0) < 0) {
+		printf("\nFAIL: livesource creation\n");
+		return 1;
+	}
+	memset(nseqs, 0, sizeof nseqs);
+
+	/*
+	 * No worker yet: the source sends all partitions itself, the fan-out
+	 * jobs run later, after the packets and snapshot are released.
+	 */
+	int seq = 0;
+	for (; seq < 10; seq++)
+		test_fanout_send(&fx, 1019, seq, 0);
+	int complete = 1;
+	for (int i = 0; i < nsubs; i++) {
+		nseqs[i] = test_fanout_read(fx.subs[i], NULL, seqs[i], 256);
+		if (!test_fanout_check_seqs(seqs[i], nseqs[i], 0, seq))
+			complete = 0;
+	}
+	if (complete)
+		putchar('.');
+	else {
+		printf("\nFAIL: fan-out without workers\n");
+		fail++;
+	}
+
+	for (int i = 0; i < nworkers; i++)
+		pthread_create(&workers[i], NULL, test_fanout_worker, &fx.caster);
+
+	/* One backlogged subscriber in each partition */
+	for (int i = 1; i < nsubs; i += 4) {
+		char *backlog = (char *)calloc(1, fx.config.backlog_evbuffer+1);
+		evbuffer_add(bufferevent_get_output(fx.subs[i]->bev), backlog, fx.config.backlog_evbuffer+1);
+		free(backlog);
+	}
+	for (; seq < 250; seq++)
+		test_fanout_send(&fx, 1019, seq, 0);
+
+	complete = 1;
+	for (int i = 0; i < nsubs; i++) {
+		if (i % 4 == 1)
+			/* Dropped */
 			continue;
+		nseqs[i] += test_fanout_read(fx.subs[i], NULL, seqs[i]+nseqs[i], 256-nseqs[i]);
+		if (!test_fanout_check_seqs(seqs[i], nseqs[i], 0, seq))
+			complete = 0;
+	}
+	if (complete)
+		putchar('.');
+	else {
+		printf("\nFAIL: fan-out with workers\n");
+		fail++;
+	}
+	if (fx.livesource->nsubs == 15 && atomic_load(&fx.log.dropped) == 5 && atomic_load(&fx.log.mismatches) == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: %d subscribers left, %d backlogged dropped, %d mismatches\n",
+			fx.livesource->nsubs, atomic_load(&fx.log.dropped), atomic_load(&fx.log.mismatches));
+		fail++;
+	}
+
+	/* Sessions are freed by the workers, before they stop */
+	test_fanout_stop(&fx);
+	for (int i = 0; i < nworkers; i++)
+		joblist_append_stop(fx.caster.joblist);
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	if (fx.caster.ntrips.n == 0 && fx.caster.ntrips.nfree == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: %d sessions left, %d to free\n", fx.caster.ntrips.n, fx.caster.ntrips.nfree);
+		fail++;
+	}
+
+	test_fanout_free(&fx);
+	joblist_free(fx.caster.joblist);
+	pthread_key_delete(fx.caster.thread_id);
+	threads = threads_saved;
+	nthreads = nthreads_saved;
+
+	putchar('\n');
+	return fail;
+}
+
+static int rtcm_replay_test() {
+	int fail = 0;
+	unsigned char frame[1030];
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	caster.config = &config;
+	st.caster = &caster;
+	st.mountpoint = "TEST";
+	st.input = evbuffer_new();
+	st.rtcm_info = rtcm_info_new();
+
+	puts("rtcm_info_replay");
+
+	struct {
+		int type, len, mmb, sat, kept;
+	} frames[] = {
+		{1005, 19, 0, 0, 1},
+		{1019, 61, 0, 5, 0},		// superseded by the next one
+		{1019, 61, 0, 5, 1},
+		{1019, 61, 0, 6, 1},
+		{1077, 300, 1, 0, 0},		// previous epoch
+		{1087, 200, 0, 0, 0},
+		{1230, 6, 0, 0, 0},		// not cached
+		{1077, 300, 1, 0, 1},		// last complete epoch
+		{1087, 200, 0, 0, 1},
+		{1097, 200, 1, 0, 0}		// incomplete epoch
+	};
+	size_t kept_len = 0;
+	for (int i = 0; i < sizeof frames / sizeof frames[0]; i++) {
+		int len = test_rtcm_frame(frame, frames[i].type, frames[i].len, frames[i].mmb);
+		if (frames[i].sat) {
+			/* Satellite id in bits 12-17, recompute the CRC */
+			test_rtcm_setbits(frame, 12, 6, frames[i].sat);
+			test_rtcm_frame_crc(frame, len);
 		}
-		dist_table_display(stdout, s, 10);
-		dist_table_free(s);
+		evbuffer_add(st.input, frame, len);
+		if (frames[i].kept)
+			kept_len += len;
+	}
+	rtcm_packet_handle(&st);
+
+	struct evbuffer *output = evbuffer_new();
+	size_t r = rtcm_info_replay(st.rtcm_info, output, NULL, SIZE_MAX);
+	if (r == kept_len && evbuffer_get_length(output) == kept_len)
+		putchar('.');
+	else {
+		printf("\nFAIL: replayed %zd bytes, expected %zd\n", r, kept_len);
+		fail++;
+	}
+
+	/* Filtered replay */
+	struct rtcm_filter *filter = rtcm_filter_new();
+	rtcm_filter_set_types(filter, "1005,1087");
+	evbuffer_drain(output, evbuffer_get_length(output));
+	r = rtcm_info_replay(st.rtcm_info, output, filter, SIZE_MAX);
+	if (r == 25+206)
+		putchar('.');
+	else {
+		printf("\nFAIL: replayed %zd filtered bytes, expected %d\n", r, 25+206);
+		fail++;
+	}
+
+	/* Decimated replay: the cached epoch is sent, and counts as the last one forwarded */
+	rtcm_filter_free(filter);
+	filter = rtcm_filter_new();
+	filter->decimation_ms = 5000;
+	evbuffer_drain(output, evbuffer_get_length(output));
+	r = rtcm_info_replay(st.rtcm_info, output, filter, SIZE_MAX);
+	if (r == kept_len && evbuffer_get_length(output) == kept_len && !filter->in_epoch && filter->last_epoch_ms == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: replayed %zd decimated bytes, expected %zd\n", r, kept_len);
+		fail++;
+	}
+	rtcm_filter_free(filter);
+
+	/* Capped replay: the epoch is kept whole, one ephemeris less */
+	evbuffer_drain(output, evbuffer_get_length(output));
+	r = rtcm_info_replay(st.rtcm_info, output, NULL, kept_len - 1);
+	if (r == kept_len - 67)
+		putchar('.');
+	else {
+		printf("\nFAIL: replayed %zd bytes with a cap, expected %zd\n", r, kept_len - 67);
+		fail++;
+	}
+	evbuffer_drain(output, evbuffer_get_length(output));
+	r = rtcm_info_replay(st.rtcm_info, output, NULL, 25+67+67);
+	if (r == 25+67+67)
+		putchar('.');
+	else {
+		printf("\nFAIL: replayed %zd bytes without room for the epoch, expected %d\n", r, 25+67+67);
+		fail++;
 	}
+
+	/* Expired GPS ephemeris */
+	st.rtcm_info->replay_ephemeris_time[0][5] -= 7201;
+	evbuffer_drain(output, evbuffer_get_length(output));
+	r = rtcm_info_replay(st.rtcm_info, output, NULL, SIZE_MAX);
+	if (r == kept_len - 67)
+		putchar('.');
+	else {
+		printf("\nFAIL: replayed %zd bytes with an expired ephemeris, expected %zd\n", r, kept_len - 67);
+		fail++;
+	}
+
+	evbuffer_free(output);
+	evbuffer_free(st.input);
+	rtcm_info_free(st.rtcm_info);
+	putchar('\n');
+	return fail;
 }
-#endif
 
-int main() {
+static int rtcm_framer_test() {
 	int fail = 0;
-	fail += gga_test();
-	fail += b64_test();
-	fail += test_ip_analyze_prefixquota();
-	fail += urldecode_test();
+	unsigned char stream[2000];
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	caster.config = &config;
+	st.caster = &caster;
+	st.mountpoint = "TEST";
+	st.input = evbuffer_new();
+	st.rtcm_info = rtcm_info_new();
+
+	puts("rtcm_packet_handle");
+
+	/* Garbage, 3 frames, then the start of a 4th frame */
+	int len = 0;
+	memcpy(stream, "\x01\x02\x03\x04\x05", 5);
+	len += 5;
+	len += test_rtcm_frame(stream+len, 1005, 19, 0);
+	len += test_rtcm_frame(stream+len, 1077, 300, 1);
+	len += test_rtcm_frame(stream+len, 1087, 200, 0);
+	size_t frames_len = len - 5;
+	int len1019 = test_rtcm_frame(stream+len, 1019, 61, 0);
+
+	/* Feed the stream in small chains */
+	srandom(2);
+	for (int i = 0; i < len+20; ) {
+		int n = 1 + random() % 7;
+		if (i + n > len+20)
+			n = len+20 - i;
+		evbuffer_add_reference(st.input, stream+i, n, NULL, NULL);
+		i += n;
+	}
+	rtcm_packet_handle(&st);
+
+	struct evbuffer *output = evbuffer_new();
+	size_t replayed = rtcm_info_replay(st.rtcm_info, output, NULL, SIZE_MAX);
+	if (evbuffer_get_length(st.input) == 20 && st.received_bytes == frames_len + 5
+	    && st.received_bytes - st.dropped_bytes == frames_len && replayed == frames_len
+	    && !memcmp(evbuffer_pullup(output, -1), stream+5, frames_len))
+		putchar('.');
+	else {
+		printf("\nFAIL: %zd bytes left, %llu received, %zd replayed\n",
+			evbuffer_get_length(st.input), st.received_bytes, replayed);
+		fail++;
+	}
+
+	/* End of the last frame */
+	evbuffer_add_reference(st.input, stream+len+20, len1019-20, NULL, NULL);
+	rtcm_packet_handle(&st);
+	evbuffer_drain(output, evbuffer_get_length(output));
+	replayed = rtcm_info_replay(st.rtcm_info, output, NULL, SIZE_MAX);
+	if (evbuffer_get_length(st.input) == 0 && replayed == frames_len + len1019)
+		putchar('.');
+	else {
+		printf("\nFAIL: %zd bytes left, %zd replayed\n", evbuffer_get_length(st.input), replayed);
+		fail++;
+	}
+
+	/*
+	 * Strict mode: garbage, a false header match, a corrupted frame
+	 * and trailing garbage are dropped.
+	 */
+	rtcm_info_free(st.rtcm_info);
+	st.rtcm_info = rtcm_info_new();
+	config.rtcm_strict = 1;
+	st.received_bytes = 0;
+	st.dropped_bytes = 0;
+	len = 0;
+	memcpy(stream, "\x01\x02\x03\x04\x05", 5);
+	len += 5;
+	int len1005 = test_rtcm_frame(stream+len, 1005, 19, 0);
+	len += len1005;
+	memcpy(stream+len, "\xd3\x00\x02\xaa\xbb", 5);
+	len += 5;
+	int len1077 = test_rtcm_frame(stream+len, 1077, 300, 0);
+	len += len1077;
+	len += test_rtcm_frame(stream+len, 1019, 61, 0);
+	stream[len-20] ^= 0x10;
+	memcpy(stream+len, "xyz", 3);
+	len += 3;
+	evbuffer_add(st.input, stream, len);
+	rtcm_packet_handle(&st);
+	evbuffer_drain(output, evbuffer_get_length(output));
+	replayed = rtcm_info_replay(st.rtcm_info, output, NULL, SIZE_MAX);
+	size_t dropped = len - len1005 - len1077;
+	if (evbuffer_get_length(st.input) == 0 && replayed == len1005 + len1077
+	    && st.dropped_bytes == dropped && st.rtcm_info->dropped_bytes == dropped
+	    && st.received_bytes == len && st.received_bytes - st.dropped_bytes == replayed)
+		putchar('.');
+	else {
+		printf("\nFAIL: strict mode %zd bytes left, %zd replayed, %llu received, %llu dropped\n",
+			evbuffer_get_length(st.input), replayed, st.received_bytes, st.dropped_bytes);
+		fail++;
+	}
+
+	evbuffer_free(output);
+	evbuffer_free(st.input);
+	rtcm_info_free(st.rtcm_info);
+	putchar('\n');
+	return fail;
+}
+
+static int rtcm_filter_test() {
+	int fail = 0;
+	puts("rtcm_filter");
+
+	struct {
+		char *types;
+		int valid;
+	} parse_tests[] = {
+		{"1005,1077,1097", 1},
+		{"4072", 1},
+		{"", 0},
+		{"1005,", 1},
+		{"1005,,1077", 0},
+		{"999", 0},
+		{"1231", 0},
+		{"1077x", 0},
+		{"abc", 0}
+	};
+	for (int i = 0; i < sizeof parse_tests / sizeof parse_tests[0]; i++) {
+		struct rtcm_filter *filter = rtcm_filter_new();
+		if ((rtcm_filter_set_types(filter, parse_tests[i].types) == 0) == parse_tests[i].valid)
+			putchar('.');
+		else {
+			printf("\nFAIL: rtcm_filter_set_types(\"%s\")\n", parse_tests[i].types);
+			fail++;
+		}
+		rtcm_filter_free(filter);
+	}
+
+	struct rtcm_filter *filter = rtcm_filter_new();
+	rtcm_filter_set_types(filter, "1005,1077,1097,4072");
+	struct {
+		int type, pass;
+	} check_tests[] = {
+		{1005, 1}, {1077, 1}, {1097, 1}, {4072, 1},
+		{1006, 0}, {1087, 0}, {1230, 0}, {4073, 0},
+		{-1, 1}
+	};
+	for (int i = 0; i < sizeof check_tests / sizeof check_tests[0]; i++) {
+		if (!!rtcm_filter_check(filter, check_tests[i].type) == check_tests[i].pass)
+			putchar('.');
+		else {
+			printf("\nFAIL: rtcm_filter_check %d\n", check_tests[i].type);
+			fail++;
+		}
+	}
+	rtcm_filter_free(filter);
+	if (rtcm_filter_check(NULL, 1077))
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_filter_check without filter\n");
+		fail++;
+	}
+
+	/*
+	 * Decimation of a 5 Hz stream to 1 Hz: epochs of GPS + GLONASS MSM,
+	 * with a station message every 300 ms.
+	 */
+	struct config config;
+	struct caster_state caster;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	caster.config = &config;
+	unsigned char frame[300];
+
+	filter = rtcm_filter_new();
+	filter->decimation_ms = 1000;
+	int nepochs = 0, nstation = 0;
+	long tow0 = 7*86400000L - 600;		// crosses the week boundary
+	for (long t = 0; t <= 2000; t += 100) {
+		int types[] = {1077, 1087};
+		long tow = (tow0 + t) % (7*86400000L);
+		int len;
+		struct packet *p;
+		if (t % 200 == 0)
+			for (int i = 0; i < 2; i++) {
+				len = test_rtcm_frame(frame, types[i], 100, i == 0);
+				if (types[i] == 1087) {
+					/* GLONASS day of week and Moscow time of day */
+					long glo = tow + 3*3600000L - 18000;
+					test_rtcm_setbits(frame, 24, 3, (glo / 86400000L) % 7);
+					test_rtcm_setbits(frame, 27, 27, glo % 86400000L);
+				} else
+					test_rtcm_setbits(frame, 24, 30, tow);
+				test_rtcm_frame_crc(frame, len);
+				p = packet_new(len, &caster);
+				memcpy(p->data, frame, len);
+				rtcm_packet_set_info(p);
+				if (p->rtcm_epoch_ms != tow) {
+					printf("\nFAIL: type %d epoch %ld, expected %ld\n", types[i], p->rtcm_epoch_ms, tow);
+					fail++;
+				}
+				if (rtcm_filter_packet(filter, p) && i == 1)
+					nepochs++;
+				packet_free(p);
+			}
+		if (t % 300 == 0) {
+			len = test_rtcm_frame(frame, 1005, 19, 0);
+			p = packet_new(len, &caster);
+			memcpy(p->data, frame, len);
+			rtcm_packet_set_info(p);
+			if (rtcm_filter_packet(filter, p))
+				nstation++;
+			packet_free(p);
+		}
+	}
+	if (nepochs == 3 && nstation == 7)
+		putchar('.');
+	else {
+		printf("\nFAIL: decimation sent %d epochs (expected 3), %d station messages (expected 7)\n", nepochs, nstation);
+		fail++;
+	}
+	rtcm_filter_free(filter);
+
+	putchar('\n');
+	return fail;
+}
+
+static int rtcm_msm_test() {
+	int fail = 0;
+	unsigned char frame[100];
+	struct rtcm_msm_header h;
+	puts("rtcm_msm");
+
+	/* Satellites 1, 5, 10, signals 2 and 16, 5 cells out of 6 */
+	int len = test_rtcm_frame(frame, 1077, 40, 1);
+	test_rtcm_setbits(frame, 12, 12, 2048);
+	test_rtcm_setbits(frame, 24, 30, 345678);
+	test_rtcm_setbits(frame, 55, 3, 5);
+	test_rtcm_setbits(frame, 73, 1, 1);
+	test_rtcm_setbits(frame, 77, 1, 1);
+	test_rtcm_setbits(frame, 82, 1, 1);
+	test_rtcm_setbits(frame, 138, 1, 1);
+	test_rtcm_setbits(frame, 152, 1, 1);
+	test_rtcm_setbits(frame, 169, 6, 0x3b);
+	test_rtcm_frame_crc(frame, len);
+	if (rtcm_msm_header_decode(frame, len, &h) == 0
+	    && h.gnss == 0 && h.msm == 7 && h.station_id == 2048 && h.epoch_ms == 345678
+	    && h.mmb == 1 && h.iods == 5 && h.sat_mask == 0x8840000000000000UL && h.sig_mask == 0x40010000
+	    && h.nsat == 3 && h.nsig == 2 && h.ncell == 5)
+		putchar('.');
+	else {
+		printf("\nFAIL: MSM header decoding\n");
+		fail++;
+	}
+
+	/* Truncated cell mask */
+	len = test_rtcm_frame(frame, 1077, 21, 0);
+	if (rtcm_msm_header_decode(frame, len, &h) == -1)
+		putchar('.');
+	else {
+		printf("\nFAIL: truncated MSM header decoded\n");
+		fail++;
+	}
+	len = test_rtcm_frame(frame, 1005, 19, 0);
+	if (rtcm_msm_header_decode(frame, len, &h) == -1)
+		putchar('.');
+	else {
+		printf("\nFAIL: 1005 decoded as MSM\n");
+		fail++;
+	}
+
+	/*
+	 * Epoch metrics: GPS + Galileo epochs received 1 s after their epoch time,
+	 * one interrupted epoch and one missing Galileo.
+	 */
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	caster.config = &config;
+	st.caster = &caster;
+	st.mountpoint = "TEST";
+	st.input = evbuffer_new();
+	st.rtcm_info = rtcm_info_new();
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long gps_ms = ((now.tv_sec - RTCM_GPS_EPOCH_UNIX) % (RTCM_WEEK_MS/1000)) * 1000 + now.tv_usec / 1000 + RTCM_LEAP_MS;
+	struct {
+		int type, mmb, epoch;
+	} frames[] = {
+		{1077, 1, 0}, {1097, 0, 0},
+		{1077, 1, 1},			// interrupted
+		{1077, 1, 2}, {1097, 0, 2},
+		{1077, 0, 3}			// Galileo missing
+	};
+	for (int i = 0; i < sizeof frames / sizeof frames[0]; i++) {
+		len = test_rtcm_frame(frame, frames[i].type, 40, frames[i].mmb);
+		test_rtcm_setbits(frame, 24, 30, (gps_ms - 4000 + frames[i].epoch*1000) % RTCM_WEEK_MS);
+		test_rtcm_setbits(frame, 73, 4, 0xf);
+		test_rtcm_setbits(frame, 137, 1, 1);
+		test_rtcm_setbits(frame, 169, 4, 0xf);
+		test_rtcm_frame_crc(frame, len);
+		evbuffer_add(st.input, frame, len);
+	}
+	rtcm_packet_handle(&st);
+
+	struct rtcm_info *rp = st.rtcm_info;
+	if (rp->msm_nepochs == 4 && rp->msm_nepochs_incomplete == 2
+	    && !rp->msm_last.complete && rp->msm_last.gnss == 1 && rp->msm_last.nsat[0] == 4
+	    && rp->latency_ms >= 900 && rp->latency_ms < 3000)
+		putchar('.');
+	else {
+		printf("\nFAIL: MSM metrics %lu epochs, %lu incomplete, latency %ld ms\n",
+			rp->msm_nepochs, rp->msm_nepochs_incomplete, rp->latency_ms);
+		fail++;
+	}
+
+	evbuffer_free(st.input);
+	rtcm_info_free(st.rtcm_info);
+	putchar('\n');
+	return fail;
+}
+
+static int rtcm_stats_test() {
+	int fail = 0;
+	unsigned char frame[300];
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	caster.config = &config;
+	st.caster = &caster;
+	st.mountpoint = "TEST";
+	st.input = evbuffer_new();
+	st.rtcm_info = rtcm_info_new();
+	struct rtcm_info *rp = st.rtcm_info;
+
+	puts("rtcm_type_stats");
+
+	int len1077 = 0, len1230 = 0;
+	for (int i = 0; i < 10; i++) {
+		len1077 = test_rtcm_frame(frame, 1077, 200, 0);
+		evbuffer_add(st.input, frame, len1077);
+		if (i % 5 == 0) {
+			len1230 = test_rtcm_frame(frame, 1230, 10, 0);
+			evbuffer_add(st.input, frame, len1230);
+		}
+	}
+	rtcm_packet_handle(&st);
+
+	struct rtcm_type_stats *ts1077 = &rp->type_stats[1077-RTCM_1K_MIN];
+	struct rtcm_type_stats *ts1230 = &rp->type_stats[1230-RTCM_1K_MIN];
+	if (ts1077->count == 10 && ts1077->bytes == 10*len1077
+	    && ts1230->count == 2 && ts1230->bytes == 2*len1230
+	    && rp->type_stats[1005-RTCM_1K_MIN].count == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: type counters 1077 %lu/%lu, 1230 %lu/%lu\n",
+			ts1077->count, ts1077->bytes, ts1230->count, ts1230->bytes);
+		fail++;
+	}
+
+	/* Rates after one time constant */
+	rp->rate_date.tv_sec -= RTCM_RATE_TAU;
+	test_rtcm_frame(frame, 1230, 10, 0);
+	evbuffer_add(st.input, frame, len1230);
+	rtcm_packet_handle(&st);
+	double alpha = 1 - exp(-1);
+	if (fabs(ts1077->rate - alpha*10/RTCM_RATE_TAU) < 0.01
+	    && fabs(ts1230->rate - alpha*3/RTCM_RATE_TAU) < 0.01
+	    && fabs(ts1230->byte_rate - alpha*3*len1230/RTCM_RATE_TAU) < 0.1
+	    && ts1230->tick_count == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: type rates 1077 %f, 1230 %f\n", ts1077->rate, ts1230->rate);
+		fail++;
+	}
+
+	evbuffer_free(st.input);
+	rtcm_info_free(st.rtcm_info);
+	putchar('\n');
+	return fail;
+}
+
+static int rtcm_msm4_test() {
+	int fail = 0;
+	unsigned char frame[100], out[100];
+	puts("rtcm_msm7_to_msm4");
+
+	/* 2 satellites, 2 signals, 3 cells */
+	int len = test_rtcm_frame(frame, 1077, 61, 1);
+	test_rtcm_setbits(frame, 24, 30, 123456);
+	test_rtcm_setbits(frame, 73, 2, 3);
+	test_rtcm_setbits(frame, 137, 2, 3);
+	test_rtcm_setbits(frame, 169, 4, 0xd);
+	int hlen = 173, sat = hlen, sig = hlen + 36*2;
+	long rough[] = {70, 75}, rough_mod[] = {500, 600};
+	for (int i = 0; i < 2; i++) {
+		test_rtcm_setbits(frame, sat + 8*i, 8, rough[i]);
+		test_rtcm_setbits(frame, sat + 16 + 4*i, 4, 0xf);
+		test_rtcm_setbits(frame, sat + 24 + 10*i, 10, rough_mod[i]);
+		test_rtcm_setbits(frame, sat + 44 + 14*i, 14, 0x1fff);
+	}
+	long pr[] = {1000, -(1L<<19), (1L<<19)-1};
+	long cp[] = {4001, -5, -(1L<<23)};
+	long lti[] = {20, 100, 704};
+	long half[] = {0, 1, 0};
+	long cnr[] = {16*45+7, 0, 1023};
+	for (int i = 0; i < 3; i++) {
+		test_rtcm_setbits(frame, sig + 20*i, 20, pr[i] & 0xfffff);
+		test_rtcm_setbits(frame, sig + 60 + 24*i, 24, cp[i] & 0xffffff);
+		test_rtcm_setbits(frame, sig + 132 + 10*i, 10, lti[i]);
+		test_rtcm_setbits(frame, sig + 162 + i, 1, half[i]);
+		test_rtcm_setbits(frame, sig + 165 + 10*i, 10, cnr[i]);
+		test_rtcm_setbits(frame, sig + 195 + 15*i, 15, 0x1234);
+	}
+	test_rtcm_frame_crc(frame, len);
+
+	int olen = rtcm_msm7_to_msm4(frame, len, out);
+	unsigned char check[100];
+	memcpy(check, out, olen);
+	test_rtcm_frame_crc(check, olen);
+	struct rtcm_msm_header h;
+	if (olen == 51 && rtcm_frame_type(out, olen) == 1074 && !memcmp(check, out, olen)
+	    && rtcm_msm_header_decode(out, olen, &h) == 0
+	    && h.msm == 4 && h.mmb == 1 && h.epoch_ms == 123456 && h.nsat == 2 && h.nsig == 2 && h.ncell == 3)
+		putchar('.');
+	else {
+		printf("\nFAIL: MSM4 frame length %d type %d\n", olen, rtcm_frame_type(out, olen));
+		fail++;
+	}
+
+	int osig = hlen + 18*2;
+	long epr[] = {31, -(1L<<14), (1L<<14)-1};
+	long ecp[] = {1000, -1, -(1L<<21)};
+	long elti[] = {0, 3, 15};
+	long ecnr[] = {45, 0, 63};
+	int ok = 1;
+	const unsigned char *payload = out + 3;
+	size_t plen = olen - 3;
+	for (int i = 0; i < 2; i++)
+		ok &= rtcm_bits(payload, plen, hlen + 8*i, 8) == rough[i]
+			&& rtcm_bits(payload, plen, hlen + 16 + 10*i, 10) == rough_mod[i];
+	for (int i = 0; i < 3; i++)
+		ok &= rtcm_sbits(payload, plen, osig + 15*i, 15) == epr[i]
+			&& rtcm_sbits(payload, plen, osig + 45 + 22*i, 22) == ecp[i]
+			&& rtcm_bits(payload, plen, osig + 111 + 4*i, 4) == elti[i]
+			&& rtcm_bits(payload, plen, osig + 123 + i, 1) == half[i]
+			&& rtcm_bits(payload, plen, osig + 126 + 6*i, 6) == ecnr[i];
+	if (ok)
+		putchar('.');
+	else {
+		printf("\nFAIL: MSM4 field conversion\n");
+		fail++;
+	}
+
+	/* Not MSM7 */
+	len = test_rtcm_frame(frame, 1074, 61, 0);
+	if (rtcm_msm7_to_msm4(frame, len, out) == -1)
+		putchar('.');
+	else {
+		printf("\nFAIL: MSM4 frame transcoded\n");
+		fail++;
+	}
+
+	/*
+	 * Transcoding in the framer, selected by the subscriber filter
+	 */
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	config.msm4_transcoding = 1;
+	caster.config = &config;
+	st.caster = &caster;
+	st.mountpoint = "TEST";
+	st.input = evbuffer_new();
+	st.rtcm_info = rtcm_info_new();
+
+	len = test_rtcm_frame(frame, 1077, 61, 0);
+	test_rtcm_setbits(frame, 73, 2, 3);
+	test_rtcm_setbits(frame, 137, 2, 3);
+	test_rtcm_setbits(frame, 169, 4, 0xd);
+	test_rtcm_frame_crc(frame, len);
+	evbuffer_add(st.input, frame, len);
+	rtcm_packet_handle(&st);
+
+	struct evbuffer *output = evbuffer_new();
+	struct rtcm_filter *filter = rtcm_filter_new();
+	size_t r7 = rtcm_info_replay(st.rtcm_info, output, filter, SIZE_MAX);
+	filter->msm4 = 1;
+	size_t r4 = rtcm_info_replay(st.rtcm_info, output, filter, SIZE_MAX);
+	rtcm_filter_set_types(filter, "1077");
+	size_t r0 = rtcm_info_replay(st.rtcm_info, output, filter, SIZE_MAX);
+	if (r7 == len && r4 == 51 && r0 == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: MSM4 replay %zd %zd %zd\n", r7, r4, r0);
+		fail++;
+	}
+	rtcm_filter_free(filter);
+	evbuffer_free(output);
+	evbuffer_free(st.input);
+	rtcm_info_free(st.rtcm_info);
+	putchar('\n');
+	return fail;
+}
+
+static int test_rtcm_decode_calls;
+
+static void test_rtcm_decode_handler(struct rtcm_frame *frame, void *arg) {
+	if (frame->type == 4095)
+		test_rtcm_decode_calls++;
+}
+
+static int rtcm_decode_test() {
+	int fail = 0;
+	unsigned char frame[40];
+	struct rtcm_frame f;
+
+	puts("rtcm_decode");
+
+	/* Bit reader, on 64-bit loads, 9-byte spills and past the buffer end */
+	unsigned char buf[12] = {0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0, 0xff, 0x80, 0x01, 0xfe};
+	if (rtcm_bits(buf, sizeof buf, 0, 64) == 0x123456789abcdef0ULL
+	    && rtcm_bits(buf, sizeof buf, 4, 64) == 0x23456789abcdef0fULL
+	    && rtcm_bits(buf, sizeof buf, 72, 12) == 0x800
+	    && rtcm_bits(buf, sizeof buf, 88, 16) == 0xfe00
+	    && rtcm_sbits(buf, sizeof buf, 64, 8) == -1
+	    && rtcm_sbits(buf, sizeof buf, 72, 8) == -128
+	    && rtcm_sbits(buf, sizeof buf, 80, 8) == 1)
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_bits\n");
+		fail++;
+	}
+
+	/* Fields contained in a single byte past the first one */
+	if (rtcm_bits(buf, sizeof buf, 9, 3) == 3
+	    && rtcm_bits(buf, sizeof buf, 54, 1) == 1
+	    && rtcm_bits(buf, sizeof buf, 57, 2) == 3
+	    && rtcm_bits(buf, sizeof buf, 89, 3) == 7
+	    && rtcm_bits(buf, sizeof buf, 95, 1) == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_bits within a byte\n");
+		fail++;
+	}
+
+	/* 1005 with negative ECEF coordinates */
+	int len = test_rtcm_frame(frame, 1005, 19, 0);
+	test_rtcm_setbits(frame, 12, 12, 2003);
+	test_rtcm_setbits(frame, 34, 38, -4052051LL & ((1LL<<38)-1));
+	test_rtcm_setbits(frame, 74, 38, 4212836LL);
+	test_rtcm_setbits(frame, 114, 38, -4799289LL & ((1LL<<38)-1));
+	test_rtcm_frame_crc(frame, len);
+	int64_t z;
+	if (rtcm_decode(frame, len, &f) == 0 && f.desc != NULL && f.type == 1005
+	    && f.field[RTCM_F_STATION_ID] == 2003
+	    && f.field[RTCM_F_ECEF_X] == -4052051
+	    && f.field[RTCM_F_ECEF_Y] == 4212836
+	    && f.field[RTCM_F_ECEF_Z] == -4799289
+	    && !rtcm_frame_has(&f, RTCM_F_ANTENNA_HEIGHT)
+	    && rtcm_decode_field(frame, len, RTCM_F_ECEF_Z, &z) == 0 && z == -4799289)
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_decode 1005\n");
+		fail++;
+	}
+
+	/* Truncated 1005: type only */
+	len = test_rtcm_frame(frame, 1005, 10, 0);
+	if (rtcm_decode(frame, len, &f) == 0 && f.desc == NULL && f.type == 1005)
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_decode short 1005\n");
+		fail++;
+	}
+
+	/* Handlers run once per received frame */
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	caster.config = &config;
+	st.caster = &caster;
+	st.mountpoint = "TEST";
+	st.input = evbuffer_new();
+	st.rtcm_info = rtcm_info_new();
+
+	rtcm_decode_register(4095, test_rtcm_decode_handler);
+	for (int i = 0; i < 3; i++) {
+		len = test_rtcm_frame(frame, 4095, 10, 0);
+		evbuffer_add(st.input, frame, len);
+		len = test_rtcm_frame(frame, 1230, 10, 0);
+		evbuffer_add(st.input, frame, len);
+	}
+	rtcm_packet_handle(&st);
+	if (test_rtcm_decode_calls == 3 && st.rtcm_info->type_stats[rtcm_type_index(4095)].count == 3)
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_decode_dispatch %d calls\n", test_rtcm_decode_calls);
+		fail++;
+	}
+
+	/* No more calls once unregistered, the built-in handlers still run */
+	if (rtcm_decode_unregister(4095, test_rtcm_decode_handler) == 0
+	    && rtcm_decode_unregister(4095, test_rtcm_decode_handler) == -1) {
+		len = test_rtcm_frame(frame, 4095, 10, 0);
+		evbuffer_add(st.input, frame, len);
+		rtcm_packet_handle(&st);
+	}
+	if (test_rtcm_decode_calls == 3 && st.rtcm_info->type_stats[rtcm_type_index(4095)].count == 4)
+		putchar('.');
+	else {
+		printf("\nFAIL: rtcm_decode_unregister %d calls\n", test_rtcm_decode_calls);
+		fail++;
+	}
+
+	evbuffer_free(st.input);
+	rtcm_info_free(st.rtcm_info);
+	putchar('\n');
+	return fail;
+}
+
+static void test_log_cb(void *arg, struct gelf_entry *g, int level, const char *fmt, va_list ap) {
+}
+
+static int recorder_test() {
+	int fail = 0;
+	unsigned char frame[100];
+	char dir[] = "/tmp/recorder_testXXXXXX";
+	struct config config;
+	struct config_threads threads_config = {.stacksize = 500*1024};
+	struct caster_state caster;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	caster.config = &config;
+	caster.flog.log_cb = test_log_cb;
+	config.threads = &threads_config;
+
+	puts("recorder");
+
+	if (mkdtemp(dir) == NULL) {
+		printf("\nFAIL: mkdtemp\n");
+		return 1;
+	}
+	struct config_recorder rc = {
+		.mountpoint = "REC", .directory = dir,
+		.segment_max_size = 100, .segment_max_duration = 3600, .sync_interval = -1
+	};
+
+	/* Full queue: frames are dropped, not waited for */
+	struct recorder *r = recorder_new(&caster, &rc, 1, 2);
+	struct recorder_stream *stream = recorder_find(r, "REC");
+	struct packet *packets[3];
+	for (int i = 0; i < 3; i++) {
+		int len = test_rtcm_frame(frame, 1005 + i, 54, 0);
+		packets[i] = packet_new(len, &caster);
+		memcpy(packets[i]->data, frame, len);
+	}
+	if (stream != NULL && recorder_find(r, "OTHER") == NULL
+	    && recorder_queue(r, stream, packets, 3) == 1 && atomic_load(&r->dropped) == 1
+	    && recorder_drain(r) == 2 && recorder_drain(r) == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: recorder queue\n");
+		fail++;
+	}
+
+	/* Size rotation after each 60-byte frame */
+	if (atomic_load(&stream->frames) == 2 && atomic_load(&stream->bytes) == 120
+	    && atomic_load(&stream->segments) == 2)
+		putchar('.');
+	else {
+		printf("\nFAIL: recorder segments %lu\n", atomic_load(&stream->segments));
+		fail++;
+	}
+	recorder_free(r);
+
+	/* Write error: the segment is closed, the next frame starts a new one */
+	r = recorder_new(&caster, &rc, 1, 16);
+	stream = recorder_find(r, "REC");
+	recorder_queue(r, stream, packets, 1);
+	recorder_drain(r);
+	int full = open("/dev/full", O_WRONLY);
+	if (full >= 0 && stream->fd >= 0) {
+		dup2(full, stream->fd);
+		close(full);
+	}
+	recorder_flush(r);
+	int closed = stream->fd < 0 && atomic_load(&stream->write_errors) == 1;
+	recorder_queue(r, stream, packets + 1, 1);
+	recorder_drain(r);
+	if (closed && stream->fd >= 0 && stream->offset == 60 && atomic_load(&stream->segments) == 2)
+		putchar('.');
+	else {
+		printf("\nFAIL: recorder write error, %lu errors, offset %lu\n",
+			atomic_load(&stream->write_errors), (unsigned long)stream->offset);
+		fail++;
+	}
+	recorder_free(r);
+
+	/* Frames written by the I/O thread */
+	r = recorder_new(&caster, &rc, 1, 16);
+	recorder_start(r);
+	recorder_queue(r, recorder_find(r, "REC"), packets + 2, 1);
+	recorder_free(r);
+
+	/* Frames are copied when queued */
+	for (int i = 0; i < 3; i++)
+		packet_free(packets[i]);
+
+	/*
+	 * Check the segment and index files: one per segment, the one
+	 * closed on a write error being empty.
+	 */
+	char path[PATH_MAX];
+	long rtcm_size = 0, idx_size = 0;
+	int nsegments = 0;
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	while (d && (de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		struct stat sb;
+		snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+		if (stat(path, &sb) == 0 && !strncmp(de->d_name, "REC-", 4)) {
+			if (strstr(de->d_name, ".rtcm")) {
+				rtcm_size += sb.st_size;
+				nsegments++;
+			} else if (strstr(de->d_name, ".idx"))
+				idx_size += sb.st_size;
+		}
+		unlink(path);
+	}
+	if (d)
+		closedir(d);
+	rmdir(dir);
+	if (nsegments == 5 && rtcm_size == 240 && idx_size == 4*sizeof(struct recorder_index))
+		putchar('.');
+	else {
+		printf("\nFAIL: recorder segments %d, %ld bytes, index %ld bytes\n", nsegments, rtcm_size, idx_size);
+		fail++;
+	}
+
+	putchar('\n');
+	return fail;
+}
+
+static int replay_test() {
+	int fail = 0;
+	unsigned char frame[100];
+	char dir[] = "/tmp/replay_testXXXXXX";
+	char path[PATH_MAX], index_path[PATH_MAX];
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	caster.config = &config;
+	caster.flog.log_cb = test_log_cb;
+	st.caster = &caster;
+	st.mountpoint = "REPLAY";
+	st.input = evbuffer_new();
+
+	puts("replay");
+
+	if (mkdtemp(dir) == NULL) {
+		printf("\nFAIL: mkdtemp\n");
+		return 1;
+	}
+	snprintf(path, sizeof path, "%s/REC-20240101-000000.rtcm", dir);
+	snprintf(index_path, sizeof index_path, "%s/REC-20240101-000000.idx", dir);
+
+	/* 3 frames of 60 bytes, the first 2 in the first second */
+	FILE *f = fopen(path, "w");
+	for (int i = 0; i < 3; i++) {
+		int len = test_rtcm_frame(frame, 1005 + i, 54, 0);
+		fwrite(frame, len, 1, f);
+	}
+	fclose(f);
+	struct recorder_index index[2] = {{1704067200000LL, 0}, {1704067201000LL, 120}};
+	f = fopen(index_path, "w");
+	fwrite(index, sizeof index, 1, f);
+	fclose(f);
+
+	struct config_replay rc = {.mountpoint = "REPLAY", .file = path, .speed = 10, .loop = 1};
+	struct replay *r = replay_new(&caster, &rc);
+	r->st = &st;
+	struct timeval delay;
+	if (replay_load(r) == 0 && r->nindex == 2 && r->len == 180
+	    && replay_send(r, &delay) == 0 && st.received_bytes == 120
+	    && delay.tv_sec == 0 && delay.tv_usec > 90000 && delay.tv_usec <= 100000)
+		putchar('.');
+	else {
+		printf("\nFAIL: replay first entry, %llu bytes\n", st.received_bytes);
+		fail++;
+	}
+
+	/* Loop back to the start */
+	if (replay_send(r, &delay) == 0 && st.received_bytes == 180
+	    && r->next == 0 && r->loops == 1 && !timerisset(&delay))
+		putchar('.');
+	else {
+		printf("\nFAIL: replay loop\n");
+		fail++;
+	}
+
+	/* End of the recording without loop */
+	r->loop = 0;
+	replay_send(r, &delay);
+	if (replay_send(r, &delay) == -1 && st.received_bytes == 360)
+		putchar('.');
+	else {
+		printf("\nFAIL: replay end\n");
+		fail++;
+	}
+	r->st = NULL;
+	replay_free(r);
+
+	/* Inconsistent index */
+	index[1].offset = 500;
+	f = fopen(index_path, "w");
+	fwrite(index, sizeof index, 1, f);
+	fclose(f);
+	r = replay_new(&caster, &rc);
+	if (replay_load(r) < 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: replay bad index\n");
+		fail++;
+	}
+	replay_free(r);
+
+	unlink(path);
+	unlink(index_path);
+	rmdir(dir);
+	evbuffer_free(st.input);
+	putchar('\n');
+	return fail;
+}
+
+static int generator_test() {
+	int fail = 0;
+	unsigned char buf[GENERATOR_MAX_MESSAGES*1029];
+	struct config config;
+	struct caster_state caster;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	caster.config = &config;
+	caster.flog.log_cb = test_log_cb;
+	struct config_generator gconfig = {
+		.prefix = "SYNTH", .count = 3, .messages = "1005(10),1077,1087,1097(2),1124",
+		.satellites = 12, .signals = 2, .epoch_interval = 1000,
+		.latitude = 46.5, .longitude = 2.5, .radius = 50
+	};
+	pos_t center = {46.5, 2.5};
+
+	puts("generator");
+
+	struct generator *g = generator_new(&caster, &gconfig, 0);
+	if (g == NULL) {
+		printf("\nFAIL: generator_new\n");
+		return 1;
+	}
+	if (g->nmessages == 5 && g->messages[0].type == 1005 && g->messages[0].interval == 10
+	    && g->messages[3].interval == 2 && g->messages[4].interval == 1)
+		putchar('.');
+	else {
+		printf("\nFAIL: message list: %d messages\n", g->nmessages);
+		fail++;
+	}
+	if (g->nsources == 3 && !strcmp(g->sources[1].mountpoint, "SYNTH2"))
+		putchar('.');
+	else {
+		printf("\nFAIL: sources: %d\n", g->nsources);
+		fail++;
+	}
+
+	for (int i = 0; i < g->nsources; i++) {
+		struct generator_source *src = &g->sources[i];
+		float d = distance(&src->pos, &center);
+		if (d <= 50100)
+			putchar('.');
+		else {
+			printf("\nFAIL: source %d at %.0f m\n", i, d);
+			fail++;
+		}
+
+		/* All messages due at epoch 10, except 1005 at epoch 11 */
+		for (long long epoch = 10; epoch <= 11; epoch++) {
+			static const int types10[] = {1005, 1077, 1087, 1097, 1124};
+			static const int types11[] = {1077, 1087, 1124};
+			const int *types = epoch == 10 ? types10 : types11;
+			int ntypes = epoch == 10 ? 5 : 3;
+			int len = generator_epoch(src, epoch, buf, sizeof buf);
+			int n = 0, off = 0;
+			long epoch_ms = -1;
+
+			while (off < len) {
+				struct rtcm_frame f;
+				int flen = (buf[off+1] & 3)*256 + buf[off+2] + 6;
+				unsigned long crc = crc24q_hash(buf+off, flen-3);
+				if (off + flen > len || rtcm_decode(buf+off, flen, &f) < 0 || f.desc == NULL
+				    || (buf[off+flen-3] << 16 | buf[off+flen-2] << 8 | buf[off+flen-1]) != crc
+				    || n >= ntypes || f.type != types[n]) {
+					printf("\nFAIL: epoch %lld frame %d\n", epoch, n);
+					fail++;
+					break;
+				}
+				if (f.type == 1005) {
+					pos_t pos;
+					pos.lat = atan2(f.field[RTCM_F_ECEF_Z],
+						hypot(f.field[RTCM_F_ECEF_X], f.field[RTCM_F_ECEF_Y])) * (180/M_PI);
+					pos.lon = atan2(f.field[RTCM_F_ECEF_Y], f.field[RTCM_F_ECEF_X]) * (180/M_PI);
+					/* Geocentric latitude, less than 0.2 degrees from the geodetic one */
+					if (fabs(pos.lon - src->pos.lon) > 1e-5 || fabs(pos.lat - src->pos.lat) > 0.2) {
+						printf("\nFAIL: 1005 position %f %f\n", pos.lat, pos.lon);
+						fail++;
+					}
+				} else {
+					int last = n == ntypes-1;
+					if (!f.is_msm || f.msm.nsat != 12 || f.msm.nsig != 2 || f.msm.ncell != 24
+					    || f.msm.mmb != !last || (epoch_ms != -1 && f.epoch_ms != epoch_ms)) {
+						printf("\nFAIL: MSM %d header\n", f.type);
+						fail++;
+					}
+					epoch_ms = f.epoch_ms;
+				}
+				n++;
+				off += flen;
+			}
+			if (n == ntypes && off == len)
+				putchar('.');
+			else {
+				printf("\nFAIL: epoch %lld: %d frames, expected %d\n", epoch, n, ntypes);
+				fail++;
+			}
+		}
+	}
+
+	if (generator_parse_messages(g, "1005,1230") == -1
+	    && generator_parse_messages(g, "1077(0)") == -1
+	    && generator_parse_messages(g, "") == -1
+	    && generator_parse_messages(g, "1006(5),1134") == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: message list parsing\n");
+		fail++;
+	}
+
+	/* Late jobs catch up on missed epochs, up to a limit */
+	struct generator_source *src = &g->sources[0];
+	src->last_epoch = -1;
+	long long first = generator_first_epoch(src, 100);
+	src->last_epoch = 100;
+	if (first == 100 && generator_first_epoch(src, 100) == 101
+	    && generator_first_epoch(src, 103) == 101
+	    && generator_first_epoch(src, 100 + GENERATOR_MAX_CATCHUP) == 101
+	    && generator_first_epoch(src, 200) == 200 - GENERATOR_MAX_CATCHUP + 1)
+		putchar('.');
+	else {
+		printf("\nFAIL: epoch catch-up\n");
+		fail++;
+	}
+
+	generator_free(g);
+	putchar('\n');
+	return fail;
+}
+
+static int crc24q_test() {
+	int fail = 0;
+	unsigned char data[2100];
+	puts("crc24q");
+
+	/* Reference value */
+	for (enum crc24q_impl impl = 0; impl < CRC24Q_NIMPL; impl++) {
+		if (!crc24q_impl_available(impl))
+			continue;
+		unsigned long crc = crc24q_update_impl(impl, 0, (unsigned char *)"123456789", 9);
+		if (crc == 0xcde703)
+			putchar('.');
+		else {
+			printf("\nFAIL: %s: CRC %06lx, expected cde703\n", crc24q_impl_name(impl), crc);
+			fail++;
+		}
+	}
+
+	/* Random frames of all sizes, split at random positions */
+	srandom(1);
+	for (int len = 0; len < sizeof data; len += 1 + len/16) {
+		for (int i = 0; i < len; i++)
+			data[i] = random();
+		unsigned long expected = crc24q_update_impl(CRC24Q_BYTEWISE, 0, data, len);
+		int split = len ? random() % len : 0;
+		for (enum crc24q_impl impl = 0; impl < CRC24Q_NIMPL; impl++) {
+			if (!crc24q_impl_available(impl))
+				continue;
+			unsigned long crc = crc24q_update_impl(impl, 0, data, len);
+			unsigned long crc_split = crc24q_update_impl(impl, crc24q_update_impl(impl, 0, data, split), data+split, len-split);
+			if (crc != expected || crc_split != expected) {
+				printf("\nFAIL: %s: length %d split %d: CRC %06lx/%06lx, expected %06lx\n",
+					crc24q_impl_name(impl), len, split, crc, crc_split, expected);
+				fail++;
+			}
+		}
+		if (crc24q_hash(data, len) != expected) {
+			printf("\nFAIL: crc24q_hash: length %d\n", len);
+			fail++;
+		}
+		putchar('.');
+	}
+
+	putchar('\n');
+	return fail;
+}
+
+/*
+ * Random position, uniform on the sphere.
+ */
+static void test_random_pos(pos_t *pos) {
+	pos->lat = asin(2.*random()/RAND_MAX - 1) * (180/M_PI);
+	pos->lon = 360.*random()/RAND_MAX - 180;
+}
+
+static int geoindex_test() {
+	int fail = 0;
+	int sizes[] = {0, 1, 7, 100, 3000};
+	pos_t query[200];
+
+	puts("geoindex");
+
+	srandom(21);
+	for (int i = 0; i < sizeof query / sizeof query[0]; i++)
+		test_random_pos(&query[i]);
+	/* Poles and antimeridian */
+	query[0].lat = 90; query[0].lon = 0;
+	query[1].lat = -90; query[1].lon = 0;
+	query[2].lat = 10; query[2].lon = 180;
+
+	for (int s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+		int n = sizes[s];
+		struct sourceline *lines = (struct sourceline *)calloc(n ? n : 1, sizeof(struct sourceline));
+		struct sourceline **plines = (struct sourceline **)malloc(sizeof(struct sourceline *)*(n ? n : 1));
+		for (int i = 0; i < n; i++) {
+			test_random_pos(&lines[i].pos);
+			plines[i] = &lines[i];
+		}
+		/* Duplicate positions */
+		if (n > 10)
+			lines[n-1].pos = lines[n-2].pos;
+
+		struct geoindex *index = geoindex_new(plines, n);
+
+		for (int q = 0; q < sizeof query / sizeof query[0]; q++) {
+			double v[3];
+			geoindex_unit_vector(&query[q], v);
+
+			for (int mode = 0; mode < 2*GEOINDEX_NIMPL; mode++) {
+				enum geoindex_impl impl = mode / 2;
+				int linear = mode & 1;
+				struct geoindex_result result[5];
+				int k = 5;
+				int nr = geoindex_nearest_impl(index, impl, linear, &query[q], k, result);
+				int expected = n < k ? n : k;
+
+				if (!geoindex_impl_available(impl))
+					continue;
+				if (nr != expected) {
+					printf("FAIL %s %d bases: %d results, expected %d\n", geoindex_impl_name(impl), n, nr, expected);
+					fail++;
+					continue;
+				}
+
+				/* Compare with a linear scan in double precision */
+				int closer = 0;
+				for (int i = 0; i < n; i++) {
+					double w[3];
+					geoindex_unit_vector(&lines[i].pos, w);
+					double d2 = (v[0]-w[0])*(v[0]-w[0]) + (v[1]-w[1])*(v[1]-w[1]) + (v[2]-w[2])*(v[2]-w[2]);
+					if (nr && d2 < result[nr-1].chord2*(1-1e-4) - 1e-9)
+						closer++;
+				}
+				for (int i = 1; i < nr; i++)
+					if (result[i].chord2 < result[i-1].chord2)
+						closer = n;
+				if (nr && closer >= nr) {
+					printf("FAIL %s%s %d bases, query %d: result not the nearest\n",
+						geoindex_impl_name(impl), linear ? " linear" : "", n, q);
+					fail++;
+				}
+			}
+		}
+		geoindex_free(index);
+		free(plines);
+		free(lines);
+		putchar('.');
+	}
+
+	/* Many bases at the same position, as sourcelines without one at 0,0 */
+	{
+		int n = 20000;
+		struct sourceline *lines = (struct sourceline *)calloc(n, sizeof(struct sourceline));
+		struct sourceline **plines = (struct sourceline **)malloc(sizeof(struct sourceline *)*n);
+		for (int i = 0; i < n; i++)
+			plines[i] = &lines[i];
+		lines[n/3].pos.lat = 45;
+		lines[n/3].pos.lon = 5;
+		struct geoindex *index = geoindex_new(plines, n);
+		pos_t q = {44, 4};
+		struct geoindex_result result[3];
+		int nr = index ? geoindex_nearest(index, &q, 3, result) : 0;
+		if (nr == 3 && result[0].sourceline == &lines[n/3] && result[1].chord2 == result[2].chord2)
+			putchar('.');
+		else {
+			printf("\nFAIL: geoindex with equal positions, %d results\n", nr);
+			fail++;
+		}
+		if (index)
+			geoindex_free(index);
+		free(plines);
+		free(lines);
+	}
+
+	/* Through a sourcetable: virtual entries are ignored, the index follows updates */
+	struct sourcetable *table = sourcetable_new("LOCAL", 0, 0);
+	sourcetable_add(table, "STR;NEAR;NEAR;RTCM 3.3;;2;GPS;NONE;NONE;48.00;2.00;0;0;;none;N;N;9600;", 0);
+	sourcetable_add(table, "STR;VIRT;VIRT;RTCM 3.3;;2;GPS;NONE;NONE;48.10;2.10;1;0;;none;N;N;9600;", 0);
+	sourcetable_add(table, "STR;FAR;FAR;RTCM 3.3;;2;GPS;NONE;NONE;45.00;5.00;0;0;;none;N;N;9600;", 0);
+	pos_t pos = {48.1, 2.1};
+	struct dist_table d;
+	if (sourcetable_find_pos(table, &pos, &d) != 2 || strcmp(d.dist_array[0].mountpoint, "NEAR")
+	    || strcmp(d.dist_array[1].mountpoint, "FAR") || fabs(d.dist_array[0].dist - distance(&pos, &d.dist_array[0].pos)) > 1) {
+		printf("FAIL sourcetable_find_pos\n");
+		fail++;
+	}
+	sourcetable_add(table, "STR;NEW;NEW;RTCM 3.3;;2;GPS;NONE;NONE;48.09;2.09;0;0;;none;N;N;9600;", 0);
+	if (sourcetable_find_pos(table, &pos, &d) != 3 || strcmp(d.dist_array[0].mountpoint, "NEW")) {
+		printf("FAIL sourcetable_find_pos after update\n");
+		fail++;
+	}
+	sourcetable_free(table);
+	putchar('.');
+
+	putchar('\n');
+	return fail;
+}
+
+struct stack_flatten_test_args {
+	struct caster_state *caster;
+	atomic_int *stop;
+	int errors;
+};
+
+static void *stack_flatten_test_reader(void *arg) {
+	struct stack_flatten_test_args *args = (struct stack_flatten_test_args *)arg;
+	sourcetable_stack_t *stack = &args->caster->sourcetablestack;
+	while (!atomic_load(args->stop)) {
+		struct sourcetable *f = stack_flatten_get(args->caster, stack);
+		if (f == NULL || sourcetable_find_mountpoint(f, "A") == NULL)
+			args->errors++;
+		if (f)
+			stack_flatten_put(stack, f);
+	}
+	return NULL;
+}
+
+static int stack_flatten_test() {
+	int fail = 0;
+	struct caster_state caster;
+	memset(&caster, 0, sizeof caster);
+	sourcetable_stack_t *stack = &caster.sourcetablestack;
+	TAILQ_INIT(&stack->list);
+	atomic_init(&stack->generation, 0);
+
+	puts("stack_flatten_get");
+
+	/* Locks are needed by the concurrent readers below */
+	int saved_threads = threads;
+	threads = 1;
+
+	struct sourcetable *t1 = sourcetable_new("host1", 2101, 0);
+	sourcetable_add(t1, "STR;A;A;RTCM 3.3;;2;GPS;NONE;NONE;48.00;2.00;0;0;;none;N;N;9600;", 1);
+	stack_replace_host(&caster, stack, "host1", 2101, t1);
+
+	struct sourcetable *f1 = stack_flatten_get(&caster, stack);
+	struct sourcetable *f2 = stack_flatten_get(&caster, stack);
+	if (f1 == NULL || f1 != f2 || sourcetable_nentries(f1, 0) != 1) {
+		printf("FAIL same generation\n");
+		fail++;
+	}
+	putchar('.');
+
+	struct sourcetable *t2 = sourcetable_new("host2", 2101, 0);
+	sourcetable_add(t2, "STR;B;B;RTCM 3.3;;2;GPS;NONE;NONE;45.00;5.00;0;0;;none;N;N;9600;", 1);
+	stack_replace_host(&caster, stack, "host2", 2101, t2);
+
+	struct sourcetable *f3 = stack_flatten_get(&caster, stack);
+	if (f3 == NULL || f3 == f1 || sourcetable_nentries(f3, 0) != 2
+	    || sourcetable_find_mountpoint(f1, "A") == NULL) {
+		printf("FAIL new generation\n");
+		fail++;
+	}
+	putchar('.');
+
+	stack_flatten_put(stack, f1);
+	stack_flatten_put(stack, f2);
+	stack_flatten_put(stack, f3);
+
+	/* Lock-free readers while the table is rebuilt */
+	atomic_int stop;
+	pthread_t readers[4];
+	struct stack_flatten_test_args args[4];
+	atomic_init(&stop, 0);
+	for (int i = 0; i < 4; i++) {
+		args[i].caster = &caster;
+		args[i].stop = &stop;
+		args[i].errors = 0;
+		pthread_create(&readers[i], NULL, stack_flatten_test_reader, &args[i]);
+	}
+	for (int i = 0; i < 500; i++) {
+		stack_bump_generation(stack);
+		struct sourcetable *f = stack_flatten_get(&caster, stack);
+		if (f)
+			stack_flatten_put(stack, f);
+	}
+	atomic_store(&stop, 1);
+	int errors = 0;
+	for (int i = 0; i < 4; i++) {
+		pthread_join(readers[i], NULL);
+		errors += args[i].errors;
+	}
+	if (errors == 0)
+		putchar('.');
+	else {
+		printf("\nFAIL: %d bad flattened tables read\n", errors);
+		fail++;
+	}
+
+	stack_replace_host(&caster, stack, "host1", 2101, NULL);
+	stack_replace_host(&caster, stack, "host2", 2101, NULL);
+	stack_flatten_clear(stack);
+	threads = saved_threads;
+	putchar('\n');
+	return fail;
+}
+
+static int nearest_sched_test() {
+	int fail = 0;
+	struct config config;
+	struct caster_state caster;
+	struct ntrip_state st;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	memset(&st, 0, sizeof st);
+	config.min_nearest_recompute_interval = 10;
+	config.max_nearest_recompute_interval = 120;
+	caster.config = &config;
+	caster.flog.log_cb = test_log_cb;
+	TAILQ_INIT(&caster.sourcetablestack.list);
+	atomic_init(&caster.sourcetablestack.generation, 0);
+	struct event_base *base = event_base_new();
+	st.caster = &caster;
+	st.bev = bufferevent_socket_new(base, -1, 0);
+	st.state = NTRIP_WAIT_CLIENT_INPUT;
+	st.source_virtual = 1;
+	st.last_pos_valid = 1;
+	st.virtual_mountpoint = "BASE";
+	gettimeofday(&st.last_recompute_date, NULL);
+
+	puts("nearest_sched");
+
+	struct nearest_sched *sched = nearest_sched_new(&caster);
+	caster.nearest_sched = sched;
+
+	/* GGA updates are coalesced in a single pending recompute */
+	for (int i = 0; i < 5; i++)
+		nearest_sched_schedule(sched, &st);
+	struct timeval now, later, interval = {10, 0};
+	gettimeofday(&now, NULL);
+	timeradd(&st.last_recompute_date, &interval, &later);
+	if (sched->npending != 1 || st.nearest_request == NULL
+	    || nearest_sched_run(sched, &now) != 0 || sched->npending != 1) {
+		printf("FAIL coalescing: %d pending\n", sched->npending);
+		fail++;
+	}
+	putchar('.');
+
+	/* Due after the minimum interval */
+	if (nearest_sched_run(sched, &later) != 1 || sched->npending != 0 || st.nearest_request != NULL) {
+		printf("FAIL due recompute\n");
+		fail++;
+	}
+	putchar('.');
+
+	/* A closed session is skipped */
+	nearest_sched_schedule(sched, &st);
+	nearest_sched_cancel(&st);
+	if (nearest_sched_run(sched, &later) != 1 || st.nearest_request != NULL) {
+		printf("FAIL cancel\n");
+		fail++;
+	}
+	putchar('.');
+
+	/* Requests are run in due order, whatever the scheduling order */
+	struct ntrip_state st2 = st;
+	struct timeval early = {5, 0}, between;
+	st2.bev = bufferevent_socket_new(base, -1, 0);
+	timersub(&st.last_recompute_date, &early, &st2.last_recompute_date);
+	timeradd(&st2.last_recompute_date, &interval, &between);
+	nearest_sched_schedule(sched, &st);
+	nearest_sched_schedule(sched, &st2);
+	if (TAILQ_FIRST(&sched->pending) != st2.nearest_request
+	    || nearest_sched_run(sched, &between) != 1 || st2.nearest_request != NULL
+	    || st.nearest_request == NULL || sched->npending != 1) {
+		printf("FAIL due order\n");
+		fail++;
+	}
+	putchar('.');
+
+	/* Left pending at exit */
+	nearest_sched_free(sched);
+	if (st.nearest_request != NULL) {
+		printf("FAIL free\n");
+		fail++;
+	}
+	putchar('\n');
+
+	stack_flatten_clear(&caster.sourcetablestack);
+	bufferevent_free(st2.bev);
+	bufferevent_free(st.bev);
+	event_base_free(base);
+	return fail;
+}
+
+static int nearest_cache_test() {
+	int fail = 0;
+	struct config config;
+	struct caster_state caster;
+	memset(&config, 0, sizeof config);
+	memset(&caster, 0, sizeof caster);
+	config.hysteresis_m = 500;
+	caster.config = &config;
+	struct nearest_sched *sched = nearest_sched_new(&caster);
+	caster.nearest_sched = sched;
+
+	puts("nearest_cache_find_pos");
+
+	struct sourcetable *table = sourcetable_new("LOCAL", 0, 0);
+	sourcetable_add(table, "STR;A;A;RTCM 3.3;;2;GPS;NONE;NONE;48.00;2.00;0;0;;none;N;N;9600;", 0);
+	sourcetable_add(table, "STR;B;B;RTCM 3.3;;2;GPS;NONE;NONE;48.20;2.00;0;0;;none;N;N;9600;", 0);
+	sourcetable_add(table, "STR;C;C;RTCM 3.3;;2;GPS;NONE;NONE;45.00;5.00;0;0;;none;N;N;9600;", 0);
+
+	/* Same cell: one miss, then a hit with distances from the actual position */
+	pos_t p1 = {48.0501, 2.0001}, p2 = {48.0502, 2.0002};
+	struct dist_table d;
+	if (nearest_cache_find_pos(sched, table, &p1, &d) != 3 || strcmp(d.dist_array[0].mountpoint, "A")
+	    || nearest_cache_find_pos(sched, table, &p2, &d) != 3 || strcmp(d.dist_array[0].mountpoint, "A")
+	    || fabs(d.dist_array[0].dist - distance(&p2, &d.dist_array[0].pos)) > 1
+	    || atomic_load(&sched->cache_hits) != 1 || atomic_load(&sched->cache_misses) != 1) {
+		printf("FAIL same cell\n");
+		fail++;
+	}
+	putchar('.');
+
+	/* Another cell, closer to B */
+	pos_t p3 = {48.15, 2.0};
+	if (nearest_cache_find_pos(sched, table, &p3, &d) != 3 || strcmp(d.dist_array[0].mountpoint, "B")
+	    || strcmp(d.dist_array[1].mountpoint, "A") || atomic_load(&sched->cache_misses) != 2) {
+		printf("FAIL other cell\n");
+		fail++;
+	}
+	putchar('.');
+
+	/* No hysteresis, no cache */
+	struct sourcetable *table2 = sourcetable_new("LOCAL", 0, 0);
+	sourcetable_add(table2, "STR;A;A;RTCM 3.3;;2;GPS;NONE;NONE;48.00;2.00;0;0;;none;N;N;9600;", 0);
+	config.hysteresis_m = 0;
+	if (nearest_cache_find_pos(sched, table2, &p1, &d) != 1 || table2->nearest_cache != NULL
+	    || atomic_load(&sched->cache_hits) + atomic_load(&sched->cache_misses) != 3) {
+		printf("FAIL disabled\n");
+		fail++;
+	}
+	putchar('.');
+	config.hysteresis_m = 500;
+
+	/* Polar rows: columns clamped to 100 times the row height, center not beyond the pole */
+	struct nearest_cache cache;
+	cache.cell_m = 250;
+	double dlat = cache.cell_m / 111320., dlon = dlat / 0.01;
+	char k1[48], k2[48], k3[48];
+	pos_t c1, c2, c3;
+	pos_t q1 = {90, -180 + 100.2*dlon}, q2 = {90, -180 + 100.8*dlon}, q3 = {90, -180 + 101.2*dlon};
+	nearest_cache_cell(&cache, &q1, k1, sizeof k1, &c1);
+	nearest_cache_cell(&cache, &q2, k2, sizeof k2, &c2);
+	nearest_cache_cell(&cache, &q3, k3, sizeof k3, &c3);
+	if (strcmp(k1, k2) || !strcmp(k1, k3) || c1.lat > 90 || c1.lat < 90 - dlat
+	    || fabs(c1.lon - (-180 + 100.5*dlon)) > 1e-4) {
+		printf("FAIL pole clamp: %s %s %s, center %.6f %.6f\n", k1, k2, k3, c1.lat, c1.lon);
+		fail++;
+	}
+	putchar('.');
+
+	/* Antimeridian: the last column is cut short, 180 and -180 share a cell */
+	int bad = 0;
+	for (double lat = 0; lat < 85; lat += 0.37) {
+		pos_t e = {lat, 179.99999}, w = {lat, -180}, e2 = {lat, 180};
+		nearest_cache_cell(&cache, &e, k1, sizeof k1, &c1);
+		nearest_cache_cell(&cache, &w, k2, sizeof k2, &c2);
+		nearest_cache_cell(&cache, &e2, k3, sizeof k3, &c3);
+		if (c1.lon > 180 || c1.lon < 179.9 || c2.lon < -180 || strcmp(k2, k3))
+			bad++;
+	}
+	if (bad) {
+		printf("FAIL antimeridian: %d bad rows\n", bad);
+		fail++;
+	}
+	putchar('.');
+
+	/* A new sourcetable generation comes with an empty cache */
+	sourcetable_stack_t *stack = &caster.sourcetablestack;
+	TAILQ_INIT(&stack->list);
+	atomic_init(&stack->generation, 0);
+	struct sourcetable *t1 = sourcetable_new("host1", 2101, 0);
+	sourcetable_add(t1, "STR;A;A;RTCM 3.3;;2;GPS;NONE;NONE;48.00;2.00;0;0;;none;N;N;9600;", 1);
+	stack_replace_host(&caster, stack, "host1", 2101, t1);
+	struct sourcetable *f1 = stack_flatten_get(&caster, stack);
+	unsigned long misses = atomic_load(&sched->cache_misses);
+	nearest_cache_find_pos(sched, f1, &p1, &d);
+	nearest_cache_find_pos(sched, f1, &p1, &d);
+	stack_bump_generation(stack);
+	struct sourcetable *f2 = stack_flatten_get(&caster, stack);
+	if (f2 == NULL || f2 == f1 || f2->nearest_cache != NULL
+	    || nearest_cache_find_pos(sched, f2, &p1, &d) != 1
+	    || atomic_load(&sched->cache_misses) != misses + 2) {
+		printf("FAIL generation change\n");
+		fail++;
+	}
+	putchar('.');
+	stack_flatten_put(stack, f1);
+	stack_flatten_put(stack, f2);
+	stack_replace_host(&caster, stack, "host1", 2101, NULL);
+	stack_flatten_clear(stack);
+
+	/* A full cache evicts one cell per new cell */
+	for (int i = 0; i < NEAREST_CACHE_MAX + 10; i++) {
+		pos_t p = {48 + (i / 256) * 0.01, 2 + (i % 256) * 0.01};
+		nearest_cache_find_pos(sched, table2, &p, &d);
+	}
+	if (table2->nearest_cache == NULL || table2->nearest_cache->cells->nentries != NEAREST_CACHE_MAX
+	    || atomic_load(&sched->cache_evictions) != 10) {
+		printf("FAIL eviction: %lu evictions\n", atomic_load(&sched->cache_evictions));
+		fail++;
+	}
+	putchar('.');
+
+	sourcetable_free(table);
+	sourcetable_free(table2);
+	nearest_sched_free(sched);
+	putchar('\n');
+	return fail;
+}
+
+#if 0
+static void sourcetable_test(struct sourcetable *sourcetable) {
+	char *ggalist[] = {
+	    "$GPGGA,014822.78,0000.0000000,N,00000.0000000,E,1,00,1.0,-17.162,M,17.162,M,0.0,*5C\r\n",
+	    "$GNGGA,205655.60,4849.4770477,N,00220.6693234,E,4,12,0.63,60.806,M,46.188,M,14.6,0000*6E\r\n",
+	    "$GNGGA,104710.00,4832.5844943,N,00229.8320136,E,5,12,0.84,80.418,M,46.332,M,1.0,0000*5A\r\n",
+	    "$GPGGA,182700,4609.8802,N,00056.9231,W,4,10,1,11.8,M,1,M,3,0*50\r\n",
+	    NULL
+	};
+
+	for (char **gga = ggalist; *gga; gga++) {
+		pos_t pos;
+		if (parse_gga(*gga, &pos) < 0) {
+			continue;
+		}
+		printf("sourcetable test from %s -> %.3f %.3f\n", *gga, pos.lat, pos.lon);
+		struct dist_table s;
+		if (sourcetable_find_pos(sourcetable, &pos, &s) <= 0) {
+			continue;
+		}
+		dist_table_display(stdout, &s, 10);
+	}
+}
+#endif
+
+/*
+ * Time elapsed since start, in nanoseconds.
+ */
+static double bench_elapsed_ns(struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec)*1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Nearest base queries per second, for 1k to 100k bases: full scan with
+ * distance() as done before the spatial index, full scan and k-d tree
+ * with each distance kernel.
+ */
+static void geoindex_bench() {
+	int nqueries = 2000;
+	pos_t *query = (pos_t *)malloc(nqueries*sizeof(pos_t));
+
+	srandom(23);
+	for (int q = 0; q < nqueries; q++)
+		test_random_pos(&query[q]);
+
+	puts("nearest base, queries/s");
+	for (int n = 1000; n <= 100000; n *= 10) {
+		struct sourceline *lines = (struct sourceline *)calloc(n, sizeof(struct sourceline));
+		struct sourceline **plines = (struct sourceline **)malloc(sizeof(struct sourceline *)*n);
+		for (int i = 0; i < n; i++) {
+			test_random_pos(&lines[i].pos);
+			plines[i] = &lines[i];
+		}
+		struct geoindex *index = geoindex_new(plines, n);
+		struct timespec start;
+		struct geoindex_result result[DIST_TABLE_SIZE];
+		float sum = 0;
+
+		int nq = nqueries * 1000 / n;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int q = 0; q < nq; q++) {
+			float min = 1e10;
+			for (int i = 0; i < n; i++) {
+				float d = distance(&lines[i].pos, &query[q]);
+				if (d < min)
+					min = d;
+			}
+			sum += min;
+		}
+		printf("%6d bases: distance() %9.0f\n", n, nq/bench_elapsed_ns(&start)*1e9);
+
+		for (enum geoindex_impl impl = 0; impl < GEOINDEX_NIMPL; impl++) {
+			if (!geoindex_impl_available(impl))
+				continue;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (int q = 0; q < nq; q++) {
+				geoindex_nearest_impl(index, impl, 1, &query[q], DIST_TABLE_SIZE, result);
+				sum += result[0].chord2;
+			}
+			double linear = nq/bench_elapsed_ns(&start)*1e9;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (int r = 0; r < 100; r++)
+				for (int q = 0; q < nqueries; q++) {
+					geoindex_nearest_impl(index, impl, 0, &query[q], DIST_TABLE_SIZE, result);
+					sum += result[0].chord2;
+				}
+			double tree = 100*nqueries/bench_elapsed_ns(&start)*1e9;
+			printf("%6d bases: %-8s scan %9.0f k-d tree %9.0f\n", n, geoindex_impl_name(impl), linear, tree);
+		}
+		/* Keep the computation from being optimized away */
+		if (sum == 1)
+			putchar(' ');
+
+		geoindex_free(index);
+		free(plines);
+		free(lines);
+	}
+	free(query);
+}
+
+/*
+ * Send npackets packets of len bytes through a livesource with nsubs
+ * subscribers, with livesource_send_subscribers(), periodically draining
+ * their outputs.
+ *
+ * Return the time in nanoseconds per packet and subscriber.
+ */
+static double bench_fanout(int zero_copy, size_t zero_copy_min_packet, int nsubs, int npackets, size_t len) {
+	struct test_fanout fx;
+	test_fanout_init(&fx);
+	fx.config.zero_copy = zero_copy;
+	fx.config.zero_copy_min_packet = zero_copy_min_packet;
+	if (test_fanout_start(&fx, nsubs, 0) < 0)
+		return -1;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int p = 0; p < npackets; p++) {
+		struct packet *packet = packet_new(len, &fx.caster);
+		memset(packet->data, p, len);
+		bufferevent_lock(fx.source->bev);
+		livesource_send_subscribers(fx.livesource, packet, &fx.caster);
+		bufferevent_unlock(fx.source->bev);
+		packet_free(packet);
+
+		/* Simulate subscribers sending their backlog */
+		if ((p & 15) == 15)
+			for (int i = 0; i < nsubs; i++)
+				test_fanout_flush(fx.subs[i]);
+	}
+
+	double r = bench_elapsed_ns(&start)/npackets/nsubs;
+	test_fanout_stop(&fx);
+	test_fanout_free(&fx);
+	return r;
+}
+
+static void crc24q_bench() {
+	size_t sizes[] = {64, 1029, 65536};
+	unsigned char *data = (unsigned char *)malloc(65536);
+	for (int i = 0; i < 65536; i++)
+		data[i] = random();
+
+	puts("crc24q, MB/s");
+	for (enum crc24q_impl impl = 0; impl < CRC24Q_NIMPL; impl++) {
+		if (!crc24q_impl_available(impl))
+			continue;
+		printf("%-14s", crc24q_impl_name(impl));
+		for (int i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+			size_t total = 256*1024*1024;
+			unsigned long crc = 0;
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (size_t done = 0; done < total; done += sizes[i])
+				crc ^= crc24q_update_impl(impl, 0, data, sizes[i]);
+			double ns = bench_elapsed_ns(&start);
+			printf(" %5zd bytes %8.1f", sizes[i], total/ns*1e3);
+			/* Keep the computation from being optimized away */
+			if (crc == 1)
+				putchar(' ');
+		}
+		putchar('\n');
+	}
+	free(data);
+}
+
+static void packet_bench() {
+	puts("packet fan-out, ns per packet and subscriber");
+	for (size_t len = 50; len <= 1000; len *= 4)
+		for (int nsubs = 1; nsubs <= 1000; nsubs *= 10) {
+			int npackets = 2000000/nsubs;
+			double copy = bench_fanout(0, 0, nsubs, npackets, len);
+			double zero_copy = bench_fanout(1, 0, nsubs, npackets, len);
+			double zero_copy_512 = bench_fanout(1, 512, nsubs, npackets, len);
+			printf("%4zd bytes %5d subscribers: copy %6.1f zero_copy %6.1f zero_copy_min_packet=512 %6.1f\n",
+				len, nsubs, copy, zero_copy, zero_copy_512);
+		}
+}
+
+int main(int argc, char **argv) {
+	int fail = 0;
+	int bench = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "b")) != -1) {
+		switch (c) {
+		case 'b':
+			bench = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b]\n\t-b\trun benchmarks\n", argv[0]);
+			return 1;
+		}
+	}
+
+	crc24q_init();
+	geoindex_init();
+	rtcm_init();
+
+	fail += gga_test();
+	fail += b64_test();
+	fail += test_ip_analyze_prefixquota();
+	fail += urldecode_test();
+	fail += refptr_test();
+	fail += packet_pool_test();
+	fail += rtcm_compact_test();
+	fail += livesource_ring_test();
+	fail += livesource_batch_test();
+	fail += livesource_fanout_test();
+	fail += rtcm_replay_test();
+	fail += rtcm_framer_test();
+	fail += rtcm_filter_test();
+	fail += rtcm_msm_test();
+	fail += rtcm_stats_test();
+	fail += rtcm_msm4_test();
+	fail += rtcm_decode_test();
+	fail += recorder_test();
+	fail += replay_test();
+	fail += generator_test();
+	fail += crc24q_test();
+	fail += geoindex_test();
+	fail += stack_flatten_test();
+	fail += nearest_sched_test();
+	fail += nearest_cache_test();
+
+	if (bench) {
+		crc24q_bench();
+		packet_bench();
+		geoindex_bench();
+	}
 	return fail != 0;
 }
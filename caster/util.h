@@ -66,7 +66,6 @@ char *path_join(const char *abs, const char **list);
 char *urldecode(char *s);
 char *b64encode(const char *str, size_t len, int add_nul);
 char *b64decode(char *str, size_t len, int add_nul);
-unsigned long crc24q_hash(unsigned char *data, size_t len);
 int parse_gga(const char *line, pos_t *pos);
 char *host_port_str(char *host, unsigned short port);
 char *mystrdup(const char *str);